@@ -9,10 +9,18 @@ expr
     | (ADD | SUB) expr  # UnaryOp
     | expr (MUL | DIV) expr  # BinaryOp
     | expr (ADD | SUB) expr  # BinaryOp
-    | CELL  # Cell
+    | NAME '(' (arg (',' arg)*)? ')'  # Function
+    | (CELL | REF)  # Cell
     | NUMBER  # Literal
     ;
 
+// ranges and text are only meaningful as function arguments
+arg
+    : CELL ':' CELL  # Range
+    | STRING  # String
+    | expr  # Argument
+    ;
+
 // number literals cannot be signed, or else 1-2 would be lexed as [1] [-2]
 fragment INT: [-+]? UINT ;
 fragment UINT: [0-9]+ ;
@@ -27,4 +35,8 @@ SUB: '-' ;
 MUL: '*' ;
 DIV: '/' ;
 CELL: [A-Z]+[0-9]+ ;
+// a reference to a deleted cell or range, as formulas print it
+REF: '#REF!' ;
+NAME: [A-Z]+ ;
+STRING: '"' ~'"'* '"' ;
 WS: [ \t\n\r]+ -> skip ;
@@ -3,13 +3,23 @@
 #include "FormulaBaseListener.h"
 #include "FormulaLexer.h"
 #include "FormulaParser.h"
+#include "formula.h"
+#include "memory_stats.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <limits>
 #include <memory>
 #include <optional>
+#include <unordered_map>
 #include <sstream>
+#include <string>
 #include <utility>
+#include <vector>
 
 namespace ASTImpl {
 
@@ -68,16 +78,223 @@ namespace ASTImpl {
 /* EP_ATOM */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
 };
 
+// Opcodes of the postfix encoding produced by FormulaAST::Serialize
+    enum class OpCode : char {
+        Number,     // followed by a double
+        Cell,       // followed by int32 row and int32 col
+        Add,
+        Subtract,
+        Multiply,
+        Divide,
+        UnaryPlus,
+        UnaryMinus,
+        String,     // followed by uint32 length and the characters
+        Range,      // followed by int32 rows and cols of the first and the last cell
+        Function,   // followed by the function id and the argument count, one byte each
+        // Only in the keys of shared subexpressions: an operand that is a shared subexpression itself
+        Subexpression,
+    };
+
+    template <typename T>
+    void AppendRaw(std::string& out, T value) {
+        char bytes[sizeof(T)];
+        std::memcpy(bytes, &value, sizeof(T));
+        out.append(bytes, sizeof(T));
+    }
+
+    template <typename T>
+    T ReadRaw(std::string_view& data) {
+        if (data.size() < sizeof(T)) {
+            throw ParsingError("Truncated formula encoding");
+        }
+        T value;
+        std::memcpy(&value, data.data(), sizeof(T));
+        data.remove_prefix(sizeof(T));
+        return value;
+    }
+
+    // Number of a subexpression that is not shared with other formulas
+    constexpr uint32_t NO_SLOT = std::numeric_limits<uint32_t>::max();
+    // An operation reading fewer cells is cheaper to evaluate than to share
+    constexpr uint32_t MIN_SHARED_CELLS = 2;
+
+    // What NumberSubexpressions learns about a subtree
+    struct SubtreeInfo {
+        // Arithmetic over cells and numbers only, so that its value depends on nothing else
+        bool arithmetic = true;
+        uint32_t cells = 0;
+
+        bool IsShareable() const {
+            return arithmetic && cells >= MIN_SHARED_CELLS;
+        }
+    };
+
+    // Emits the code of a CompiledFormula as the nodes of the tree compile themselves
+    class ProgramBuilder {
+    public:
+        using Instruction = CompiledFormula::Instruction;
+        using Op = Instruction::Op;
+
+        static constexpr size_t NO_BEGIN = std::numeric_limits<size_t>::max();
+
+        explicit ProgramBuilder(CompiledFormula& program)
+                : program_(program) {
+        }
+
+        size_t GetSize() const {
+            return program_.code_.size();
+        }
+
+        Instruction& Emit(Op op, uint32_t arg = 0) {
+            Instruction& instruction = program_.code_.emplace_back();
+            instruction.op = op;
+            instruction.arg = arg;
+            return instruction;
+        }
+
+        // A constant operand is only known to be needed once its sibling turns out not to be
+        // constant, hence the insertion. Jumps are relative, so inserting does not break them.
+        void InsertNumber(size_t at, double number) {
+            Instruction instruction;
+            instruction.number = number;
+            program_.code_.insert(program_.code_.begin() + static_cast<std::ptrdiff_t>(at), instruction);
+        }
+
+        void EmitCell(Position pos) {
+            auto [slot, added] = slots_.emplace(pos, static_cast<uint32_t>(program_.cells_.size()));
+            if (added) {
+                program_.cells_.push_back(pos);
+            }
+            Emit(Op::Cell, slot->second);
+        }
+
+        void EmitExpression(const Expr& expr) {
+            Emit(Op::Expression).expr = &expr;
+        }
+
+        // NO_BEGIN for a subtree that is not numbered
+        size_t BeginShared(uint32_t slot) {
+            if (slot == NO_SLOT) {
+                return NO_BEGIN;
+            }
+            Emit(Op::BeginShared, slot);
+            return GetSize() - 1;
+        }
+
+        void EndShared(size_t begin) {
+            if (begin == NO_BEGIN) {
+                return;
+            }
+            Emit(Op::EndShared, program_.code_[begin].arg);
+            program_.code_[begin].jump = static_cast<uint32_t>(GetSize() - begin);
+        }
+
+        void Finish() {
+            program_.code_.shrink_to_fit();
+            program_.cells_.shrink_to_fit();
+
+            std::vector<uint32_t> reads(program_.cells_.size());
+            for (const Instruction& instruction : program_.code_) {
+                if (instruction.op == Op::Cell) {
+                    ++reads[instruction.arg];
+                }
+            }
+            std::vector<uint32_t> slots(program_.cells_.size(), NO_SLOT);
+            for (Instruction& instruction : program_.code_) {
+                if (instruction.op == Op::Cell && reads[instruction.arg] > 1) {
+                    uint32_t& slot = slots[instruction.arg];
+                    if (slot == NO_SLOT) {
+                        slot = program_.slots_++;
+                    }
+                    instruction.op = Op::RepeatedCell;
+                    instruction.slot = slot;
+                }
+            }
+
+            // Skipping a shared subexpression pushes its value instead, so the straight line
+            // bounds both depths
+            uint32_t stack = 0;
+            uint32_t shared = 0;
+            for (const Instruction& instruction : program_.code_) {
+                switch (instruction.op) {
+                    case Op::Number:
+                    case Op::Cell:
+                    case Op::RepeatedCell:
+                    case Op::Expression:
+                        program_.max_stack_ = std::max(program_.max_stack_, ++stack);
+                        break;
+                    case Op::Arithmetic:
+                        --stack;
+                        break;
+                    case Op::Negate:
+                        break;
+                    case Op::BeginShared:
+                        program_.max_shared_ = std::max(program_.max_shared_, ++shared);
+                        break;
+                    case Op::EndShared:
+                        --shared;
+                        break;
+                }
+            }
+        }
+
+    private:
+        CompiledFormula& program_;
+        std::unordered_map<Position, uint32_t, PositionHasher> slots_;
+    };
+
 class Expr {
 public:
     virtual ~Expr() = default;
     virtual void Print(std::ostream& out) const = 0;
+    virtual void Serialize(std::string& out) const = 0;
     virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const = 0;
-    virtual double Evaluate(const SheetInterface& sheet) const = 0;
+    // shared is null when the sheet does not share subexpressions between formulas
+    virtual double Evaluate(const SheetInterface& sheet, SharedSubexpressions* shared) const = 0;
+
+    // Value of the expression as a lookup key: cells and strings keep their text
+    virtual LookupKey EvaluateKey(const SheetInterface& sheet, SharedSubexpressions* shared) const {
+        return Evaluate(sheet, shared);
+    }
+
+    // Numbers in postfix order the subtrees that may be shared with other formulas (see
+    // FormulaInterface::GetSubexpressions). The tree keeps its shape once built, so the numbers
+    // never change.
+    virtual SubtreeInfo NumberSubexpressions(uint32_t& next) = 0;
+    // Number of the subtree, NO_SLOT if it is not numbered
+    virtual uint32_t GetSlot() const {
+        return NO_SLOT;
+    }
+    // Appends the numbered subexpressions of the subtree, in the order of their numbers
+    virtual void CollectSubexpressions(std::vector<FormulaInterface::Subexpression>& out) const {
+    }
+    // Appends the cells the subtree reads
+    virtual void CollectCells(std::vector<Position>& out) const {
+    }
+
+    // Appends the code of the subtree to out. A constant subtree emits nothing and returns its
+    // value; by default the node is evaluated as it is.
+    virtual std::optional<double> Compile(ProgramBuilder& out) const {
+        out.EmitExpression(*this);
+        return std::nullopt;
+    }
+
+    // Range of a range argument, nullptr for any other expression
+    virtual const CellRange* GetRange() const {
+        return nullptr;
+    }
+
+    // Position of a cell reference, nullptr for any other expression
+    virtual const Position* GetCell() const {
+        return nullptr;
+    }
 
     // higher is tighter
     virtual ExprPrecedence GetPrecedence() const = 0;
 
+    // Bytes of the subtree
+    virtual size_t GetMemoryUsage() const = 0;
+
     void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence,
                       bool right_child = false) const {
         auto precedence = GetPrecedence();
@@ -96,6 +313,64 @@ public:
 };
 
 namespace {
+    // Result of an arithmetic operation; an infinite or undefined one is an arithmetic error
+    double Arithmetic(char operation, double lhs, double rhs) {
+        double result = 0.0;
+        switch (operation) {
+            case '+':
+                result = lhs + rhs;
+                break;
+            case '-':
+                result = lhs - rhs;
+                break;
+            case '*':
+                result = lhs * rhs;
+                break;
+            case '/':
+                result = lhs / rhs;
+                break;
+        }
+        if (!std::isfinite(result)) {
+            throw FormulaError(FormulaError::Category::Div0);
+        }
+        return result;
+    }
+
+    // Value of a numbered subexpression: taken from the node the sheet shares between the formulas
+    // having it, or computed and stored there. Errors are shared as well.
+    template <typename Compute>
+    double EvaluateShared(SharedSubexpressions* shared, uint32_t slot, Compute compute) {
+        if (!shared || slot == NO_SLOT) {
+            return compute();
+        }
+        if (const FormulaInterface::Value* value = shared->Find(slot)) {
+            if (const double* number = std::get_if<double>(value)) {
+                return *number;
+            }
+            throw std::get<FormulaError>(*value);
+        }
+        try {
+            double value = compute();
+            shared->Store(slot, value);
+            return value;
+        } catch (const FormulaError& error) {
+            shared->Store(slot, error);
+            throw;
+        }
+    }
+
+    // Adds an operand to the key of a numbered operation: serialized, or as a reference to its
+    // number if it is numbered itself
+    void AppendOperand(const Expr& operand, FormulaInterface::Subexpression& out) {
+        if (const uint32_t slot = operand.GetSlot(); slot != NO_SLOT) {
+            out.key += static_cast<char>(OpCode::Subexpression);
+            out.operands.push_back(slot);
+        } else {
+            operand.Serialize(out.key);
+            operand.CollectCells(out.cells);
+        }
+    }
+
     class BinaryOpExpr final : public Expr {
     public:
         enum Type : char {
@@ -126,6 +401,29 @@ namespace {
             rhs_->PrintFormula(out, precedence, /* right_child = */ true);
         }
 
+        void Serialize(std::string& out) const override {
+            lhs_->Serialize(out);
+            rhs_->Serialize(out);
+            AppendOpCode(out);
+        }
+
+        void AppendOpCode(std::string& out) const {
+            switch (type_) {
+                case Add:
+                    out += static_cast<char>(OpCode::Add);
+                    break;
+                case Subtract:
+                    out += static_cast<char>(OpCode::Subtract);
+                    break;
+                case Multiply:
+                    out += static_cast<char>(OpCode::Multiply);
+                    break;
+                case Divide:
+                    out += static_cast<char>(OpCode::Divide);
+                    break;
+            }
+        }
+
         ExprPrecedence GetPrecedence() const override {
             switch (type_) {
                 case Add:
@@ -143,47 +441,77 @@ namespace {
             }
         }
 
-        double Evaluate(const SheetInterface& sheet) const override {
-            double lhs_ev = lhs_->Evaluate(sheet);
-            double rhs_ev = rhs_->Evaluate(sheet);
+        size_t GetMemoryUsage() const override {
+            return sizeof(*this) + lhs_->GetMemoryUsage() + rhs_->GetMemoryUsage();
+        }
+
+        SubtreeInfo NumberSubexpressions(uint32_t& next) override {
+            const SubtreeInfo lhs = lhs_->NumberSubexpressions(next);
+            const SubtreeInfo rhs = rhs_->NumberSubexpressions(next);
+            const SubtreeInfo info{lhs.arithmetic && rhs.arithmetic, lhs.cells + rhs.cells};
+            slot_ = info.IsShareable() ? next++ : NO_SLOT;
+            return info;
+        }
+
+        uint32_t GetSlot() const override {
+            return slot_;
+        }
+
+        void CollectSubexpressions(std::vector<FormulaInterface::Subexpression>& out) const override {
+            lhs_->CollectSubexpressions(out);
+            rhs_->CollectSubexpressions(out);
+            if (slot_ != NO_SLOT) {
+                FormulaInterface::Subexpression subexpression;
+                AppendOperand(*lhs_, subexpression);
+                AppendOperand(*rhs_, subexpression);
+                AppendOpCode(subexpression.key);
+                out.push_back(std::move(subexpression));
+            }
+        }
+
+        void CollectCells(std::vector<Position>& out) const override {
+            lhs_->CollectCells(out);
+            rhs_->CollectCells(out);
+        }
 
-            double result;
-            try {
-                switch (type_) {
-                    case Type::Add:
-                    {
-                        result =  lhs_ev + rhs_ev;
-                        break;
-                    }
-                    case Type::Subtract:
-                    {
-                        result =  lhs_ev - rhs_ev;
-                        break;
-                    }
-                    case Type::Multiply:
-                    {
-                        result =  lhs_ev * rhs_ev;
-                        break;
-                    }
-                    case Type::Divide:
-                    {
-                        double tmp = lhs_ev / rhs_ev;
-                        if (!std::isfinite(tmp)) {
-                            throw FormulaError(FormulaError::Category::Div0);
-                        }
-                        result = tmp;
-                        break;
-                    }
+        double Evaluate(const SheetInterface& sheet, SharedSubexpressions* shared) const override {
+            return EvaluateShared(shared, slot_, [&] {
+                return Compute(sheet, shared);
+            });
+        }
+
+        std::optional<double> Compile(ProgramBuilder& out) const override {
+            const size_t begin = out.BeginShared(slot_);
+            const size_t lhs_start = out.GetSize();
+            const std::optional<double> lhs = lhs_->Compile(out);
+            const std::optional<double> rhs = rhs_->Compile(out);
+            if (lhs && rhs) {
+                try {
+                    return Arithmetic(static_cast<char>(type_), *lhs, *rhs);
+                } catch (const FormulaError&) {
+                    // Left for the evaluation to report
                 }
-            } catch (...) {
-                throw FormulaError(FormulaError::Category::Div0);
             }
-            return result;
-            // Скопируйте ваше решение из предыдущих уроков.
+            if (lhs) {
+                out.InsertNumber(lhs_start, *lhs);
+            }
+            if (rhs) {
+                out.InsertNumber(out.GetSize(), *rhs);
+            }
+            out.Emit(ProgramBuilder::Op::Arithmetic, static_cast<uint32_t>(type_));
+            out.EndShared(begin);
+            return std::nullopt;
         }
 
     private:
+        double Compute(const SheetInterface& sheet, SharedSubexpressions* shared) const {
+            double lhs_ev = lhs_->Evaluate(sheet, shared);
+            double rhs_ev = rhs_->Evaluate(sheet, shared);
+            return Arithmetic(static_cast<char>(type_), lhs_ev, rhs_ev);
+        }
+
         Type type_;
+        uint32_t slot_ = NO_SLOT;
         std::unique_ptr<Expr> lhs_;
         std::unique_ptr<Expr> rhs_;
     };
@@ -212,20 +540,69 @@ namespace {
             operand_->PrintFormula(out, precedence);
         }
 
+        void Serialize(std::string& out) const override {
+            operand_->Serialize(out);
+            out += static_cast<char>(type_ == UnaryMinus ? OpCode::UnaryMinus : OpCode::UnaryPlus);
+        }
+
         ExprPrecedence GetPrecedence() const override {
             return EP_UNARY;
         }
 
-        double Evaluate(const SheetInterface& sheet) const override {
-            if (type_ == Type::UnaryMinus) {
-                return operand_->Evaluate(sheet) * -1.0;
+        size_t GetMemoryUsage() const override {
+            return sizeof(*this) + operand_->GetMemoryUsage();
+        }
+
+        SubtreeInfo NumberSubexpressions(uint32_t& next) override {
+            const SubtreeInfo info = operand_->NumberSubexpressions(next);
+            slot_ = info.IsShareable() ? next++ : NO_SLOT;
+            return info;
+        }
+
+        uint32_t GetSlot() const override {
+            return slot_;
+        }
+
+        void CollectSubexpressions(std::vector<FormulaInterface::Subexpression>& out) const override {
+            operand_->CollectSubexpressions(out);
+            if (slot_ != NO_SLOT) {
+                FormulaInterface::Subexpression subexpression;
+                AppendOperand(*operand_, subexpression);
+                subexpression.key += static_cast<char>(type_ == UnaryMinus ? OpCode::UnaryMinus : OpCode::UnaryPlus);
+                out.push_back(std::move(subexpression));
             }
-            return operand_->Evaluate(sheet) * 1.0;
+        }
+
+        void CollectCells(std::vector<Position>& out) const override {
+            operand_->CollectCells(out);
+        }
+
+        double Evaluate(const SheetInterface& sheet, SharedSubexpressions* shared) const override {
+            return EvaluateShared(shared, slot_, [&] {
+                if (type_ == Type::UnaryMinus) {
+                    return operand_->Evaluate(sheet, shared) * -1.0;
+                }
+                return operand_->Evaluate(sheet, shared) * 1.0;
+            });
             // Скопируйте ваше решение из предыдущих уроков.
         }
 
+        std::optional<double> Compile(ProgramBuilder& out) const override {
+            const size_t begin = out.BeginShared(slot_);
+            const std::optional<double> operand = operand_->Compile(out);
+            if (operand) {
+                return type_ == UnaryMinus ? -*operand : *operand;
+            }
+            if (type_ == UnaryMinus) {
+                out.Emit(ProgramBuilder::Op::Negate);
+            }
+            out.EndShared(begin);
+            return std::nullopt;
+        }
+
     private:
         Type type_;
+        uint32_t slot_ = NO_SLOT;
         std::unique_ptr<Expr> operand_;
     };
 
@@ -248,39 +625,343 @@ namespace {
             Print(out);
         }
 
+        void Serialize(std::string& out) const override {
+            out += static_cast<char>(OpCode::Cell);
+            AppendRaw<int32_t>(out, cell_->row);
+            AppendRaw<int32_t>(out, cell_->col);
+        }
+
         ExprPrecedence GetPrecedence() const override {
             return EP_ATOM;
         }
 
-        double Evaluate(const SheetInterface& sheet) const override {
+        size_t GetMemoryUsage() const override {
+            return sizeof(*this);
+        }
+
+        SubtreeInfo NumberSubexpressions(uint32_t& /* next */) override {
+            return {true, 1};
+        }
+
+        void CollectCells(std::vector<Position>& out) const override {
+            if (cell_->IsValid()) {
+                out.push_back(*cell_);
+            }
+        }
+
+        double Evaluate(const SheetInterface& sheet, SharedSubexpressions* /* shared */) const override {
             if (!cell_->IsValid()) {
                 throw FormulaError(FormulaError::Category::Ref);
             }
-            auto cell = sheet.GetCell(*cell_);
+            return sheet.GetCellNumber(*cell_);
+        }
 
-            if (cell == nullptr) {
-                auto& const_less_sheet = const_cast<SheetInterface&>(sheet);
-                const_less_sheet.SetCell(*cell_, {});
+        std::optional<double> Compile(ProgramBuilder& out) const override {
+            if (cell_->IsValid()) {
+                out.EmitCell(*cell_);
+            } else {
+                out.EmitExpression(*this);
             }
+            return std::nullopt;
+        }
 
+        LookupKey EvaluateKey(const SheetInterface& sheet, SharedSubexpressions* /* shared */) const override {
+            if (!cell_->IsValid()) {
+                throw FormulaError(FormulaError::Category::Ref);
+            }
+            const CellInterface* cell = sheet.GetCell(*cell_);
+            if (cell == nullptr) {
+                return 0.0;
+            }
             CellInterface::Value value = cell->GetValue();
+            if (const auto* error = std::get_if<FormulaError>(&value)) {
+                throw *error;
+            }
+            // Empty text looks up zero, like in arithmetic
+            auto key = MakeLookupKey(value);
+            return key ? *key : LookupKey(0.0);
+        }
 
-            if (std::holds_alternative<double>(value)) {
-                return std::get<double>(value);
-            } else if (std::holds_alternative<std::string>(value)){
-                try {
-                    double num = std::stod(std::get<std::string>(value));
-                    return num;
-                } catch (std::invalid_argument& exc) {
-                    throw FormulaError{ FormulaError::Category::Value };
+        const Position* GetCell() const override {
+            return cell_;
+        }
+
+    private:
+        const Position* cell_;
+    };
+
+    class RangeExpr final : public Expr {
+    public:
+        explicit RangeExpr(const CellRange* range)
+                : range_(range) {
+        }
+
+        void Print(std::ostream& out) const override {
+            if (!range_->IsValid()) {
+                out << FormulaError(FormulaError::Category::Ref);
+            } else {
+                out << range_->ToString();
+            }
+        }
+
+        void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+            Print(out);
+        }
+
+        void Serialize(std::string& out) const override {
+            out += static_cast<char>(OpCode::Range);
+            AppendRaw<int32_t>(out, range_->first.row);
+            AppendRaw<int32_t>(out, range_->first.col);
+            AppendRaw<int32_t>(out, range_->last.row);
+            AppendRaw<int32_t>(out, range_->last.col);
+        }
+
+        ExprPrecedence GetPrecedence() const override {
+            return EP_ATOM;
+        }
+
+        size_t GetMemoryUsage() const override {
+            return sizeof(*this);
+        }
+
+        SubtreeInfo NumberSubexpressions(uint32_t& /* next */) override {
+            return {false, 0};
+        }
+
+        double Evaluate(const SheetInterface& /* sheet */, SharedSubexpressions* /* shared */) const override {
+            // A range has no single value
+            throw FormulaError(FormulaError::Category::Value);
+        }
+
+        const CellRange* GetRange() const override {
+            return range_;
+        }
+
+    private:
+        const CellRange* range_;
+    };
+
+    class StringExpr final : public Expr {
+    public:
+        explicit StringExpr(std::string value)
+                : value_(std::move(value)) {
+        }
+
+        void Print(std::ostream& out) const override {
+            out << '"' << value_ << '"';
+        }
+
+        void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+            Print(out);
+        }
+
+        void Serialize(std::string& out) const override {
+            out += static_cast<char>(OpCode::String);
+            AppendRaw<uint32_t>(out, static_cast<uint32_t>(value_.size()));
+            out += value_;
+        }
+
+        ExprPrecedence GetPrecedence() const override {
+            return EP_ATOM;
+        }
+
+        size_t GetMemoryUsage() const override {
+            return sizeof(*this) + SheetMemoryStats::GetHeapBytes(value_);
+        }
+
+        SubtreeInfo NumberSubexpressions(uint32_t& /* next */) override {
+            return {false, 0};
+        }
+
+        double Evaluate(const SheetInterface& /* sheet */, SharedSubexpressions* /* shared */) const override {
+            throw FormulaError(FormulaError::Category::Value);
+        }
+
+        LookupKey EvaluateKey(const SheetInterface& /* sheet */, SharedSubexpressions* /* shared */) const override {
+            auto key = MakeLookupKey(value_);
+            return key ? *key : LookupKey(std::string());
+        }
+
+    private:
+        std::string value_;
+    };
+
+    // Lookup functions. Keys are found through SheetInterface::Lookup, which the sheet serves
+    // from column indexes.
+    class FunctionExpr final : public Expr {
+    public:
+        enum class Function : char {
+            Match,
+            VLookup,
+            XLookup,
+        };
+
+        struct Signature {
+            Function function;
+            std::string_view name;
+            size_t min_args;
+            size_t max_args;
+            // Bit i is set when argument i has to be a range
+            unsigned range_args;
+        };
+
+        static constexpr Signature SIGNATURES[] = {
+            {Function::Match, "MATCH", 2, 3, 0b010},
+            {Function::VLookup, "VLOOKUP", 3, 4, 0b010},
+            {Function::XLookup, "XLOOKUP", 3, 5, 0b110},
+        };
+
+        static const Signature* FindSignature(std::string_view name) {
+            for (const Signature& signature : SIGNATURES) {
+                if (signature.name == name) {
+                    return &signature;
+                }
+            }
+            return nullptr;
+        }
+
+        // Throws ParsingError unless the arguments fit the signature
+        FunctionExpr(const Signature& signature, std::vector<std::unique_ptr<Expr>> args)
+                : signature_(signature)
+                , args_(std::move(args)) {
+            if (args_.size() < signature_.min_args || args_.size() > signature_.max_args) {
+                throw ParsingError("Wrong number of arguments for " + std::string(signature_.name));
+            }
+            for (size_t i = 0; i < args_.size(); ++i) {
+                if ((args_[i]->GetRange() != nullptr) != ((signature_.range_args >> i) & 1u)) {
+                    throw ParsingError("Wrong argument " + std::to_string(i + 1) + " for "
+                                       + std::string(signature_.name));
                 }
             }
+        }
+
+        void Print(std::ostream& out) const override {
+            out << '(' << signature_.name;
+            for (const auto& arg : args_) {
+                out << ' ';
+                arg->Print(out);
+            }
+            out << ')';
+        }
 
-            throw *std::get_if<FormulaError>(&value);
+        void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+            out << signature_.name << '(';
+            bool first = true;
+            for (const auto& arg : args_) {
+                if (!first) {
+                    out << ',';
+                }
+                first = false;
+                // Arguments are separated by commas, so they never need parentheses
+                arg->PrintFormula(out, EP_ADD);
+            }
+            out << ')';
+        }
+
+        void Serialize(std::string& out) const override {
+            for (const auto& arg : args_) {
+                arg->Serialize(out);
+            }
+            out += static_cast<char>(OpCode::Function);
+            out += static_cast<char>(signature_.function);
+            out += static_cast<char>(args_.size());
+        }
+
+        ExprPrecedence GetPrecedence() const override {
+            return EP_ATOM;
+        }
+
+        size_t GetMemoryUsage() const override {
+            size_t bytes = sizeof(*this) + args_.capacity() * sizeof(args_.front());
+            for (const auto& arg : args_) {
+                bytes += arg->GetMemoryUsage();
+            }
+            return bytes;
+        }
+
+        // A lookup reads whole ranges, so it is not shared; its arguments may be
+        SubtreeInfo NumberSubexpressions(uint32_t& next) override {
+            for (const auto& arg : args_) {
+                arg->NumberSubexpressions(next);
+            }
+            return {false, 0};
+        }
+
+        void CollectSubexpressions(std::vector<FormulaInterface::Subexpression>& out) const override {
+            for (const auto& arg : args_) {
+                arg->CollectSubexpressions(out);
+            }
+        }
+
+        double Evaluate(const SheetInterface& sheet, SharedSubexpressions* shared) const override {
+            LookupKey key = args_[0]->EvaluateKey(sheet, shared);
+            const CellRange& range = Range(1);
+            switch (signature_.function) {
+                case Function::Match: {
+                    double type = args_.size() > 2 ? args_[2]->Evaluate(sheet, shared) : 1.0;
+                    auto match = type > 0 ? LookupMatch::ExactOrLess
+                                          : type < 0 ? LookupMatch::ExactOrGreater : LookupMatch::Exact;
+                    return Find(sheet, key, range, match) + 1;
+                }
+                case Function::VLookup: {
+                    double column = args_[2]->Evaluate(sheet, shared);
+                    if (column < 1) {
+                        throw FormulaError(FormulaError::Category::Value);
+                    }
+                    if (column >= range.GetCols() + 1) {
+                        throw FormulaError(FormulaError::Category::Ref);
+                    }
+                    auto match = args_.size() > 3 && args_[3]->Evaluate(sheet, shared) == 0 ? LookupMatch::Exact
+                                                                                    : LookupMatch::ExactOrLess;
+                    CellRange keys{range.first, {range.last.row, range.first.col}};
+                    int row = Find(sheet, key, keys, match);
+                    return sheet.GetCellNumber({range.first.row + row, range.first.col + static_cast<int>(column) - 1});
+                }
+                case Function::XLookup: {
+                    const CellRange& results = Range(2);
+                    if (results.GetRows() != range.GetRows() || results.GetCols() != range.GetCols()) {
+                        throw FormulaError(FormulaError::Category::Value);
+                    }
+                    double mode = args_.size() > 4 ? args_[4]->Evaluate(sheet, shared) : 0.0;
+                    if (mode != 0 && mode != 1 && mode != -1) {
+                        throw FormulaError(FormulaError::Category::Value);
+                    }
+                    auto match = mode < 0 ? LookupMatch::ExactOrLess
+                                          : mode > 0 ? LookupMatch::ExactOrGreater : LookupMatch::Exact;
+                    auto found = sheet.Lookup(key, range, match);
+                    if (!found) {
+                        if (args_.size() > 3) {
+                            return args_[3]->Evaluate(sheet, shared);
+                        }
+                        throw FormulaError(FormulaError::Category::NA);
+                    }
+                    Position pos = results.GetRows() > 1 ? Position{results.first.row + *found, results.first.col}
+                                                         : Position{results.first.row, results.first.col + *found};
+                    return sheet.GetCellNumber(pos);
+                }
+            }
+            throw FormulaError(FormulaError::Category::Value);
         }
 
     private:
-        const Position* cell_;
+        const CellRange& Range(size_t index) const {
+            const CellRange& range = *args_[index]->GetRange();
+            if (!range.IsValid()) {
+                throw FormulaError(FormulaError::Category::Ref);
+            }
+            return range;
+        }
+
+        static int Find(const SheetInterface& sheet, const LookupKey& key, CellRange range, LookupMatch match) {
+            auto found = sheet.Lookup(key, range, match);
+            if (!found) {
+                throw FormulaError(FormulaError::Category::NA);
+            }
+            return *found;
+        }
+
+        const Signature& signature_;
+        std::vector<std::unique_ptr<Expr>> args_;
     };
 
     class NumberExpr final : public Expr {
@@ -297,11 +978,28 @@ namespace {
             out << value_;
         }
 
+        void Serialize(std::string& out) const override {
+            out += static_cast<char>(OpCode::Number);
+            AppendRaw<double>(out, value_);
+        }
+
         ExprPrecedence GetPrecedence() const override {
             return EP_ATOM;
         }
 
-        double Evaluate(const SheetInterface& sheet) const override {
+        size_t GetMemoryUsage() const override {
+            return sizeof(*this);
+        }
+
+        SubtreeInfo NumberSubexpressions(uint32_t& /* next */) override {
+            return {true, 0};
+        }
+
+        double Evaluate(const SheetInterface& /* sheet */, SharedSubexpressions* /* shared */) const override {
+            return value_;
+        }
+
+        std::optional<double> Compile(ProgramBuilder& /* out */) const override {
             return value_;
         }
 
@@ -323,6 +1021,10 @@ namespace {
             return std::move(cells_);
         }
 
+        std::forward_list<CellRange> MoveRanges() {
+            return std::move(ranges_);
+        }
+
     public:
         void exitUnaryOp(FormulaParser::UnaryOpContext* ctx) override {
             assert(args_.size() >= 1);
@@ -355,10 +1057,14 @@ namespace {
         }
 
         void exitCell(FormulaParser::CellContext* ctx) override {
-            auto value_str = ctx->CELL()->getSymbol()->getText();
-            auto value = Position::FromString(value_str);
-            if (!value.IsValid()) {
-                throw FormulaException("Invalid position: " + value_str);
+            // #REF! is how a reference to a deleted cell is printed
+            Position value = Position::NONE;
+            if (ctx->CELL()) {
+                auto value_str = ctx->CELL()->getSymbol()->getText();
+                value = Position::FromString(value_str);
+                if (!value.IsValid()) {
+                    throw FormulaException("Invalid position: " + value_str);
+                }
             }
 
             cells_.push_front(value);
@@ -390,6 +1096,49 @@ namespace {
             args_.back() = std::move(node);
         }
 
+        void exitRange(FormulaParser::RangeContext* ctx) override {
+            Position corners[2];
+            for (size_t i = 0; i < 2; ++i) {
+                auto value_str = ctx->CELL(i)->getSymbol()->getText();
+                corners[i] = Position::FromString(value_str);
+                if (!corners[i].IsValid()) {
+                    throw FormulaException("Invalid position: " + value_str);
+                }
+            }
+            // B10:A1 is the same range as A1:B10
+            ranges_.push_front({{std::min(corners[0].row, corners[1].row), std::min(corners[0].col, corners[1].col)},
+                                {std::max(corners[0].row, corners[1].row), std::max(corners[0].col, corners[1].col)}});
+            args_.push_back(std::make_unique<RangeExpr>(&ranges_.front()));
+        }
+
+        void exitString(FormulaParser::StringContext* ctx) override {
+            auto text = ctx->STRING()->getSymbol()->getText();
+            args_.push_back(std::make_unique<StringExpr>(text.substr(1, text.size() - 2)));
+        }
+
+        void exitFunction(FormulaParser::FunctionContext* ctx) override {
+            auto name = ctx->NAME()->getSymbol()->getText();
+            const auto* signature = FunctionExpr::FindSignature(name);
+            if (!signature) {
+                throw ParsingError("Unknown function: " + name);
+            }
+            // The arguments are the last expressions built, in order
+            const size_t count = ctx->arg().size();
+            assert(args_.size() >= count);
+            std::vector<std::unique_ptr<Expr>> args(std::make_move_iterator(args_.end() - count),
+                                                    std::make_move_iterator(args_.end()));
+            args_.resize(args_.size() - count);
+            // A deleted range is printed as #REF! too and read back as a cell reference
+            for (size_t i = 0; i < count; ++i) {
+                const Position* cell = args[i]->GetCell();
+                if (cell && !cell->IsValid() && ((signature->range_args >> i) & 1u)) {
+                    ranges_.push_front(CellRange::NONE);
+                    args[i] = std::make_unique<RangeExpr>(&ranges_.front());
+                }
+            }
+            args_.push_back(std::make_unique<FunctionExpr>(*signature, std::move(args)));
+        }
+
         void visitErrorNode(antlr4::tree::ErrorNode* node) override {
             throw ParsingError("Error when parsing: " + node->getSymbol()->getText());
         }
@@ -397,6 +1146,7 @@ namespace {
     private:
         std::vector<std::unique_ptr<Expr>> args_;
         std::forward_list<Position> cells_;
+        std::forward_list<CellRange> ranges_;
     };
 
     class BailErrorListener : public antlr4::BaseErrorListener {
@@ -433,7 +1183,7 @@ FormulaAST ParseFormulaAST(std::istream& in) {
     ASTImpl::ParseASTListener listener;
     tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
 
-    return FormulaAST(listener.MoveRoot(), listener.MoveCells());
+    return FormulaAST(listener.MoveRoot(), listener.MoveCells(), listener.MoveRanges());
 }
 
 FormulaAST ParseFormulaAST(const std::string& in_str) {
@@ -455,14 +1205,259 @@ void FormulaAST::PrintFormula(std::ostream& out) const {
     root_expr_->PrintFormula(out, ASTImpl::EP_ATOM);
 }
 
-double FormulaAST::Execute(const SheetInterface& sheet) const {
-    return root_expr_->Evaluate(sheet);
+void FormulaAST::Serialize(std::string& out) const {
+    root_expr_->Serialize(out);
+}
+
+FormulaAST FormulaAST::Deserialize(std::string_view data) {
+    using namespace ASTImpl;
+
+    std::vector<std::unique_ptr<Expr>> args;
+    std::forward_list<Position> cells;
+    std::forward_list<CellRange> ranges;
+    auto pop = [&args]() {
+        if (args.empty()) {
+            throw ParsingError("Malformed formula encoding");
+        }
+        auto expr = std::move(args.back());
+        args.pop_back();
+        return expr;
+    };
+
+    while (!data.empty()) {
+        auto op = static_cast<OpCode>(ReadRaw<char>(data));
+        switch (op) {
+            case OpCode::Number:
+                args.push_back(std::make_unique<NumberExpr>(ReadRaw<double>(data)));
+                break;
+            case OpCode::Cell: {
+                int row = ReadRaw<int32_t>(data);
+                int col = ReadRaw<int32_t>(data);
+                cells.push_front({row, col});
+                args.push_back(std::make_unique<CellExpr>(&cells.front()));
+                break;
+            }
+            case OpCode::String: {
+                auto size = ReadRaw<uint32_t>(data);
+                if (data.size() < size) {
+                    throw ParsingError("Truncated formula encoding");
+                }
+                args.push_back(std::make_unique<StringExpr>(std::string(data.substr(0, size))));
+                data.remove_prefix(size);
+                break;
+            }
+            case OpCode::Range: {
+                CellRange range;
+                range.first.row = ReadRaw<int32_t>(data);
+                range.first.col = ReadRaw<int32_t>(data);
+                range.last.row = ReadRaw<int32_t>(data);
+                range.last.col = ReadRaw<int32_t>(data);
+                ranges.push_front(range);
+                args.push_back(std::make_unique<RangeExpr>(&ranges.front()));
+                break;
+            }
+            case OpCode::Function: {
+                auto function = static_cast<FunctionExpr::Function>(ReadRaw<char>(data));
+                auto count = static_cast<size_t>(ReadRaw<unsigned char>(data));
+                const FunctionExpr::Signature* signature = nullptr;
+                for (const auto& candidate : FunctionExpr::SIGNATURES) {
+                    if (candidate.function == function) {
+                        signature = &candidate;
+                    }
+                }
+                if (!signature || count > args.size()) {
+                    throw ParsingError("Malformed formula encoding");
+                }
+                std::vector<std::unique_ptr<Expr>> function_args(std::make_move_iterator(args.end() - count),
+                                                                 std::make_move_iterator(args.end()));
+                args.resize(args.size() - count);
+                args.push_back(std::make_unique<FunctionExpr>(*signature, std::move(function_args)));
+                break;
+            }
+            case OpCode::UnaryPlus:
+            case OpCode::UnaryMinus: {
+                auto type = op == OpCode::UnaryMinus ? UnaryOpExpr::UnaryMinus : UnaryOpExpr::UnaryPlus;
+                args.push_back(std::make_unique<UnaryOpExpr>(type, pop()));
+                break;
+            }
+            case OpCode::Add:
+            case OpCode::Subtract:
+            case OpCode::Multiply:
+            case OpCode::Divide: {
+                constexpr BinaryOpExpr::Type types[] = {BinaryOpExpr::Add, BinaryOpExpr::Subtract,
+                                                        BinaryOpExpr::Multiply, BinaryOpExpr::Divide};
+                auto type = types[static_cast<int>(op) - static_cast<int>(OpCode::Add)];
+                auto rhs = pop();
+                auto lhs = pop();
+                args.push_back(std::make_unique<BinaryOpExpr>(type, std::move(lhs), std::move(rhs)));
+                break;
+            }
+            default:
+                throw ParsingError("Unknown opcode in formula encoding");
+        }
+    }
+    if (args.size() != 1) {
+        throw ParsingError("Malformed formula encoding");
+    }
+    return FormulaAST(std::move(args.front()), std::move(cells), std::move(ranges));
+}
+
+double FormulaAST::Execute(const SheetInterface& sheet, SharedSubexpressions* shared) const {
+    return root_expr_->Evaluate(sheet, shared);
+}
+
+CompiledFormula FormulaAST::Compile() const {
+    CompiledFormula program;
+    ASTImpl::ProgramBuilder builder(program);
+    if (std::optional<double> constant = root_expr_->Compile(builder)) {
+        builder.InsertNumber(builder.GetSize(), *constant);
+    }
+    builder.Finish();
+    return program;
+}
+
+namespace {
+    // Per-evaluation storage of a CompiledFormula. Evaluations nest through the cells they read,
+    // so it lives on the stack, and only large programs take it from the heap.
+    template <typename T, size_t INLINE_SIZE>
+    class FrameBuffer {
+    public:
+        explicit FrameBuffer(size_t size)
+                : heap_(size > INLINE_SIZE ? std::make_unique<T[]>(size) : nullptr) {
+        }
+
+        T* Get() {
+            return heap_ ? heap_.get() : inline_;
+        }
+
+    private:
+        T inline_[INLINE_SIZE];
+        std::unique_ptr<T[]> heap_;
+    };
+}  // namespace
+
+double CompiledFormula::Execute(const SheetInterface& sheet, SharedSubexpressions* shared) const {
+    using Op = Instruction::Op;
+
+    // A formula that is a shared subexpression as a whole often has its value already
+    size_t start = 0;
+    const Instruction& first = code_.front();
+    const bool shared_root = shared && first.op == Op::BeginShared && first.jump == code_.size();
+    if (shared_root) {
+        if (const FormulaInterface::Value* value = shared->Find(first.arg)) {
+            if (const double* number = std::get_if<double>(value)) {
+                return *number;
+            }
+            throw std::get<FormulaError>(*value);
+        }
+        start = 1;
+    }
+
+    FrameBuffer<double, 16> frame(max_stack_ + slots_);
+    double* stack = frame.Get();
+    // Not a number marks a slot not read yet; a cell whose value is NaN is just read again
+    double* slots = stack + max_stack_;
+    std::fill(slots, slots + slots_, std::numeric_limits<double>::quiet_NaN());
+    FrameBuffer<uint32_t, 8> open_frame(max_shared_);
+    uint32_t* open = open_frame.Get();
+
+    size_t top = 0;
+    size_t open_count = 0;
+    if (shared_root) {
+        open[open_count++] = first.arg;
+    }
+    try {
+        for (size_t pc = start; pc < code_.size(); ++pc) {
+            const Instruction& instruction = code_[pc];
+            switch (instruction.op) {
+                case Op::Number:
+                    stack[top++] = instruction.number;
+                    break;
+                case Op::Cell:
+                    stack[top++] = sheet.GetCellNumber(cells_[instruction.arg]);
+                    break;
+                case Op::RepeatedCell: {
+                    double& value = slots[instruction.slot];
+                    if (std::isnan(value)) {
+                        value = sheet.GetCellNumber(cells_[instruction.arg]);
+                    }
+                    stack[top++] = value;
+                    break;
+                }
+                case Op::Arithmetic:
+                    --top;
+                    stack[top - 1] = ASTImpl::Arithmetic(static_cast<char>(instruction.arg), stack[top - 1], stack[top]);
+                    break;
+                case Op::Negate:
+                    stack[top - 1] = -stack[top - 1];
+                    break;
+                case Op::Expression:
+                    stack[top++] = instruction.expr->Evaluate(sheet, shared);
+                    break;
+                case Op::BeginShared:
+                    if (!shared) {
+                        break;
+                    }
+                    if (const FormulaInterface::Value* value = shared->Find(instruction.arg)) {
+                        if (const double* number = std::get_if<double>(value)) {
+                            stack[top++] = *number;
+                            pc += instruction.jump - 1;
+                            break;
+                        }
+                        throw std::get<FormulaError>(*value);
+                    }
+                    open[open_count++] = instruction.arg;
+                    break;
+                case Op::EndShared:
+                    if (shared) {
+                        shared->Store(instruction.arg, stack[top - 1]);
+                        --open_count;
+                    }
+                    break;
+            }
+        }
+    } catch (const FormulaError& error) {
+        // Every shared subexpression being evaluated has this error, as with the tree
+        while (open_count > 0) {
+            shared->Store(open[--open_count], error);
+        }
+        throw;
+    }
+    return stack[0];
+}
+
+size_t CompiledFormula::GetMemoryUsage() const {
+    return sizeof(*this) + code_.capacity() * sizeof(Instruction) + cells_.capacity() * sizeof(Position);
+}
+
+std::vector<FormulaInterface::Subexpression> FormulaAST::GetSubexpressions() const {
+    std::vector<FormulaInterface::Subexpression> subexpressions;
+    subexpressions.reserve(subexpression_count_);
+    root_expr_->CollectSubexpressions(subexpressions);
+    return subexpressions;
+}
+
+std::optional<uint32_t> FormulaAST::GetRootSubexpression() const {
+    const uint32_t slot = root_expr_->GetSlot();
+    return slot == ASTImpl::NO_SLOT ? std::nullopt : std::optional<uint32_t>(slot);
+}
+
+
+size_t FormulaAST::GetTreeMemoryUsage() const {
+    // A list node holds the value and the link to the next one
+    const size_t ranges = std::distance(ranges_.begin(), ranges_.end());
+    return root_expr_->GetMemoryUsage() + ranges * (sizeof(void*) + sizeof(CellRange));
 }
 
-FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells)
+FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells,
+                       std::forward_list<CellRange> ranges)
         : root_expr_(std::move(root_expr))
-        , cells_(std::move(cells)) {
+        , cells_(std::move(cells))
+        , ranges_(std::move(ranges)) {
     cells_.sort();  // to avoid sorting in GetReferencedCells
+    root_expr_->NumberSubexpressions(subexpression_count_);
 }
 
+FormulaAST::FormulaAST(FormulaAST&&) = default;
+FormulaAST& FormulaAST::operator=(FormulaAST&&) = default;
 FormulaAST::~FormulaAST() = default;
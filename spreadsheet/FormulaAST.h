@@ -2,14 +2,20 @@
 
 #include "FormulaLexer.h"
 #include "common.h"
+#include "formula.h"
 
+#include <cstdint>
 #include <forward_list>
 #include <functional>
+#include <memory>
+#include <optional>
 #include <stdexcept>
 #include <regex>
+#include <vector>
 
 namespace ASTImpl {
     class Expr;
+    class ProgramBuilder;
 }
 
 class ParsingError : public std::runtime_error {
@@ -18,19 +24,76 @@ class ParsingError : public std::runtime_error {
 
 using ErrType = FormulaError::Category;
 
+// Flat form of a FormulaAST for formulas that are evaluated often: postfix code over a value
+// stack, with constant subtrees folded and the referenced cells resolved at compilation. A cell
+// referenced more than once gets a slot, so that it is read once per evaluation. Lookup functions are still evaluated by their AST nodes, so the program is only
+// valid while the AST it was compiled from is alive and unchanged.
+class CompiledFormula {
+public:
+    // Same result and errors as FormulaAST::Execute
+    double Execute(const SheetInterface& sheet, SharedSubexpressions* shared) const;
+    size_t GetMemoryUsage() const;
+
+private:
+    friend class ASTImpl::ProgramBuilder;
+
+    struct Instruction {
+        enum class Op : uint8_t {
+            Number,         // pushes number
+            Cell,           // pushes the value of cell arg
+            RepeatedCell,   // the same through its slot, reading the cell at the first use
+            Arithmetic,     // replaces the two top values with the result of operation arg: + - * /
+            Negate,
+            Expression,     // pushes the value of the AST node expr
+            BeginShared,    // shared subexpression arg: if it has a value, pushes it and skips jump
+                            // instructions up to its EndShared included
+            EndShared,      // stores the top of the stack as shared subexpression arg
+        };
+
+        Op op = Op::Number;
+        uint32_t arg = 0;
+        union {
+            double number = 0.0;
+            const ASTImpl::Expr* expr;
+            uint32_t jump;
+            uint32_t slot;
+        };
+    };
+
+    std::vector<Instruction> code_;
+    std::vector<Position> cells_;
+    // Deepest value stack and deepest nesting of shared subexpressions the code reaches
+    uint32_t max_stack_ = 0;
+    uint32_t max_shared_ = 0;
+    uint32_t slots_ = 0;
+};
+
 class FormulaAST {
 public:
     explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr,
-                        std::forward_list<Position> cells);
-    FormulaAST(FormulaAST&&) = default;
-    FormulaAST& operator=(FormulaAST&&) = default;
+                        std::forward_list<Position> cells,
+                        std::forward_list<CellRange> ranges = {});
+    FormulaAST(FormulaAST&&);
+    FormulaAST& operator=(FormulaAST&&);
     ~FormulaAST();
 
-    double Execute(const SheetInterface& sheet) const;
+    double Execute(const SheetInterface& sheet, SharedSubexpressions* shared = nullptr) const;
+    CompiledFormula Compile() const;
+    // See FormulaInterface::GetSubexpressions
+    std::vector<FormulaInterface::Subexpression> GetSubexpressions() const;
+    // Number of the subexpression that is the whole formula, if the formula is one
+    std::optional<uint32_t> GetRootSubexpression() const;
+    // Bytes of the expression nodes and of the range list; the cell list is not included
+    size_t GetTreeMemoryUsage() const;
     void PrintCells(std::ostream& out) const;
     void Print(std::ostream& out) const;
     void PrintFormula(std::ostream& out) const;
 
+    // Appends a compact postfix encoding of the AST to out. Deserialize() restores an
+    // equivalent AST from it without running the parser.
+    void Serialize(std::string& out) const;
+    static FormulaAST Deserialize(std::string_view data);
+
     std::forward_list<Position>& GetCells() {
         return cells_;
     }
@@ -39,6 +102,15 @@ public:
         return cells_;
     }
 
+    // Ranges passed to functions, in no particular order
+    std::forward_list<CellRange>& GetRanges() {
+        return ranges_;
+    }
+
+    const std::forward_list<CellRange>& GetRanges() const {
+        return ranges_;
+    }
+
 private:
     std::unique_ptr<ASTImpl::Expr> root_expr_;
 
@@ -46,6 +118,8 @@ private:
     // efficiently traversed without going through
     // the whole AST
     std::forward_list<Position> cells_;
+    std::forward_list<CellRange> ranges_;
+    uint32_t subexpression_count_ = 0;
 };
 
 FormulaAST ParseFormulaAST(std::istream& in);
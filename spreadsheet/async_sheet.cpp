@@ -0,0 +1,176 @@
+#include "async_sheet.h"
+
+#include <exception>
+
+AsyncSheet::AsyncSheet(std::unique_ptr<Sheet> sheet, RecalcBudget slice)
+        : sheet_(std::move(sheet))
+        , slice_(slice) {
+    worker_ = std::thread([this] {
+        Run();
+    });
+}
+
+AsyncSheet::~AsyncSheet() {
+    {
+        std::lock_guard guard(queue_mutex_);
+        stop_ = true;
+    }
+    wake_.notify_all();
+    worker_.join();
+}
+
+std::future<void> AsyncSheet::SetCell(Position pos, std::string text) {
+    if (!pos.IsValid()) {
+        throw InvalidPositionException("Invalid position");
+    }
+    Edit edit;
+    edit.pos = pos;
+    edit.text = std::move(text);
+    if (Cell::IsFormulaText(edit.text)) {
+        edit.formula = ParseFormula(edit.text.substr(1));
+    }
+    return Enqueue(std::move(edit));
+}
+
+std::future<void> AsyncSheet::ClearCell(Position pos) {
+    if (!pos.IsValid()) {
+        throw InvalidPositionException("Invalid pos");
+    }
+    Edit edit;
+    edit.pos = pos;
+    edit.clear = true;
+    return Enqueue(std::move(edit));
+}
+
+void AsyncSheet::SetViewport(Position top_left, Position bottom_right) {
+    std::lock_guard guard(mutex_);
+    sheet_->SetViewport(top_left, bottom_right);
+}
+
+std::future<void> AsyncSheet::Enqueue(Edit edit) {
+    auto applied = edit.applied.get_future();
+    {
+        std::lock_guard guard(queue_mutex_);
+        edit_queue_.push_back(std::move(edit));
+        edits_.fetch_add(1, std::memory_order_release);
+    }
+    wake_.notify_one();
+    return applied;
+}
+
+void AsyncSheet::ApplyEdits() {
+    std::vector<Edit> edits;
+    {
+        std::lock_guard guard(queue_mutex_);
+        edits.swap(edit_queue_);
+    }
+    for (Edit& edit : edits) {
+        try {
+            if (edit.clear) {
+                sheet_->ClearCell(edit.pos);
+            } else {
+                sheet_->SetCell(edit.pos, std::move(edit.text), std::move(edit.formula));
+            }
+            edit.applied.set_value();
+        } catch (...) {
+            edit.applied.set_exception(std::current_exception());
+        }
+        ++applied_edits_;
+    }
+}
+
+AsyncSheet::StaleValue AsyncSheet::GetStaleValue(Position pos) const {
+    if (!pos.IsValid()) {
+        throw InvalidPositionException("Invalid position");
+    }
+    // The worker stores the counter after publishing, so the snapshot read below is at least as
+    // new as the edits the counter covers
+    const uint64_t published = published_edits_.load(std::memory_order_acquire);
+    auto values = sheet_->ReadValues();
+    const CellInterface::Value* value = values->Find(pos);
+    return {value ? *value : CellInterface::Value(std::string()),
+            edits_.load(std::memory_order_acquire) != published};
+}
+
+std::future<CellInterface::Value> AsyncSheet::GetValueAsync(Position pos) {
+    std::promise<CellInterface::Value> promise;
+    auto future = promise.get_future();
+    {
+        std::lock_guard guard(mutex_);
+        // Edits queued before the call count too, applied or not
+        if (applied_edits_ == edits_.load(std::memory_order_acquire) && !sheet_->IsDirty(pos)) {
+            // Clean cells are cached, reading them costs nothing
+            const CellInterface* cell = sheet_->GetCell(pos);
+            promise.set_value(cell ? cell->GetValue() : CellInterface::Value(std::string()));
+            return future;
+        }
+        value_waiters_.emplace_back(pos, std::move(promise));
+    }
+    {
+        std::lock_guard guard(queue_mutex_);
+        has_value_waiters_ = true;
+    }
+    wake_.notify_one();
+    return future;
+}
+
+std::shared_future<void> AsyncSheet::WhenClean() {
+    std::lock_guard guard(mutex_);
+    if (!sheet_->HasDirtyCells() && published_edits_.load() == edits_.load()) {
+        std::promise<void> done;
+        done.set_value();
+        return done.get_future().share();
+    }
+    if (!has_clean_waiters_) {
+        clean_promise_ = std::promise<void>();
+        clean_future_ = clean_promise_.get_future().share();
+        has_clean_waiters_ = true;
+    }
+    return clean_future_;
+}
+
+void AsyncSheet::ServeValueWaiters() {
+    for (auto& [pos, promise] : value_waiters_) {
+        try {
+            const CellInterface* cell = sheet_->GetCell(pos);
+            promise.set_value(cell ? cell->GetValue() : CellInterface::Value(std::string()));
+        } catch (...) {
+            promise.set_exception(std::current_exception());
+        }
+    }
+    value_waiters_.clear();
+}
+
+void AsyncSheet::Run() {
+    // Dirty cells or edits are left after the last slice, the sheet may come in dirty
+    bool busy = true;
+    while (true) {
+        {
+            std::unique_lock queue_lock(queue_mutex_);
+            wake_.wait(queue_lock, [this, busy] {
+                return stop_ || busy || !edit_queue_.empty() || has_value_waiters_;
+            });
+            if (stop_) {
+                return;
+            }
+            has_value_waiters_ = false;
+        }
+
+        {
+            std::lock_guard lock(mutex_);
+            ApplyEdits();
+            ServeValueWaiters();
+            busy = !sheet_->RecalculateStep(slice_);
+            if (!busy) {
+                published_edits_.store(applied_edits_, std::memory_order_release);
+                // Edits queued meanwhile wake the worker again
+                if (has_clean_waiters_ && applied_edits_ == edits_.load(std::memory_order_acquire)) {
+                    clean_promise_.set_value();
+                    has_clean_waiters_ = false;
+                }
+            }
+        }
+        // Edits and waiters get the lock between slices
+        std::this_thread::yield();
+    }
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include "sheet.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Таблица с асинхронным пересчётом. SetCell и ClearCell только ставят правку в очередь, а
+// связывает ячейки, проверяет циклы, помечает зависимые формулы и вычисляет их фоновый поток:
+// правки по порядку, пересчёт порциями в пределах slice (сначала видимую область). Вызывающий
+// поток не ждёт ни правок, ни пересчёта. Все методы можно вызывать из любых потоков.
+class AsyncSheet {
+public:
+    // Значение из последней опубликованной версии снимка
+    struct StaleValue {
+        CellInterface::Value value;
+        // Таблица изменилась после публикации этой версии, и значение могло устареть
+        bool stale = false;
+    };
+
+    static constexpr RecalcBudget DEFAULT_SLICE{std::numeric_limits<size_t>::max(), std::chrono::milliseconds(1)};
+
+    explicit AsyncSheet(std::unique_ptr<Sheet> sheet = std::make_unique<Sheet>(), RecalcBudget slice = DEFAULT_SLICE);
+    // Останавливает фоновый поток; невыполненные обещания завершаются исключением broken_promise
+    ~AsyncSheet();
+
+    AsyncSheet(const AsyncSheet&) = delete;
+    AsyncSheet& operator=(const AsyncSheet&) = delete;
+
+    // Позиция и синтаксис формулы проверяются сразу (InvalidPositionException, FormulaException),
+    // причём формула разбирается в вызывающем потоке без блокировки таблицы. Возвращённое обещание
+    // выполняется, когда фоновый поток применил правку, или завершается исключением
+    // CircularDependencyException; его можно не ждать.
+    std::future<void> SetCell(Position pos, std::string text);
+    std::future<void> ClearCell(Position pos);
+    // См. Sheet::SetViewport
+    void SetViewport(Position top_left, Position bottom_right);
+
+    // Сразу возвращает последнее стабильное значение, не дожидаясь пересчёта. Не блокирует.
+    StaleValue GetStaleValue(Position pos) const;
+    // Актуальное значение ячейки, когда оно будет вычислено. Ячейки, которых ждут, фоновый поток
+    // вычисляет в первую очередь.
+    std::future<CellInterface::Value> GetValueAsync(Position pos);
+    // Готово, когда все изменения на момент вызова (и позже) пересчитаны и опубликованы
+    std::shared_future<void> WhenClean();
+
+    // Вызывает func(Sheet&) под блокировкой таблицы: доступ к остальным методам Sheet. Правки из
+    // очереди применяются до вызова, в этом потоке.
+    template <typename Func>
+    auto Access(Func&& func) {
+        std::lock_guard guard(mutex_);
+        ApplyEdits();
+        return func(*sheet_);
+    }
+
+private:
+    struct Edit {
+        Position pos;
+        std::string text;
+        // Parsed by the thread that queued the edit
+        std::unique_ptr<FormulaInterface> formula;
+        bool clear = false;
+        std::promise<void> applied;
+    };
+
+    std::future<void> Enqueue(Edit edit);
+    // Applies the queued edits; called with mutex_ held
+    void ApplyEdits();
+    void Run();
+    void ServeValueWaiters();
+
+    std::unique_ptr<Sheet> sheet_;
+    const RecalcBudget slice_;
+
+    // Guards sheet_ and the state below up to the queue
+    mutable std::mutex mutex_;
+    std::vector<std::pair<Position, std::promise<CellInterface::Value>>> value_waiters_;
+    std::promise<void> clean_promise_;
+    std::shared_future<void> clean_future_;
+    bool has_clean_waiters_ = false;
+    uint64_t applied_edits_ = 0;
+
+    // Guards the queue and the wake-up of the worker. Taken after mutex_ when both are needed, and
+    // never held for long, so that queuing an edit does not wait for the worker.
+    std::mutex queue_mutex_;
+    std::condition_variable wake_;
+    std::vector<Edit> edit_queue_;
+    bool has_value_waiters_ = false;
+    bool stop_ = false;
+
+    // Number of edits queued so far and the number of them reflected in the published snapshot
+    std::atomic<uint64_t> edits_{0};
+    std::atomic<uint64_t> published_edits_{0};
+
+    std::thread worker_;
+};
@@ -0,0 +1,122 @@
+// Export throughput on a 1M-cell sheet: the original per-field std::ostream path against
+// Sheet::PrintValues/PrintTexts through ExportWriter, to a stream and to a file descriptor.
+// Usage: spreadsheet_export_bench [output-path, default /dev/null]
+
+#include "exporter.h"
+#include "sheet.h"
+
+#include <chrono>
+#include <fcntl.h>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+namespace {
+    constexpr int ROWS = 1000;
+    constexpr int COLS = 1000;
+
+    void FillSheet(Sheet& sheet) {
+        std::vector<std::pair<Position, std::string>> cells;
+        cells.reserve(ROWS * COLS);
+        for (int row = 0; row < ROWS; ++row) {
+            for (int col = 0; col < COLS; ++col) {
+                std::string text;
+                switch (col % 4) {
+                    case 0:
+                        text = std::to_string(row * 0.37 + col);
+                        break;
+                    case 1:
+                        text = "label " + std::to_string(row % 97);
+                        break;
+                    case 2:
+                        text = "=" + Position{row, col - 2}.ToString() + "/3";
+                        break;
+                    default:
+                        text = "'=escaped";
+                        break;
+                }
+                cells.emplace_back(Position{row, col}, std::move(text));
+            }
+        }
+        sheet.SetCells(std::move(cells));
+    }
+
+    // The export loop as it was before ExportWriter: a std::variant copy per cell, several
+    // GetText() copies and operator<< for every field.
+    void LegacyPrintValues(const SheetInterface& sheet, std::ostream& output) {
+        auto size = sheet.GetPrintableSize();
+        for (int i = 0; i < size.rows; ++i) {
+            for (int j = 0; j < size.cols; ++j) {
+                if (const auto* cell = sheet.GetCell({i, j})) {
+                    const auto result = cell->GetValue();
+                    if (std::holds_alternative<double>(result)) {
+                        output << std::get<double>(result);
+                    } else if (std::holds_alternative<FormulaError>(result)) {
+                        output << std::get<FormulaError>(result);
+                    } else if (!cell->GetText().empty()) {
+                        std::string text = cell->GetText();
+                        if (text.front() == ESCAPE_SIGN) {
+                            output << std::string(text.begin() + 1, text.end());
+                        } else {
+                            output << cell->GetText();
+                        }
+                    }
+                }
+                if (j + 1 < size.cols) {
+                    output << '\t';
+                }
+            }
+            output << '\n';
+        }
+    }
+
+    void Measure(const std::string& name, const std::function<void()>& run) {
+        auto start = std::chrono::steady_clock::now();
+        run();
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << name << ": " << seconds * 1000 << " ms, "
+                  << static_cast<double>(ROWS) * COLS / seconds / 1e6 << " Mcells/s" << std::endl;
+    }
+}  // namespace
+
+int main(int argc, char** argv) {
+    std::string path = argc > 1 ? argv[1] : "/dev/null";
+
+    Sheet sheet;
+    FillSheet(sheet);
+    {
+        // Evaluate every formula once so that all runs measure export rather than recalculation
+        std::ofstream warmup(path);
+        sheet.PrintValues(warmup);
+    }
+
+    Measure("values, legacy ostream", [&] {
+        std::ofstream output(path);
+        LegacyPrintValues(sheet, output);
+    });
+    Measure("values, ExportWriter over ostream", [&] {
+        std::ofstream output(path);
+        sheet.PrintValues(output);
+    });
+    Measure("values, ExportWriter over fd", [&] {
+        int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        {
+            ExportWriter writer(fd);
+            sheet.PrintValues(writer);
+        }
+        ::close(fd);
+    });
+    Measure("texts, ExportWriter over fd", [&] {
+        int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        {
+            ExportWriter writer(fd);
+            sheet.PrintTexts(writer);
+        }
+        ::close(fd);
+    });
+    return 0;
+}
@@ -0,0 +1,61 @@
+// Replays a workload trace written by RecordingSheet against a fresh Sheet at full speed and
+// prints per-operation latency histograms as JSON: run it on two builds of the engine to compare
+// them on identical input.
+// Usage: spreadsheet_replay <trace> [repetitions, default 1]
+
+#include "sheet.h"
+#include "workload_trace.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <exception>
+#include <iostream>
+#include <map>
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        std::cerr << "Usage: spreadsheet_replay <trace> [repetitions]" << std::endl;
+        return 2;
+    }
+    const int repetitions = argc > 2 ? std::max(1, std::atoi(argv[2])) : 1;
+
+    std::map<TraceOp, LatencyHistogram> latencies;
+    uint64_t exceptions = 0;
+    try {
+        for (int i = 0; i < repetitions; ++i) {
+            Sheet sheet;
+            ReplayReport report = ReplayTrace(argv[1], sheet);
+            exceptions += report.exceptions;
+            for (const auto& [op, histogram] : report.latencies) {
+                latencies[op].Merge(histogram);
+            }
+        }
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
+    std::cout << "{\"trace\": \"" << argv[1] << "\", \"repetitions\": " << repetitions
+              << ", \"exceptions\": " << exceptions << ", \"operations\": {";
+    bool first_op = true;
+    for (const auto& [op, histogram] : latencies) {
+        std::cout << (first_op ? "\n  " : ",\n  ") << '"' << ToString(op) << "\": {\"count\": " << histogram.GetCount()
+                  << ", \"total_ns\": " << histogram.GetTotal().count()
+                  << ", \"p50_ns\": " << histogram.GetPercentile(0.5).count()
+                  << ", \"p90_ns\": " << histogram.GetPercentile(0.9).count()
+                  << ", \"p99_ns\": " << histogram.GetPercentile(0.99).count()
+                  << ", \"max_ns\": " << histogram.GetMax().count() << ", \"histogram\": [";
+        bool first_bucket = true;
+        for (size_t bucket = 0; bucket < LatencyHistogram::BUCKETS; ++bucket) {
+            if (uint64_t count = histogram.GetBucket(bucket)) {
+                std::cout << (first_bucket ? "" : ", ") << "{\"below_ns\": " << (uint64_t{1} << bucket)
+                          << ", \"count\": " << count << "}";
+                first_bucket = false;
+            }
+        }
+        std::cout << "]}";
+        first_op = false;
+    }
+    std::cout << "\n}}" << std::endl;
+    return 0;
+}
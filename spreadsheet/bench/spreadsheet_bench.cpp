@@ -0,0 +1,376 @@
+// Synthetic workloads over the engine's hot paths. Every scenario builds its sheet untimed, then
+// times each operation separately and reports throughput, latency percentiles and the peak RSS of
+// the process it ran in: scenarios run in forked children, so their peaks do not add up.
+// The workloads are seeded and reproducible. The report is a JSON document on stdout.
+// Usage: spreadsheet_bench [--scale K] [--only NAME]
+
+#include "exporter.h"
+#include "formula.h"
+#include "sheet.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <fcntl.h>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+namespace {
+    constexpr uint32_t SEED = 20240601;
+
+    class Recorder {
+    public:
+        // Times one operation that handles `items` cells (formulas, bytes...)
+        template <typename Operation>
+        void Time(size_t items, Operation&& operation) {
+            auto start = std::chrono::steady_clock::now();
+            operation();
+            auto elapsed = std::chrono::steady_clock::now() - start;
+            latencies_.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+            items_ += items;
+        }
+
+        // One JSON object; latencies are sorted in place
+        std::string Report(const std::string& name) {
+            std::sort(latencies_.begin(), latencies_.end());
+            int64_t total = 0;
+            for (int64_t latency : latencies_) {
+                total += latency;
+            }
+            auto percentile = [this](double p) -> int64_t {
+                if (latencies_.empty()) {
+                    return 0;
+                }
+                size_t index = static_cast<size_t>(p * static_cast<double>(latencies_.size() - 1) + 0.5);
+                return latencies_[index];
+            };
+            const double seconds = static_cast<double>(total) / 1e9;
+
+            rusage usage{};
+            getrusage(RUSAGE_SELF, &usage);
+
+            std::ostringstream out;
+            out << std::setprecision(6);
+            out << "{\"name\": \"" << name << "\", \"operations\": " << latencies_.size()
+                << ", \"items\": " << items_ << ", \"seconds\": " << seconds
+                << ", \"operations_per_second\": " << (seconds > 0 ? latencies_.size() / seconds : 0.0)
+                << ", \"items_per_second\": " << (seconds > 0 ? items_ / seconds : 0.0)
+                << ", \"latency_ns\": {\"p50\": " << percentile(0.5) << ", \"p90\": " << percentile(0.9)
+                << ", \"p99\": " << percentile(0.99) << ", \"max\": " << percentile(1.0)
+                << "}, \"peak_rss_kb\": " << usage.ru_maxrss << "}";
+            return out.str();
+        }
+
+    private:
+        std::vector<int64_t> latencies_;
+        size_t items_ = 0;
+    };
+
+    std::string Name(int row, int col) {
+        return Position{row, col}.ToString();
+    }
+
+    // Edit a constant, then publish the recalculated values: what an interactive edit costs
+    void RunEdits(Sheet& sheet, Recorder& recorder, int edits, const std::function<Position(int)>& target) {
+        for (int i = 0; i < edits; ++i) {
+            Position pos = target(i);
+            recorder.Time(1, [&] {
+                sheet.SetCell(pos, std::to_string(i));
+                sheet.Recalculate();
+            });
+        }
+    }
+
+    void BulkLoad(Recorder& recorder, int scale) {
+        constexpr int BATCH = 1000;
+        Sheet sheet;
+        std::mt19937 random(SEED);
+        for (int batch = 0; batch < 200 * scale; ++batch) {
+            std::vector<std::pair<Position, std::string>> cells;
+            cells.reserve(BATCH);
+            for (int i = 0; i < BATCH; ++i) {
+                int row = batch * 10 + i / 100;
+                int col = i % 100;
+                cells.emplace_back(Position{row, col}, col % 3 == 0 ? "label " + std::to_string(random() % 100)
+                                                                    : std::to_string(random() % 100000));
+            }
+            recorder.Time(BATCH, [&] {
+                sheet.SetCells(std::move(cells));
+            });
+        }
+    }
+
+    void FormulaParsing(Recorder& recorder, int scale) {
+        std::mt19937 random(SEED);
+        std::vector<std::string> formulas;
+        for (int i = 0; i < 100000 * scale; ++i) {
+            formulas.push_back(Name(random() % 1000, random() % 50) + "*(" + Name(random() % 1000, random() % 50)
+                               + "-" + std::to_string(random() % 100) + ")/" + Name(random() % 1000, random() % 50)
+                               + "+" + std::to_string(random() % 1000 / 10.0));
+        }
+        for (const std::string& formula : formulas) {
+            recorder.Time(1, [&] {
+                ParseFormula(formula);
+            });
+        }
+    }
+
+    void DeepChain(Recorder& recorder, int scale) {
+        // Evaluation recurses along the chain, so its depth is not scaled
+        constexpr int DEPTH = 5000;
+        Sheet sheet;
+        sheet.SetCell({0, 0}, "1");
+        for (int row = 1; row < DEPTH; ++row) {
+            sheet.SetCell({row, 0}, "=" + Name(row - 1, 0) + "+1");
+        }
+        sheet.Recalculate();
+        RunEdits(sheet, recorder, 50 * scale, [](int) {
+            return Position{0, 0};
+        });
+    }
+
+    void FanOut(Recorder& recorder, int scale) {
+        Sheet sheet;
+        sheet.SetCell({0, 0}, "1");
+        for (int i = 0; i < 20000 * scale; ++i) {
+            sheet.SetCell({i / 100, 1 + i % 100}, "=A1*" + std::to_string(i % 10 + 1));
+        }
+        sheet.Recalculate();
+        RunEdits(sheet, recorder, 50, [](int) {
+            return Position{0, 0};
+        });
+    }
+
+    void FanIn(Recorder& recorder, int scale) {
+        constexpr int INPUTS = 64;
+        Sheet sheet;
+        std::string sum = "=";
+        for (int row = 0; row < INPUTS; ++row) {
+            sheet.SetCell({row, 0}, std::to_string(row));
+            sum += (row ? "+" : "") + Name(row, 0);
+        }
+        for (int row = 0; row < 2000 * scale; ++row) {
+            sheet.SetCell({row, 1}, sum);
+        }
+        sheet.Recalculate();
+        RunEdits(sheet, recorder, 200, [](int i) {
+            return Position{i % INPUTS, 0};
+        });
+    }
+
+    void RandomDag(Recorder& recorder, int scale) {
+        constexpr int COLS = 100;
+        constexpr int ROOTS = 1000;
+        const int cells = 20000 * scale;
+        Sheet sheet;
+        std::mt19937 random(SEED);
+        auto at = [](int index) {
+            return Position{index / COLS, index % COLS};
+        };
+        for (int index = 0; index < cells; ++index) {
+            if (index < ROOTS) {
+                sheet.SetCell(at(index), std::to_string(index));
+                continue;
+            }
+            // Edges only go to earlier cells, so the graph is acyclic
+            std::string text = "=";
+            for (int edge = 0, edges = 1 + random() % 3; edge < edges; ++edge) {
+                text += (edge ? "+" : "") + at(random() % index).ToString();
+            }
+            sheet.SetCell(at(index), text);
+        }
+        sheet.Recalculate();
+        RunEdits(sheet, recorder, 500, [&random, &at](int) {
+            return at(random() % ROOTS);
+        });
+    }
+
+    void FillDown(Recorder& recorder, int scale) {
+        // Pairs of columns: the values and the formula filled down next to them
+        constexpr int ROWS = 10000;
+        const int pairs = 5 * scale;
+        Sheet sheet;
+        for (int pair = 0; pair < pairs; ++pair) {
+            for (int row = 0; row < ROWS; ++row) {
+                sheet.SetCell({row, 2 * pair}, std::to_string(row));
+            }
+        }
+        for (int pair = 0; pair < pairs; ++pair) {
+            for (int row = 0; row < ROWS; ++row) {
+                const std::string text = "=" + Name(row, 2 * pair) + "*2+1";
+                recorder.Time(1, [&] {
+                    sheet.SetCell({row, 2 * pair + 1}, text);
+                });
+            }
+        }
+    }
+
+    void SparseFarCorner(Recorder& recorder, int scale) {
+        Sheet sheet;
+        std::mt19937 random(SEED);
+        for (int i = 0; i < 500 * scale; ++i) {
+            Position pos{static_cast<int>(random() % Position::MAX_ROWS), static_cast<int>(random() % Position::MAX_COLS)};
+            recorder.Time(1, [&] {
+                sheet.SetCell(pos, "far");
+            });
+        }
+    }
+
+    void ExportValues(Recorder& recorder, int scale) {
+        constexpr int COLS = 100;
+        const int rows = 1000 * scale;
+        Sheet sheet;
+        for (int row = 0; row < rows; ++row) {
+            for (int col = 0; col < COLS; ++col) {
+                sheet.SetCell({row, col}, col % 2 ? "=" + Name(row, col - 1) + "/7" : std::to_string(row * col));
+            }
+        }
+        int fd = ::open("/dev/null", O_WRONLY);
+        for (int i = 0; i < 20; ++i) {
+            recorder.Time(static_cast<size_t>(rows) * COLS, [&] {
+                ExportWriter writer(fd);
+                sheet.PrintValues(writer);
+            });
+        }
+        ::close(fd);
+    }
+
+    void ClearChurn(Recorder& recorder, int scale) {
+        const int rows = 10000 * scale;
+        Sheet sheet;
+        for (int row = 0; row < rows; ++row) {
+            sheet.SetCell({row, 0}, std::to_string(row));
+            sheet.SetCell({row, 1}, "=" + Name(row, 0) + "+" + Name((row + 1) % rows, 0));
+        }
+        std::mt19937 random(SEED);
+        for (int i = 0; i < 5 * rows; ++i) {
+            Position pos{static_cast<int>(random() % rows), static_cast<int>(random() % 2)};
+            const std::string text = pos.col ? "=" + Name(pos.row, 0) + "*3" : std::to_string(i);
+            recorder.Time(1, [&] {
+                sheet.ClearCell(pos);
+                sheet.SetCell(pos, text);
+            });
+        }
+    }
+
+    // Formulas built on the same few sums of the inputs, evaluated with and without sharing them
+    void SharedSubexpressions(Recorder& recorder, int scale, bool sharing) {
+        constexpr int INPUTS = 32;
+        constexpr int GROUPS = 4;
+        Sheet sheet;
+        sheet.SetSubexpressionSharing(sharing);
+        std::vector<std::string> sums(GROUPS);
+        for (int row = 0; row < INPUTS; ++row) {
+            sheet.SetCell({row, 0}, std::to_string(row));
+            for (int group = 0; group < GROUPS; ++group) {
+                sums[group] += (row ? "+" : "") + Name(row, 0) + "*" + std::to_string(group + 1);
+            }
+        }
+        for (int i = 0; i < 5000 * scale; ++i) {
+            sheet.SetCell({i / 50, 1 + i % 50}, "=(" + sums[i % GROUPS] + ")/" + std::to_string(i % 7 + 1));
+        }
+        sheet.Recalculate();
+        RunEdits(sheet, recorder, 50, [](int i) {
+            return Position{i % INPUTS, 0};
+        });
+    }
+
+    void SharedSubexpressionsOn(Recorder& recorder, int scale) {
+        SharedSubexpressions(recorder, scale, true);
+    }
+
+    void SharedSubexpressionsOff(Recorder& recorder, int scale) {
+        SharedSubexpressions(recorder, scale, false);
+    }
+
+    const std::vector<std::pair<std::string, void (*)(Recorder&, int)>> SCENARIOS = {
+        {"bulk_load", BulkLoad},
+        {"formula_parsing", FormulaParsing},
+        {"deep_chain", DeepChain},
+        {"fan_out", FanOut},
+        {"fan_in", FanIn},
+        {"random_dag", RandomDag},
+        {"fill_down", FillDown},
+        {"sparse_far_corner", SparseFarCorner},
+        {"export_values", ExportValues},
+        {"clear_churn", ClearChurn},
+        {"shared_subexpressions", SharedSubexpressionsOn},
+        {"unshared_subexpressions", SharedSubexpressionsOff},
+    };
+
+    // Runs the scenario in a child process and returns its report
+    std::string RunIsolated(const std::string& name, void (*scenario)(Recorder&, int), int scale) {
+        int channel[2];
+        if (::pipe(channel) != 0) {
+            std::perror("pipe");
+            std::exit(1);
+        }
+        pid_t child = ::fork();
+        if (child == 0) {
+            ::close(channel[0]);
+            Recorder recorder;
+            scenario(recorder, scale);
+            const std::string report = recorder.Report(name);
+            for (size_t written = 0; written < report.size();) {
+                ssize_t result = ::write(channel[1], report.data() + written, report.size() - written);
+                if (result <= 0) {
+                    ::_exit(1);
+                }
+                written += static_cast<size_t>(result);
+            }
+            ::_exit(0);
+        }
+        ::close(channel[1]);
+        std::string report;
+        char buffer[4096];
+        for (ssize_t size; (size = ::read(channel[0], buffer, sizeof(buffer))) > 0;) {
+            report.append(buffer, static_cast<size_t>(size));
+        }
+        ::close(channel[0]);
+        int status = 0;
+        ::waitpid(child, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0 || report.empty()) {
+            return "{\"name\": \"" + name + "\", \"failed\": true}";
+        }
+        return report;
+    }
+}  // namespace
+
+int main(int argc, char** argv) {
+    int scale = 1;
+    std::string only;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        std::string option = argv[i];
+        if (option == "--scale") {
+            scale = std::max(1, std::atoi(argv[i + 1]));
+        } else if (option == "--only") {
+            only = argv[i + 1];
+        } else {
+            std::cerr << "Usage: spreadsheet_bench [--scale K] [--only NAME]" << std::endl;
+            return 2;
+        }
+    }
+
+    std::cout << "{\"benchmark\": \"spreadsheet_bench\", \"scale\": " << scale << ", \"seed\": " << SEED
+              << ", \"scenarios\": [";
+    bool first = true;
+    for (const auto& [name, scenario] : SCENARIOS) {
+        if (!only.empty() && name != only) {
+            continue;
+        }
+        std::cout << (first ? "\n  " : ",\n  ") << RunIsolated(name, scenario, scale) << std::flush;
+        first = false;
+    }
+    std::cout << "\n]}" << std::endl;
+    return 0;
+}
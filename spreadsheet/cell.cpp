@@ -1,152 +1,383 @@
 #include "cell.h"
 
+#include <atomic>
 #include <cassert>
 #include <iostream>
 #include <string>
 #include <optional>
+#include <type_traits>
+#include <utility>
+#include <variant>
 
 #include "sheet.h"
+#include "trace_events.h"
 
 // Реализуйте следующие методы
 using namespace std::literals;
 
+namespace {
+    // Below this many dependents a search through the list is cheaper than keeping an index
+    constexpr size_t REFERRING_INDEX_THRESHOLD = 32;
+}  // namespace
+
 Cell::Cell(Sheet& table, Position pos)
         : table_(table)
         , pos_(pos){
-    text_ = "";
     val_ = nullptr;
 
 }
 
-Cell::~Cell() {
-    Cell::Clear();
+Cell::Cell(Sheet& table, const Cell& other)
+        : table_(table)
+        , pos_(other.pos_)
+        , val_(other.val_)
+        , text_(other.text_)
+        , referenced_cells_(other.referenced_cells_)
+        , referring_cells_(other.referring_cells_) {
+    if (other.referring_index_) {
+        referring_index_ = std::make_unique<std::unordered_map<Position, size_t, PositionHasher>>(*other.referring_index_);
+    }
+}
+
+bool Cell::IsFormulaText(const std::string& text) {
+    return text.size() > 1 && text[0] == FORMULA_SIGN;
 }
 
 void Cell::Set(std::string text) {
-    std::unique_ptr<FormulaInterface> tmp_formula_ptr = nullptr;
-    std::vector<Position> tmp_referenced_cells{};
+    table_.SetCell(pos_, std::move(text));
+}
+
+std::unique_ptr<FormulaInterface> Cell::Parse(const std::string& text) const {
+    if (!IsFormulaText(text)) {
+        return nullptr;
+    }
+    SPREADSHEET_PROFILE(auto parse = table_.GetProfiler().Measure(Profiler::Kind::Parse, pos_);)
+    TraceScope trace("parse", pos_);
+    return ParseFormula({text.begin() + 1, text.end()});
+}
+
+void Cell::Set(std::string text, std::unique_ptr<FormulaInterface> formula) {
+    Assign(std::move(text), std::move(formula), false);
+}
 
-    if (text[0] == FORMULA_SIGN && text.size() > 1) { //expression
-        tmp_formula_ptr = ParseFormula({text.begin() + 1, text.end()});
+void Cell::Revert(std::string text, std::shared_ptr<const FormulaInterface> formula) {
+    Assign(std::move(text), std::move(formula), true);
+}
+
+void Cell::Assign(std::string text, std::shared_ptr<const FormulaInterface> formula, bool trusted) {
+    std::shared_ptr<const FormulaInterface> tmp_formula_ptr = std::move(formula);
+    std::vector<Position> tmp_referenced_cells{};
+    std::vector<CellRange> tmp_referenced_ranges{};
 
+    if (tmp_formula_ptr) {
         tmp_referenced_cells = tmp_formula_ptr->GetReferencedCells();
-        std::unordered_set<Position, PositionHasher> visited_cells{};
-        HasCircularDependency(pos_, tmp_referenced_cells, visited_cells);
-    }
-    //Erasing all current references
-    for (const Position& cell_pos : referenced_cells_) {
-        Cell* cell = table_.GetCommonCell(cell_pos);
-        if (cell) {
-            // Find the position in referring_cells_ and erase it
-            auto it = std::find(cell->referring_cells_.begin(), cell->referring_cells_.end(), pos_);
-            if (it != cell->referring_cells_.end()) {
-                cell->referring_cells_.erase(it);
-            }
+        tmp_referenced_ranges = tmp_formula_ptr->GetReferencedRanges();
+        if (!trusted) {
+            TraceScope trace("cycle check", pos_);
+            HasCircularDependency(tmp_referenced_cells, tmp_referenced_ranges);
         }
     }
-    referenced_cells_.clear();
 
-    if (tmp_formula_ptr) {
-        for (const Position &pos: tmp_referenced_cells) {
-            if (table_.GetCell(pos) == nullptr) {
-                table_.SetCell(pos, ""s);
+    {
+        TraceScope trace("relink", pos_);
+        table_.AccountCell(*this, -1);
+        if (val_) {
+            table_.RemoveRangeDependent(pos_, val_->GetReferencedRanges());
+            table_.RemoveSubexpressions(*val_);
+        }
+        //Erasing all current references
+        for (const Position& cell_pos : referenced_cells_) {
+            Cell* cell = table_.GetCommonCell(cell_pos);
+            if (cell) {
+                table_.AccountCell(*cell, -1);
+                cell->RemoveReferring(pos_);
+                table_.AccountCell(*cell, 1);
             }
-            referenced_cells_.emplace_back(pos);
+        }
+        referenced_cells_.clear();
+
+        if (tmp_formula_ptr) {
+            for (const Position &pos: tmp_referenced_cells) {
+                if (table_.GetCommonCell(pos) == nullptr) {
+                    table_.SetCell(pos, ""s);
+                }
+                referenced_cells_.emplace_back(pos);
 
-            Cell *ref_cell_no_const = table_.GetCommonCell(pos);
-            ref_cell_no_const->referring_cells_.emplace_back(pos_);
+                Cell *ref_cell_no_const = table_.GetCommonCell(pos);
+                table_.AccountCell(*ref_cell_no_const, -1);
+                ref_cell_no_const->AddReferring(pos_);
+                table_.AccountCell(*ref_cell_no_const, 1);
+            }
         }
+        table_.AddRangeDependent(pos_, tmp_referenced_ranges);
         val_ = std::move(tmp_formula_ptr);
-    }
+        if (val_) {
+            table_.AddSubexpressions(*val_);
+        }
 
-    if (!text.empty()) {
-        text_ = std::move(text);
-    } else {
-        text_ = "";
-        val_ = nullptr;
+        if (val_ != nullptr && !trusted) {
+            // Keep the normalized expression so that GetText() does not print the AST every time
+            SetText(FORMULA_SIGN + val_->GetExpression());
+        } else {
+            SetText(text);
+        }
+        table_.AccountCell(*this, 1);
+        table_.IndexCell(pos_);
     }
+
+    TraceScope trace("invalidate", pos_);
     CacheInvalidation();
 }
 
 void Cell::Clear() {
-    Set("");
+    Set(std::string(), nullptr);
 }
 
 Cell::Value Cell::GetValue() const {
-    if (text_.has_value() && val_ == nullptr) {
-        if (text_.value().empty()) {
-            return std::string("");
-        } else if (text_.value()[0] == ESCAPE_SIGN) {
-            return std::string{text_->begin() + 1, text_->end()};
-        }
-    }
+    return MakeValue(GetValueView());
+}
 
-    if (cached_value_.has_value()) {
-        return cached_value_.value();
-    }
+Cell::ValueView Cell::GetValueView() const {
+    return table_.GetValueView(*this);
+}
 
-    if (val_ != nullptr) {
-        try {
-            FormulaInterface::Value result = val_->Evaluate(table_);
-            if (std::holds_alternative<double>(result)) {
-                cached_value_ = std::get<double>(result);
-                return cached_value_.value();
-            } else if (std::holds_alternative<FormulaError>(result)) {
-                return std::get<FormulaError>(result);
-            }
-        } catch (const FormulaException &e) {
-            return FormulaError(e.what());
+Cell::Value Cell::MakeValue(ValueView view) {
+    return std::visit([](auto value) -> Value {
+        if constexpr (std::is_same_v<decltype(value), std::string_view>) {
+            return std::string(value);
+        } else {
+            return value;
         }
-    }
-    return text_.value_or("");  // return text if no value or an empty value
+    }, view);
 }
 
 std::string Cell::GetText() const {
-    if (val_ != nullptr) {
-        return FORMULA_SIGN + val_->GetExpression();
-    }
-    return text_.value();
+    return std::string(GetTextView());
+}
+
+std::string_view Cell::GetTextView() const {
+    return table_.GetTexts().View(text_);
+}
+
+TextId Cell::GetTextId() const {
+    return text_;
+}
+
+bool Cell::IsEmpty() const {
+    return text_ == TextDictionary::EMPTY;
 }
 
 std::vector<Position> Cell::GetReferencedCells() const {
     return referenced_cells_;
 }
 
-bool Cell::HasCache() const {
-    return cached_value_.has_value();
+Position Cell::GetPosition() const {
+    return pos_;
 }
-void Cell::ClearCache() {
-    cached_value_.reset();
+
+const FormulaInterface* Cell::GetFormula() const {
+    return val_.get();
 }
 
-void Cell::CacheInvalidation() {
-    ClearCache();
-    for (const Position& cell_pos : referring_cells_) {
-        Cell* cell = table_.GetCommonCell(cell_pos);
+std::shared_ptr<const FormulaInterface> Cell::GetSharedFormula() const {
+    return val_;
+}
 
-        if (!cell->HasCache()) {
-            continue;
-        } else {
-            cell->ClearCache();
-            CacheInvalidation();
+void Cell::Restore(std::string text, std::unique_ptr<FormulaInterface> formula,
+                   std::vector<Position> referenced_cells, std::optional<FormulaInterface::Value> cached_value) {
+    for (const Position& pos : referenced_cells) {
+        if (table_.GetCommonCell(pos) == nullptr) {
+            table_.SetCell(pos, ""s);
         }
+        Cell* cell = table_.GetCommonCell(pos);
+        table_.AccountCell(*cell, -1);
+        cell->AddReferring(pos_);
+        table_.AccountCell(*cell, 1);
+    }
+    table_.AccountCell(*this, -1);
+    referenced_cells_ = std::move(referenced_cells);
+    val_ = std::move(formula);
+    if (val_) {
+        table_.AddRangeDependent(pos_, val_->GetReferencedRanges());
+        table_.AddSubexpressions(*val_);
+    }
+    SetText(text);
+    table_.AccountCell(*this, 1);
+    if (cached_value) {
+        // Loading the value is as cheap as recalling it
+        table_.GetValueCache().Insert(pos_, *cached_value, 1);
+    } else {
+        table_.InvalidateValue(*this);
+    }
+    table_.IndexCell(pos_);
+    table_.MarkDirty(pos_);
+}
+
+bool Cell::Shift(const ReferenceShift& shift) {
+    table_.AccountCell(*this, -1);
+    bool stale = ShiftLinks(shift);
+    table_.AccountCell(*this, 1);
+    return stale;
+}
+
+bool Cell::ShiftLinks(const ReferenceShift& shift) {
+    pos_ = shift.Apply(pos_);
+    referring_cells_.erase(std::remove_if(referring_cells_.begin(), referring_cells_.end(),
+                                          [&shift](Position& pos) {
+                                              pos = shift.Apply(pos);
+                                              return !pos.IsValid();
+                                          }),
+                           referring_cells_.end());
+    if (referring_index_) {
+        RebuildReferringIndex();
+    }
+
+    bool moved = false;
+    bool stale = false;
+    for (Position pos : referenced_cells_) {
+        Position shifted = shift.Apply(pos);
+        moved = moved || !(shifted == pos);
+        stale = stale || !shifted.IsValid();
+    }
+    // A range reaching the shifted part may read other cells now, even if its bounds stay
+    for (const CellRange& range : val_ ? val_->GetReferencedRanges() : std::vector<CellRange>{}) {
+        moved = moved || !(shift.Apply(range) == range);
+        stale = stale || (shift.axis == ReferenceShift::Axis::Rows ? range.last.row : range.last.col) >= shift.first;
+    }
+    if (!moved) {
+        return stale;
+    }
+
+    // Its subexpressions are keyed by the references about to change
+    table_.RemoveSubexpressions(*val_);
+    // A formula held elsewhere keeps its references: this cell switches to a copy. The acquire
+    // fence orders the last reads of a fork that just released it before the rewrite.
+    if (val_.use_count() != 1) {
+        val_ = val_->Clone();
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    // Every formula is created non-const (parsed, loaded or cloned) and only shared as const
+    std::const_pointer_cast<FormulaInterface>(val_)->ShiftReferences(shift);
+    referenced_cells_ = val_->GetReferencedCells();
+    table_.AddSubexpressions(*val_);
+    SetText(FORMULA_SIGN + val_->GetExpression());
+    return stale;
+}
+
+void Cell::SetText(std::string_view text) {
+    // Interned before the old text is released, so that an unchanged text keeps its entry
+    TextId id = table_.InternText(text);
+    table_.ReleaseText(text_);
+    text_ = id;
+}
+
+void Cell::AddReferring(Position pos) {
+    referring_cells_.push_back(pos);
+    if (referring_index_) {
+        referring_index_->emplace(pos, referring_cells_.size() - 1);
+    } else if (referring_cells_.size() > REFERRING_INDEX_THRESHOLD) {
+        RebuildReferringIndex();
+    }
+}
+
+void Cell::RemoveReferring(Position pos) {
+    if (!referring_index_) {
+        // Short lists keep the order in which the dependents were linked
+        auto it = std::find(referring_cells_.begin(), referring_cells_.end(), pos);
+        if (it != referring_cells_.end()) {
+            referring_cells_.erase(it);
+        }
+        return;
+    }
+    auto found = referring_index_->find(pos);
+    if (found == referring_index_->end()) {
+        return;
+    }
+    const size_t index = found->second;
+    referring_index_->erase(found);
+    if (index + 1 != referring_cells_.size()) {
+        referring_cells_[index] = referring_cells_.back();
+        (*referring_index_)[referring_cells_[index]] = index;
+    }
+    referring_cells_.pop_back();
+}
+
+void Cell::RebuildReferringIndex() {
+    if (!referring_index_) {
+        referring_index_ = std::make_unique<std::unordered_map<Position, size_t, PositionHasher>>();
+    }
+    referring_index_->clear();
+    for (size_t i = 0; i < referring_cells_.size(); ++i) {
+        referring_index_->emplace(referring_cells_[i], i);
     }
 }
 
-void Cell::HasCircularDependency(const Position& current_pos, const std::vector<Position>& references,
-                                 std::unordered_set<Position, PositionHasher>& visited) const {
-    for (const Position& ref_pos : references) {
-        if (visited.count(ref_pos)) continue;
-        if (current_pos == ref_pos) throw CircularDependencyException("Circular dependency");
-        visited.emplace(ref_pos);
+void Cell::CacheInvalidation() {
+    table_.InvalidateValue(*this);
+    table_.MarkDirty(pos_);
+    // Only the direct dependents here: the sheet walks on from them later, so that an edit costs
+    // the same however long the chains below it are
+    [[maybe_unused]] const size_t invalidated = table_.InvalidateDependents(pos_);
+    SPREADSHEET_PROFILE(table_.GetProfiler().CountInvalidation(pos_, invalidated);)
+}
+
+void Cell::HasCircularDependency(const std::vector<Position>& references, const std::vector<CellRange>& ranges) const {
+    // The new formula closes a cycle if it reads this cell or anything depending on it. Walking
+    // the dependents rather than the references keeps ranges cheap: their cells are not visited.
+    const std::unordered_set<Position, PositionHasher> read(references.begin(), references.end());
+    std::unordered_set<Position, PositionHasher> visited{pos_};
+    std::vector<Position> pending{pos_};
+    SPREADSHEET_PROFILE(auto check = table_.GetProfiler().Measure(Profiler::Kind::CycleCheck, pos_);)
+    while (!pending.empty()) {
+        Position pos = pending.back();
+        pending.pop_back();
+        if (read.count(pos) || std::any_of(ranges.begin(), ranges.end(), [pos](const CellRange& range) {
+                return range.Contains(pos);
+            })) {
+            throw CircularDependencyException("Circular dependency");
+        }
 
-        auto ref_cell = table_.GetCell(ref_pos);
-        if (ref_cell) {
-            HasCircularDependency(current_pos, ref_cell->GetReferencedCells(), visited);
+        std::vector<Position> dependents;
+        if (const Cell* cell = std::as_const(table_).GetCommonCell(pos)) {
+            dependents = cell->referring_cells_;
+        }
+        table_.CollectRangeDependents(pos, dependents);
+        for (Position dependent : dependents) {
+            if (visited.insert(dependent).second) {
+                pending.push_back(dependent);
+            }
         }
+        SPREADSHEET_PROFILE(check.count = visited.size();)
     }
 }
 
+void Cell::AccountMemory(SheetMemoryStats& stats, int sign) const {
+    stats.cells.Add(sign, 1, sizeof(Cell));
+    if (text_ == TextDictionary::EMPTY) {
+        stats.empty_cells.Add(sign, 1, sizeof(Cell));
+    }
+    if (val_) {
+        const FormulaInterface::MemoryUsage usage = val_->GetMemoryUsage();
+        stats.formulas.Add(sign, 1, usage.tree_bytes);
+        stats.formula_references.Add(sign, usage.references, usage.reference_bytes);
+    }
+    size_t edge_bytes = (referenced_cells_.capacity() + referring_cells_.capacity()) * sizeof(Position);
+    if (referring_index_) {
+        // A node holds the entry, the link to the next node and the cached hash
+        edge_bytes += sizeof(*referring_index_) + referring_index_->bucket_count() * sizeof(void*)
+                      + referring_index_->size() * (sizeof(std::pair<const Position, size_t>) + 2 * sizeof(void*));
+    }
+    stats.dependency_edges.Add(sign, referenced_cells_.size() + referring_cells_.size(), edge_bytes);
+}
+
 std::vector<Position> Cell::GetCellReferring() const {
     return referring_cells_;
 }
+
+const std::vector<Position>& Cell::GetReferencedCellsView() const {
+    return referenced_cells_;
+}
+
+const std::vector<Position>& Cell::GetCellReferringView() const {
+    return referring_cells_;
+}
@@ -1,41 +1,111 @@
 #pragma once
 
 #include <optional>
+#include <string_view>
+#include <unordered_map>
 #include <unordered_set>
 #include <algorithm>
 
 #include "common.h"
 #include "formula.h"
+#include "memory_stats.h"
+#include "text_dictionary.h"
 
 class Sheet;
 
 class Cell : public CellInterface {
 public:
     Cell(Sheet& table, Position pos);
+    // Копия ячейки для другой таблицы (форка): формула не копируется, а разделяется, связи
+    // с другими ячейками сохраняются
+    Cell(Sheet& table, const Cell& other);
 
-    ~Cell();
+    // Не трогает другие ячейки: перед удалением ячейки из живой таблицы её нужно очистить (Clear)
+    ~Cell() = default;
 
-    void Set(std::string text);
+    // Правка через интерфейс ячейки идёт через таблицу (Sheet::SetCell), как и правка по позиции:
+    // она так же попадает в историю отмены
+    void Set(std::string text) override;
+    // Разбирает текст формулы; nullptr для текстовой ячейки
+    std::unique_ptr<FormulaInterface> Parse(const std::string& text) const;
+    // Задаёт содержимое ячейки уже разобранной формулой; вызывается таблицей, которая сама
+    // записывает правку в историю. Для текстовой ячейки formula равен nullptr.
+    void Set(std::string text, std::unique_ptr<FormulaInterface> formula);
+    // Возвращает ячейку в состояние, которое у неё уже было (отмена правки): текст уже
+    // нормализован, формула не разбирается заново, а проверка циклов не нужна
+    void Revert(std::string text, std::shared_ptr<const FormulaInterface> formula);
     void Clear();
 
+    // Является ли текст формулой, т.е. нужно ли его передавать в ParseFormula
+    static bool IsFormulaText(const std::string& text);
+
+    // Видимое значение без копирования текста: строка ссылается на словарь текстов таблицы и
+    // действительна до следующего изменения таблицы
+    using ValueView = std::variant<std::string_view, double, FormulaError>;
+
+    // Значение формулы вычисляется при необходимости и сохраняется в кэшах таблицы, поэтому оба
+    // метода вызываются только из потока-писателя таблицы (см. Sheet::ReadValues)
     Value GetValue() const override;
+    ValueView GetValueView() const;
+    // Значение с собственной копией текста
+    static Value MakeValue(ValueView view);
     std::string GetText() const override;
+    // Текст хранится в словаре таблицы, которой принадлежит ячейка; ячейку из строки, разделяемой
+    // с форком, таблица читает через свой словарь (по номеру текста)
+    std::string_view GetTextView() const;
+    // Номер текста в словаре таблицы: у ячеек с равными текстами равные номера
+    TextId GetTextId() const;
+    // Пуст ли текст ячейки; не обращается к словарю
+    bool IsEmpty() const;
     std::vector<Position> GetReferencedCells() const override;
     std::vector<Position> GetCellReferring() const;
+    // Те же списки без копирования; действительны до следующего изменения таблицы
+    const std::vector<Position>& GetReferencedCellsView() const;
+    const std::vector<Position>& GetCellReferringView() const;
+
+    Position GetPosition() const;
+    // Формула ячейки или nullptr для текстовой ячейки
+    const FormulaInterface* GetFormula() const;
+    // Та же формула как разделяемый неизменяемый объект
+    std::shared_ptr<const FormulaInterface> GetSharedFormula() const;
+
+    // Восстанавливает ячейку из снимка таблицы: формула уже собрана, ссылки referenced_cells
+    // заведомо не образуют циклов, в кэш значений попадает сохранённое значение.
+    void Restore(std::string text, std::unique_ptr<FormulaInterface> formula,
+                 std::vector<Position> referenced_cells, std::optional<FormulaInterface::Value> cached_value);
+
+    // Переносит ячейку при вставке или удалении строк (столбцов): позицию, связи с другими ячейками
+    // и ссылки формулы (текст формулы обновляется). Связанные ячейки таблица переносит так же,
+    // поэтому связи на время переноса могут быть несогласованы. Возвращает true, если значение
+    // формулы могло измениться (ссылка на удалённую ячейку, сдвиг внутри диапазона) и кэш нужно
+    // сбросить.
+    bool Shift(const ReferenceShift& shift);
+    // Сбрасывает кэш ячейки и зависящих от неё формул
+    void CacheInvalidation();
+
+    // Добавляет в stats (sign = 1) или убирает из них (sign = -1) всё, что хранит ячейка
+    void AccountMemory(SheetMemoryStats& stats, int sign) const;
 
 private:
     Sheet& table_;
     Position pos_;
-    std::unique_ptr<FormulaInterface> val_;
-    std::optional<std::string> text_;
+    // Formulas are immutable once shared between the copies of a cell in forks or with the undo
+    // journal; Shift() rewrites one in place only while this cell is its sole holder
+    std::shared_ptr<const FormulaInterface> val_;
+    // Interned in the sheet's dictionary: cells with the same label share one copy of it
+    TextId text_ = TextDictionary::EMPTY;
 
     std::vector<Position> referenced_cells_;
     std::vector<Position> referring_cells_;
-    mutable std::optional<double> cached_value_;
+    // Index of each dependent in referring_cells_, built once a cell has many of them: unlinking a
+    // dependent then swaps it with the last one instead of searching and shifting the whole list
+    std::unique_ptr<std::unordered_map<Position, size_t, PositionHasher>> referring_index_;
 
-    bool HasCache() const;
-    void ClearCache();
-    void CacheInvalidation();
-    void HasCircularDependency(const Position& current_pos, const std::vector<Position>& references,
-                               std::unordered_set<Position, PositionHasher>& visited_cells) const;
+    void Assign(std::string text, std::shared_ptr<const FormulaInterface> formula, bool trusted);
+    void SetText(std::string_view text);
+    bool ShiftLinks(const ReferenceShift& shift);
+    void AddReferring(Position pos);
+    void RemoveReferring(Position pos);
+    void RebuildReferringIndex();
+    void HasCircularDependency(const std::vector<Position>& references, const std::vector<CellRange>& ranges) const;
 };
\ No newline at end of file
@@ -2,6 +2,7 @@
 
 #include <iosfwd>
 #include <memory>
+#include <optional>
 #include <stdexcept>
 #include <string>
 #include <string_view>
@@ -33,6 +34,24 @@ struct Position {
     static const Position NONE;
 };
 
+// Прямоугольный диапазон ячеек [first, last], например A1:B10
+struct CellRange {
+    Position first;
+    Position last;
+
+    bool operator==(const CellRange& rhs) const;
+
+    // Обе границы корректны, и first не правее и не ниже last
+    bool IsValid() const;
+    bool Contains(Position pos) const;
+    int GetRows() const;
+    int GetCols() const;
+    // Запись вида A1:B10; пустая строка для некорректного диапазона
+    std::string ToString() const;
+
+    static const CellRange NONE;
+};
+
 struct PositionHasher {
     size_t operator()(const Position& position) const {
         return position.Hash();
@@ -56,6 +75,7 @@ public:
         Ref,    // ссылка на ячейку с некорректной позицией
         Value,  // ячейка не может быть трактована как число
         Div0,  // в результате вычисления возникло деление на ноль
+        NA,    // функция поиска не нашла значение
     };
 
     FormulaError(Category category)
@@ -131,6 +151,20 @@ public:
     virtual std::vector<Position> GetReferencedCells() const = 0;
 };
 
+// Значение, по которому ищут функции MATCH, VLOOKUP и XLOOKUP: число или текст, приведённый к
+// нижнему регистру (сравнение без учёта регистра)
+using LookupKey = std::variant<double, std::string>;
+
+// Ключ поиска для значения ячейки; текст, целиком записывающий число, - это число, как и в
+// арифметике. Пустой текст и ошибки не ищутся: nullopt.
+std::optional<LookupKey> MakeLookupKey(const CellInterface::Value& value);
+
+enum class LookupMatch {
+    Exact,           // значение, равное ключу
+    ExactOrLess,     // наибольшее значение, не большее ключа
+    ExactOrGreater,  // наименьшее значение, не меньшее ключа
+};
+
 // Интерфейс таблицы
 class SheetInterface {
 public:
@@ -165,6 +199,17 @@ public:
     // GetValue() или GetText() соответственно. Пустая ячейка представляется пустой строкой в любом случае.
     virtual void PrintValues(std::ostream& output) const = 0;
     virtual void PrintTexts(std::ostream& output) const = 0;
+
+    // Ищет key среди значений ячеек range - диапазона из одного столбца или одной строки - и
+    // возвращает номер найденной ячейки от начала диапазона (с нуля) либо nullopt. Число
+    // сравнивается только с числами, текст - только с текстом; из равных значений находится
+    // первое. Реализация по умолчанию перебирает ячейки диапазона.
+    virtual std::optional<int> Lookup(const LookupKey& key, CellRange range, LookupMatch match) const;
+    // Значение ячейки как операнд арифметики формулы: число, значение формулы или текст, целиком
+    // записывающий число; отсутствующая ячейка и пустой текст - 0. Для другого текста выбрасывает
+    // FormulaError #VALUE!, для ошибки формулы - эту ошибку. Реализация по умолчанию разбирает
+    // значение ячейки из GetCell().
+    virtual double GetCellNumber(Position pos) const;
 };
 
 // Создаёт готовую к работе пустую таблицу.
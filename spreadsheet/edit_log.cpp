@@ -0,0 +1,492 @@
+#include "edit_log.h"
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <optional>
+#include <set>
+#include <stdexcept>
+#include <utility>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+using namespace std::literals;
+namespace fs = std::filesystem;
+
+namespace {
+    enum LogOp : uint8_t {
+        LOG_SET = 1,
+        LOG_CLEAR = 2,
+    };
+
+    // length and crc32 of the payload
+    constexpr size_t RECORD_HEADER_SIZE = 8;
+    // op, row, col
+    constexpr size_t PAYLOAD_HEADER_SIZE = 9;
+
+    const std::string SNAPSHOT_PREFIX = "snapshot."s;
+    const std::string SEGMENT_PREFIX = "edits."s;
+    const std::string SEGMENT_SUFFIX = ".log"s;
+
+    std::array<uint32_t, 256> MakeCrcTable() {
+        std::array<uint32_t, 256> table{};
+        for (uint32_t i = 0; i < table.size(); ++i) {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; ++bit) {
+                crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320u : crc >> 1;
+            }
+            table[i] = crc;
+        }
+        return table;
+    }
+
+    // CRC-32 (IEEE 802.3), the same checksum zlib computes
+    uint32_t Crc32(const char* data, size_t size) {
+        static const std::array<uint32_t, 256> table = MakeCrcTable();
+        uint32_t crc = 0xFFFFFFFFu;
+        for (size_t i = 0; i < size; ++i) {
+            crc = table[(crc ^ static_cast<uint8_t>(data[i])) & 0xFF] ^ (crc >> 8);
+        }
+        return crc ^ 0xFFFFFFFFu;
+    }
+
+    template <typename T>
+    void AppendRaw(std::string& out, T value) {
+        char bytes[sizeof(T)];
+        std::memcpy(bytes, &value, sizeof(T));
+        out.append(bytes, sizeof(T));
+    }
+
+    template <typename T>
+    T ReadRaw(const char* data) {
+        T value;
+        std::memcpy(&value, data, sizeof(T));
+        return value;
+    }
+
+    int OpenForAppend(const std::string& path) {
+#ifdef _WIN32
+        int fd = _open(path.c_str(), _O_WRONLY | _O_CREAT | _O_APPEND | _O_BINARY, 0644);
+#else
+        int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+#endif
+        if (fd < 0) {
+            throw std::runtime_error("Cannot open edit log "s + path + ": " + std::strerror(errno));
+        }
+        return fd;
+    }
+
+    void WriteAll(int fd, const char* data, size_t size) {
+        while (size > 0) {
+#ifdef _WIN32
+            auto written = _write(fd, data, static_cast<unsigned>(size));
+#else
+            auto written = ::write(fd, data, size);
+#endif
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error("Edit log write failed: "s + std::strerror(errno));
+            }
+            data += written;
+            size -= static_cast<size_t>(written);
+        }
+    }
+
+    void SyncFile(int fd) {
+#ifdef _WIN32
+        int result = _commit(fd);
+#else
+        int result = ::fsync(fd);
+#endif
+        if (result != 0) {
+            throw std::runtime_error("Edit log fsync failed: "s + std::strerror(errno));
+        }
+    }
+
+    // Makes a created, renamed or removed directory entry durable
+    void SyncDirectory(const std::string& directory) {
+#ifndef _WIN32
+        int fd = ::open(directory.c_str(), O_RDONLY);
+        if (fd >= 0) {
+            ::fsync(fd);
+            ::close(fd);
+        }
+#endif
+    }
+
+    std::string SnapshotPath(const std::string& directory, uint64_t generation) {
+        return (fs::path(directory) / (SNAPSHOT_PREFIX + std::to_string(generation))).string();
+    }
+
+    std::string SegmentPath(const std::string& directory, uint64_t segment) {
+        return (fs::path(directory) / (SEGMENT_PREFIX + std::to_string(segment) + SEGMENT_SUFFIX)).string();
+    }
+
+    // Parses "<prefix><number><suffix>"
+    std::optional<uint64_t> ParseNumberedName(const std::string& name, const std::string& prefix,
+                                              const std::string& suffix) {
+        if (name.size() <= prefix.size() + suffix.size() || name.compare(0, prefix.size(), prefix) != 0
+            || name.compare(name.size() - suffix.size(), suffix.size(), suffix) != 0) {
+            return std::nullopt;
+        }
+        std::string digits = name.substr(prefix.size(), name.size() - prefix.size() - suffix.size());
+        if (!std::all_of(digits.begin(), digits.end(), [](char c) { return c >= '0' && c <= '9'; })) {
+            return std::nullopt;
+        }
+        return std::stoull(digits);
+    }
+
+    struct DirectoryState {
+        // Generation 0 stands for the empty sheet and is always there
+        std::set<uint64_t> snapshots{0};
+        std::map<uint64_t, std::string> segments;
+
+        // Whether the segments a snapshot of this generation needs to reach the newest one exist
+        bool CanReplayFrom(uint64_t generation) const {
+            for (uint64_t segment = generation; segment < *snapshots.rbegin(); ++segment) {
+                if (!segments.count(segment)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+    };
+
+    DirectoryState ScanDirectory(const std::string& directory) {
+        DirectoryState state;
+        for (const auto& entry : fs::directory_iterator(directory)) {
+            std::string name = entry.path().filename().string();
+            if (auto generation = ParseNumberedName(name, SNAPSHOT_PREFIX, ""s)) {
+                state.snapshots.insert(*generation);
+            } else if (auto segment = ParseNumberedName(name, SEGMENT_PREFIX, SEGMENT_SUFFIX)) {
+                state.segments.emplace(*segment, entry.path().string());
+            }
+        }
+        return state;
+    }
+
+    std::unique_ptr<Sheet> LoadBase(const std::string& directory, uint64_t generation) {
+        return generation > 0 ? Sheet::LoadSnapshot(SnapshotPath(directory, generation)) : std::make_unique<Sheet>();
+    }
+}  // namespace
+
+EditLog::EditLog(const std::string& path, const EditLogOptions& options)
+        : fd_(OpenForAppend(path))
+        , options_(options)
+        , last_sync_(std::chrono::steady_clock::now()) {
+    buffer_.reserve(options_.group_commit_bytes);
+}
+
+EditLog::~EditLog() {
+    try {
+        Commit();
+        if (has_unsynced_ && options_.fsync != FsyncPolicy::Never) {
+            SyncFile(fd_);
+        }
+    } catch (...) {
+        // Destructors must not throw; call Commit() explicitly to observe write errors
+    }
+#ifdef _WIN32
+    _close(fd_);
+#else
+    ::close(fd_);
+#endif
+}
+
+void EditLog::AppendSet(Position pos, std::string_view text) {
+    Append(LOG_SET, pos, text);
+}
+
+void EditLog::AppendClear(Position pos) {
+    Append(LOG_CLEAR, pos, {});
+}
+
+void EditLog::Append(uint8_t op, Position pos, std::string_view text) {
+    size_t record_begin = buffer_.size();
+    AppendRaw<uint32_t>(buffer_, static_cast<uint32_t>(PAYLOAD_HEADER_SIZE + text.size()));
+    AppendRaw<uint32_t>(buffer_, 0);  // checksum placeholder
+
+    size_t payload_begin = buffer_.size();
+    buffer_ += static_cast<char>(op);
+    AppendRaw<int32_t>(buffer_, pos.row);
+    AppendRaw<int32_t>(buffer_, pos.col);
+    buffer_.append(text);
+
+    uint32_t crc = Crc32(buffer_.data() + payload_begin, buffer_.size() - payload_begin);
+    std::memcpy(buffer_.data() + record_begin + sizeof(uint32_t), &crc, sizeof(crc));
+
+    if (buffer_.size() >= options_.group_commit_bytes) {
+        // The group is full: hand it to the OS now, durability still waits for Commit()
+        WriteAll(fd_, buffer_.data(), buffer_.size());
+        buffer_.clear();
+        has_unsynced_ = true;
+    }
+}
+
+void EditLog::Commit() {
+    if (!buffer_.empty()) {
+        WriteAll(fd_, buffer_.data(), buffer_.size());
+        buffer_.clear();
+        has_unsynced_ = true;
+    }
+    if (!has_unsynced_) {
+        return;
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    bool sync = options_.fsync == FsyncPolicy::EveryCommit
+                || (options_.fsync == FsyncPolicy::Interval && now - last_sync_ >= options_.fsync_interval);
+    if (sync) {
+        SyncFile(fd_);
+        last_sync_ = now;
+        has_unsynced_ = false;
+    }
+}
+
+uint64_t EditLog::Replay(const std::string& path, SheetInterface& sheet) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        return 0;
+    }
+
+    in.seekg(0, std::ios::end);
+    const uint64_t file_size = static_cast<uint64_t>(in.tellg());
+    in.seekg(0);
+
+    uint64_t valid_size = 0;
+    std::string payload;
+    char header[RECORD_HEADER_SIZE];
+    while (in.read(header, RECORD_HEADER_SIZE)) {
+        auto length = ReadRaw<uint32_t>(header);
+        auto crc = ReadRaw<uint32_t>(header + sizeof(uint32_t));
+        // A corrupted length must not turn into a huge allocation
+        if (length < PAYLOAD_HEADER_SIZE || length > file_size - valid_size - RECORD_HEADER_SIZE) {
+            break;
+        }
+        payload.resize(length);
+        if (!in.read(payload.data(), length) || Crc32(payload.data(), length) != crc) {
+            break;  // torn or corrupted tail
+        }
+
+        auto op = static_cast<uint8_t>(payload[0]);
+        Position pos{ReadRaw<int32_t>(payload.data() + 1), ReadRaw<int32_t>(payload.data() + 5)};
+        if (op == LOG_SET) {
+            sheet.SetCell(pos, payload.substr(PAYLOAD_HEADER_SIZE));
+        } else if (op == LOG_CLEAR) {
+            sheet.ClearCell(pos);
+        } else {
+            break;
+        }
+        valid_size += RECORD_HEADER_SIZE + length;
+    }
+    return valid_size;
+}
+
+// Reads through to the wrapped sheet and edits through JournaledSheet::SetCell, so that an edit
+// made through the cell is logged
+class JournaledSheet::JournaledCell final : public CellInterface {
+public:
+    JournaledCell(JournaledSheet& sheet, Position pos)
+            : sheet_(sheet)
+            , pos_(pos) {
+    }
+
+    void Set(std::string text) override {
+        sheet_.SetCell(pos_, std::move(text));
+    }
+
+    Value GetValue() const override {
+        const CellInterface* cell = GetCell();
+        return cell ? cell->GetValue() : Value(std::string());
+    }
+
+    std::string GetText() const override {
+        const CellInterface* cell = GetCell();
+        return cell ? cell->GetText() : std::string();
+    }
+
+    std::vector<Position> GetReferencedCells() const override {
+        const CellInterface* cell = GetCell();
+        return cell ? cell->GetReferencedCells() : std::vector<Position>{};
+    }
+
+private:
+    const CellInterface* GetCell() const {
+        return std::as_const(*sheet_.sheet_).GetCell(pos_);
+    }
+
+    JournaledSheet& sheet_;
+    Position pos_;
+};
+
+JournaledSheet::JournaledSheet(std::string directory, const EditLogOptions& options, std::unique_ptr<Sheet> sheet,
+                               uint64_t snapshot_generation, uint64_t segment)
+        : directory_(std::move(directory))
+        , options_(options)
+        , sheet_(std::move(sheet))
+        , log_(std::make_unique<EditLog>(SegmentPath(directory_, segment), options_))
+        , snapshot_generation_(snapshot_generation)
+        , segment_(segment) {
+}
+
+std::unique_ptr<JournaledSheet> JournaledSheet::Open(const std::string& directory, const EditLogOptions& options) {
+    fs::create_directories(directory);
+    DirectoryState state = ScanDirectory(directory);
+
+    // The newest snapshot normally loads. One that does not is passed over for an older one, as
+    // long as the segments compacted into the newer one are still there to replay.
+    std::unique_ptr<Sheet> sheet;
+    uint64_t generation = 0;
+    std::exception_ptr error;
+    for (auto it = state.snapshots.rbegin(); it != state.snapshots.rend() && !sheet; ++it) {
+        if (!state.CanReplayFrom(*it)) {
+            continue;
+        }
+        try {
+            sheet = LoadBase(directory, *it);
+            generation = *it;
+        } catch (const SnapshotException&) {
+            if (!error) {
+                error = std::current_exception();
+            }
+        }
+    }
+    if (!sheet) {
+        std::rethrow_exception(error);
+    }
+    // The next compaction must not find the broken snapshots again
+    for (auto it = state.snapshots.upper_bound(generation); it != state.snapshots.end(); ++it) {
+        fs::remove(SnapshotPath(directory, *it));
+    }
+
+    uint64_t segment = generation;
+    for (auto it = state.segments.lower_bound(generation); it != state.segments.end(); ++it) {
+        uint64_t valid_size = EditLog::Replay(it->second, *sheet);
+        if (std::next(it) == state.segments.end() && valid_size < fs::file_size(it->second)) {
+            // New records must not end up behind a torn one, where replay would never reach them
+            fs::resize_file(it->second, valid_size);
+        }
+        segment = it->first;
+    }
+
+    return std::unique_ptr<JournaledSheet>(
+            new JournaledSheet(directory, options, std::move(sheet), generation, segment));
+}
+
+JournaledSheet::~JournaledSheet() {
+    if (compaction_.joinable()) {
+        compaction_.join();
+    }
+}
+
+void JournaledSheet::SetCell(Position pos, std::string text) {
+    std::string logged = text;
+    sheet_->SetCell(pos, std::move(text));
+    log_->AppendSet(pos, logged);
+}
+
+const CellInterface* JournaledSheet::GetCell(Position pos) const {
+    return sheet_->GetCell(pos);
+}
+
+CellInterface* JournaledSheet::GetCell(Position pos) {
+    if (std::as_const(*sheet_).GetCell(pos) == nullptr) {
+        return nullptr;
+    }
+    auto& cell = cells_[pos];
+    if (!cell) {
+        cell = std::make_unique<JournaledCell>(*this, pos);
+    }
+    return cell.get();
+}
+
+void JournaledSheet::ClearCell(Position pos) {
+    sheet_->ClearCell(pos);
+    log_->AppendClear(pos);
+    cells_.erase(pos);
+}
+
+Size JournaledSheet::GetPrintableSize() const {
+    return sheet_->GetPrintableSize();
+}
+
+void JournaledSheet::PrintValues(std::ostream& output) const {
+    sheet_->PrintValues(output);
+}
+
+void JournaledSheet::PrintTexts(std::ostream& output) const {
+    sheet_->PrintTexts(output);
+}
+
+void JournaledSheet::Commit() {
+    log_->Commit();
+}
+
+void JournaledSheet::Compact() {
+    WaitForCompaction();
+
+    // Seal the current segment; from now on it is only read by the compaction thread
+    log_->Commit();
+    log_.reset();
+    const uint64_t sealed = segment_++;
+    log_ = std::make_unique<EditLog>(SegmentPath(directory_, segment_), options_);
+    SyncDirectory(directory_);
+
+    const uint64_t base_generation = snapshot_generation_;
+    compaction_ = std::thread([this, directory = directory_, base_generation, sealed]() {
+        try {
+            auto sheet = LoadBase(directory, base_generation);
+            for (uint64_t segment = base_generation; segment <= sealed; ++segment) {
+                EditLog::Replay(SegmentPath(directory, segment), *sheet);
+            }
+            // SaveSnapshot fsyncs the file before renaming it and the directory is synced right
+            // after, so the inputs are only removed once the new snapshot is durable. Until then
+            // a crash leaves the old snapshot and the segments, which Open() falls back to.
+            sheet->SaveSnapshot(SnapshotPath(directory, sealed + 1));
+            SyncDirectory(directory);
+            // Read by the next Compact() only after joining this thread
+            snapshot_generation_ = sealed + 1;
+
+            for (uint64_t segment = base_generation; segment <= sealed; ++segment) {
+                fs::remove(SegmentPath(directory, segment));
+            }
+            if (base_generation > 0) {
+                fs::remove(SnapshotPath(directory, base_generation));
+            }
+        } catch (...) {
+            std::lock_guard guard(compaction_mutex_);
+            compaction_error_ = std::current_exception();
+        }
+    });
+}
+
+void JournaledSheet::WaitForCompaction() {
+    if (compaction_.joinable()) {
+        compaction_.join();
+    }
+    std::exception_ptr error;
+    {
+        std::lock_guard guard(compaction_mutex_);
+        std::swap(error, compaction_error_);
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+Sheet& JournaledSheet::GetSheet() {
+    return *sheet_;
+}
@@ -0,0 +1,111 @@
+#pragma once
+
+#include "sheet.h"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+
+// Когда записи журнала принудительно сбрасываются на диск (fsync)
+enum class FsyncPolicy {
+    Never,        // только write(): переживает падение процесса, но не ОС
+    EveryCommit,  // fsync при каждом Commit()
+    Interval,     // fsync не чаще, чем раз в fsync_interval
+};
+
+struct EditLogOptions {
+    FsyncPolicy fsync = FsyncPolicy::EveryCommit;
+    std::chrono::milliseconds fsync_interval{100};
+    // Записи копятся в памяти и уходят в файл одним write() при Commit() или когда
+    // накопилось столько байт (групповая фиксация)
+    size_t group_commit_bytes = 1 << 16;
+};
+
+// Журнал изменений: файл из записей [длина][crc32][операция][строка][столбец][текст].
+// Запись добавляется только в конец, испорченный или недописанный хвост отбрасывается при чтении.
+class EditLog {
+public:
+    EditLog(const std::string& path, const EditLogOptions& options);
+    ~EditLog();
+
+    EditLog(const EditLog&) = delete;
+    EditLog& operator=(const EditLog&) = delete;
+
+    void AppendSet(Position pos, std::string_view text);
+    void AppendClear(Position pos);
+
+    // Записывает накопленные записи в файл и при необходимости делает fsync
+    void Commit();
+
+    // Применяет записи журнала к таблице. Возвращает длину корректного префикса файла.
+    static uint64_t Replay(const std::string& path, SheetInterface& sheet);
+
+private:
+    void Append(uint8_t op, Position pos, std::string_view text);
+
+    int fd_ = -1;
+    EditLogOptions options_;
+    std::string buffer_;
+    std::chrono::steady_clock::time_point last_sync_;
+    bool has_unsynced_ = false;
+};
+
+// Таблица с журналом. Каталог содержит снимки snapshot.<N> и сегменты журнала edits.<N>.log;
+// снимок snapshot.<N> включает все изменения из сегментов с номерами меньше N. Каждый успешный
+// SetCell/ClearCell записывается в текущий сегмент, неудачный (с исключением) - нет.
+class JournaledSheet : public SheetInterface {
+public:
+    // Восстанавливает таблицу: загружает последний снимок и применяет к нему оставшиеся сегменты.
+    // Если снимок не читается (сбой во время свёртки), берётся предыдущий, пока сегменты для него
+    // на месте; непрочитанные снимки удаляются. Недописанный хвост последнего сегмента обрезается.
+    static std::unique_ptr<JournaledSheet> Open(const std::string& directory, const EditLogOptions& options = {});
+
+    ~JournaledSheet() override;
+
+    void SetCell(Position pos, std::string text) override;
+    const CellInterface* GetCell(Position pos) const override;
+    // Ячейка, правка которой (Set) записывается в журнал так же, как SetCell
+    CellInterface* GetCell(Position pos) override;
+    void ClearCell(Position pos) override;
+    Size GetPrintableSize() const override;
+    void PrintValues(std::ostream& output) const override;
+    void PrintTexts(std::ostream& output) const override;
+
+    // Фиксирует накопленные изменения согласно политике fsync
+    void Commit();
+
+    // Начинает новый сегмент журнала и в фоновом потоке сворачивает снимок и закрытые сегменты
+    // в новый снимок, после чего удаляет их. Живая таблица при этом не блокируется.
+    // Если предыдущее сжатие ещё идёт, дожидается его.
+    void Compact();
+    // Дожидается окончания фонового сжатия. Пробрасывает его исключение, если оно было.
+    void WaitForCompaction();
+
+    Sheet& GetSheet();
+
+private:
+    class JournaledCell;
+
+    JournaledSheet(std::string directory, const EditLogOptions& options, std::unique_ptr<Sheet> sheet,
+                   uint64_t snapshot_generation, uint64_t segment);
+
+    std::string directory_;
+    EditLogOptions options_;
+    std::unique_ptr<Sheet> sheet_;
+    std::unique_ptr<EditLog> log_;
+    uint64_t snapshot_generation_;
+    uint64_t segment_;
+    // Handed out by the non-const GetCell, one per position; ClearCell drops the one it clears
+    std::unordered_map<Position, std::unique_ptr<JournaledCell>, PositionHasher> cells_;
+
+    std::thread compaction_;
+    std::mutex compaction_mutex_;
+    std::exception_ptr compaction_error_;
+};
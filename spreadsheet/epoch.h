@@ -0,0 +1,136 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Публикация неизменяемых объектов для читателей без блокировок по схеме эпох (как в RCU).
+// Писатель один: он подменяет текущий объект методом Publish(), а старый освобождает, когда все
+// читатели, которые могли его видеть, закончили чтение. Читатели из любых потоков получают
+// текущий объект через Read() без мьютексов; пока жив ReadGuard, объект не освобождается.
+template <typename T>
+class EpochPublisher {
+public:
+    // Сколько читателей одновременно могут держать ReadGuard без ожидания свободного слота
+    static constexpr size_t READER_SLOTS = 64;
+
+    class ReadGuard {
+    public:
+        ReadGuard(ReadGuard&& other) noexcept
+                : slot_(std::exchange(other.slot_, nullptr))
+                , value_(other.value_) {
+        }
+        ReadGuard(const ReadGuard&) = delete;
+        ReadGuard& operator=(const ReadGuard&) = delete;
+        ReadGuard& operator=(ReadGuard&&) = delete;
+
+        ~ReadGuard() {
+            if (slot_) {
+                slot_->store(IDLE, std::memory_order_release);
+            }
+        }
+
+        const T* Get() const {
+            return value_;
+        }
+        const T* operator->() const {
+            return value_;
+        }
+        const T& operator*() const {
+            return *value_;
+        }
+
+    private:
+        friend class EpochPublisher;
+
+        ReadGuard(std::atomic<uint64_t>* slot, const T* value)
+                : slot_(slot)
+                , value_(value) {
+        }
+
+        std::atomic<uint64_t>* slot_;
+        const T* value_;
+    };
+
+    explicit EpochPublisher(std::unique_ptr<const T> initial)
+            : current_(initial.release()) {
+    }
+
+    EpochPublisher(const EpochPublisher&) = delete;
+    EpochPublisher& operator=(const EpochPublisher&) = delete;
+
+    // Все ReadGuard должны быть уничтожены раньше
+    ~EpochPublisher() {
+        for (auto& [epoch, value] : retired_) {
+            delete value;
+        }
+        delete current_.load();
+    }
+
+    ReadGuard Read() const {
+        size_t index = std::hash<std::thread::id>()(std::this_thread::get_id()) % READER_SLOTS;
+        while (true) {
+            // Announce the epoch before loading the pointer: a writer that retires the object
+            // afterwards sees the announcement and keeps the object alive
+            uint64_t epoch = global_epoch_.load();
+            uint64_t idle = IDLE;
+            std::atomic<uint64_t>& slot = slots_[index].epoch;
+            if (slot.compare_exchange_strong(idle, epoch)) {
+                return ReadGuard(&slot, current_.load());
+            }
+            index = (index + 1) % READER_SLOTS;
+        }
+    }
+
+    // Текущий объект; только для потока писателя
+    const T* Current() const {
+        return current_.load(std::memory_order_relaxed);
+    }
+
+    // Только для потока писателя
+    void Publish(std::unique_ptr<const T> value) {
+        const T* old = current_.exchange(value.release());
+        uint64_t retired_at = global_epoch_.fetch_add(1);
+        retired_.emplace_back(retired_at, old);
+        Reclaim();
+    }
+
+    // Освобождает объекты, которые больше не может видеть ни один читатель; только для писателя
+    void Reclaim() {
+        uint64_t oldest_reader = UINT64_MAX;
+        for (const auto& slot : slots_) {
+            uint64_t epoch = slot.epoch.load();
+            if (epoch != IDLE && epoch < oldest_reader) {
+                oldest_reader = epoch;
+            }
+        }
+        auto still_visible = retired_.begin();
+        for (auto it = retired_.begin(); it != retired_.end(); ++it) {
+            // A reader that announced epoch e may hold anything retired at epoch e or later
+            if (it->first < oldest_reader) {
+                delete it->second;
+            } else {
+                *still_visible++ = *it;
+            }
+        }
+        retired_.erase(still_visible, retired_.end());
+    }
+
+private:
+    static constexpr uint64_t IDLE = 0;
+
+    struct alignas(64) Slot {
+        std::atomic<uint64_t> epoch{IDLE};
+    };
+
+    mutable std::array<Slot, READER_SLOTS> slots_;
+    std::atomic<const T*> current_;
+    std::atomic<uint64_t> global_epoch_{1};
+    std::vector<std::pair<uint64_t, const T*>> retired_;
+};
@@ -0,0 +1,114 @@
+#include "exporter.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <ios>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+using namespace std::literals;
+
+namespace {
+    // Matches std::ostream defaults: std::defaultfloat with precision 6, i.e. printf's %g
+    constexpr int DEFAULT_PRECISION = 6;
+    // Longest %g output for a double with precision 6, e.g. -1.23457e-308
+    constexpr size_t MAX_NUMBER_LENGTH = 32;
+
+    bool HasDefaultNumberFormat(const std::ostream& output) {
+        std::ios_base::fmtflags relevant = std::ios_base::floatfield | std::ios_base::showpoint
+                                           | std::ios_base::showpos | std::ios_base::uppercase;
+        return (output.flags() & relevant) == 0 && output.precision() == DEFAULT_PRECISION;
+    }
+}  // namespace
+
+ExportWriter::ExportWriter(int fd, size_t buffer_size)
+        : fd_(fd)
+        , buffer_(std::max(buffer_size, MAX_NUMBER_LENGTH)) {
+}
+
+ExportWriter::ExportWriter(std::ostream& output, size_t buffer_size)
+        : output_(&output)
+        , default_number_format_(HasDefaultNumberFormat(output))
+        , buffer_(std::max(buffer_size, MAX_NUMBER_LENGTH)) {
+}
+
+ExportWriter::~ExportWriter() {
+    try {
+        Flush();
+    } catch (...) {
+        // Destructors must not throw; call Flush() explicitly to observe write errors
+    }
+}
+
+void ExportWriter::Write(std::string_view text) {
+    while (!text.empty()) {
+        if (size_ == buffer_.size()) {
+            Flush();
+        }
+        size_t count = std::min(text.size(), buffer_.size() - size_);
+        std::memcpy(buffer_.data() + size_, text.data(), count);
+        size_ += count;
+        text.remove_prefix(count);
+    }
+}
+
+void ExportWriter::Write(double value) {
+    if (!default_number_format_) {
+        std::ostringstream formatted;
+        formatted.copyfmt(*output_);
+        formatted << value;
+        Write(std::string_view(formatted.str()));
+        return;
+    }
+    if (buffer_.size() - size_ < MAX_NUMBER_LENGTH) {
+        Flush();
+    }
+    char* begin = buffer_.data() + size_;
+    auto [end, ec] = std::to_chars(begin, buffer_.data() + buffer_.size(), value,
+                                   std::chars_format::general, DEFAULT_PRECISION);
+    size_ += end - begin;
+}
+
+void ExportWriter::Write(FormulaError error) {
+    Write(error.ToString());
+}
+
+void ExportWriter::Flush() {
+    if (size_ == 0) {
+        return;
+    }
+    if (output_) {
+        output_->write(buffer_.data(), static_cast<std::streamsize>(size_));
+        size_ = 0;
+        return;
+    }
+
+    const char* data = buffer_.data();
+    size_t left = size_;
+    size_ = 0;
+    while (left > 0) {
+#ifdef _WIN32
+        auto written = _write(fd_, data, static_cast<unsigned>(left));
+#else
+        auto written = ::write(fd_, data, left);
+#endif
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error("Export write failed: "s + std::strerror(errno));
+        }
+        data += written;
+        left -= static_cast<size_t>(written);
+    }
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstddef>
+#include <iosfwd>
+#include <string_view>
+#include <vector>
+
+// Буферизованный писатель для выгрузки таблицы. Накапливает вывод в буфере и сбрасывает его
+// большими блоками либо в файловый дескриптор, либо в std::ostream. Числа форматируются через
+// std::to_chars так же, как operator<< потока с настройками по умолчанию (%g, точность 6).
+class ExportWriter {
+public:
+    static constexpr size_t DEFAULT_BUFFER_SIZE = 1 << 20;
+
+    explicit ExportWriter(int fd, size_t buffer_size = DEFAULT_BUFFER_SIZE);
+    // Если у потока изменены флаги форматирования или точность, числа выводятся через него,
+    // чтобы результат совпадал с прямым выводом в поток.
+    explicit ExportWriter(std::ostream& output, size_t buffer_size = DEFAULT_BUFFER_SIZE);
+
+    ExportWriter(const ExportWriter&) = delete;
+    ExportWriter& operator=(const ExportWriter&) = delete;
+
+    ~ExportWriter();
+
+    void Write(char ch) {
+        if (size_ == buffer_.size()) {
+            Flush();
+        }
+        buffer_[size_++] = ch;
+    }
+
+    void Write(std::string_view text);
+    void Write(double value);
+    void Write(FormulaError error);
+
+    // Сбрасывает буфер. Бросает std::runtime_error, если запись в дескриптор не удалась.
+    void Flush();
+
+private:
+    int fd_ = -1;
+    std::ostream* output_ = nullptr;
+    bool default_number_format_ = true;
+
+    std::vector<char> buffer_;
+    size_t size_ = 0;
+};
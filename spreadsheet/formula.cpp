@@ -3,8 +3,11 @@
 #include "FormulaAST.h"
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cctype>
+#include <iterator>
+#include <optional>
 #include <sstream>
 
 using namespace std::literals;
@@ -19,20 +22,42 @@ namespace {
 // Реализуйте следующие методы:
 
     explicit Formula(std::string expression)
-    try : ast_(ParseFormulaAST(expression)) {
+    try : ast_(ParseFormulaAST(expression))
+        , memory_(MeasureMemory(ast_)) {
     } catch (const std::exception& exc) {
         std::throw_with_nested(FormulaException(exc.what()));
     }
 
+    explicit Formula(FormulaAST ast)
+        : ast_(std::move(ast))
+        , memory_(MeasureMemory(ast_)) {
+    }
+
     Value Evaluate(const SheetInterface& sheet) const override {
         try {
-            Value val = ast_.Execute(sheet);
+            Value val = Execute(sheet, nullptr);
             return val;
         } catch (const FormulaError& error) {
             return error;
         }
     }
 
+    Value Evaluate(const SheetInterface& sheet, SharedSubexpressions& shared) const override {
+        try {
+            return Execute(sheet, &shared);
+        } catch (const FormulaError& error) {
+            return error;
+        }
+    }
+
+    bool IsOptimized() const override {
+        return program_.load(std::memory_order_acquire) != nullptr;
+    }
+
+    std::vector<Subexpression> GetSubexpressions() const override {
+        return ast_.GetSubexpressions();
+    }
+
     std::string GetExpression() const override {
         std::stringstream str_out;
 
@@ -41,15 +66,196 @@ namespace {
     }
 
     std::vector<Position> GetReferencedCells() const override {
-        return {ast_.GetCells().begin(), ast_.GetCells().end()};
+        // Cells are sorted, so repeats are adjacent and the invalid ones come first
+        std::vector<Position> cells;
+        for (const Position& pos : ast_.GetCells()) {
+            if (pos.IsValid() && (cells.empty() || !(cells.back() == pos))) {
+                cells.push_back(pos);
+            }
+        }
+        return cells;
+    }
+
+    std::vector<CellRange> GetReferencedRanges() const override {
+        std::vector<CellRange> ranges;
+        for (const CellRange& range : ast_.GetRanges()) {
+            if (range.IsValid()) {
+                ranges.push_back(range);
+            }
+        }
+        return ranges;
+    }
+
+    void Serialize(std::string& out) const override {
+        ast_.Serialize(out);
+    }
+
+    std::unique_ptr<FormulaInterface> Clone() const override {
+        std::string data;
+        ast_.Serialize(data);
+        return std::make_unique<Formula>(FormulaAST::Deserialize(data));
+    }
+
+    void ShiftReferences(const ReferenceShift& shift) override {
+        // The program keeps the positions it was compiled with; only this cell holds the formula
+        // now, so nothing is evaluating it
+        program_.store(nullptr, std::memory_order_relaxed);
+        compiled_.reset();
+        evaluations_.store(0, std::memory_order_relaxed);
+        // Cell expressions point into this list, so the positions change under them in place
+        auto& cells = ast_.GetCells();
+        for (Position& pos : cells) {
+            pos = shift.Apply(pos);
+        }
+        cells.sort();
+        for (CellRange& range : ast_.GetRanges()) {
+            range = shift.Apply(range);
+        }
+    }
+
+    MemoryUsage GetMemoryUsage() const override {
+        return memory_;
     }
 
     private:
+        // Tells whether the value of the whole formula was taken from the shared values, so that
+        // such evaluations do not count towards the promotion
+        class RootProbe final : public SharedSubexpressions {
+        public:
+            RootProbe(SharedSubexpressions& shared, uint32_t root)
+                : shared_(shared)
+                , root_(root) {
+            }
+
+            const Value* Find(size_t index) override {
+                const Value* value = shared_.Find(index);
+                found_root_ = found_root_ || (value && index == root_);
+                return value;
+            }
+
+            void Store(size_t index, const Value& value) override {
+                shared_.Store(index, value);
+            }
+
+            bool FoundRoot() const {
+                return found_root_;
+            }
+
+        private:
+            SharedSubexpressions& shared_;
+            uint32_t root_;
+            bool found_root_ = false;
+        };
+
+        double Execute(const SheetInterface& sheet, SharedSubexpressions* shared) const {
+            if (const CompiledFormula* program = program_.load(std::memory_order_acquire)) {
+                return program->Execute(sheet, shared);
+            }
+            std::optional<RootProbe> probe;
+            if (std::optional<uint32_t> root = shared ? ast_.GetRootSubexpression() : std::nullopt) {
+                probe.emplace(*shared, *root);
+            }
+            auto count = [&] {
+                if (!probe || !probe->FoundRoot()) {
+                    CountEvaluation();
+                }
+            };
+            // An error is as much a result of the evaluation as a number
+            try {
+                const double value = ast_.Execute(sheet, probe ? &*probe : shared);
+                count();
+                return value;
+            } catch (const FormulaError&) {
+                count();
+                throw;
+            }
+        }
+
+        // Counts an evaluation by the tree. Exactly one evaluation reaches the threshold, so the
+        // program is compiled once; it serves the evaluations after this one.
+        void CountEvaluation() const {
+            if (evaluations_.fetch_add(1, std::memory_order_relaxed) + 1 == PROMOTION_THRESHOLD) {
+                compiled_ = std::make_unique<CompiledFormula>(ast_.Compile());
+                program_.store(compiled_.get(), std::memory_order_release);
+            }
+        }
+
+        // The tree never changes after parsing: shifting rewrites positions in place
+        static MemoryUsage MeasureMemory(const FormulaAST& ast) {
+            const auto& cells = ast.GetCells();
+            const size_t references = std::distance(cells.begin(), cells.end());
+            return {sizeof(Formula) + ast.GetTreeMemoryUsage(), references,
+                    references * (sizeof(void*) + sizeof(Position))};
+        }
+
         FormulaAST ast_;
+        MemoryUsage memory_;
+        // Evaluations by the tree so far, counted up to the promotion
+        mutable std::atomic<uint32_t> evaluations_ = 0;
+        // Owned by compiled_ and published through program_: readers only see the pointer. The
+        // program is not part of memory_, which the sheet accounts when it takes the formula.
+        mutable std::unique_ptr<const CompiledFormula> compiled_;
+        mutable std::atomic<const CompiledFormula*> program_ = nullptr;
 //        mutable std::optional<Value> cache_;
     };
 }  // namespace
 
+Position ReferenceShift::Apply(Position pos) const {
+    if (!pos.IsValid()) {
+        return Position::NONE;
+    }
+    int& index = axis == Axis::Rows ? pos.row : pos.col;
+    if (index < first) {
+        return pos;
+    }
+    if (count < 0 && index < first - count) {
+        return Position::NONE;
+    }
+    index += count;
+    return pos.IsValid() ? pos : Position::NONE;
+}
+
+CellRange ReferenceShift::Apply(CellRange range) const {
+    if (!range.IsValid()) {
+        return CellRange::NONE;
+    }
+    const bool rows = axis == Axis::Rows;
+    int& low = rows ? range.first.row : range.first.col;
+    int& high = rows ? range.last.row : range.last.col;
+    if (count > 0) {
+        const int limit = rows ? Position::MAX_ROWS : Position::MAX_COLS;
+        if (low >= first) {
+            low += count;
+        }
+        if (high >= first) {
+            high = std::min(high + count, limit - 1);
+        }
+        return low < limit ? range : CellRange::NONE;
+    }
+    // The deleted part is cut out; a bound inside it moves to the nearest remaining row
+    const int end = first - count;
+    const int new_low = low < first ? low : low < end ? first : low + count;
+    const int new_high = high < first ? high : high < end ? first - 1 : high + count;
+    if (new_high < new_low) {
+        return CellRange::NONE;
+    }
+    low = new_low;
+    high = new_high;
+    return range;
+}
+
+ReferenceShift ReferenceShift::Inverse() const {
+    return {axis, first, -count};
+}
+
 std::unique_ptr<FormulaInterface> ParseFormula(std::string expression) {
     return std::make_unique<Formula>(std::move(expression));
+}
+
+std::unique_ptr<FormulaInterface> LoadFormula(std::string_view data) {
+    try {
+        return std::make_unique<Formula>(FormulaAST::Deserialize(data));
+    } catch (const std::exception& exc) {
+        std::throw_with_nested(FormulaException(exc.what()));
+    }
 }
\ No newline at end of file
@@ -2,13 +2,42 @@
 
 #include "common.h"
 
+#include <cstdint>
 #include <memory>
+#include <string>
+#include <string_view>
 #include <vector>
 
+// Вставка или удаление строк (столбцов) таблицы. count > 0 вставляет count строк перед строкой
+// first, count < 0 удаляет строки [first, first - count).
+struct ReferenceShift {
+    enum class Axis {
+        Rows,
+        Cols,
+    };
+
+    Axis axis = Axis::Rows;
+    int first = 0;
+    int count = 0;
+
+    // Куда переезжает ячейка pos. Position::NONE, если она удалена или вышла за пределы таблицы.
+    Position Apply(Position pos) const;
+    // Диапазон после сдвига: вставка внутри диапазона его расширяет, удаление части - сужает.
+    // CellRange::NONE, если удалён весь диапазон.
+    CellRange Apply(CellRange range) const;
+    // Обратная операция: удаление вставленного или вставка удалённого
+    ReferenceShift Inverse() const;
+};
+
+class SharedSubexpressions;
+
 // Формула, позволяющая вычислять и обновлять арифметическое выражение.
 // Поддерживаемые возможности:
 // * Простые бинарные операции и числа, скобки: 1+2*3, 2.5*(2+3.5/7)
 // * Значения ячеек в качестве переменных: A1+B2*C3
+// * Функции поиска по диапазонам: MATCH(key,A1:A10,0), VLOOKUP(key,A1:C10,3,0),
+//   XLOOKUP(key,A1:A10,B1:B10,if_not_found,match_mode); ключом может быть и текст "abc".
+//   Ненайденное значение даёт ошибку #N/A.
 // Ячейки, указанные в формуле, могут быть как формулами, так и текстом. Если это
 // текст, но он представляет число, тогда его нужно трактовать как число. Пустая
 // ячейка или ячейка с пустым текстом трактуется как число ноль.
@@ -25,6 +54,34 @@ public:
     // возвращается именно эта ошибка. Если таких ошибок несколько, возвращается
     // любая.
     virtual Value Evaluate(const SheetInterface& sheet) const = 0;
+    // То же, но значения подвыражений из GetSubexpressions() берутся из shared и сохраняются туда
+    // под их номерами
+    virtual Value Evaluate(const SheetInterface& sheet, SharedSubexpressions& shared) const = 0;
+
+    // Формула вычисляется в два уровня. Сначала - обходом дерева разбора, которое дёшево построить.
+    // Формула, вычисленная много раз, переводится в быструю форму (вычисления, значение которых
+    // целиком взято из SharedSubexpressions, не считаются): плоский код со свёрнутыми
+    // константами, где каждая ячейка читается один раз за вычисление. Результат от формы не
+    // зависит. Перевод выполняется один раз и безопасен, когда формулу вычисляют несколько таблиц
+    // из разных потоков.
+    static constexpr uint32_t PROMOTION_THRESHOLD = 16;
+    // Переведена ли формула в быструю форму
+    virtual bool IsOptimized() const = 0;
+
+    // Подвыражение, значение которого может быть общим у нескольких формул: операция над
+    // ячейками и числами, читающая хотя бы две ячейки. Операнд, который сам является таким
+    // подвыражением, входит в ключ ссылкой на свой номер: равные ключи с равными подвыражениями-
+    // операндами означают одинаковые выражения над одними и теми же ячейками.
+    struct Subexpression {
+        std::string key;
+        // Ячейки, которые подвыражение читает не через подвыражения-операнды, с повторами
+        std::vector<Position> cells;
+        // Номера подвыражений-операндов в порядке ссылок на них в ключе
+        std::vector<uint32_t> operands;
+    };
+    // Подвыражения формулы; номер подвыражения - его индекс в списке. Вложенные подвыражения
+    // идут раньше содержащих их.
+    virtual std::vector<Subexpression> GetSubexpressions() const = 0;
 
     // Возвращает выражение, которое описывает формулу.
     // Не содержит пробелов и лишних скобок.
@@ -34,8 +91,47 @@ public:
     // формулы. Список отсортирован по возрастанию и не содерживт повторяющихся
     // ячеек.
     virtual std::vector<Position> GetReferencedCells() const = 0;
+
+    // Диапазоны, переданные функциям. Их ячейки не входят в GetReferencedCells().
+    virtual std::vector<CellRange> GetReferencedRanges() const = 0;
+
+    // Дописывает в out компактное двоичное представление формулы, из которого LoadFormula
+    // восстанавливает её без синтаксического разбора.
+    virtual void Serialize(std::string& out) const = 0;
+
+    // Независимая копия формулы
+    virtual std::unique_ptr<FormulaInterface> Clone() const = 0;
+
+    // Переписывает ссылки формулы на месте после вставки или удаления строк (столбцов). Ссылки на
+    // удалённые ячейки становятся ошибкой #REF! и пропадают из GetReferencedCells().
+    virtual void ShiftReferences(const ReferenceShift& shift) = 0;
+
+    // Память формулы: дерево выражения со списком диапазонов и список ячеек, на которые оно
+    // ссылается (позиции вместе с повторами и ссылками #REF!)
+    struct MemoryUsage {
+        size_t tree_bytes = 0;
+        size_t references = 0;
+        size_t reference_bytes = 0;
+    };
+    virtual MemoryUsage GetMemoryUsage() const = 0;
+};
+
+// Значения подвыражений (см. FormulaInterface::GetSubexpressions), общие для формул таблицы
+class SharedSubexpressions {
+public:
+    // Значение подвыражения с номером index или nullptr, если его ещё нет
+    virtual const FormulaInterface::Value* Find(size_t index) = 0;
+    virtual void Store(size_t index, const FormulaInterface::Value& value) = 0;
+
+protected:
+    ~SharedSubexpressions() = default;
 };
 
-// Парсит переданное выражение и возвращает объект формулы.
+// Парсит переданное выражение и возвращает объект формулы. Ссылка #REF! читается так же, как
+// печатается: ячейкой или диапазоном с ошибкой, поэтому текст любой формулы разбирается обратно.
 // Бросает FormulaException в случае, если формула синтаксически некорректна.
 std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
+
+// Восстанавливает формулу из представления, записанного FormulaInterface::Serialize.
+// Бросает FormulaException, если данные повреждены.
+std::unique_ptr<FormulaInterface> LoadFormula(std::string_view data);
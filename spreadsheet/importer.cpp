@@ -0,0 +1,267 @@
+#include "importer.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define SPREADSHEET_IMPORT_SSE2
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+using namespace std::literals;
+
+namespace {
+    constexpr char TSV_DELIMITER = '\t';
+    constexpr char CSV_DELIMITER = ',';
+    constexpr char CSV_QUOTE = '"';
+    constexpr char NEWLINE = '\n';
+
+#ifdef SPREADSHEET_IMPORT_SSE2
+    // Index of the lowest set bit of a non-zero mask
+    unsigned CountTrailingZeros(unsigned mask) {
+#ifdef _MSC_VER
+        unsigned long index;
+        _BitScanForward(&index, mask);
+        return static_cast<unsigned>(index);
+#else
+        return static_cast<unsigned>(__builtin_ctz(mask));
+#endif
+    }
+#endif
+
+    // Returns the first delimiter or line break in [begin, end), or end if there is none.
+    // Scans 16 bytes per step where SSE2 is available.
+    const char* FindFieldEnd(const char* begin, const char* end, char delimiter) {
+#ifdef SPREADSHEET_IMPORT_SSE2
+        const __m128i delimiters = _mm_set1_epi8(delimiter);
+        const __m128i newlines = _mm_set1_epi8(NEWLINE);
+        while (end - begin >= 16) {
+            __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(begin));
+            __m128i hits = _mm_or_si128(_mm_cmpeq_epi8(block, delimiters), _mm_cmpeq_epi8(block, newlines));
+            if (int mask = _mm_movemask_epi8(hits); mask != 0) {
+                return begin + CountTrailingZeros(static_cast<unsigned>(mask));
+            }
+            begin += 16;
+        }
+#endif
+        for (; begin != end; ++begin) {
+            if (*begin == delimiter || *begin == NEWLINE) {
+                return begin;
+            }
+        }
+        return end;
+    }
+
+    const char* FindChar(const char* begin, const char* end, char ch) {
+        const void* found = std::memchr(begin, ch, end - begin);
+        return found ? static_cast<const char*>(found) : end;
+    }
+
+    class Importer {
+    public:
+        Importer(Sheet& sheet, std::istream& input, const ImportOptions& options)
+                : sheet_(sheet)
+                , input_(input)
+                , options_(options)
+                , buffer_(std::max<size_t>(options.chunk_size, 16)) {
+            batch_.reserve(options_.batch_size);
+        }
+
+        void Run() {
+            while (true) {
+                bool complete = options_.format == ImportFormat::Csv ? ParseCsvRecord() : ParseTextsRecord();
+                if (complete) {
+                    EmitRecord();
+                    continue;
+                }
+                if (!Refill()) {
+                    break;
+                }
+            }
+            Flush();
+        }
+
+    private:
+        struct Field {
+            int col;
+            std::string_view text;
+            bool quoted;
+        };
+
+        Sheet& sheet_;
+        std::istream& input_;
+        ImportOptions options_;
+
+        std::vector<char> buffer_;
+        size_t begin_ = 0;  // start of the unparsed data
+        size_t end_ = 0;    // end of the data read so far
+        bool eof_ = false;
+
+        int row_ = 0;
+        // Views into buffer_, only valid until the next Refill()
+        std::vector<Field> fields_;
+        std::vector<std::pair<Position, std::string>> batch_;
+
+        // Moves the unparsed tail to the front of the buffer and reads the next chunk behind it.
+        // The buffer only grows when a single record does not fit into it.
+        bool Refill() {
+            if (eof_) {
+                return false;
+            }
+            size_t tail = end_ - begin_;
+            if (begin_ > 0) {
+                std::memmove(buffer_.data(), buffer_.data() + begin_, tail);
+            }
+            begin_ = 0;
+            end_ = tail;
+            if (buffer_.size() - end_ < options_.chunk_size / 2) {
+                buffer_.resize(std::max(buffer_.size() * 2, end_ + options_.chunk_size));
+            }
+            input_.read(buffer_.data() + end_, static_cast<std::streamsize>(buffer_.size() - end_));
+            end_ += static_cast<size_t>(input_.gcount());
+            if (!input_) {
+                eof_ = true;
+            }
+            return true;
+        }
+
+        // Parses one line of the PrintTexts format. Returns false when the line is not complete yet.
+        bool ParseTextsRecord() {
+            fields_.clear();
+            const char* data = buffer_.data();
+            const char* pos = data + begin_;
+            const char* end = data + end_;
+            if (pos == end) {
+                return false;
+            }
+
+            int col = 0;
+            while (true) {
+                const char* field_end = FindFieldEnd(pos, end, TSV_DELIMITER);
+                if (field_end == end && !eof_) {
+                    return false;
+                }
+                fields_.push_back({col++, {pos, static_cast<size_t>(field_end - pos)}, false});
+                if (field_end == end || *field_end == NEWLINE) {
+                    begin_ = field_end == end ? end_ : field_end + 1 - data;
+                    return true;
+                }
+                pos = field_end + 1;
+            }
+        }
+
+        // Parses one RFC-4180 record. Quoted fields may contain delimiters, quotes doubled as ""
+        // and line breaks. Returns false when the record is not complete yet.
+        bool ParseCsvRecord() {
+            fields_.clear();
+            const char* data = buffer_.data();
+            const char* pos = data + begin_;
+            const char* end = data + end_;
+            if (pos == end) {
+                return false;
+            }
+
+            int col = 0;
+            while (true) {
+                const char* field_begin = pos;
+                bool quoted = pos != end && *pos == CSV_QUOTE;
+                if (quoted) {
+                    // Find the closing quote, skipping over escaped "" pairs
+                    ++pos;
+                    while (true) {
+                        pos = FindChar(pos, end, CSV_QUOTE);
+                        if (pos == end || (pos + 1 == end && !eof_)) {
+                            return false;  // in the latter case "" cannot be told from a closing quote yet
+                        }
+                        if (pos + 1 != end && pos[1] == CSV_QUOTE) {
+                            pos += 2;
+                            continue;
+                        }
+                        ++pos;
+                        break;
+                    }
+                }
+                // Anything after a closing quote is kept as is, as are quotes inside unquoted fields
+                const char* field_end = FindFieldEnd(pos, end, CSV_DELIMITER);
+                if (field_end == end && !eof_) {
+                    return false;
+                }
+
+                std::string_view text(field_begin, field_end - field_begin);
+                bool last = field_end == end || *field_end == NEWLINE;
+                if (last && !text.empty() && text.back() == '\r') {
+                    text.remove_suffix(1);
+                }
+                fields_.push_back({col++, text, quoted});
+                if (last) {
+                    begin_ = field_end == end ? end_ : field_end + 1 - data;
+                    return true;
+                }
+                pos = field_end + 1;
+            }
+        }
+
+        static std::string Unquote(std::string_view text) {
+            // text is "<content>"[rest]; content has every quote doubled
+            std::string result;
+            result.reserve(text.size());
+            size_t i = 1;
+            while (i < text.size()) {
+                if (text[i] == CSV_QUOTE) {
+                    if (i + 1 < text.size() && text[i + 1] == CSV_QUOTE) {
+                        result += CSV_QUOTE;
+                        i += 2;
+                        continue;
+                    }
+                    result.append(text.substr(i + 1));
+                    break;
+                }
+                result += text[i++];
+            }
+            return result;
+        }
+
+        void EmitRecord() {
+            for (const Field& field : fields_) {
+                if (field.text.empty()) {
+                    continue;
+                }
+                batch_.emplace_back(Position{row_, field.col},
+                                    field.quoted ? Unquote(field.text) : std::string(field.text));
+            }
+            ++row_;
+            if (batch_.size() >= options_.batch_size) {
+                Flush();
+            }
+        }
+
+        void Flush() {
+            if (batch_.empty()) {
+                return;
+            }
+            sheet_.SetCells(std::move(batch_));
+            batch_.clear();
+            batch_.reserve(options_.batch_size);
+        }
+    };
+}  // namespace
+
+void ImportTexts(Sheet& sheet, std::istream& input, const ImportOptions& options) {
+    Importer(sheet, input, options).Run();
+}
+
+void ImportTextsFromFile(Sheet& sheet, const std::string& path, const ImportOptions& options) {
+    std::ifstream input(path, std::ios::binary);
+    if (!input) {
+        throw std::runtime_error("Cannot open file: "s + path);
+    }
+    ImportTexts(sheet, input, options);
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include "sheet.h"
+
+#include <cstddef>
+#include <istream>
+#include <string>
+
+// Формат загружаемых данных
+enum class ImportFormat {
+    Texts,  // формат Sheet::PrintTexts: ячейки разделены табуляцией, строки - переводом строки
+    Csv,    // RFC-4180: запятые, поля в двойных кавычках, "" внутри кавычек, CRLF или LF
+};
+
+struct ImportOptions {
+    ImportFormat format = ImportFormat::Texts;
+    // Размер блока, которым читается поток. Буфер растёт только под запись, не влезающую в блок.
+    size_t chunk_size = 1 << 20;
+    // Сколько ячеек накапливается перед передачей в Sheet::SetCells
+    size_t batch_size = 1 << 14;
+};
+
+// Потоково загружает ячейки в таблицу, начиная с A1. Пустые поля пропускаются. Дополнительная
+// память ограничена блоком чтения и одной пачкой ячеек и не зависит от размера входных данных.
+// Исключения такие же, как у Sheet::SetCells; ячейки, загруженные до ошибки, остаются в таблице.
+void ImportTexts(Sheet& sheet, std::istream& input, const ImportOptions& options = {});
+
+// То же для файла. Бросает std::runtime_error, если файл не удалось открыть.
+void ImportTextsFromFile(Sheet& sheet, const std::string& path, const ImportOptions& options = {});
@@ -0,0 +1,284 @@
+#include "lookup_index.h"
+
+#include <algorithm>
+#include <iterator>
+#include <limits>
+#include <string>
+
+namespace {
+    // A red-black tree node: the value plus the color and three links
+    constexpr size_t NODE_COST = sizeof(std::pair<const LookupIndexes::Key, std::vector<int>>) + 4 * sizeof(void*);
+    // The texts belong to the dictionary of the sheet
+    constexpr size_t ROW_COST = sizeof(std::optional<std::map<LookupIndexes::Key, std::vector<int>>::iterator>)
+                                + sizeof(int);
+}  // namespace
+
+template <typename Visit>
+void RangeDependents::ForEachNode(int first, int last, Visit visit) {
+    first = std::max(first, 0);
+    last = std::min(last, TREE_LEAVES - 1);
+    // Bottom-up: a node is taken when its sibling falls outside the span
+    for (int lo = first + TREE_LEAVES, hi = last + TREE_LEAVES + 1; lo < hi; lo >>= 1, hi >>= 1) {
+        if (lo & 1) {
+            visit(lo++);
+        }
+        if (hi & 1) {
+            visit(--hi);
+        }
+    }
+}
+
+void RangeDependents::Add(Position dependent, const std::vector<CellRange>& ranges) {
+    for (const CellRange& range : ranges) {
+        for (int col = range.first.col; col <= range.last.col; ++col) {
+            Column& column = by_column_[col];
+            ForEachNode(range.first.row, range.last.row, [&column, dependent](int node) {
+                ++column[node][dependent];
+            });
+        }
+    }
+}
+
+void RangeDependents::Remove(Position dependent, const std::vector<CellRange>& ranges) {
+    for (const CellRange& range : ranges) {
+        for (int col = range.first.col; col <= range.last.col; ++col) {
+            auto column = by_column_.find(col);
+            if (column == by_column_.end()) {
+                continue;
+            }
+            ForEachNode(range.first.row, range.last.row, [&column, dependent](int node) {
+                auto formulas = column->second.find(node);
+                if (formulas == column->second.end()) {
+                    return;
+                }
+                auto it = formulas->second.find(dependent);
+                if (it != formulas->second.end() && --it->second == 0) {
+                    formulas->second.erase(it);
+                }
+                if (formulas->second.empty()) {
+                    column->second.erase(formulas);
+                }
+            });
+            if (column->second.empty()) {
+                by_column_.erase(column);
+            }
+        }
+    }
+}
+
+void RangeDependents::Collect(Position pos, std::vector<Position>& out) const {
+    auto column = by_column_.find(pos.col);
+    if (column == by_column_.end() || pos.row < 0 || pos.row >= TREE_LEAVES) {
+        return;
+    }
+    for (int node = pos.row + TREE_LEAVES; node > 0; node >>= 1) {
+        auto formulas = column->second.find(node);
+        if (formulas == column->second.end()) {
+            continue;
+        }
+        for (const auto& [dependent, count] : formulas->second) {
+            out.push_back(dependent);
+        }
+    }
+}
+
+void RangeDependents::CollectShifted(const ReferenceShift& shift, std::vector<Position>& out) const {
+    const bool by_rows = shift.axis == ReferenceShift::Axis::Rows;
+    for (const auto& [col, column] : by_column_) {
+        if (!by_rows && col < shift.first) {
+            continue;
+        }
+        for (const auto& [node, formulas] : column) {
+            // A span ends at row shift.first or later iff one of its nodes does
+            int level = 0;
+            while ((node >> (level + 1)) > 0) {
+                ++level;
+            }
+            const int size = TREE_LEAVES >> level;
+            const int last_row = (node - (1 << level) + 1) * size - 1;
+            if (by_rows && last_row < shift.first) {
+                continue;
+            }
+            for (const auto& [dependent, count] : formulas) {
+                out.push_back(dependent);
+            }
+        }
+    }
+}
+
+LookupIndexes::KeyOrder::View LookupIndexes::KeyOrder::MakeView(const Key& key) {
+    if (const double* number = std::get_if<double>(&key)) {
+        return *number;
+    }
+    return std::string_view(*std::get<std::shared_ptr<const std::string>>(key));
+}
+
+LookupIndexes::KeyOrder::View LookupIndexes::KeyOrder::MakeView(const LookupKey& key) {
+    if (const double* number = std::get_if<double>(&key)) {
+        return *number;
+    }
+    return std::string_view(std::get<std::string>(key));
+}
+
+void LookupIndexes::ColumnIndex::Insert(int row, std::optional<Key> key) {
+    if (!key) {
+        keys[row].reset();
+        return;
+    }
+    auto [it, inserted] = rows.try_emplace(std::move(*key));
+    if (inserted) {
+        memory += NODE_COST;
+    }
+    auto& key_rows = it->second;
+    key_rows.insert(std::upper_bound(key_rows.begin(), key_rows.end(), row), row);
+    memory += sizeof(int);
+    keys[row] = it;
+}
+
+void LookupIndexes::ColumnIndex::Erase(int row) {
+    if (!keys[row]) {
+        return;
+    }
+    auto it = *keys[row];
+    auto& key_rows = it->second;
+    key_rows.erase(std::lower_bound(key_rows.begin(), key_rows.end(), row));
+    memory -= sizeof(int);
+    if (key_rows.empty()) {
+        memory -= NODE_COST;
+        rows.erase(it);
+    }
+    keys[row].reset();
+}
+
+void LookupIndexes::ColumnIndex::LinkRows() {
+    for (auto it = rows.begin(); it != rows.end(); ++it) {
+        for (int row : it->second) {
+            keys[row] = it;
+        }
+    }
+}
+
+std::optional<int> LookupIndexes::ColumnIndex::Find(const LookupKey& key, LookupMatch match) const {
+    auto it = rows.end();
+    switch (match) {
+        case LookupMatch::Exact:
+            it = rows.find(key);
+            break;
+        case LookupMatch::ExactOrLess:
+            it = rows.upper_bound(key);
+            it = it == rows.begin() ? rows.end() : std::prev(it);
+            break;
+        case LookupMatch::ExactOrGreater:
+            it = rows.lower_bound(key);
+            break;
+    }
+    // Numbers and text are never compared with each other
+    if (it == rows.end() || it->first.index() != key.index()) {
+        return std::nullopt;
+    }
+    return it->second.front();
+}
+
+size_t LookupIndexes::EstimateMemory(int rows) {
+    // As if every value were distinct
+    return static_cast<size_t>(rows) * (ROW_COST + NODE_COST);
+}
+
+bool LookupIndexes::CanIndex(CellRange range) const {
+    return range.IsValid() && range.GetCols() == 1 && range.GetRows() >= MIN_INDEXED_ROWS
+           && (EstimateMemory(range.GetRows()) <= memory_limit_
+               || indexes_.count({range.first.col, range.first.row, range.last.row}));
+}
+
+std::optional<int> LookupIndexes::Lookup(const LookupKey& key, CellRange range, LookupMatch match,
+                                         const KeyReader& read) {
+    struct DepthGuard {
+        int& depth;
+        ~DepthGuard() {
+            --depth;
+        }
+    } guard{++depth_};
+
+    auto it = indexes_.find({range.first.col, range.first.row, range.last.row});
+    if (it == indexes_.end()) {
+        // Built aside: reading the cells may index other ranges meanwhile
+        ColumnIndex index;
+        const int rows = range.GetRows();
+        index.keys.resize(rows);
+        index.is_pending.assign(rows, false);
+        index.memory = static_cast<size_t>(rows) * ROW_COST;
+        for (int row = 0; row < rows; ++row) {
+            index.Insert(row, read({range.first.row + row, range.first.col}));
+        }
+        memory_usage_ += index.memory;
+        it = indexes_.emplace(RangeId{range.first.col, range.first.row, range.last.row}, std::move(index)).first;
+        it->second.LinkRows();
+    } else if (!it->second.pending.empty()) {
+        ColumnIndex& index = it->second;
+        const size_t before = index.memory;
+        for (int row : std::exchange(index.pending, {})) {
+            index.is_pending[row] = false;
+            index.Erase(row);
+            index.Insert(row, read({range.first.row + row, range.first.col}));
+        }
+        memory_usage_ = memory_usage_ - before + index.memory;
+    }
+
+    ColumnIndex& index = it->second;
+    index.last_use = ++clock_;
+    auto found = index.Find(key, match);
+    if (depth_ == 1) {
+        Evict();
+    }
+    return found;
+}
+
+void LookupIndexes::Invalidate(Position pos) {
+    if (indexes_.empty()) {
+        return;
+    }
+    for (auto it = indexes_.lower_bound({pos.col, std::numeric_limits<int>::min(), std::numeric_limits<int>::min()});
+         it != indexes_.end() && std::get<0>(it->first) == pos.col; ++it) {
+        const auto [col, first_row, last_row] = it->first;
+        if (pos.row < first_row || pos.row > last_row) {
+            continue;
+        }
+        ColumnIndex& index = it->second;
+        const int row = pos.row - first_row;
+        if (!index.is_pending[row]) {
+            index.is_pending[row] = true;
+            index.pending.push_back(row);
+        }
+    }
+}
+
+void LookupIndexes::Clear() {
+    indexes_.clear();
+    memory_usage_ = 0;
+}
+
+size_t LookupIndexes::GetMemoryUsage() const {
+    return memory_usage_;
+}
+
+size_t LookupIndexes::GetIndexCount() const {
+    return indexes_.size();
+}
+
+void LookupIndexes::SetMemoryLimit(size_t bytes) {
+    memory_limit_ = bytes;
+    if (depth_ == 0) {
+        Evict();
+    }
+}
+
+void LookupIndexes::Evict() {
+    // Least recently used first; the index just used goes last, if it alone exceeds the limit
+    while (memory_usage_ > memory_limit_ && !indexes_.empty()) {
+        auto oldest = std::min_element(indexes_.begin(), indexes_.end(), [](const auto& lhs, const auto& rhs) {
+            return lhs.second.last_use < rhs.second.last_use;
+        });
+        memory_usage_ -= oldest->second.memory;
+        indexes_.erase(oldest);
+    }
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+#include "common.h"
+#include "formula.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <variant>
+#include <vector>
+
+// Формулы, читающие диапазоны (аргументы функций поиска). Ячейки диапазона не связываются с
+// формулой по отдельности: по позиции ячейки реестр находит формулы, чьё значение от неё зависит.
+class RangeDependents {
+public:
+    void Add(Position dependent, const std::vector<CellRange>& ranges);
+    void Remove(Position dependent, const std::vector<CellRange>& ranges);
+
+    // Дописывает в out формулы, чьи диапазоны содержат pos
+    void Collect(Position pos, std::vector<Position>& out) const;
+    // Дописывает в out формулы, чьи диапазоны задевает вставка или удаление строк (столбцов)
+    void CollectShifted(const ReferenceShift& shift, std::vector<Position>& out) const;
+
+private:
+    // Per column, a segment tree over the rows, only the nonempty nodes are kept. A span of rows is
+    // stored in the O(log) nodes covering it, so Collect looks at the nodes on the path from the
+    // root to the row rather than at every range in the column. Nodes are numbered as in a binary
+    // heap: the root is 1, the leaf of row r is TREE_LEAVES + r.
+    static constexpr int TREE_LEAVES = Position::MAX_ROWS;
+    // The formulas stored in a node and how many of their spans it covers
+    using Node = std::unordered_map<Position, int, PositionHasher>;
+    using Column = std::unordered_map<int, Node>;
+
+    // Calls visit(node) for the nodes covering rows [first, last]
+    template <typename Visit>
+    static void ForEachNode(int first, int last, Visit visit);
+
+    std::unordered_map<int, Column> by_column_;
+};
+
+// Индексы для функций поиска: для диапазона из одного столбца - упорядоченное отображение значения
+// в строки, которое находит точное, ближайшее меньшее и ближайшее большее значение за логарифм.
+// Индекс строится при первом поиске по диапазону; ячейки, чьё значение могло измениться
+// (Invalidate), переиндексируются при следующем поиске. Память ограничена: давно не использованные
+// индексы вытесняются, а диапазоны, чей индекс не поместился бы, просматриваются подряд.
+class LookupIndexes {
+public:
+    // Ключ значения ячейки в индексе: число или текст ключа, разделяемый со словарём текстов
+    // таблицы, а не копия. Равные тексты индексируются одним узлом.
+    using Key = std::variant<double, std::shared_ptr<const std::string>>;
+    // Ключ значения ячейки; nullopt для пустой ячейки и ошибки
+    using KeyReader = std::function<std::optional<Key>(Position)>;
+
+    static constexpr size_t DEFAULT_MEMORY_LIMIT = 64 << 20;
+    // Короткие диапазоны быстрее просмотреть, чем индексировать
+    static constexpr int MIN_INDEXED_ROWS = 32;
+
+    // Можно ли искать в range через индекс
+    bool CanIndex(CellRange range) const;
+    // См. SheetInterface::Lookup; значения ячеек читаются через read
+    std::optional<int> Lookup(const LookupKey& key, CellRange range, LookupMatch match, const KeyReader& read);
+
+    // Значение ячейки pos могло измениться
+    void Invalidate(Position pos);
+    void Clear();
+
+    size_t GetMemoryUsage() const;
+    size_t GetIndexCount() const;
+    void SetMemoryLimit(size_t bytes);
+
+private:
+    // Orders keys as LookupKey does, comparing the texts rather than the handles
+    struct KeyOrder {
+        using is_transparent = void;
+        using View = std::variant<double, std::string_view>;
+
+        static View MakeView(const Key& key);
+        static View MakeView(const LookupKey& key);
+
+        template <typename Lhs, typename Rhs>
+        bool operator()(const Lhs& lhs, const Rhs& rhs) const {
+            return MakeView(lhs) < MakeView(rhs);
+        }
+    };
+
+    struct ColumnIndex {
+        // Rows relative to the start of the range, ascending
+        using Rows = std::map<Key, std::vector<int>, KeyOrder>;
+
+        Rows rows;
+        // Per row its node in rows; no copy of the key
+        std::vector<std::optional<Rows::iterator>> keys;
+        std::vector<int> pending;
+        std::vector<bool> is_pending;
+        size_t memory = 0;
+        uint64_t last_use = 0;
+
+        void Insert(int row, std::optional<Key> key);
+        void Erase(int row);
+        // Points keys at the nodes of rows again, which moving the index may not preserve
+        void LinkRows();
+        std::optional<int> Find(const LookupKey& key, LookupMatch match) const;
+    };
+
+    // Column, first and last row of the indexed range
+    using RangeId = std::tuple<int, int, int>;
+
+    static size_t EstimateMemory(int rows);
+    void Evict();
+
+    std::map<RangeId, ColumnIndex> indexes_;
+    size_t memory_usage_ = 0;
+    size_t memory_limit_ = DEFAULT_MEMORY_LIMIT;
+    uint64_t clock_ = 0;
+    // Reading the cells of a range may look up other ranges; indexes are only evicted once the
+    // outermost lookup is done
+    int depth_ = 0;
+};
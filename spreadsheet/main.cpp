@@ -1,7 +1,17 @@
+#include <filesystem>
+#include <fstream>
 #include <limits>
+#include <thread>
+#include <utility>
+#include "async_sheet.h"
 #include "common.h"
+#include "edit_log.h"
 #include "formula.h"
+#include "importer.h"
+#include "sheet.h"
 #include "test_runner_p.h"
+#include "trace_events.h"
+#include "workload_trace.h"
 
 inline std::ostream& operator<<(std::ostream& output, Position pos) {
     return output << "(" << pos.row << ", " << pos.col << ")";
@@ -24,6 +34,8 @@ inline std::ostream& operator<<(std::ostream& output, const CellInterface::Value
     return output;
 }
 
+// The unit tests are built into spreadsheet_unit_test, the plain build runs the demo below
+#ifdef SPREADSHEET_UNIT_TESTS
 namespace {
 
     void TestPositionAndStringConversion() {
@@ -345,31 +357,1459 @@ namespace {
         ASSERT(caught);
         ASSERT_EQUAL(sheet->GetCell("M6"_pos)->GetText(), "Ready");
     }
+
+    void TestSetCellsBulk() {
+        Sheet sheet;
+        std::vector<std::pair<Position, std::string>> cells;
+        for (int i = 0; i < 2000; ++i) {
+            cells.emplace_back(Position{i, 0}, std::to_string(i));
+            cells.emplace_back(Position{i, 1}, "=A" + std::to_string(i + 1) + "*2");
+        }
+        sheet.SetCells(std::move(cells));
+        ASSERT_EQUAL(sheet.GetCell("B1000"_pos)->GetText(), "=A1000*2");
+        ASSERT_EQUAL(sheet.GetCell("B1000"_pos)->GetValue(), CellInterface::Value(1998.0));
+
+        bool caught = false;
+        try {
+            sheet.SetCells({{"C1"_pos, "ok"}, {"C2"_pos, "=1+"}, {"C3"_pos, "skipped"}});
+        } catch (const FormulaException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "ok");
+        ASSERT(sheet.GetCell("C2"_pos) == nullptr);
+        ASSERT(sheet.GetCell("C3"_pos) == nullptr);
+    }
+
+    void TestImportTexts() {
+        Sheet source;
+        source.SetCell("A1"_pos, "=(1+2)*3");
+        source.SetCell("C1"_pos, "'=escaped");
+        source.SetCell("B3"_pos, "some text");
+        source.SetCell("D4"_pos, "=A1+B3");
+        std::ostringstream texts;
+        source.PrintTexts(texts);
+
+        // A tiny chunk forces records to straddle chunk boundaries
+        Sheet imported;
+        std::istringstream input(texts.str());
+        ImportTexts(imported, input, {ImportFormat::Texts, 5, 2});
+        std::ostringstream reimported;
+        imported.PrintTexts(reimported);
+        ASSERT_EQUAL(reimported.str(), texts.str());
+        ASSERT_EQUAL(imported.GetCell("A1"_pos)->GetValue(), CellInterface::Value(9.0));
+    }
+
+    void TestImportCsv() {
+        Sheet sheet;
+        std::istringstream input("1,\"a,b\",\"say \"\"hi\"\"\"\r\n,=A1*2\r\n\"multi\nline\",x");
+        ImportTexts(sheet, input, {ImportFormat::Csv, 4, 1});
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "a,b");
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "say \"hi\"");
+        ASSERT(sheet.GetCell("A2"_pos) == nullptr || sheet.GetCell("A2"_pos)->GetText().empty());
+        ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(), CellInterface::Value(2.0));
+        ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetText(), "multi\nline");
+        ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetText(), "x");
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{3, 3}));
+    }
+
+    void TestExportWriterMatchesStream() {
+        const double numbers[] = {0.0, -0.0, 1.0, 35.0, 0.1, 1.0 / 3, 123456.0, 1234567.0, 1e-5,
+                                  -2.5e-300, 1e+200, std::numeric_limits<double>::max()};
+        std::ostringstream expected;
+        std::ostringstream actual;
+        {
+            ExportWriter writer(actual, 16);
+            for (double number : numbers) {
+                expected << number << '\t';
+                writer.Write(number);
+                writer.Write('\t');
+            }
+        }
+        ASSERT_EQUAL(actual.str(), expected.str());
+
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "=1/3");
+        sheet.SetCell("B2"_pos, "'text");
+        sheet.SetCell("C1"_pos, "=A1/0");
+        std::ostringstream values;
+        sheet.PrintValues(values);
+        ASSERT_EQUAL(values.str(), "0.333333\t\t#ARITHM!\n\ttext\t\n");
+    }
+
+    void TestReadRange() {
+        Sheet sheet;
+        sheet.SetCell("B2"_pos, "'text");
+        sheet.SetCell("C2"_pos, "=B3*2");
+        sheet.SetCell("B3"_pos, "21");
+        sheet.SetCell("C3"_pos, "=1/0");
+
+        std::vector<RangeValue> buffer(3 * 3);
+        sheet.ReadRange("B2"_pos, "D4"_pos, buffer.data(), buffer.size());
+        ASSERT(buffer[0].type == RangeValue::Type::Text);
+        ASSERT_EQUAL(buffer[0].text, "text");
+        ASSERT(buffer[1].type == RangeValue::Type::Number);
+        ASSERT_EQUAL(buffer[1].number, 42.0);
+        ASSERT(buffer[2].type == RangeValue::Type::Empty);
+        ASSERT(buffer[3].type == RangeValue::Type::Text);
+        ASSERT(buffer[4].type == RangeValue::Type::Error);
+        ASSERT(buffer[4].error == FormulaError::Category::Div0);
+        ASSERT(buffer[8].type == RangeValue::Type::Empty);
+
+        bool caught = false;
+        try {
+            sheet.ReadRange("B2"_pos, "A1"_pos, buffer.data(), buffer.size());
+        } catch (const InvalidPositionException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+    }
+
+    void TestSnapshotRoundTrip() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "=(1+2)*3");
+        sheet.SetCell("B1"_pos, "=-A1/C3");
+        sheet.SetCell("A2"_pos, "repeated");
+        sheet.SetCell("B2"_pos, "repeated");
+        sheet.SetCell("C2"_pos, "'=escaped");
+        sheet.SetCell("C3"_pos, "4");
+        sheet.SetCell("D4"_pos, "=A1+B1+Z9");
+        std::ostringstream texts;
+        std::ostringstream values;
+        sheet.PrintTexts(texts);
+        sheet.PrintValues(values);
+
+        const std::string path = "spreadsheet_snapshot_test.bin";
+        sheet.SaveSnapshot(path);
+        auto restored = Sheet::LoadSnapshot(path);
+
+        // A file of another format version is rejected as a whole
+        {
+            std::fstream file(path, std::ios::binary | std::ios::in | std::ios::out);
+            const uint32_t old_version = 1;
+            file.seekp(8);
+            file.write(reinterpret_cast<const char*>(&old_version), sizeof(old_version));
+        }
+        bool rejected = false;
+        try {
+            Sheet::LoadSnapshot(path);
+        } catch (const SnapshotException&) {
+            rejected = true;
+        }
+        ASSERT(rejected);
+        std::remove(path.c_str());
+
+        std::ostringstream restored_texts;
+        std::ostringstream restored_values;
+        restored->PrintTexts(restored_texts);
+        restored->PrintValues(restored_values);
+        ASSERT_EQUAL(restored_texts.str(), texts.str());
+        ASSERT_EQUAL(restored_values.str(), values.str());
+        ASSERT_EQUAL(restored->GetCell("D4"_pos)->GetReferencedCells(), (std::vector{"A1"_pos, "B1"_pos, "Z9"_pos}));
+
+        // Restored dependencies must still drive invalidation
+        restored->SetCell("C3"_pos, "-4");
+        ASSERT_EQUAL(restored->GetCell("B1"_pos)->GetValue(), CellInterface::Value(2.25));
+
+        // A fork saves its own values, not those of the parent it shares rows with, and does not
+        // need the parent to be alive
+        auto parent = std::make_unique<Sheet>();
+        parent->SetCell("A1"_pos, "1");
+        parent->SetCell("A2"_pos, "=A1");
+        parent->Recalculate();
+        auto fork = parent->Fork();
+        parent->SetCell("A1"_pos, "5");
+        parent->Recalculate();
+        fork->SaveSnapshot(path);
+        ASSERT_EQUAL(Sheet::LoadSnapshot(path)->GetCell("A2"_pos)->GetValue(), CellInterface::Value(1.0));
+        parent.reset();
+        fork->SaveSnapshot(path);
+        ASSERT_EQUAL(Sheet::LoadSnapshot(path)->GetCell("A2"_pos)->GetValue(), CellInterface::Value(1.0));
+        std::remove(path.c_str());
+    }
+
+    void TestEditLogRecovery() {
+        namespace fs = std::filesystem;
+        const fs::path directory = fs::temp_directory_path() / "spreadsheet_edit_log_test";
+        fs::remove_all(directory);
+        auto texts_of = [](const SheetInterface& sheet) {
+            std::ostringstream out;
+            sheet.PrintTexts(out);
+            return out.str();
+        };
+
+        std::string expected;
+        {
+            auto sheet = JournaledSheet::Open(directory.string());
+            sheet->SetCell("A1"_pos, "=B1*2");
+            sheet->SetCell("B1"_pos, "21");
+            sheet->SetCell("C3"_pos, "temporary");
+            sheet->ClearCell("C3"_pos);
+            try {
+                sheet->SetCell("B1"_pos, "=A1");
+            } catch (const CircularDependencyException&) {
+                // failed edits are not logged
+            }
+            sheet->Commit();
+            sheet->Compact();
+            sheet->SetCell("B2"_pos, "after compaction");
+            // Edits through a cell are logged as well
+            sheet->GetCell("B2"_pos)->Set("edited through the cell");
+            sheet->WaitForCompaction();
+            expected = texts_of(*sheet);
+        }
+        {
+            // A torn record at the end of the log is dropped on recovery
+            std::ofstream tail((directory / "edits.1.log").string(), std::ios::binary | std::ios::app);
+            const char torn[] = "\x20\x00\x00\x00garbage";
+            tail.write(torn, sizeof torn - 1);
+        }
+        {
+            auto sheet = JournaledSheet::Open(directory.string());
+            ASSERT_EQUAL(texts_of(*sheet), expected);
+            ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(42.0));
+            sheet->SetCell("D1"_pos, "after recovery");
+            expected = texts_of(*sheet);
+        }
+        {
+            // So is a record whose length runs past the end of the file
+            std::ofstream tail((directory / "edits.1.log").string(), std::ios::binary | std::ios::app);
+            const char oversized[] = "\xf0\xff\xff\xff\x00\x00\x00\x00\x01";
+            tail.write(oversized, sizeof oversized - 1);
+        }
+        {
+            auto sheet = JournaledSheet::Open(directory.string());
+            ASSERT_EQUAL(texts_of(*sheet), expected);
+        }
+        {
+            // A crash during compaction may leave a snapshot that does not load; the previous
+            // generation and the segments after it are still in place and recovery uses them
+            std::ofstream torn((directory / "snapshot.2").string(), std::ios::binary);
+            torn << "SHEETSNP";
+        }
+        {
+            auto sheet = JournaledSheet::Open(directory.string());
+            ASSERT_EQUAL(texts_of(*sheet), expected);
+            ASSERT(fs::exists(directory / "snapshot.1"));
+            ASSERT(!fs::exists(directory / "snapshot.2"));
+            sheet->Compact();
+            sheet->WaitForCompaction();
+        }
+        {
+            auto sheet = JournaledSheet::Open(directory.string());
+            ASSERT_EQUAL(texts_of(*sheet), expected);
+            ASSERT(fs::exists(directory / "snapshot.2"));
+            ASSERT(!fs::exists(directory / "snapshot.1"));
+        }
+        fs::remove_all(directory);
+    }
+
+    void TestValueSnapshotReaders() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "=0");
+        sheet.SetCell("B1"_pos, "=A1*2");
+        sheet.SetCell("C1"_pos, "=B1/A1");
+        sheet.Recalculate();
+        {
+            auto values = sheet.ReadValues();
+            ASSERT_EQUAL(values->GetVersion(), 1u);
+            ASSERT_EQUAL(*values->Find("B1"_pos), CellInterface::Value(0.0));
+            ASSERT(std::holds_alternative<FormulaError>(*values->Find("C1"_pos)));
+            ASSERT(values->Find("Z100"_pos) == nullptr);
+        }
+
+        constexpr int ITERATIONS = 2000;
+        std::atomic<bool> done = false;
+        std::atomic<bool> consistent = true;
+        std::vector<std::thread> readers;
+        for (int i = 0; i < 4; ++i) {
+            readers.emplace_back([&] {
+                uint64_t last_version = 0;
+                while (!done.load()) {
+                    auto values = sheet.ReadValues();
+                    double a = std::get<double>(*values->Find("A1"_pos));
+                    double b = std::get<double>(*values->Find("B1"_pos));
+                    if (b != a * 2 || values->GetVersion() < last_version) {
+                        consistent = false;
+                    }
+                    last_version = values->GetVersion();
+                }
+            });
+        }
+        for (int i = 1; i <= ITERATIONS; ++i) {
+            sheet.SetCell("A1"_pos, "=" + std::to_string(i));
+            sheet.Recalculate();
+        }
+        done = true;
+        for (auto& reader : readers) {
+            reader.join();
+        }
+        ASSERT(consistent.load());
+
+        auto values = sheet.ReadValues();
+        ASSERT_EQUAL(*values->Find("C1"_pos), CellInterface::Value(2.0));
+
+        // Unchanged rows are shared with the previous version
+        sheet.SetCell("A2"_pos, "text");
+        sheet.Recalculate();
+        auto next = sheet.ReadValues();
+        ASSERT_EQUAL(next->GetVersion(), values->GetVersion() + 1);
+        ASSERT(next->Find("A1"_pos) == values->Find("A1"_pos));
+        ASSERT_EQUAL(*next->Find("A2"_pos), CellInterface::Value(std::string("text")));
+
+        sheet.ClearCell("A2"_pos);
+        sheet.Recalculate();
+        ASSERT_EQUAL(*sheet.ReadValues()->Find("A2"_pos), CellInterface::Value(std::string()));
+    }
+
+    void TestSheetFork() {
+        auto parent = std::make_unique<Sheet>();
+        parent->SetCell("A1"_pos, "1");
+        parent->SetCell("B1"_pos, "=A1*2");
+        parent->SetCell("A2"_pos, "=B1+1");
+        parent->SetCell("C5"_pos, "unchanged");
+        ASSERT_EQUAL(parent->GetCell("A2"_pos)->GetValue(), CellInterface::Value(3.0));
+        parent->Recalculate();
+
+        auto fork = parent->Fork();
+        ASSERT_EQUAL(fork->ReadValues()->GetVersion(), parent->ReadValues()->GetVersion());
+        fork->SetCell("A1"_pos, "5");
+        ASSERT_EQUAL(fork->GetCell("A2"_pos)->GetValue(), CellInterface::Value(11.0));
+        ASSERT_EQUAL(parent->GetCell("A2"_pos)->GetValue(), CellInterface::Value(3.0));
+
+        parent->SetCell("C5"_pos, "parent");
+        parent->ClearCell("A2"_pos);
+        ASSERT_EQUAL(fork->GetCell("C5"_pos)->GetText(), "unchanged");
+        ASSERT_EQUAL(fork->GetCell("A2"_pos)->GetText(), "=B1+1");
+
+        // Reading and evaluating copy none of the rows the sheets share, only writing does
+        auto reader = fork->Fork();
+        std::ostringstream values;
+        reader->PrintValues(values);
+        fork->PrintValues(values);
+        RangeValue range[4];
+        reader->ReadRange("A1"_pos, "B2"_pos, range, 4);
+        ASSERT_EQUAL(range[2].number, 11.0);
+        const CellInterface* shared = reader->GetCell("A2"_pos);
+        ASSERT_EQUAL(shared->GetValue(), CellInterface::Value(11.0));
+        for (Position pos : {"A1"_pos, "B1"_pos, "A2"_pos, "C5"_pos}) {
+            ASSERT_EQUAL(std::as_const(*reader).GetCommonCell(pos), std::as_const(*fork).GetCommonCell(pos));
+        }
+        reader->SetCell("A1"_pos, "2");
+        ASSERT(std::as_const(*reader).GetCommonCell("A1"_pos) != std::as_const(*fork).GetCommonCell("A1"_pos));
+        ASSERT_EQUAL(shared->GetValue(), CellInterface::Value(5.0));
+        ASSERT_EQUAL(fork->GetCell("A2"_pos)->GetValue(), CellInterface::Value(11.0));
+        reader.reset();
+
+        // A fork of a fork outlives both of its ancestors
+        auto nested = fork->Fork();
+        parent.reset();
+        fork.reset();
+        nested->SetCell("B1"_pos, "=A1*3");
+        ASSERT_EQUAL(nested->GetCell("A2"_pos)->GetValue(), CellInterface::Value(16.0));
+        nested->Recalculate();
+        ASSERT_EQUAL(*nested->ReadValues()->Find("A2"_pos), CellInterface::Value(16.0));
+
+        // Scenario forks are independent and may be driven from their own threads
+        Sheet model;
+        for (int i = 0; i < 100; ++i) {
+            model.SetCell(Position{i, 0}, "=" + std::to_string(i));
+            model.SetCell(Position{i, 1}, i == 0 ? "=A1" : "=B" + std::to_string(i) + "+A" + std::to_string(i + 1));
+        }
+        ASSERT_EQUAL(model.GetCell("B100"_pos)->GetValue(), CellInterface::Value(4950.0));
+        std::vector<std::unique_ptr<Sheet>> scenarios;
+        for (int i = 0; i < 8; ++i) {
+            scenarios.push_back(model.Fork());
+        }
+        std::vector<std::thread> threads;
+        for (int i = 0; i < 8; ++i) {
+            threads.emplace_back([&scenario = *scenarios[i], i] {
+                scenario.SetCell("A1"_pos, "=" + std::to_string(i));
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        for (int i = 0; i < 8; ++i) {
+            ASSERT_EQUAL(scenarios[i]->GetCell("B100"_pos)->GetValue(), CellInterface::Value(4950.0 + i));
+        }
+        ASSERT_EQUAL(model.GetCell("B100"_pos)->GetValue(), CellInterface::Value(4950.0));
+    }
+
+    void TestAsyncSheet() {
+        AsyncSheet sheet(std::make_unique<Sheet>(), RecalcBudget{16});
+        sheet.SetCell("A1"_pos, "1");
+        for (int i = 2; i <= 1000; ++i) {
+            sheet.SetCell(Position{i - 1, 0}, "=A" + std::to_string(i - 1) + "+1");
+        }
+        ASSERT_EQUAL(sheet.GetValueAsync("A1000"_pos).get(), CellInterface::Value(1000.0));
+
+        sheet.WhenClean().wait();
+        auto stable = sheet.GetStaleValue("A1000"_pos);
+        ASSERT_EQUAL(stable.value, CellInterface::Value(1000.0));
+        ASSERT(!stable.stale);
+        ASSERT_EQUAL(sheet.GetStaleValue("Z99"_pos).value, CellInterface::Value(std::string()));
+
+        // Readers keep getting the previous stable value until the new one is published
+        sheet.SetCell("A1"_pos, "101");
+        auto during = sheet.GetStaleValue("A1000"_pos);
+        ASSERT(during.value == CellInterface::Value(1000.0) || during.value == CellInterface::Value(1100.0));
+        ASSERT(during.value == CellInterface::Value(1100.0) || during.stale);
+        ASSERT_EQUAL(sheet.GetValueAsync("A1000"_pos).get(), CellInterface::Value(1100.0));
+        sheet.WhenClean().wait();
+        stable = sheet.GetStaleValue("A1000"_pos);
+        ASSERT_EQUAL(stable.value, CellInterface::Value(1100.0));
+        ASSERT(!stable.stale);
+
+        sheet.ClearCell("A1"_pos);
+        sheet.WhenClean().wait();
+        ASSERT_EQUAL(sheet.GetStaleValue("A1000"_pos).value, CellInterface::Value(999.0));
+        ASSERT_EQUAL(sheet.Access([](Sheet& s) {
+            return s.GetCell("A1000"_pos)->GetText();
+        }), "=A999+1");
+
+        // Syntax errors come from the caller thread, cycles are found by the worker
+        bool caught = false;
+        try {
+            sheet.SetCell("A1"_pos, "=1+");
+        } catch (const FormulaException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+
+        auto cycle = sheet.SetCell("A1"_pos, "=A1000");
+        caught = false;
+        try {
+            cycle.get();
+        } catch (const CircularDependencyException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+
+        // Access sees edits that are still queued
+        sheet.SetCell("B1"_pos, "=A1000*2");
+        ASSERT_EQUAL(sheet.Access([](Sheet& s) {
+            return s.GetCell("B1"_pos)->GetText();
+        }), "=A1000*2");
+        ASSERT_EQUAL(sheet.GetValueAsync("B1"_pos).get(), CellInterface::Value(1998.0));
+    }
+
+    void TestRecalculateBudget() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        for (int i = 1; i < 1000; ++i) {
+            sheet.SetCell(Position{0, i}, "=A1+" + std::to_string(i));
+        }
+        sheet.Recalculate();
+
+        sheet.SetViewport("ALK1"_pos, "ALL1"_pos);
+        sheet.SetCell("A1"_pos, "2");
+        ASSERT(sheet.IsDirty("ALL1"_pos));
+        ASSERT(!sheet.RecalculateStep(RecalcBudget{2}));
+        // The visible cells go first and are published as soon as they are done; the rest is
+        // published by the step that finishes the sheet
+        ASSERT(!sheet.IsDirty("ALK1"_pos) && !sheet.IsDirty("ALL1"_pos));
+        ASSERT(sheet.HasDirtyCells());
+        ASSERT_EQUAL(*sheet.ReadValues()->Find("ALL1"_pos), CellInterface::Value(1001.0));
+        ASSERT_EQUAL(*sheet.ReadValues()->Find("B1"_pos), CellInterface::Value(2.0));
+
+        // A zero time budget still makes progress
+        ASSERT(!sheet.RecalculateStep(RecalcBudget{std::numeric_limits<size_t>::max(), std::chrono::microseconds(0)}));
+        size_t steps = 1;
+        while (!sheet.RecalculateStep(RecalcBudget{100})) {
+            ++steps;
+        }
+        ASSERT_EQUAL(steps, 10u);
+        ASSERT(!sheet.HasDirtyCells());
+        ASSERT_EQUAL(*sheet.ReadValues()->Find("ALL1"_pos), CellInterface::Value(1001.0));
+        ASSERT_EQUAL(*sheet.ReadValues()->Find("B1"_pos), CellInterface::Value(3.0));
+
+        // A value staged before its cell changed again is not published along with the viewport
+        sheet.ResetViewport();
+        sheet.SetCell("A1"_pos, "3");
+        ASSERT(!sheet.RecalculateStep(RecalcBudget{1}));
+        sheet.SetCell("A1"_pos, "4");
+        sheet.SetViewport("ALK1"_pos, "ALL1"_pos);
+        ASSERT(!sheet.RecalculateStep(RecalcBudget{2}));
+        ASSERT_EQUAL(*sheet.ReadValues()->Find("ALL1"_pos), CellInterface::Value(1003.0));
+        for (int i = 1; i < 998; ++i) {
+            ASSERT_EQUAL(*sheet.ReadValues()->Find(Position{0, i}), CellInterface::Value(2.0 + i));
+        }
+
+        // A fork shares the pending work rather than copying it: it publishes the values staged
+        // before it was made, and the progress of either sheet does not show in the other
+        sheet.Recalculate();
+        sheet.SetCell("A1"_pos, "5");
+        ASSERT(!sheet.RecalculateStep(RecalcBudget{500}));
+        auto fork = sheet.Fork();
+        auto edited = sheet.Fork();
+        edited->SetCell("A1"_pos, "6");
+        edited->Recalculate();
+        fork->Recalculate();
+        ASSERT(sheet.HasDirtyCells());
+        for (int i = 1; i < 1000; ++i) {
+            ASSERT_EQUAL(*fork->ReadValues()->Find(Position{0, i}), CellInterface::Value(5.0 + i));
+            ASSERT_EQUAL(*edited->ReadValues()->Find(Position{0, i}), CellInterface::Value(6.0 + i));
+        }
+        sheet.Recalculate();
+        ASSERT_EQUAL(*sheet.ReadValues()->Find("B1"_pos), CellInterface::Value(6.0));
+        ASSERT_EQUAL(*sheet.ReadValues()->Find("ALL1"_pos), CellInterface::Value(1004.0));
+    }
+
+    void TestIncrementalInvalidation() {
+        // An edit resets the caches of the formulas reading the cell; the chain below them is
+        // reached by the next recalculation steps, within their budget
+        Sheet sheet;
+        constexpr int LENGTH = 100;
+        sheet.SetCell("A1"_pos, "1");
+        for (int row = 1; row < LENGTH; ++row) {
+            sheet.SetCell({row, 0}, "=A" + std::to_string(row) + "+1");
+            sheet.SetCell({row, 1}, "=A" + std::to_string(row + 1));
+        }
+        sheet.Recalculate();
+        auto cached = [&sheet] {
+            return sheet.GetValueCacheStats().entries;
+        };
+        ASSERT_EQUAL(cached(), size_t(2 * (LENGTH - 1)));
+
+        sheet.SetCell("A1"_pos, "2");
+        ASSERT_EQUAL(cached(), size_t(2 * (LENGTH - 1) - 1));
+        ASSERT(sheet.IsDirty("B100"_pos));
+        ASSERT(!sheet.RecalculateStep(RecalcBudget{10}));
+        ASSERT(cached() < size_t(2 * (LENGTH - 1) - 10));
+        ASSERT(cached() > size_t(LENGTH));
+        ASSERT_EQUAL(*sheet.ReadValues()->Find("B100"_pos), CellInterface::Value(100.0));
+
+        // Reading a value or looking up a range finishes the invalidation first
+        ASSERT(sheet.Lookup(101.0, CellRange{"B1"_pos, "B100"_pos}, LookupMatch::Exact) == std::optional<int>(99));
+        ASSERT_EQUAL(sheet.GetCell("B100"_pos)->GetValue(), CellInterface::Value(101.0));
+        sheet.Recalculate();
+        ASSERT_EQUAL(*sheet.ReadValues()->Find("B100"_pos), CellInterface::Value(101.0));
+
+        // A fork takes over the invalidation left pending, and shifting cells finishes it
+        sheet.SetCell("A1"_pos, "3");
+        ASSERT(!sheet.RecalculateStep(RecalcBudget{10}));
+        auto fork = sheet.Fork();
+        fork->Recalculate();
+        ASSERT_EQUAL(*fork->ReadValues()->Find("B100"_pos), CellInterface::Value(102.0));
+        sheet.InsertRows(0);
+        ASSERT_EQUAL(sheet.GetCell("B101"_pos)->GetValue(), CellInterface::Value(102.0));
+        sheet.Recalculate();
+        ASSERT(!sheet.HasDirtyCells());
+        ASSERT_EQUAL(*sheet.ReadValues()->Find("A101"_pos), CellInterface::Value(102.0));
+    }
+
+    void TestChangeFeed() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("B1"_pos, "=A1*0");
+        sheet.SetCell("C1"_pos, "=A1+1");
+        sheet.SetCell("A2"_pos, "=C1");
+        sheet.Recalculate();
+        const uint64_t start = sheet.GetVersion();
+        ASSERT_EQUAL(start, 1u);
+
+        std::vector<std::pair<uint64_t, std::vector<Position>>> received;
+        const uint64_t subscription = sheet.Subscribe([&](uint64_t version, const std::vector<Position>& changed) {
+            received.emplace_back(version, changed);
+        });
+
+        // B1 is recomputed but stays 0
+        sheet.SetCell("A1"_pos, "2");
+        sheet.Recalculate();
+        const std::vector<Position> expected = {"A1"_pos, "C1"_pos, "A2"_pos};
+        ASSERT_EQUAL(sheet.GetChangesSince(start).value(), expected);
+        ASSERT_EQUAL(received.size(), 1u);
+        ASSERT_EQUAL(received[0].first, start + 1);
+        ASSERT_EQUAL(received[0].second, expected);
+
+        // Nothing changed, nothing is published
+        sheet.SetCell("A1"_pos, "2");
+        sheet.Recalculate();
+        ASSERT_EQUAL(sheet.GetVersion(), start + 1);
+        ASSERT_EQUAL(received.size(), 1u);
+
+        // Batches are coalesced
+        sheet.Unsubscribe(subscription);
+        sheet.SetCell("D4"_pos, "new");
+        sheet.Recalculate();
+        ASSERT_EQUAL(received.size(), 1u);
+        ASSERT_EQUAL(sheet.GetChangesSince(start).value(),
+                     (std::vector{"A1"_pos, "C1"_pos, "A2"_pos, "D4"_pos}));
+        ASSERT(sheet.GetChangesSince(sheet.GetVersion()).value().empty());
+
+        auto fork = sheet.Fork();
+        ASSERT(!fork->GetChangesSince(start).has_value());
+        fork->ClearCell("D4"_pos);
+        fork->Recalculate();
+        ASSERT_EQUAL(fork->GetChangesSince(sheet.GetVersion()).value(), std::vector{"D4"_pos});
+    }
+
+    void TestUndoRedo() {
+        Sheet sheet;
+        auto texts_of = [&sheet] {
+            std::ostringstream out;
+            sheet.PrintTexts(out);
+            return out.str();
+        };
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("B1"_pos, "=A1+1");
+        const std::string before_paste = texts_of();
+
+        std::vector<std::pair<Position, std::string>> paste;
+        for (int i = 0; i < 1000; ++i) {
+            paste.emplace_back(Position{i, 0}, std::to_string(i + 10));
+            paste.emplace_back(Position{i, 2}, "=A" + std::to_string(i + 1) + "*2");
+        }
+        sheet.SetCells(std::move(paste));
+        const std::string after_paste = texts_of();
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(11.0));
+
+        sheet.BeginUndoGroup();
+        sheet.SetCell("A1"_pos, "=C2");
+        sheet.ClearCell("B1"_pos);
+        sheet.EndUndoGroup();
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(44.0));
+
+        ASSERT(sheet.Undo());
+        ASSERT_EQUAL(texts_of(), after_paste);
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(11.0));
+        ASSERT(sheet.Undo());
+        ASSERT_EQUAL(texts_of(), before_paste);
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(2.0));
+        ASSERT(sheet.GetCell("C1"_pos) == nullptr || sheet.GetCell("C1"_pos)->GetText().empty());
+
+        ASSERT(sheet.Redo());
+        ASSERT_EQUAL(texts_of(), after_paste);
+        ASSERT_EQUAL(sheet.GetCell("C1000"_pos)->GetValue(), CellInterface::Value(2018.0));
+
+        // A new edit drops the redo history
+        sheet.SetCell("D1"_pos, "x");
+        ASSERT(!sheet.Redo());
+        ASSERT(sheet.Undo());
+        ASSERT(sheet.Undo());
+        ASSERT_EQUAL(texts_of(), before_paste);
+
+        // The circular reference check runs for edits, not for undo
+        bool caught = false;
+        try {
+            sheet.SetCell("A1"_pos, "=B1");
+        } catch (const CircularDependencyException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+
+        // An edit through the cell interface is journaled like SetCell, whether or not the row is
+        // shared with a fork; otherwise undo would restore C1 under a formula reading it
+        {
+            Sheet edited;
+            edited.SetCell("C1"_pos, "=D1");
+            edited.SetCell("C1"_pos, "1");
+            edited.GetCell("D1"_pos)->Set("=C1");
+            ASSERT(edited.Undo());
+            ASSERT(edited.GetCell("D1"_pos) == nullptr);
+            ASSERT(edited.Undo());
+            ASSERT_EQUAL(edited.GetCell("C1"_pos)->GetText(), std::string("=D1"));
+            ASSERT_EQUAL(edited.GetCell("C1"_pos)->GetValue(), CellInterface::Value(0.0));
+        }
+
+        sheet.SetUndoMemoryLimit(0);
+        ASSERT(!sheet.GetUndoJournal().CanUndo());
+        ASSERT_EQUAL(sheet.GetUndoJournal().GetMemoryUsage(), 0u);
+        ASSERT(!sheet.Undo());
+    }
+
+    void TestInsertDeleteRowsCols() {
+        Sheet sheet;
+        auto texts_of = [&sheet] {
+            std::ostringstream out;
+            sheet.PrintTexts(out);
+            return out.str();
+        };
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("A2"_pos, "2");
+        sheet.SetCell("A3"_pos, "3");
+        sheet.SetCell("B1"_pos, "=A1+A3");
+        sheet.SetCell("B3"_pos, "=A2*2");
+        const std::string initial = texts_of();
+
+        sheet.InsertRows(1);
+        ASSERT(sheet.GetCell("A2"_pos) == nullptr);
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), std::string("=A1+A4"));
+        ASSERT_EQUAL(sheet.GetCell("B4"_pos)->GetText(), std::string("=A3*2"));
+        ASSERT_EQUAL(sheet.GetCell("B4"_pos)->GetValue(), CellInterface::Value(4.0));
+        ASSERT_EQUAL(sheet.GetCell("B4"_pos)->GetReferencedCells(), std::vector<Position>{"A3"_pos});
+
+        // The row of A3 goes, the formula reading it breaks and the one reading A4 follows it up
+        sheet.DeleteRows(2);
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), std::string("=A1+A3"));
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(4.0));
+        ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetText(), std::string("=#REF!*2"));
+        ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetValue(), CellInterface::Value(FormulaError(FormulaError::Category::Ref)));
+        ASSERT(sheet.GetCell("B3"_pos)->GetReferencedCells().empty());
+
+        sheet.SetCell("A3"_pos, "10");
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(11.0));
+        sheet.InsertCols(0, 2);
+        ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetText(), std::string("=C1+C3"));
+        sheet.DeleteCols(2);
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), std::string("=#REF!+#REF!"));
+        sheet.Recalculate();
+        const auto* value = sheet.ReadValues()->Find("C1"_pos);
+        ASSERT(value != nullptr && std::holds_alternative<FormulaError>(*value));
+
+        // Undo brings back the erased cells and the references to them
+        ASSERT(sheet.Undo());
+        ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetText(), std::string("=C1+C3"));
+        ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(11.0));
+        ASSERT(sheet.Undo());
+        ASSERT(sheet.Undo());
+        ASSERT(sheet.Undo());
+        ASSERT(sheet.Undo());
+        ASSERT_EQUAL(texts_of(), initial);
+        ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetValue(), CellInterface::Value(4.0));
+        ASSERT(sheet.Redo());
+        ASSERT(sheet.Redo());
+        ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetText(), std::string("=#REF!*2"));
+
+        // A fork shares the formulas: rewriting them in one sheet leaves the other intact
+        auto fork = sheet.Fork();
+        fork->InsertRows(0);
+        ASSERT_EQUAL(fork->GetCell("B2"_pos)->GetText(), std::string("=A2+A4"));
+        ASSERT_EQUAL(fork->GetCell("B2"_pos)->GetValue(), CellInterface::Value(4.0));
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), std::string("=A1+A3"));
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(4.0));
+
+        // Broken references are read back as they are printed, in place of a cell or a range
+        const FormulaError ref(FormulaError::Category::Ref);
+        fork->SetCell("E1"_pos, fork->GetCell("B4"_pos)->GetText());
+        ASSERT_EQUAL(fork->GetCell("E1"_pos)->GetText(), std::string("=#REF!*2"));
+        ASSERT_EQUAL(fork->GetCell("E1"_pos)->GetValue(), CellInterface::Value(ref));
+        ASSERT(fork->GetCell("E1"_pos)->GetReferencedCells().empty());
+        fork->SetCell("E2"_pos, "=MATCH(#REF!,#REF!,0)");
+        ASSERT_EQUAL(fork->GetCell("E2"_pos)->GetText(), std::string("=MATCH(#REF!,#REF!,0)"));
+        ASSERT_EQUAL(fork->GetCell("E2"_pos)->GetValue(), CellInterface::Value(ref));
+
+        bool caught = false;
+        try {
+            sheet.InsertRows(0, Position::MAX_ROWS);
+        } catch (const InvalidPositionException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), std::string("=A1+A3"));
+    }
+
+    void TestLookupFunctions() {
+        Sheet sheet;
+        for (int row = 0; row < 100; ++row) {
+            sheet.SetCell({row, 0}, std::to_string((row + 1) * 10));
+            sheet.SetCell({row, 1}, std::to_string(row + 1));
+            sheet.SetCell({row, 2}, "key" + std::to_string(row + 1));
+        }
+        sheet.SetCell("D1"_pos, "=MATCH(500,A1:A100,0)");
+        sheet.SetCell("D2"_pos, "=MATCH(505,A1:A100)");
+        sheet.SetCell("D3"_pos, "=VLOOKUP(255,A1:B100,2)");
+        sheet.SetCell("D4"_pos, "=XLOOKUP(\"KEY7\",C1:C100,B1:B100)");
+        sheet.SetCell("D5"_pos, "=MATCH(5,A1:A100,0)");
+        sheet.SetCell("D6"_pos, "=XLOOKUP(5,A1:A100,B1:B100,-1)");
+        ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetText(), std::string("=MATCH(500,A1:A100,0)"));
+        ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(50.0));
+        ASSERT_EQUAL(sheet.GetCell("D2"_pos)->GetValue(), CellInterface::Value(50.0));
+        ASSERT_EQUAL(sheet.GetCell("D3"_pos)->GetValue(), CellInterface::Value(25.0));
+        ASSERT_EQUAL(sheet.GetCell("D4"_pos)->GetValue(), CellInterface::Value(7.0));
+        ASSERT_EQUAL(sheet.GetCell("D5"_pos)->GetValue(), CellInterface::Value(FormulaError(FormulaError::Category::NA)));
+        ASSERT_EQUAL(sheet.GetCell("D6"_pos)->GetValue(), CellInterface::Value(-1.0));
+        ASSERT(sheet.GetLookupIndexMemoryUsage() > 0);
+
+        // Edits inside an indexed range reach both the index and the formulas reading the range
+        sheet.SetCell("A50"_pos, "7");
+        ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(FormulaError(FormulaError::Category::NA)));
+        sheet.SetCell("A60"_pos, "500");
+        ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(60.0));
+
+        // Without memory for indexes the cells are scanned, with the same results
+        sheet.SetLookupIndexMemoryLimit(0);
+        ASSERT_EQUAL(sheet.GetLookupIndexMemoryUsage(), size_t(0));
+        sheet.SetCell("A70"_pos, "500");
+        ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(60.0));
+        ASSERT_EQUAL(sheet.GetCell("D4"_pos)->GetValue(), CellInterface::Value(7.0));
+        ASSERT_EQUAL(sheet.GetLookupIndexMemoryUsage(), size_t(0));
+        sheet.SetLookupIndexMemoryLimit(LookupIndexes::DEFAULT_MEMORY_LIMIT);
+
+        // Of overlapping ranges, an edit reaches only the ones containing the cell
+        for (int row = 0; row < 100; ++row) {
+            sheet.SetCell({row, 5}, std::to_string(row));
+        }
+        sheet.SetCell("G1"_pos, "=MATCH(60,F50:F70,0)");
+        sheet.SetCell("G2"_pos, "=MATCH(60,F1:F100,0)");
+        sheet.SetCell("G3"_pos, "=MATCH(60,F1:F40,0)");
+        ASSERT_EQUAL(sheet.GetCell("G1"_pos)->GetValue(), CellInterface::Value(12.0));
+        ASSERT_EQUAL(sheet.GetCell("G2"_pos)->GetValue(), CellInterface::Value(61.0));
+        ASSERT_EQUAL(sheet.GetCell("G3"_pos)->GetValue(), CellInterface::Value(FormulaError(FormulaError::Category::NA)));
+        sheet.SetCell("F61"_pos, "0");
+        ASSERT(!sheet.GetCachedValue("G1"_pos) && !sheet.GetCachedValue("G2"_pos));
+        ASSERT(sheet.GetCachedValue("G3"_pos).has_value());
+        ASSERT_EQUAL(sheet.GetCell("G1"_pos)->GetValue(), CellInterface::Value(FormulaError(FormulaError::Category::NA)));
+        sheet.SetCell("F61"_pos, "60");
+
+        // Ranges follow inserted and deleted rows
+        sheet.InsertRows(0);
+        ASSERT_EQUAL(sheet.GetCell("D2"_pos)->GetText(), std::string("=MATCH(500,A2:A101,0)"));
+        ASSERT_EQUAL(sheet.GetCell("D2"_pos)->GetValue(), CellInterface::Value(60.0));
+        sheet.DeleteRows(10);
+        ASSERT_EQUAL(sheet.GetCell("D2"_pos)->GetText(), std::string("=MATCH(500,A2:A100,0)"));
+        ASSERT_EQUAL(sheet.GetCell("D2"_pos)->GetValue(), CellInterface::Value(59.0));
+        ASSERT(sheet.Undo());
+        ASSERT_EQUAL(sheet.GetCell("D2"_pos)->GetText(), std::string("=MATCH(500,A2:A101,0)"));
+        ASSERT_EQUAL(sheet.GetCell("D2"_pos)->GetValue(), CellInterface::Value(60.0));
+        ASSERT_EQUAL(sheet.GetCell("G2"_pos)->GetText(), std::string("=MATCH(60,F51:F71,0)"));
+        sheet.SetCell("F62"_pos, "0");
+        ASSERT_EQUAL(sheet.GetCell("G2"_pos)->GetValue(), CellInterface::Value(FormulaError(FormulaError::Category::NA)));
+        sheet.SetCell("F62"_pos, "60");
+        ASSERT_EQUAL(sheet.GetCell("G2"_pos)->GetValue(), CellInterface::Value(12.0));
+
+        // A cell of a range cannot depend on the formula reading the range
+        bool caught = false;
+        try {
+            sheet.SetCell("A5"_pos, "=D2+1");
+        } catch (const CircularDependencyException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+        ASSERT_EQUAL(sheet.GetCell("A5"_pos)->GetText(), std::string("40"));
+    }
+
+    void TestSearchIndex() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "Paid");
+        sheet.SetCell("A2"_pos, "unpaid");
+        sheet.SetCell("A3"_pos, "PAID");
+        sheet.SetCell("B1"_pos, "120");
+        sheet.SetCell("B2"_pos, "80");
+        sheet.SetCell("B3"_pos, "=B1+B2");
+        sheet.Recalculate();
+        const std::vector<Position> paid{"A1"_pos, "A3"_pos};
+        ASSERT_EQUAL(sheet.FindText("paid"), paid);
+        ASSERT_EQUAL(sheet.FindTextContaining("PAID"), (std::vector<Position>{"A1"_pos, "A2"_pos, "A3"_pos}));
+        ASSERT_EQUAL(sheet.FindTextContaining("id"), (std::vector<Position>{"A1"_pos, "A2"_pos, "A3"_pos}));
+        ASSERT_EQUAL(sheet.FindTextPrefix("un"), std::vector<Position>{"A2"_pos});
+        ASSERT_EQUAL(sheet.FindTextContaining("b1+"), std::vector<Position>{"B3"_pos});
+        ASSERT_EQUAL(sheet.FindNumbers(100, 250), (std::vector<Position>{"B1"_pos, "B3"_pos}));
+
+        // Edits keep the index current; formula values follow the published ones
+        sheet.SetCell("A3"_pos, "overdue");
+        sheet.ClearCell("A1"_pos);
+        ASSERT(sheet.FindText("paid").empty());
+        ASSERT_EQUAL(sheet.FindTextPrefix("over"), std::vector<Position>{"A3"_pos});
+        sheet.SetCell("B2"_pos, "1000");
+        ASSERT_EQUAL(sheet.FindNumbers(100, 250), (std::vector<Position>{"B1"_pos, "B3"_pos}));
+        sheet.Recalculate();
+        ASSERT_EQUAL(sheet.FindNumbers(100, 250), std::vector<Position>{"B1"_pos});
+        ASSERT_EQUAL(sheet.FindNumbers(1000, 2000), (std::vector<Position>{"B2"_pos, "B3"_pos}));
+
+        sheet.InsertRows(0);
+        ASSERT_EQUAL(sheet.FindTextPrefix("over"), std::vector<Position>{"A4"_pos});
+        ASSERT_EQUAL(sheet.FindTextContaining("b2+"), std::vector<Position>{"B4"_pos});
+        ASSERT(sheet.Undo());
+        ASSERT_EQUAL(sheet.FindTextPrefix("over"), std::vector<Position>{"A3"_pos});
+        ASSERT(sheet.Undo());
+        ASSERT_EQUAL(sheet.FindNumbers(80, 80), std::vector<Position>{"B2"_pos});
+
+        // A fork indexes its own cells
+        auto fork = sheet.Fork();
+        fork->SetCell("C1"_pos, "overdue");
+        ASSERT_EQUAL(fork->FindText("OVERDUE"), (std::vector<Position>{"C1"_pos, "A3"_pos}));
+        ASSERT_EQUAL(sheet.FindText("OVERDUE"), std::vector<Position>{"A3"_pos});
+    }
+
+    void TestWorkloadTrace() {
+        const std::string path = "spreadsheet_trace_test.bin";
+        Sheet original;
+        {
+            RecordingSheet sheet(original, path);
+            sheet.SetCell("A1"_pos, "2");
+            sheet.SetCell("A2"_pos, "=A1*21");
+            ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(42.0));
+            ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetText(), std::string("=A1*21"));
+            sheet.GetCell("A1"_pos)->Set("3");
+            try {
+                sheet.SetCell("A1"_pos, "=A2");
+            } catch (const CircularDependencyException&) {
+            }
+            sheet.ClearCell("A1"_pos);
+            sheet.SetCell("B1"_pos, "text");
+            std::ostringstream out;
+            sheet.PrintValues(out);
+            sheet.PrintTexts(out);
+        }
+
+        Sheet replayed;
+        ReplayReport report = ReplayTrace(path, replayed);
+        std::remove(path.c_str());
+        std::ostringstream expected;
+        std::ostringstream actual;
+        original.PrintTexts(expected);
+        replayed.PrintTexts(actual);
+        ASSERT_EQUAL(actual.str(), expected.str());
+        ASSERT_EQUAL(report.exceptions, uint64_t(1));
+        ASSERT_EQUAL(report.latencies[TraceOp::SetCell].GetCount(), uint64_t(5));
+        ASSERT_EQUAL(report.latencies[TraceOp::GetCell].GetCount(), uint64_t(3));
+        ASSERT_EQUAL(report.latencies[TraceOp::GetValue].GetCount(), uint64_t(1));
+        ASSERT_EQUAL(report.latencies[TraceOp::ClearCell].GetCount(), uint64_t(1));
+        ASSERT_EQUAL(report.latencies[TraceOp::PrintTexts].GetCount(), uint64_t(1));
+        const LatencyHistogram& sets = report.latencies[TraceOp::SetCell];
+        uint64_t bucketed = 0;
+        for (size_t bucket = 0; bucket < LatencyHistogram::BUCKETS; ++bucket) {
+            bucketed += sets.GetBucket(bucket);
+        }
+        ASSERT_EQUAL(bucketed, uint64_t(5));
+        ASSERT(sets.GetPercentile(0.5) <= sets.GetMax());
+    }
+
+    void TestProfiler() {
+        Sheet sheet;
+        sheet.EnableProfiling(true);
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("A2"_pos, "=A1+1");
+        sheet.SetCell("A3"_pos, "=A2*2");
+        sheet.SetCell("B1"_pos, "=A3+A1");
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(5.0));
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(5.0));
+        sheet.SetCell("A1"_pos, "2");
+
+        ProfileReport report = sheet.GetProfile(2);
+#ifdef SPREADSHEET_PROFILING
+        ASSERT_EQUAL(report.evaluations, uint64_t(3));
+        ASSERT_EQUAL(report.cache_hits, uint64_t(1));
+        ASSERT_EQUAL(report.top_cells.size(), size_t(2));
+        ASSERT(report.top_cells[0].self_time >= report.top_cells[1].self_time);
+        ASSERT_EQUAL(report.top_chains.front().cells, (std::vector<Position>{"B1"_pos, "A3"_pos, "A2"_pos}));
+        const auto& cells = sheet.GetProfiler().GetCells();
+        ASSERT_EQUAL(cells.at("A1"_pos).invalidated_caches, uint64_t(3));
+        ASSERT(cells.at("A2"_pos).parse_time.count() > 0);
+        ASSERT_EQUAL(cells.at("B1"_pos).cycle_checks, uint64_t(1));
+
+        sheet.ResetProfile();
+        sheet.EnableProfiling(false);
+        sheet.GetCell("B1"_pos)->GetValue();
+        ASSERT_EQUAL(sheet.GetProfile(2).evaluations, uint64_t(0));
+#else
+        ASSERT(report.top_cells.empty() && report.top_chains.empty());
+#endif
+    }
+
+    void TestTraceEvents() {
+        auto count = [](const std::string& text, const std::string& what) {
+            size_t found = 0;
+            for (size_t at = text.find(what); at != std::string::npos; at = text.find(what, at + 1)) {
+                ++found;
+            }
+            return found;
+        };
+        EventTracer::Clear();
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "=1+2");
+        std::ostringstream trace;
+        EventTracer::WriteChromeTrace(trace);
+        ASSERT_EQUAL(count(trace.str(), "\"ph\": \"X\""), size_t(0));
+
+        EventTracer::SetEnabled(true);
+        sheet.SetCell("B2"_pos, "=A1*2");
+        std::ostringstream values;
+        sheet.PrintValues(values);
+        std::thread([] {
+            Sheet other;
+            other.SetCell("C3"_pos, "text");
+        }).join();
+        EventTracer::SetEnabled(false);
+        sheet.SetCell("B3"_pos, "=A1*3");
+
+        trace.str({});
+        EventTracer::WriteChromeTrace(trace);
+        const std::string events = trace.str();
+        ASSERT(events.find("\"traceEvents\"") != std::string::npos);
+        ASSERT_EQUAL(count(events, "{\"ph\": \"X\", \"name\": \"Sheet::SetCell\""), size_t(2));
+        ASSERT_EQUAL(count(events, "\"name\": \"parse\", \"pid\": 1, \"tid\": "), size_t(1));
+        ASSERT_EQUAL(count(events, "\"args\": {\"cell\": \"B2\"}"), size_t(6));
+        ASSERT_EQUAL(count(events, "\"name\": \"evaluate\""), size_t(2));
+        ASSERT_EQUAL(count(events, "\"name\": \"Sheet::PrintValues\""), size_t(1));
+        ASSERT_EQUAL(count(events, "\"args\": {\"cell\": \"C3\"}"), size_t(3));
+        ASSERT_EQUAL(count(events, "\"args\": {\"cell\": \"B3\"}"), size_t(0));
+
+        EventTracer::Clear();
+        trace.str({});
+        EventTracer::WriteChromeTrace(trace);
+        ASSERT_EQUAL(count(trace.str(), "\"ph\": \"X\""), size_t(0));
+    }
+    void TestMemoryStats() {
+        // The counters kept on every edit against a walk over the cells
+        auto check = [](const Sheet& sheet) {
+            size_t cells = 0, empty = 0, formulas = 0, edges = 0, caches = 0;
+            std::unordered_set<std::string_view> texts;
+            for (int row = 0; row < 12; ++row) {
+                for (int col = 0; col < 12; ++col) {
+                    const Cell* cell = sheet.GetCommonCell({row, col});
+                    if (!cell) {
+                        continue;
+                    }
+                    ++cells;
+                    if (cell->GetTextView().empty()) {
+                        ++empty;
+                    } else {
+                        texts.insert(cell->GetTextView());
+                    }
+                    formulas += cell->GetFormula() ? 1 : 0;
+                    edges += cell->GetReferencedCellsView().size() + cell->GetCellReferringView().size();
+                    caches += sheet.GetCachedValue({row, col}) ? 1 : 0;
+                }
+            }
+            const SheetMemoryStats stats = sheet.MemoryStats();
+            ASSERT_EQUAL(stats.cells.count, cells);
+            ASSERT_EQUAL(stats.cells.bytes, cells * sizeof(Cell));
+            ASSERT_EQUAL(stats.empty_cells.count, empty);
+            ASSERT_EQUAL(stats.texts.count, texts.size());
+            ASSERT_EQUAL(stats.formulas.count, formulas);
+            ASSERT_EQUAL(stats.dependency_edges.count, edges);
+            ASSERT_EQUAL(stats.value_caches.count, caches);
+            ASSERT(stats.dependency_edges.bytes >= edges * sizeof(Position));
+            return stats;
+        };
+
+        Sheet sheet;
+        SheetMemoryStats stats = check(sheet);
+        ASSERT_EQUAL(stats.GetTotalBytes(), size_t(0));
+
+        sheet.SetCell("A1"_pos, "a text too long for the small string buffer");
+        sheet.SetCell("C2"_pos, "=A1+B1+B1");
+        stats = check(sheet);
+        // B1 is a placeholder for the reference, A2 and B2 fill the row up to C2
+        ASSERT_EQUAL(stats.empty_cells.count, size_t(3));
+        ASSERT(stats.texts.bytes > 40);
+        ASSERT_EQUAL(stats.formula_references.count, size_t(3));
+        ASSERT(stats.formulas.bytes > 0);
+        ASSERT_EQUAL(stats.rows.count, size_t(2));
+        ASSERT_EQUAL(stats.published_values.count, size_t(0));
+
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("D3"_pos, "=C2*2");
+        sheet.GetCell("D3"_pos)->GetValue();
+        ASSERT_EQUAL(check(sheet).value_caches.count, size_t(2));
+        sheet.Recalculate();
+        ASSERT(sheet.MemoryStats().published_values.count > 0);
+
+        sheet.SetCell("B1"_pos, "2");
+        check(sheet);
+        sheet.InsertRows(1, 2);
+        sheet.InsertCols(0);
+        check(sheet);
+        sheet.DeleteRows(0);
+        sheet.DeleteCols(1, 2);
+        check(sheet);
+        sheet.Undo();
+        sheet.Undo();
+        check(sheet);
+
+        auto fork = sheet.Fork();
+        fork->SetCell("A1"_pos, "=E5+1");
+        fork->ClearCell("F6"_pos);
+        check(*fork);
+        check(sheet);
+
+        // Proxies for the cells of shared rows are counted and dropped as soon as the rows are
+        // copied, so reading a fork does not leave one behind per cell for good
+        Sheet shared;
+        for (int col = 0; col < 4; ++col) {
+            shared.SetCell({0, col}, "first");
+            shared.SetCell({1, col}, "second");
+        }
+        auto reader = shared.Fork();
+        for (int col = 0; col < 4; ++col) {
+            ASSERT_EQUAL(reader->GetCell({0, col})->GetText(), std::string("first"));
+            ASSERT_EQUAL(reader->GetCell({1, col})->GetText(), std::string("second"));
+        }
+        ASSERT_EQUAL(reader->MemoryStats().cell_proxies.count, size_t(8));
+        reader->SetCell("A1"_pos, "changed");
+        ASSERT_EQUAL(reader->MemoryStats().cell_proxies.count, size_t(4));
+        ASSERT(reader->MemoryStats().cell_proxies.bytes > 0);
+        ASSERT_EQUAL(reader->GetCell("B1"_pos), static_cast<const CellInterface*>(reader->GetCommonCell("B1"_pos)));
+        reader->InsertRows(0);
+        ASSERT_EQUAL(reader->MemoryStats().cell_proxies.count, size_t(0));
+        ASSERT_EQUAL(reader->GetCell("B3"_pos)->GetText(), std::string("second"));
+
+        // A cleared cell stays while the formulas after it still refer to it
+        for (int pass = 0; pass < 2; ++pass) {
+            for (int row = 0; row < 12; ++row) {
+                for (int col = 0; col < 12; ++col) {
+                    sheet.ClearCell({row, col});
+                }
+            }
+        }
+        stats = check(sheet);
+        ASSERT_EQUAL(stats.cells.count, size_t(0));
+        ASSERT_EQUAL(stats.formula_references.count, size_t(0));
+    }
+    void TestManyDependents() {
+        // Past a few dozen dependents their list is indexed; unlinking must keep both in step
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        for (int row = 1; row <= 100; ++row) {
+            sheet.SetCell({row, 0}, "=A1+" + std::to_string(row));
+        }
+        for (int row = 1; row <= 100; row += 3) {
+            sheet.ClearCell({row, 0});
+        }
+        sheet.InsertRows(50, 2);
+        for (int row = 2; row <= 30; row += 3) {
+            sheet.SetCell({row, 0}, "=B1");
+        }
+
+        std::vector<Position> expected;
+        for (int row = 1; row <= 102; ++row) {
+            const Cell* cell = sheet.GetCommonCell({row, 0});
+            if (cell && cell->GetFormula() && cell->GetText() != "=B1") {
+                expected.push_back({row, 0});
+            }
+        }
+        std::vector<Position> referring = sheet.GetCommonCell("A1"_pos)->GetCellReferring();
+        std::sort(referring.begin(), referring.end());
+        ASSERT(referring == expected);
+
+        sheet.SetCell("A1"_pos, "10");
+        ASSERT_EQUAL(sheet.GetCell({101, 0})->GetValue(), CellInterface::Value(109.0));
+        for (Position pos : expected) {
+            sheet.ClearCell(pos);
+        }
+        ASSERT(sheet.GetCommonCell("A1"_pos)->GetCellReferring().empty());
+    }
+    void TestValueCache() {
+        // A chain A1 <- A2 <- ... <- A10 in a cache of four values: the end of the chain, which
+        // is the most expensive to recompute, outlives the cheap values it was computed from
+        Sheet sheet;
+        sheet.SetValueCacheMemoryLimit(4 * ValueCache::ENTRY_COST);
+        sheet.SetCell("A1"_pos, "1");
+        for (int row = 1; row < 10; ++row) {
+            sheet.SetCell({row, 0}, "=A" + std::to_string(row) + "+1");
+        }
+        ASSERT_EQUAL(sheet.GetCell("A10"_pos)->GetValue(), CellInterface::Value(10.0));
+        ValueCacheStats stats = sheet.GetValueCacheStats();
+        ASSERT_EQUAL(stats.entries, 4u);
+        ASSERT_EQUAL(stats.misses, 9u);
+        ASSERT_EQUAL(stats.evictions, 5u);
+        ASSERT(sheet.GetCachedValue("A10"_pos).has_value());
+        ASSERT(!sheet.GetCachedValue("A2"_pos).has_value());
+        ASSERT_EQUAL(sheet.MemoryStats().value_caches.bytes, stats.memory_usage);
+
+        ASSERT_EQUAL(sheet.GetCell("A10"_pos)->GetValue(), CellInterface::Value(10.0));
+        ASSERT_EQUAL(sheet.GetValueCacheStats().hits, 1u);
+
+        // Invalidation still reaches past evicted values
+        sheet.SetCell("A1"_pos, "5");
+        ASSERT(!sheet.GetCachedValue("A10"_pos).has_value());
+        ASSERT_EQUAL(sheet.GetCell("A10"_pos)->GetValue(), CellInterface::Value(14.0));
+        ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(6.0));
+
+        // Once published, evicted values are recalled from the snapshot instead of recomputed
+        sheet.Recalculate();
+        sheet.SetValueCacheMemoryLimit(0);
+        ASSERT_EQUAL(sheet.GetValueCacheStats().entries, 0u);
+        const uint64_t misses = sheet.GetValueCacheStats().misses;
+        for (int row = 1; row < 10; ++row) {
+            ASSERT_EQUAL(sheet.GetCell({row, 0})->GetValue(), CellInterface::Value(5.0 + row));
+        }
+        stats = sheet.GetValueCacheStats();
+        ASSERT_EQUAL(stats.misses, misses);
+        ASSERT_EQUAL(stats.recalls, 9u);
+        ASSERT_EQUAL(stats.GetHitRate(), static_cast<double>(stats.hits + 9) / static_cast<double>(stats.hits + 9 + misses));
+
+        // Rows inserted above move the cached values with their cells
+        sheet.SetValueCacheMemoryLimit(std::numeric_limits<size_t>::max());
+        sheet.GetCell("A10"_pos)->GetValue();
+        sheet.InsertRows(0, 2);
+        ASSERT(sheet.GetCachedValue("A12"_pos) == FormulaInterface::Value(14.0));
+        sheet.SetCell("A3"_pos, "0");
+        ASSERT_EQUAL(sheet.GetCell("A12"_pos)->GetValue(), CellInterface::Value(9.0));
+    }
+
+    void TestTextDictionary() {
+        // A column repeating a few labels stores each of them once
+        Sheet sheet;
+        const std::vector<std::string> labels = {"Shipped", "'Pending", "Cancelled on request", "42"};
+        for (int row = 0; row < 200; ++row) {
+            sheet.SetCell({row, 0}, labels[row % labels.size()]);
+        }
+        ASSERT_EQUAL(sheet.MemoryStats().texts.count, labels.size());
+        ASSERT_EQUAL(sheet.GetCommonCell("A1"_pos)->GetTextId(), sheet.GetCommonCell("A5"_pos)->GetTextId());
+        ASSERT(sheet.GetCommonCell("A1"_pos)->GetTextId() != sheet.GetCommonCell("A2"_pos)->GetTextId());
+        ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetText(), std::string("'Pending"));
+        ASSERT_EQUAL(sheet.GetCell("A6"_pos)->GetValue(), CellInterface::Value(std::string("Pending")));
+
+        // Lookups compare the keys kept by the dictionary, in short ranges and in indexed ones
+        sheet.SetCell("B1"_pos, "=MATCH(\"pending\",A1:A8,0)");
+        sheet.SetCell("B2"_pos, "=MATCH(\"CANCELLED ON REQUEST\",A1:A200,0)");
+        sheet.SetCell("B3"_pos, "=MATCH(42,A1:A8,0)");
+        sheet.SetCell("B4"_pos, "=MATCH(\"Delivered\",A1:A8,0)");
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(2.0));
+        ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(), CellInterface::Value(3.0));
+        ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetValue(), CellInterface::Value(4.0));
+        ASSERT_EQUAL(sheet.GetCell("B4"_pos)->GetValue(), CellInterface::Value(FormulaError(FormulaError::Category::NA)));
+        // The index of A1:A200 keeps a node per distinct key and no copy of the texts per row
+        ASSERT(sheet.GetLookupIndexMemoryUsage() < 200 * sizeof(std::string));
+
+        // Published values of text cells are the values the dictionary keeps, one per text
+        sheet.Recalculate();
+        {
+            auto values = sheet.ReadValues();
+            ASSERT_EQUAL(values->Find("A3"_pos), values->Find("A199"_pos));
+            ASSERT_EQUAL(*values->Find("A3"_pos), CellInterface::Value(std::string("Cancelled on request")));
+            ASSERT_EQUAL(*values->Find("B2"_pos), CellInterface::Value(3.0));
+        }
+
+        // A fork shares the dictionary until it changes a text
+        auto fork = sheet.Fork();
+        fork->SetCell("A1"_pos, "Delivered");
+        ASSERT_EQUAL(fork->GetCell("B4"_pos)->GetValue(), CellInterface::Value(1.0));
+        ASSERT_EQUAL(fork->GetCell("A5"_pos)->GetText(), std::string("Shipped"));
+        // Formula texts are in the dictionary too
+        ASSERT_EQUAL(fork->MemoryStats().texts.count, labels.size() + 5);
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), std::string("Shipped"));
+        ASSERT_EQUAL(sheet.MemoryStats().texts.count, labels.size() + 4);
+
+        // Texts nothing refers to any more leave the dictionary
+        sheet.DeleteRows(4, 196);
+        sheet.ClearCell("B1"_pos);
+        sheet.ClearCell("B2"_pos);
+        sheet.ClearCell("B3"_pos);
+        sheet.ClearCell("B4"_pos);
+        for (int row = 0; row < 4; ++row) {
+            sheet.SetCell({row, 0}, "Shipped");
+        }
+        ASSERT_EQUAL(sheet.MemoryStats().texts.count, size_t(1));
+        ASSERT(sheet.Undo());
+        ASSERT_EQUAL(sheet.GetCell("A4"_pos)->GetValue(), CellInterface::Value(std::string("42")));
+        ASSERT_EQUAL(sheet.MemoryStats().texts.count, size_t(2));
+        ASSERT_EQUAL(fork->GetCell("A200"_pos)->GetText(), std::string("42"));
+
+        // A sheet changing a shared dictionary builds its own over it and keeps the ids; a long
+        // chain of such dictionaries is flattened on the way
+        auto chain = sheet.Fork();
+        for (int row = 0; row < 20; ++row) {
+            auto next = chain->Fork();
+            next->SetCell({row, 2}, "step " + std::to_string(row));
+            if (row > 0) {
+                next->SetCell({row - 1, 2}, "Shipped");
+            }
+            chain = std::move(next);
+        }
+        ASSERT_EQUAL(chain->MemoryStats().texts.count, size_t(3));
+        ASSERT_EQUAL(chain->GetCommonCell("C19"_pos)->GetTextId(), chain->GetCommonCell("A1"_pos)->GetTextId());
+        ASSERT_EQUAL(chain->GetCell("C20"_pos)->GetText(), std::string("step 19"));
+        ASSERT_EQUAL(chain->GetCell("A4"_pos)->GetText(), std::string("42"));
+        ASSERT_EQUAL(sheet.MemoryStats().texts.count, size_t(2));
+    }
+
+    void TestSubexpressionSharing() {
+        // Every formula repeats B1+C1: the sum is one node of the graph, evaluated once
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("B1"_pos, "=A1*2");
+        sheet.SetCell("C1"_pos, "3");
+        constexpr int ROWS = 50;
+        for (int row = 0; row < ROWS; ++row) {
+            sheet.SetCell({row, 3}, "=(B1+C1)*" + std::to_string(row + 1));
+        }
+        auto check = [](const Sheet& sheet, double sum) {
+            for (int row = 0; row < ROWS; ++row) {
+                ASSERT_EQUAL(sheet.GetCell({row, 3})->GetValue(), CellInterface::Value(sum * (row + 1)));
+            }
+        };
+        // The sum and each whole formula, the only node shared being the sum
+        ASSERT_EQUAL(sheet.GetSubexpressionStats().nodes, size_t(ROWS + 1));
+        ASSERT_EQUAL(sheet.GetSubexpressionStats().shared_nodes, size_t(1));
+        check(sheet, 5.0);
+        ASSERT_EQUAL(sheet.GetSubexpressionStats().misses, uint64_t(1));
+        ASSERT_EQUAL(sheet.GetSubexpressionStats().hits, uint64_t(ROWS - 1));
+        ASSERT_EQUAL(sheet.MemoryStats().subexpressions.count, size_t(ROWS + 1));
+
+        // A change of a cell the node reads, directly or through B1, resets its value
+        sheet.SetCell("C1"_pos, "4");
+        ASSERT_EQUAL(sheet.GetSubexpressionStats().cached_values, size_t(0));
+        check(sheet, 6.0);
+        sheet.SetCell("A1"_pos, "2");
+        check(sheet, 8.0);
+        ASSERT_EQUAL(sheet.GetSubexpressionStats().misses, uint64_t(3));
+        // Errors are shared as well
+        sheet.SetCell("C1"_pos, "abc");
+        ASSERT_EQUAL(sheet.GetCell("D7"_pos)->GetValue(), CellInterface::Value(FormulaError(FormulaError::Category::Value)));
+        ASSERT_EQUAL(sheet.GetCell("D8"_pos)->GetValue(), CellInterface::Value(FormulaError(FormulaError::Category::Value)));
+        sheet.SetCell("C1"_pos, "1");
+
+        // Nested operations share their operands: both formulas read the node of A1+C1
+        sheet.SetCell("E1"_pos, "=(A1+C1)*B1");
+        sheet.SetCell("E2"_pos, "=(A1+C1)*B1+C1");
+        ASSERT_EQUAL(sheet.GetCell("E2"_pos)->GetValue(), CellInterface::Value(13.0));
+        sheet.SetCell("C1"_pos, "2");
+        ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetValue(), CellInterface::Value(16.0));
+        ASSERT_EQUAL(sheet.GetCell("E2"_pos)->GetValue(), CellInterface::Value(18.0));
+
+        // Shifted references key new nodes
+        sheet.InsertRows(0, 2);
+        ASSERT_EQUAL(sheet.GetCell("D3"_pos)->GetText(), std::string("=(B3+C3)*1"));
+        sheet.SetCell("C3"_pos, "5");
+        ASSERT_EQUAL(sheet.GetCell("D5"_pos)->GetValue(), CellInterface::Value(27.0));
+        ASSERT_EQUAL(sheet.GetCell("E4"_pos)->GetValue(), CellInterface::Value(33.0));
+
+        // A fork shares the graph, not the values
+        auto fork = sheet.Fork();
+        fork->SetCell("C3"_pos, "0");
+        ASSERT_EQUAL(fork->GetCell("D5"_pos)->GetValue(), CellInterface::Value(12.0));
+        ASSERT_EQUAL(sheet.GetCell("D5"_pos)->GetValue(), CellInterface::Value(27.0));
+
+        // Without sharing the values are the same
+        sheet.SetSubexpressionSharing(false);
+        const uint64_t hits = sheet.GetSubexpressionStats().hits;
+        sheet.SetCell("C3"_pos, "6");
+        ASSERT_EQUAL(sheet.GetCell("D5"_pos)->GetValue(), CellInterface::Value(30.0));
+        ASSERT_EQUAL(sheet.GetSubexpressionStats().hits, hits);
+        sheet.SetSubexpressionSharing(true);
+
+        // Nodes no formula uses leave the graph
+        for (int row = 0; row < ROWS + 2; ++row) {
+            sheet.ClearCell({row, 3});
+            sheet.ClearCell({row, 4});
+        }
+        ASSERT_EQUAL(sheet.GetSubexpressionStats().nodes, size_t(0));
+        ASSERT_EQUAL(fork->GetSubexpressionStats().nodes, size_t(ROWS + 4));
+        ASSERT_EQUAL(fork->GetCell("D5"_pos)->GetValue(), CellInterface::Value(12.0));
+    }
+
+    void TestFormulaPromotion() {
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "2");
+        sheet->SetCell("A2"_pos, "5");
+        sheet->SetCell("A3"_pos, "7");
+        sheet->SetCell("B1"_pos, "abc");
+
+        // The same values and errors before and after the promotion
+        const std::vector<std::string> expressions = {
+            "A1*2+(3*4)-A2/A1", "-(1+2)*A1+A1*A1", "MATCH(A1*A1-A1+3,A1:A3,0)*A2", "A1/(A2-5)",
+            "1e308*10+A1", "A1+B1", "+A3", "(A1+A2)*(A1+A2)-A3",
+        };
+        for (const std::string& expression : expressions) {
+            auto formula = ParseFormula(expression);
+            const FormulaInterface::Value expected = formula->Evaluate(*sheet);
+            for (uint32_t i = 1; i < FormulaInterface::PROMOTION_THRESHOLD; ++i) {
+                ASSERT(!formula->IsOptimized());
+                formula->Evaluate(*sheet);
+            }
+            ASSERT(formula->IsOptimized());
+            ASSERT(formula->Evaluate(*sheet) == expected);
+        }
+
+        // A promoted formula reads the current values of its cells
+        auto formula = ParseFormula("(A1+A2)*(A1+A2)-A3");
+        for (uint32_t i = 0; i < FormulaInterface::PROMOTION_THRESHOLD; ++i) {
+            formula->Evaluate(*sheet);
+        }
+        ASSERT(formula->IsOptimized());
+        sheet->SetCell("A2"_pos, "1");
+        ASSERT(formula->Evaluate(*sheet) == FormulaInterface::Value(2.0));
+        sheet->SetCell("A3"_pos, "=A2/0");
+        ASSERT(formula->Evaluate(*sheet) == FormulaInterface::Value(FormulaError(FormulaError::Category::Div0)));
+
+        // Both forms read text cells as numbers the same way
+        sheet->SetCell("C1"_pos, "'3");
+        sheet->SetCell("C2"_pos, " 4");
+        sheet->SetCell("C3"_pos, "'");
+        auto text_sum = ParseFormula("C1+C2+C3+C4");
+        auto text_error = ParseFormula("C1+B1");
+        for (uint32_t i = 0; i <= FormulaInterface::PROMOTION_THRESHOLD; ++i) {
+            ASSERT(text_sum->Evaluate(*sheet) == FormulaInterface::Value(7.0));
+            ASSERT(text_error->Evaluate(*sheet) == FormulaInterface::Value(FormulaError(FormulaError::Category::Value)));
+        }
+        ASSERT(text_sum->IsOptimized() && text_error->IsOptimized());
+
+        // Cells recalculated often are promoted and still share their subexpressions
+        Sheet recalc;
+        recalc.SetCell("A1"_pos, "1");
+        recalc.SetCell("B1"_pos, "2");
+        recalc.SetCell("C1"_pos, "=(A1+B1)*2");
+        recalc.SetCell("C2"_pos, "=(A1+B1)*3");
+        recalc.SetCell("C3"_pos, "=(A1+B1)*2");
+        for (int i = 0; i < static_cast<int>(FormulaInterface::PROMOTION_THRESHOLD) + 2; ++i) {
+            recalc.SetCell("A1"_pos, std::to_string(i));
+            recalc.Recalculate();
+            ASSERT_EQUAL(recalc.GetCell("C2"_pos)->GetValue(), CellInterface::Value((i + 2) * 3.0));
+        }
+        ASSERT(recalc.GetCommonCell("C2"_pos)->GetFormula()->IsOptimized());
+        // Of two equal formulas, the one that takes the value of the other is not hot
+        ASSERT(recalc.GetCommonCell("C1"_pos)->GetFormula()->IsOptimized()
+               != recalc.GetCommonCell("C3"_pos)->GetFormula()->IsOptimized());
+        const uint64_t hits = recalc.GetSubexpressionStats().hits;
+        recalc.SetCell("B1"_pos, "10");
+        ASSERT_EQUAL(recalc.GetCell("C1"_pos)->GetValue(), CellInterface::Value(2.0 * (17 + 10)));
+        ASSERT_EQUAL(recalc.GetCell("C2"_pos)->GetValue(), CellInterface::Value(3.0 * (17 + 10)));
+        ASSERT_EQUAL(recalc.GetSubexpressionStats().hits, hits + 1);
+
+        // Shifting references drops the program along with the old positions
+        recalc.InsertRows(0);
+        ASSERT(!recalc.GetCommonCell("C2"_pos)->GetFormula()->IsOptimized());
+        recalc.SetCell("A2"_pos, "0");
+        ASSERT_EQUAL(recalc.GetCell("C2"_pos)->GetValue(), CellInterface::Value(20.0));
+    }
+
 }  // namespace
 
-//int main() {
-//    TestRunner tr;
-//    RUN_TEST(tr, TestPositionAndStringConversion);
-//    RUN_TEST(tr, TestPositionToStringInvalid);
-//    RUN_TEST(tr, TestStringToPositionInvalid);
-//    RUN_TEST(tr, TestEmpty);
-//    RUN_TEST(tr, TestInvalidPosition);
-//    RUN_TEST(tr, TestSetCellPlainText);
-//    RUN_TEST(tr, TestClearCell);
-//    RUN_TEST(tr, TestFormulaArithmetic);
-//    RUN_TEST(tr, TestFormulaReferences);
-//    RUN_TEST(tr, TestFormulaExpressionFormatting);
-//    RUN_TEST(tr, TestFormulaReferencedCells);
-//    RUN_TEST(tr, TestErrorValue);
-//    RUN_TEST(tr, TestErrorDiv0);
-//    RUN_TEST(tr, TestEmptyCellTreatedAsZero);
-//    RUN_TEST(tr, TestFormulaInvalidPosition);
-//    RUN_TEST(tr, TestPrint);
-//    RUN_TEST(tr, TestCellReferences);
-//    RUN_TEST(tr, TestFormulaIncorrect);
-//    RUN_TEST(tr, TestCellCircularReferences);
-//    return 0;
-//}
+int main() {
+    TestRunner tr;
+    RUN_TEST(tr, TestPositionAndStringConversion);
+    RUN_TEST(tr, TestPositionToStringInvalid);
+    RUN_TEST(tr, TestStringToPositionInvalid);
+    RUN_TEST(tr, TestEmpty);
+    RUN_TEST(tr, TestInvalidPosition);
+    RUN_TEST(tr, TestSetCellPlainText);
+    RUN_TEST(tr, TestClearCell);
+    RUN_TEST(tr, TestFormulaArithmetic);
+    RUN_TEST(tr, TestFormulaReferences);
+    RUN_TEST(tr, TestFormulaExpressionFormatting);
+    RUN_TEST(tr, TestFormulaReferencedCells);
+    RUN_TEST(tr, TestErrorValue);
+    RUN_TEST(tr, TestErrorDiv0);
+    RUN_TEST(tr, TestEmptyCellTreatedAsZero);
+    RUN_TEST(tr, TestFormulaInvalidPosition);
+    RUN_TEST(tr, TestPrint);
+    RUN_TEST(tr, TestCellReferences);
+    RUN_TEST(tr, TestFormulaIncorrect);
+    RUN_TEST(tr, TestCellCircularReferences);
+    RUN_TEST(tr, TestSetCellsBulk);
+    RUN_TEST(tr, TestImportTexts);
+    RUN_TEST(tr, TestImportCsv);
+    RUN_TEST(tr, TestExportWriterMatchesStream);
+    RUN_TEST(tr, TestReadRange);
+    RUN_TEST(tr, TestSnapshotRoundTrip);
+    RUN_TEST(tr, TestEditLogRecovery);
+    RUN_TEST(tr, TestValueSnapshotReaders);
+    RUN_TEST(tr, TestSheetFork);
+    RUN_TEST(tr, TestAsyncSheet);
+    RUN_TEST(tr, TestRecalculateBudget);
+    RUN_TEST(tr, TestIncrementalInvalidation);
+    RUN_TEST(tr, TestChangeFeed);
+    RUN_TEST(tr, TestUndoRedo);
+    RUN_TEST(tr, TestInsertDeleteRowsCols);
+    RUN_TEST(tr, TestLookupFunctions);
+    RUN_TEST(tr, TestSearchIndex);
+    RUN_TEST(tr, TestWorkloadTrace);
+    RUN_TEST(tr, TestProfiler);
+    RUN_TEST(tr, TestTraceEvents);
+    RUN_TEST(tr, TestMemoryStats);
+    RUN_TEST(tr, TestManyDependents);
+    RUN_TEST(tr, TestValueCache);
+    RUN_TEST(tr, TestTextDictionary);
+    RUN_TEST(tr, TestSubexpressionSharing);
+    RUN_TEST(tr, TestFormulaPromotion);
+    return 0;
+}
+#else
 
 void PrintSheet(const std::unique_ptr<SheetInterface>& sheet) {
     std::cout << sheet->GetPrintableSize() << std::endl;
@@ -395,3 +1835,4 @@ int main() {
 
     PrintSheet(sheet);
 }
+#endif
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+// Память таблицы по видам объектов (см. Sheet::MemoryStats). Байты - оценка по размерам объектов
+// и ёмкостям контейнеров, без накладных расходов распределителя памяти. Строки и ячейки, которые
+// таблица разделяет с форками, учитываются в каждой из таблиц.
+struct SheetMemoryStats {
+    struct Usage {
+        size_t count = 0;
+        size_t bytes = 0;
+
+        // sign = 1 добавляет объекты, sign = -1 убирает их
+        void Add(int sign, size_t objects, size_t object_bytes) {
+            count += static_cast<size_t>(sign) * objects;
+            bytes += static_cast<size_t>(sign) * object_bytes;
+        }
+    };
+
+    // Объекты Cell
+    Usage cells;
+    // Из них пустые ячейки-заглушки: ячейки, на которые только ссылаются, и ячейки, заполняющие
+    // строку до заданной (входят в cells)
+    Usage empty_cells;
+    // Словарь текстов ячеек: различные непустые тексты, каждый с ключом поиска и узлом индекса
+    Usage texts;
+    // Деревья разобранных формул вместе со списками их диапазонов
+    Usage formulas;
+    // Позиции в списках ячеек формул (FormulaAST::cells_)
+    Usage formula_references;
+    // Связи между ячейками: элементы referenced_cells_ и referring_cells_
+    Usage dependency_edges;
+    // Кэш значений формул (см. Sheet::SetValueCacheMemoryLimit)
+    Usage value_caches;
+    // Граф общих подвыражений формул и значения его узлов (см. Sheet::SetSubexpressionSharing)
+    Usage subexpressions;
+    // Значения последнего опубликованного снимка
+    Usage published_values;
+    // Индексы столбцов для MATCH, VLOOKUP и XLOOKUP
+    Usage lookup_indexes;
+    // Строки хранилища ячеек: индекс строк и векторы ячеек в строках
+    Usage rows;
+    // Представители ячеек строк, разделяемых с форком (см. Sheet::GetCell)
+    Usage cell_proxies;
+
+    // Сумма байтов без повторного учёта того, что входит в cells
+    size_t GetTotalBytes() const {
+        return cells.bytes + texts.bytes + formulas.bytes + formula_references.bytes + dependency_edges.bytes
+               + value_caches.bytes + subexpressions.bytes + published_values.bytes + lookup_indexes.bytes
+               + rows.bytes + cell_proxies.bytes;
+    }
+
+    // Байты строки вне объекта std::string; короткие строки хранятся внутри него
+    static size_t GetHeapBytes(const std::string& text) {
+        return text.capacity() > std::string().capacity() ? text.capacity() + 1 : 0;
+    }
+};
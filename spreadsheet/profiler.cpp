@@ -0,0 +1,91 @@
+#include "profiler.h"
+
+Profiler::Scope::Scope(Profiler& profiler, Kind kind, Position pos)
+        : profiler_(profiler.enabled_ ? &profiler : nullptr)
+        , kind_(kind)
+        , pos_(pos) {
+    if (!profiler_) {
+        return;
+    }
+    if (kind_ == Kind::Evaluation) {
+        profiler_->frames_.emplace_back();
+    }
+    start_ = std::chrono::steady_clock::now();
+}
+
+Profiler::Scope::~Scope() {
+    if (profiler_) {
+        profiler_->Finish(kind_, pos_, std::chrono::steady_clock::now() - start_, count);
+    }
+}
+
+void Profiler::SetEnabled(bool enabled) {
+    enabled_ = enabled;
+}
+
+bool Profiler::IsEnabled() const {
+    return enabled_;
+}
+
+void Profiler::Reset() {
+    cells_.clear();
+}
+
+Profiler::Scope Profiler::Measure(Kind kind, Position pos) {
+    return Scope(*this, kind, pos);
+}
+
+void Profiler::CountCacheHit(Position pos) {
+    if (enabled_) {
+        ++At(pos).cache_hits;
+    }
+}
+
+void Profiler::CountInvalidation(Position pos, size_t invalidated_caches) {
+    if (enabled_) {
+        CellProfile& profile = At(pos);
+        ++profile.invalidations;
+        profile.invalidated_caches += invalidated_caches;
+    }
+}
+
+void Profiler::CountInvalidatedCaches(Position pos, size_t invalidated_caches) {
+    if (enabled_) {
+        At(pos).invalidated_caches += invalidated_caches;
+    }
+}
+
+const std::unordered_map<Position, CellProfile, PositionHasher>& Profiler::GetCells() const {
+    return cells_;
+}
+
+CellProfile& Profiler::At(Position pos) {
+    CellProfile& profile = cells_[pos];
+    profile.pos = pos;
+    return profile;
+}
+
+void Profiler::Finish(Kind kind, Position pos, std::chrono::nanoseconds elapsed, size_t count) {
+    CellProfile& profile = At(pos);
+    switch (kind) {
+        case Kind::Evaluation: {
+            const std::chrono::nanoseconds children = frames_.back().children;
+            frames_.pop_back();
+            if (!frames_.empty()) {
+                frames_.back().children += elapsed;
+            }
+            ++profile.evaluations;
+            profile.eval_time += elapsed;
+            profile.self_time += elapsed - children;
+            break;
+        }
+        case Kind::Parse:
+            profile.parse_time += elapsed;
+            break;
+        case Kind::CycleCheck:
+            ++profile.cycle_checks;
+            profile.cycle_check_visits += count;
+            profile.cycle_check_time += elapsed;
+            break;
+    }
+}
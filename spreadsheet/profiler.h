@@ -0,0 +1,104 @@
+#pragma once
+
+#include "common.h"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+// Точки замера профилировщика. Без SPREADSHEET_PROFILING (опция CMake) они раскрываются в пустоту,
+// и профилировщик ничего не стоит; с ним замеры включаются во время работы (Sheet::EnableProfiling).
+#ifdef SPREADSHEET_PROFILING
+#define SPREADSHEET_PROFILE(...) __VA_ARGS__
+#else
+#define SPREADSHEET_PROFILE(...)
+#endif
+
+// Затраты одной ячейки
+struct CellProfile {
+    Position pos;
+    // Вычисления формулы (промахи кэша значения) и обращения к готовому кэшу
+    uint64_t evaluations = 0;
+    uint64_t cache_hits = 0;
+    // Время вычислений с учётом формул, которые пришлось вычислить по пути, и без них
+    std::chrono::nanoseconds eval_time{0};
+    std::chrono::nanoseconds self_time{0};
+    std::chrono::nanoseconds parse_time{0};
+    // Правки ячейки: сколько кэшей зависимых формул они сбросили
+    uint64_t invalidations = 0;
+    uint64_t invalidated_caches = 0;
+    // Проверки циклов при записи формулы: время и число обойдённых ячеек
+    uint64_t cycle_checks = 0;
+    uint64_t cycle_check_visits = 0;
+    std::chrono::nanoseconds cycle_check_time{0};
+};
+
+// Цепочка зависимостей: ячейка, самая дорогая из формул, которые она читает, и так далее
+struct ProfileChain {
+    std::vector<Position> cells;
+    std::chrono::nanoseconds eval_time{0};
+};
+
+struct ProfileReport {
+    // Самые дорогие ячейки по собственному времени вычисления и самые дорогие цепочки
+    std::vector<CellProfile> top_cells;
+    std::vector<ProfileChain> top_chains;
+    uint64_t evaluations = 0;
+    uint64_t cache_hits = 0;
+};
+
+// Счётчики профилировщика по ячейкам одной таблицы; используется из потока-писателя
+class Profiler {
+public:
+    enum class Kind {
+        Evaluation,
+        Parse,
+        CycleCheck,
+    };
+
+    // Замер от создания до разрушения объекта
+    class Scope {
+    public:
+        Scope(Profiler& profiler, Kind kind, Position pos);
+        ~Scope();
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+        // Для проверки циклов - число обойдённых ячеек
+        size_t count = 0;
+
+    private:
+        Profiler* profiler_;
+        Kind kind_;
+        Position pos_;
+        std::chrono::steady_clock::time_point start_;
+    };
+
+    void SetEnabled(bool enabled);
+    bool IsEnabled() const;
+    void Reset();
+
+    Scope Measure(Kind kind, Position pos);
+    void CountCacheHit(Position pos);
+    void CountInvalidation(Position pos, size_t invalidated_caches);
+    // Кэши, сброшенные правкой pos позже, при обходе дальних зависимых формул
+    void CountInvalidatedCaches(Position pos, size_t invalidated_caches);
+
+    const std::unordered_map<Position, CellProfile, PositionHasher>& GetCells() const;
+
+private:
+    struct Frame {
+        std::chrono::nanoseconds children{0};
+    };
+
+    CellProfile& At(Position pos);
+    void Finish(Kind kind, Position pos, std::chrono::nanoseconds elapsed, size_t count);
+
+    bool enabled_ = false;
+    std::unordered_map<Position, CellProfile, PositionHasher> cells_;
+    // Evaluations in progress, innermost last: nested ones are subtracted from the self time
+    std::vector<Frame> frames_;
+};
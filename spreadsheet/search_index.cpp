@@ -0,0 +1,149 @@
+#include "search_index.h"
+
+#include <algorithm>
+#include <cctype>
+#include <limits>
+
+void SearchIndex::Set(Position pos, std::string_view text, std::optional<double> number) {
+    Remove(pos);
+    if (text.empty() && !number) {
+        return;
+    }
+    Entry entry{texts_.end(), number};
+    if (!text.empty()) {
+        AddText(pos, Normalize(text), entry);
+    }
+    if (number) {
+        numbers_.emplace(*number, pos);
+    }
+    entries_.emplace(pos, entry);
+}
+
+void SearchIndex::Remove(Position pos) {
+    auto it = entries_.find(pos);
+    if (it == entries_.end()) {
+        return;
+    }
+    Erase(pos, it->second);
+    entries_.erase(it);
+}
+
+std::vector<Position> SearchIndex::FindExact(std::string_view text) const {
+    auto it = texts_.find(Normalize(text));
+    if (it == texts_.end()) {
+        return {};
+    }
+    return {it->second.begin(), it->second.end()};
+}
+
+std::vector<Position> SearchIndex::FindPrefix(std::string_view prefix) const {
+    const std::string key = Normalize(prefix);
+    std::vector<Position> found;
+    for (auto it = texts_.lower_bound(key); it != texts_.end() && it->first.compare(0, key.size(), key) == 0; ++it) {
+        found.insert(found.end(), it->second.begin(), it->second.end());
+    }
+    std::sort(found.begin(), found.end());
+    return found;
+}
+
+std::vector<Position> SearchIndex::FindSubstring(std::string_view needle) const {
+    const std::string key = Normalize(needle);
+    std::vector<Position> found;
+    auto collect = [&found, &key](const std::string& text, const std::set<Position>& cells) {
+        if (text.find(key) != std::string::npos) {
+            found.insert(found.end(), cells.begin(), cells.end());
+        }
+    };
+
+    const auto needle_trigrams = Trigrams(key);
+    if (needle_trigrams.empty()) {
+        // Too short for trigrams: the dictionary is still far smaller than the sheet
+        for (const auto& [text, cells] : texts_) {
+            collect(text, cells);
+        }
+    } else {
+        // Candidates are the texts with the rarest trigram of the needle, checked one by one
+        const std::unordered_set<const std::string*>* rarest = nullptr;
+        for (uint32_t trigram : needle_trigrams) {
+            auto it = trigrams_.find(trigram);
+            if (it == trigrams_.end()) {
+                return {};
+            }
+            if (!rarest || it->second.size() < rarest->size()) {
+                rarest = &it->second;
+            }
+        }
+        for (const std::string* text : *rarest) {
+            collect(*text, texts_.find(*text)->second);
+        }
+    }
+    std::sort(found.begin(), found.end());
+    return found;
+}
+
+std::vector<Position> SearchIndex::FindNumbers(double low, double high) const {
+    std::vector<Position> found;
+    const Position first{std::numeric_limits<int>::min(), std::numeric_limits<int>::min()};
+    for (auto it = numbers_.lower_bound({low, first}); it != numbers_.end() && it->first <= high; ++it) {
+        found.push_back(it->second);
+    }
+    std::sort(found.begin(), found.end());
+    return found;
+}
+
+size_t SearchIndex::GetSize() const {
+    return entries_.size();
+}
+
+std::string SearchIndex::Normalize(std::string_view text) {
+    std::string key(text);
+    std::transform(key.begin(), key.end(), key.begin(), [](unsigned char c) {
+        return static_cast<char>(std::tolower(c));
+    });
+    return key;
+}
+
+std::vector<uint32_t> SearchIndex::Trigrams(std::string_view text) {
+    std::vector<uint32_t> trigrams;
+    for (size_t i = 0; i + 3 <= text.size(); ++i) {
+        trigrams.push_back(static_cast<uint32_t>(static_cast<unsigned char>(text[i])) << 16
+                           | static_cast<uint32_t>(static_cast<unsigned char>(text[i + 1])) << 8
+                           | static_cast<unsigned char>(text[i + 2]));
+    }
+    std::sort(trigrams.begin(), trigrams.end());
+    trigrams.erase(std::unique(trigrams.begin(), trigrams.end()), trigrams.end());
+    return trigrams;
+}
+
+void SearchIndex::AddText(Position pos, std::string key, Entry& entry) {
+    auto [it, inserted] = texts_.try_emplace(std::move(key));
+    if (inserted) {
+        for (uint32_t trigram : Trigrams(it->first)) {
+            trigrams_[trigram].insert(&it->first);
+        }
+    }
+    it->second.insert(pos);
+    entry.text = it;
+}
+
+void SearchIndex::Erase(Position pos, const Entry& entry) {
+    if (entry.number) {
+        numbers_.erase({*entry.number, pos});
+    }
+    if (entry.text == texts_.end()) {
+        return;
+    }
+    entry.text->second.erase(pos);
+    if (!entry.text->second.empty()) {
+        return;
+    }
+    // The last cell with this text is gone, and so is the text
+    for (uint32_t trigram : Trigrams(entry.text->first)) {
+        auto it = trigrams_.find(trigram);
+        it->second.erase(&entry.text->first);
+        if (it->second.empty()) {
+            trigrams_.erase(it);
+        }
+    }
+    texts_.erase(entry.text);
+}
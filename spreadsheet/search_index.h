@@ -0,0 +1,55 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <set>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+// Поисковый индекс по содержимому ячеек: текст ячейки (как его возвращает GetText) и её числовое
+// значение. Различные тексты хранятся один раз, в упорядоченном словаре без учёта регистра; по
+// словарю ищутся точные совпадения и префиксы, а подстроки - через триграммы текстов.
+// Числа хранятся в упорядоченном множестве для запросов по диапазону значений.
+// Результаты всех запросов упорядочены по позиции.
+class SearchIndex {
+public:
+    // Заменяет запись ячейки pos; пустой текст без числа удаляет её
+    void Set(Position pos, std::string_view text, std::optional<double> number);
+    void Remove(Position pos);
+
+    // Ячейки, чей текст совпадает с text, начинается с prefix или содержит needle
+    std::vector<Position> FindExact(std::string_view text) const;
+    std::vector<Position> FindPrefix(std::string_view prefix) const;
+    std::vector<Position> FindSubstring(std::string_view needle) const;
+    // Ячейки, чьё число лежит в [low, high]
+    std::vector<Position> FindNumbers(double low, double high) const;
+
+    size_t GetSize() const;
+
+private:
+    using Texts = std::map<std::string, std::set<Position>, std::less<>>;
+
+    struct Entry {
+        Texts::iterator text;
+        std::optional<double> number;
+    };
+
+    static std::string Normalize(std::string_view text);
+    static std::vector<uint32_t> Trigrams(std::string_view text);
+
+    void AddText(Position pos, std::string key, Entry& entry);
+    void Erase(Position pos, const Entry& entry);
+
+    Texts texts_;
+    // Distinct texts containing each trigram
+    std::unordered_map<uint32_t, std::unordered_set<const std::string*>> trigrams_;
+    std::set<std::pair<double, Position>> numbers_;
+    std::unordered_map<Position, Entry, PositionHasher> entries_;
+};
@@ -2,114 +2,629 @@
 
 #include "cell.h"
 #include "common.h"
+#include "trace_events.h"
 
 #include <algorithm>
+#include <cmath>
+#include <atomic>
+#include <exception>
 #include <functional>
 #include <iostream>
+#include <iterator>
+#include <limits>
 #include <optional>
+#include <stdexcept>
 #include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <variant>
 
 using namespace std::literals;
 
-Sheet::~Sheet() {
-    for (auto& row : data_sheet.rows) {
-        row->cells.clear();
+namespace {
+    // Below this many formulas per thread spawning workers costs more than it saves
+    constexpr size_t MIN_FORMULAS_PER_THREAD = 256;
+    // Workers grab indices in chunks to keep contention on the shared counter low
+    constexpr size_t PARSE_CHUNK_SIZE = 64;
+
+    struct ParsedFormula {
+        std::unique_ptr<FormulaInterface> formula = nullptr;
+        std::exception_ptr error = nullptr;
+    };
+
+    // Parses every formula among cells. ParseFormula builds its own lexer, parser and listener on
+    // each call, so workers share nothing but the read-only grammar tables of the ANTLR runtime.
+    std::vector<ParsedFormula> ParseFormulas(const std::vector<std::pair<Position, std::string>>& cells) {
+        std::vector<size_t> formula_ids;
+        for (size_t i = 0; i < cells.size(); ++i) {
+            if (Cell::IsFormulaText(cells[i].second)) {
+                formula_ids.push_back(i);
+            }
+        }
+
+        std::vector<ParsedFormula> parsed(cells.size());
+        std::atomic<size_t> next{0};
+        auto worker = [&]() {
+            for (size_t begin = next.fetch_add(PARSE_CHUNK_SIZE); begin < formula_ids.size();
+                 begin = next.fetch_add(PARSE_CHUNK_SIZE)) {
+                size_t end = std::min(begin + PARSE_CHUNK_SIZE, formula_ids.size());
+                for (size_t k = begin; k < end; ++k) {
+                    const std::string& text = cells[formula_ids[k]].second;
+                    ParsedFormula& result = parsed[formula_ids[k]];
+                    try {
+                        result.formula = ParseFormula({text.begin() + 1, text.end()});
+                    } catch (...) {
+                        result.error = std::current_exception();
+                    }
+                }
+            }
+        };
+
+        size_t thread_count = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()),
+                                               formula_ids.size() / MIN_FORMULAS_PER_THREAD);
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < thread_count; ++i) {
+            threads.emplace_back(worker);
+        }
+        worker();
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        return parsed;
+    }
+
+    uint64_t NextSheetId() {
+        static std::atomic<uint64_t> next_id{1};
+        return next_id.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Whether the caller holds the only reference to an object shared with other sheets. The
+    // acquire fence pairs with the release in the reference count decrement of the other sheet,
+    // so its last reads of the object happen before our writes.
+    template <typename T>
+    bool IsExclusive(const std::shared_ptr<T>& ptr) {
+        if (ptr.use_count() != 1) {
+            return false;
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return true;
+    }
+
+    // The container for the caller to change, copied first if other sheets share it. The copy
+    // is built from the elements, without the buckets left over from past recalculations.
+    template <typename T>
+    T& CopyOnWrite(std::shared_ptr<T>& ptr) {
+        if (!IsExclusive(ptr)) {
+            ptr = std::make_shared<T>(ptr->begin(), ptr->end());
+        }
+        return *ptr;
+    }
+
+    // Closes the undo batch even when the edit throws: the cells changed before the error stay
+    // changed and have to be undoable
+    class UndoBatchScope {
+    public:
+        explicit UndoBatchScope(UndoJournal& journal)
+                : journal_(journal) {
+            journal_.BeginBatch();
+        }
+        ~UndoBatchScope() {
+            journal_.EndBatch();
+        }
+
+    private:
+        UndoJournal& journal_;
+    };
+
+    // Turns journaling off while Undo/Redo restore cells, and back on even when restoring throws
+    class ReplayScope {
+    public:
+        explicit ReplayScope(bool& replaying)
+                : replaying_(replaying) {
+            replaying_ = true;
+        }
+        ~ReplayScope() {
+            replaying_ = false;
+        }
+
+    private:
+        bool& replaying_;
+    };
+}  // namespace
+
+class Sheet::SharedCell final : public CellInterface {
+public:
+    SharedCell(Sheet& sheet, Position pos)
+            : sheet_(sheet)
+            , pos_(pos) {
+    }
+
+    void Set(std::string text) override {
+        sheet_.SetCell(pos_, std::move(text));
+    }
+
+    Value GetValue() const override {
+        const Cell* cell = sheet_.PeekCell(pos_);
+        return cell ? Cell::MakeValue(sheet_.GetValueView(*cell)) : Value(std::string());
+    }
+
+    std::string GetText() const override {
+        const Cell* cell = sheet_.PeekCell(pos_);
+        return cell ? std::string(sheet_.GetCellText(*cell)) : std::string();
+    }
+
+    std::vector<Position> GetReferencedCells() const override {
+        const Cell* cell = sheet_.PeekCell(pos_);
+        return cell ? cell->GetReferencedCells() : std::vector<Position>{};
+    }
+
+private:
+    Sheet& sheet_;
+    Position pos_;
+};
+
+Sheet::Sheet()
+        : id_(NextSheetId())
+        , data_sheet(std::make_shared<SheetData>())
+        , values_(std::make_unique<ValueSnapshot>())
+        , range_dependents_(std::make_shared<RangeDependents>())
+        , texts_(std::make_shared<TextDictionary>())
+        , subexpressions_(std::make_shared<SubexpressionGraph>()) {
+}
+
+Sheet::~Sheet() = default;
+
+std::unique_ptr<Sheet> Sheet::Fork() const {
+    auto fork = std::make_unique<Sheet>();
+    fork->data_sheet = data_sheet;
+    fork->range_dependents_ = range_dependents_;
+    fork->texts_ = texts_;
+    fork->subexpressions_ = subexpressions_;
+    fork->subexpression_sharing_ = subexpression_sharing_;
+    fork->dirty_cells_ = dirty_cells_;
+    fork->dirty_viewport_cells_ = dirty_viewport_cells_;
+    fork->viewport_ = viewport_;
+    fork->invalid_values_ = invalid_values_;
+    fork->staged_values_ = staged_values_;
+    fork->pending_invalidations_ = pending_invalidations_;
+    fork->version_ = version_;
+    // Same cells and values as far as the fork can see; they are copied as its rows are
+    fork->memory_ = memory_;
+    // The fork starts its own change history; subscriptions stay with this sheet
+    fork->history_base_version_ = version_;
+    fork->values_.Publish(std::make_unique<ValueSnapshot>(*values_.Current()));
+    fork->value_cache_.SetMemoryLimit(value_cache_.GetStats().memory_limit);
+    return fork;
+}
+
+Sheet::SheetData& Sheet::OwnData() {
+    if (!IsExclusive(data_sheet)) {
+        AccountRowIndex(-1);
+        data_sheet = std::make_shared<SheetData>(*data_sheet);
+        AccountRowIndex(1);
+    }
+    return *data_sheet;
+}
+
+bool Sheet::OwnsRow(int row_index) const {
+    return data_sheet->rows[row_index]->owner == id_ && IsExclusive(data_sheet)
+           && IsExclusive(data_sheet->rows[row_index]);
+}
+
+Sheet::Row& Sheet::OwnRow(int row_index) {
+    if (OwnsRow(row_index)) {
+        return *data_sheet->rows[row_index];
+    }
+
+    std::shared_ptr<Row>& row = OwnData().rows[row_index];
+    if (row->owner == id_ && IsExclusive(row)) {
+        return *row;
+    }
+    // Cells of an owned row are handed out as they are
+    if (!shared_cells_.empty()) {
+        for (int col = 0; col < static_cast<int>(row->cells.size()); ++col) {
+            shared_cells_.erase({row_index, col});
+        }
+    }
+    auto copy = std::make_shared<Row>();
+    copy->owner = id_;
+    copy->cells.reserve(row->cells.size());
+    AccountRow(*row, -1);
+    for (const auto& cell : row->cells) {
+        if (cell) {
+            // The copies have containers of their own, with capacities of their own
+            cell->AccountMemory(memory_, -1);
+            copy->cells.push_back(std::make_unique<Cell>(*this, *cell));
+            copy->cells.back()->AccountMemory(memory_, 1);
+        } else {
+            copy->cells.push_back(nullptr);
+        }
     }
-    data_sheet.rows.clear();
+    AccountRow(*copy, 1);
+    row = std::move(copy);
+    return *row;
 }
 
 void Sheet::SetCell(Position pos, std::string text) {
+    TraceScope trace("Sheet::SetCell", pos);
+    UndoBatchScope batch(undo_);
+    auto before = CaptureState(pos);
+    Cell* cell = EnsureCell(pos);
+    auto formula = cell->Parse(text);
+    cell->Set(std::move(text), std::move(formula));
+    RecordUndo(std::move(before));
+}
+
+void Sheet::SetCell(Position pos, std::string text, std::unique_ptr<FormulaInterface> formula) {
+    TraceScope trace("Sheet::SetCell", pos);
+    UndoBatchScope batch(undo_);
+    auto before = CaptureState(pos);
+    EnsureCell(pos)->Set(std::move(text), std::move(formula));
+    RecordUndo(std::move(before));
+}
+
+void Sheet::SetCells(std::vector<std::pair<Position, std::string>> cells) {
+    TraceScope trace("Sheet::SetCells");
+    std::vector<ParsedFormula> parsed = ParseFormulas(cells);
+    UndoBatchScope batch(undo_);
+
+    // Linking touches the dependency graph, so it stays on the calling thread
+    for (size_t i = 0; i < cells.size(); ++i) {
+        auto& [pos, text] = cells[i];
+        if (!pos.IsValid()) {
+            throw InvalidPositionException("Invalid position");
+        }
+        if (parsed[i].error) {
+            std::rethrow_exception(parsed[i].error);
+        }
+        auto before = CaptureState(pos);
+        EnsureCell(pos)->Set(std::move(text), std::move(parsed[i].formula));
+        RecordUndo(std::move(before));
+    }
+}
+
+Cell* Sheet::EnsureCell(Position pos) {
     if (!pos.IsValid()) {
         throw InvalidPositionException("Invalid position");
     }
 
     // Expand the rows to reach the required position.
-    while (pos.row >= static_cast<int>(data_sheet.rows.size())) {
-        data_sheet.rows.push_back(std::make_unique<Row>());
+    if (pos.row >= static_cast<int>(data_sheet->rows.size())) {
+        auto& rows = OwnData().rows;
+        AccountRowIndex(-1);
+        while (pos.row >= static_cast<int>(rows.size())) {
+            rows.push_back(std::make_shared<Row>());
+            rows.back()->owner = id_;
+            AccountRow(*rows.back(), 1);
+        }
+        AccountRowIndex(1);
     }
 
-    auto& row = data_sheet.rows[pos.row];
+    Row& row = OwnRow(pos.row);
 
     // Expand the cells within the row to reach the required position.
     // Also, initialize new empty cells as needed.
-    while (pos.col >= static_cast<int>(row->cells.size())) {
-        Position cellPos(pos.row, row->cells.size());  // Create position for the new cell.
-        row->cells.push_back(std::make_unique<Cell>(*this, cellPos));
+    if (pos.col >= static_cast<int>(row.cells.size())) {
+        AccountRow(row, -1);
+        while (pos.col >= static_cast<int>(row.cells.size())) {
+            Position cellPos(pos.row, row.cells.size());  // Create position for the new cell.
+            row.cells.push_back(std::make_unique<Cell>(*this, cellPos));
+            row.cells.back()->AccountMemory(memory_, 1);
+        }
+        AccountRow(row, 1);
     }
 
-    // Now that we have ensured that the cell exists, we can safely set its text.
-    row->cells[pos.col]->Set(text);
+    // A cell cleared by ClearCell leaves a null slot behind.
+    if (!row.cells[pos.col]) {
+        row.cells[pos.col] = std::make_unique<Cell>(*this, pos);
+        row.cells[pos.col]->AccountMemory(memory_, 1);
+    }
+    return row.cells[pos.col].get();
 }
 
 const CellInterface* Sheet::GetCell(Position pos) const {
     if (!pos.IsValid()) {
         throw InvalidPositionException("Invalid position");
     }
-    if (int(data_sheet.rows.size()) <= pos.row) {
-        return nullptr;
-    }
-    if (int(data_sheet.rows.at(pos.row)->cells.size()) <= pos.col) {
-        return nullptr;
+    const Cell* cell = PeekCell(pos);
+    if (cell == nullptr || OwnsRow(pos.row)) {
+        return cell;
     }
-    if (data_sheet.rows[pos.row]->cells[pos.col] != nullptr) {
-        return data_sheet.rows[pos.row]->cells[pos.col].get();
+    // A cell of a shared row would be read through the sheet it points at, and a pointer to it
+    // would dangle once either sheet copies the row
+    auto& shared = shared_cells_[pos];
+    if (!shared) {
+        shared = std::make_unique<SharedCell>(const_cast<Sheet&>(*this), pos);
     }
-    return nullptr;
+    return shared.get();
 }
 
 CellInterface* Sheet::GetCell(Position pos) {
+    return const_cast<CellInterface*>(std::as_const(*this).GetCell(pos));
+}
+
+void Sheet::ClearCell(Position pos) {
     if (!pos.IsValid()) {
-        throw InvalidPositionException("Invalid position");
+        throw InvalidPositionException("Invalid pos");
     }
-    if (int(data_sheet.rows.size()) <= pos.row) {
-        return nullptr;
+    if (pos.row >= static_cast<int>(data_sheet->rows.size())
+        || pos.col >= static_cast<int>(data_sheet->rows[pos.row]->cells.size())
+        || !data_sheet->rows[pos.row]->cells[pos.col]) {
+        // Если ячейки не существует или она уже пуста, то ничего не делаем
+        return;
     }
-    if (int(data_sheet.rows.at(pos.row)->cells.size()) <= pos.col) {
-        return nullptr;
+
+    UndoBatchScope batch(undo_);
+    auto before = CaptureState(pos);
+    std::unique_ptr<Cell>& cell = OwnRow(pos.row).cells[pos.col];
+    MarkDirty(pos);
+
+    // Очищаем содержимое: ячейка отвязывается от ячеек, на которые ссылалась
+    cell->Clear();
+    // Если на ячейку нет ссылок из других ячеек, можем ее безопасно уничтожить
+    if (cell->GetCellReferringView().empty()) {
+        cell->AccountMemory(memory_, -1);
+        cell.reset();
     }
-    if (data_sheet.rows[pos.row]->cells[pos.col] != nullptr) {
-        return data_sheet.rows[pos.row]->cells[pos.col].get();
+    RecordUndo(std::move(before));
+}
+
+void Sheet::InsertRows(int before, int count) {
+    if (before < 0 || before >= Position::MAX_ROWS || count <= 0) {
+        throw InvalidPositionException("Invalid rows to insert");
     }
-    return nullptr;
+    ChangeStructure({ReferenceShift::Axis::Rows, before, count});
 }
 
-void Sheet::ClearCell(Position pos) {
-    if (!pos.IsValid()) {
-        throw InvalidPositionException("Invalid pos");
+void Sheet::DeleteRows(int first, int count) {
+    if (first < 0 || count <= 0 || count > Position::MAX_ROWS - first) {
+        throw InvalidPositionException("Invalid rows to delete");
     }
-    if (pos.row >= static_cast<int>(data_sheet.rows.size())
-        || pos.col >= static_cast<int>(data_sheet.rows[pos.row]->cells.size())) {
-        // Если ячейки не существует, то ничего не делаем
-        return;
+    ChangeStructure({ReferenceShift::Axis::Rows, first, -count});
+}
+
+void Sheet::InsertCols(int before, int count) {
+    if (before < 0 || before >= Position::MAX_COLS || count <= 0) {
+        throw InvalidPositionException("Invalid columns to insert");
     }
+    ChangeStructure({ReferenceShift::Axis::Cols, before, count});
+}
 
-    std::unique_ptr<Cell>& cell = data_sheet.rows[pos.row]->cells[pos.col];
-    if (!cell) {
-        // Если ячейка уже пуста, то ничего не делаем
+void Sheet::DeleteCols(int first, int count) {
+    if (first < 0 || count <= 0 || count > Position::MAX_COLS - first) {
+        throw InvalidPositionException("Invalid columns to delete");
+    }
+    ChangeStructure({ReferenceShift::Axis::Cols, first, -count});
+}
+
+void Sheet::ChangeStructure(const ReferenceShift& shift) {
+    UndoBatchScope batch(undo_);
+    auto erased = ShiftCells(shift);
+    if (replaying_) {
         return;
     }
+    // Undo runs the inverse shift first and then restores these, in the coordinates before the shift
+    for (auto& state : erased) {
+        undo_.Record(std::move(state));
+    }
+    undo_.Record(shift);
+}
 
-    // Проверяем, есть ли ссылки на эту ячейку из других ячеек
-    const auto& referring_cells = cell->GetCellReferring();
-    if (!referring_cells.empty()) {
-        // Если на ячейку имеются внешние ссылки, очищаем содержимое ячейки, но не удаляем объект Cell
-        cell->Clear();
+std::vector<UndoJournal::CellState> Sheet::ShiftCells(const ReferenceShift& shift) {
+    // Pending invalidation is keyed by position, like the rest of the pending work
+    SettleInvalidation();
+    const bool by_rows = shift.axis == ReferenceShift::Axis::Rows;
+    const auto& rows = data_sheet->rows;
+
+    // Cells at or past the first shifted row (column), collected without touching the storage,
+    // so that a shift that does not fit leaves the sheet as it was
+    std::vector<Position> moved;
+    auto collect = [&](int row, int first_col) {
+        const auto& cells = rows[row]->cells;
+        for (int col = first_col; col < static_cast<int>(cells.size()); ++col) {
+            if (const auto& cell = cells[col]) {
+                if (!shift.Apply({row, col}).IsValid() && shift.count > 0 && !cell->IsEmpty()) {
+                    throw InvalidPositionException("Shifted cells do not fit into the sheet");
+                }
+                moved.push_back({row, col});
+            }
+        }
+    };
+    if (by_rows) {
+        for (int row = shift.first; row < static_cast<int>(rows.size()); ++row) {
+            collect(row, 0);
+        }
     } else {
-        // Если на ячейку нет ссылок, можем ее безопасно уничтожить
-        cell.reset();
+        for (int row = 0; row < static_cast<int>(rows.size()); ++row) {
+            collect(row, shift.first);
+        }
+    }
+    // Indexes are keyed by position; they are rebuilt by the next lookups
+    lookup_indexes_.Clear();
+
+    // Every cell linked to a moved one has positions to rewrite, even if it stays in place, and
+    // so do the formulas whose ranges reach the shifted part
+    std::vector<Position> touched = moved;
+    range_dependents_->CollectShifted(shift, touched);
+    if (touched.empty()) {
+        return {};
+    }
+    for (Position pos : moved) {
+        const Cell* cell = PeekCell(pos);
+        const auto& referenced = cell->GetReferencedCellsView();
+        const auto& referring = cell->GetCellReferringView();
+        touched.insert(touched.end(), referenced.begin(), referenced.end());
+        touched.insert(touched.end(), referring.begin(), referring.end());
+    }
+    std::sort(touched.begin(), touched.end());
+    touched.erase(std::unique(touched.begin(), touched.end()), touched.end());
+
+    // Deleted cells and formulas losing a reference or a part of a range, as they were before
+    // the shift. The ranges are unregistered here and registered again once shifted.
+    std::vector<UndoJournal::CellState> erased;
+    std::vector<Position> with_ranges;
+    for (Position pos : touched) {
+        const Cell* cell = PeekCell(pos);
+        bool erase = !shift.Apply(pos).IsValid() && !cell->IsEmpty();
+        for (Position ref : cell->GetReferencedCellsView()) {
+            erase = erase || !shift.Apply(ref).IsValid();
+        }
+        const auto* formula = cell->GetFormula();
+        const auto ranges = formula ? formula->GetReferencedRanges() : std::vector<CellRange>{};
+        for (const CellRange& range : ranges) {
+            CellRange shifted = shift.Apply(range);
+            erase = erase || !shifted.IsValid() || shifted.GetRows() < range.GetRows()
+                    || shifted.GetCols() < range.GetCols();
+        }
+        if (erase) {
+            erased.push_back(CaptureState(pos));
+            erased.back().restore_only = true;
+        }
+        if (!ranges.empty()) {
+            RemoveRangeDependent(pos, ranges);
+            with_ranges.push_back(pos);
+        }
+    }
+
+    if (search_index_) {
+        for (Position pos : moved) {
+            search_index_->Remove(pos);
+        }
+    }
+    // The cells dropped by the move below
+    for (Position pos : moved) {
+        if (!shift.Apply(pos).IsValid()) {
+            PeekCell(pos)->AccountMemory(memory_, -1);
+            // The text is released through this sheet's dictionary: the cell may be shared
+            ReleaseText(PeekCell(pos)->GetTextId());
+            if (const auto* formula = PeekCell(pos)->GetFormula()) {
+                RemoveSubexpressions(*formula);
+            }
+        }
+    }
+
+    // Block moves of whole rows, or of the cell slots within each row
+    const int limit = by_rows ? Position::MAX_ROWS : Position::MAX_COLS;
+    auto move_slots = [&shift, limit](auto& slots, auto make_slot) {
+        if (shift.first >= static_cast<int>(slots.size())) {
+            return;
+        }
+        if (shift.count < 0) {
+            auto last = std::min<size_t>(slots.size(), static_cast<size_t>(shift.first) - shift.count);
+            slots.erase(slots.begin() + shift.first, slots.begin() + last);
+        } else {
+            std::vector<typename std::decay_t<decltype(slots)>::value_type> fresh(shift.count);
+            std::generate(fresh.begin(), fresh.end(), make_slot);
+            slots.insert(slots.begin() + shift.first, std::make_move_iterator(fresh.begin()),
+                         std::make_move_iterator(fresh.end()));
+            if (static_cast<int>(slots.size()) > limit) {
+                slots.resize(limit);
+            }
+        }
+    };
+    if (by_rows) {
+        auto& all_rows = OwnData().rows;
+        auto account_moved_rows = [this, &all_rows, &shift](int sign) {
+            AccountRowIndex(sign);
+            for (int row = shift.first; row < static_cast<int>(all_rows.size()); ++row) {
+                AccountRow(*all_rows[row], sign);
+            }
+        };
+        account_moved_rows(-1);
+        move_slots(all_rows, [this] {
+            auto row = std::make_shared<Row>();
+            row->owner = id_;
+            return row;
+        });
+        account_moved_rows(1);
+    } else {
+        for (int row = 0; row < static_cast<int>(data_sheet->rows.size()); ++row) {
+            if (shift.first < static_cast<int>(data_sheet->rows[row]->cells.size())) {
+                Row& owned = OwnRow(row);
+                AccountRow(owned, -1);
+                move_slots(owned.cells, [] {
+                    return std::unique_ptr<Cell>();
+                });
+                AccountRow(owned, 1);
+            }
+        }
+    }
+    value_cache_.Shift(moved, shift);
+    // Proxies are keyed by position, while the cells move
+    shared_cells_.clear();
+    auto invalid = std::make_shared<PositionSet>();
+    for (Position pos : *invalid_values_) {
+        if (Position shifted = shift.Apply(pos); shifted.IsValid()) {
+            invalid->insert(shifted);
+        }
+    }
+    invalid_values_ = std::move(invalid);
+    // Nodes are keyed by positions: those of the moved cells are replaced as their formulas shift
+    subexpression_values_.Clear();
+
+    // Caches are reset only after all the links are consistent again
+    std::vector<Cell*> broken;
+    for (Position pos : touched) {
+        Position shifted = shift.Apply(pos);
+        if (!shifted.IsValid()) {
+            continue;
+        }
+        Cell* cell = OwnRow(shifted.row).cells[shifted.col].get();
+        if (cell->Shift(shift)) {
+            broken.push_back(cell);
+        }
+    }
+    for (Position pos : with_ranges) {
+        if (Position shifted = shift.Apply(pos); shifted.IsValid()) {
+            AddRangeDependent(shifted, PeekCell(shifted)->GetFormula()->GetReferencedRanges());
+        }
+    }
+    for (Cell* cell : broken) {
+        cell->CacheInvalidation();
+    }
+    // Rewritten references change the texts; formula values are taken from the published
+    // values at the new positions, which the next publication corrects
+    if (search_index_) {
+        for (Position pos : touched) {
+            if (Position shifted = shift.Apply(pos); shifted.IsValid()) {
+                UpdateSearchEntry(shifted);
+            }
+        }
     }
-}
 
+    // Published values are keyed by position: both the vacated and the new places of the moved
+    // cells change, and pending work follows the cells
+    std::vector<Position> pending(dirty_cells_->begin(), dirty_cells_->end());
+    for (const auto& [pos, value] : *staged_values_) {
+        pending.push_back(pos);
+    }
+    dirty_cells_ = std::make_shared<PositionSet>();
+    dirty_viewport_cells_ = std::make_shared<PositionSet>();
+    staged_values_ = std::make_shared<StagedValues>();
+    for (Position pos : pending) {
+        if (Position shifted = shift.Apply(pos); shifted.IsValid()) {
+            MarkDirty(shifted);
+        }
+    }
+    for (Position pos : moved) {
+        MarkDirty(pos);
+        if (Position shifted = shift.Apply(pos); shifted.IsValid()) {
+            MarkDirty(shifted);
+        }
+    }
+    return erased;
+}
 
 Size Sheet::GetPrintableSize() const {
     int max_row = 0;
     int max_col = 0;
 
     int i = 1;
-    for (const auto& row : data_sheet.rows) {
+    for (const auto& row : data_sheet->rows) {
         int j = 1;
         for (const auto& cell : row->cells) {
-            if (cell != nullptr && !cell->GetText().empty()) {
+            if (cell != nullptr && !cell->IsEmpty()) {
                 if (j > max_col) {
                     max_col = j;
                 }
@@ -126,83 +641,971 @@ Size Sheet::GetPrintableSize() const {
 }
 
 void Sheet::PrintValues(std::ostream& output) const {
+    ExportWriter writer(output);
+    PrintValues(writer);
+}
+
+void Sheet::PrintTexts(std::ostream& output) const {
+    ExportWriter writer(output);
+    PrintTexts(writer);
+}
+
+void Sheet::PrintValues(ExportWriter& output) const {
+    TraceScope trace("Sheet::PrintValues");
     auto table_size = GetPrintableSize();
 
     for (int i = 0; i < table_size.rows; ++i) {
+        const Row& row = *data_sheet->rows[i];
         for (int j = 0; j < table_size.cols; ++j) {
-            if (const auto& row = data_sheet.rows[i]; j < int(row->cells.size())) {
-                const auto& cell = row->cells[j];
-                if (cell) {
-                    const auto result = cell->GetValue();
-                    if (std::holds_alternative<double>(result)) {
-                        output << std::get<double>(result);
-                    } else if (std::holds_alternative<FormulaError>(result)) {
-                        output << std::get<FormulaError>(result);
-                    } else if (!cell->GetText().empty()){
-                        std::string tmp_text = cell->GetText();
-                        if (*tmp_text.begin() == ESCAPE_SIGN) {
-                            output << std::string(tmp_text.begin() + 1, tmp_text.end());
-                        } else {
-                            output << cell->GetText();
-                        }
-                    }
+            if (j < int(row.cells.size())) {
+                if (const auto& cell = row.cells[j]) {
+                    std::visit([&output](auto value) {
+                        output.Write(value);
+                    }, GetValueView(*cell));
                 }
             }
             if (j + 1 < table_size.cols) {
-                output << '\t';
+                output.Write('\t');
             }
         }
-        output << '\n';
+        output.Write('\n');
     }
 }
 
-void Sheet::PrintTexts(std::ostream& output) const {
-    auto table_size = this->GetPrintableSize();
+void Sheet::PrintTexts(ExportWriter& output) const {
+    TraceScope trace("Sheet::PrintTexts");
+    auto table_size = GetPrintableSize();
 
     for (int i = 0; i < table_size.rows; ++i) {
+        const auto& row = data_sheet->rows[i];
         for (int j = 0; j < table_size.cols; ++j) {
-            if (const auto& row = data_sheet.rows[i]; j < int(row->cells.size())) {
-                const auto& cell = row->cells[j];
-                if (cell) {
-                    output << cell->GetText();
+            if (j < int(row->cells.size())) {
+                if (const auto& cell = row->cells[j]) {
+                    output.Write(GetCellText(*cell));
                 }
             }
             if (j + 1 < table_size.cols) {
-                output << '\t';
+                output.Write('\t');
             }
         }
-        output << '\n';
+        output.Write('\n');
     }
 }
 
-const Cell *Sheet::GetCommonCell(Position pos) const {
+void Sheet::ReadRange(Position top_left, Position bottom_right, RangeValue* buffer, size_t buffer_size) const {
+    if (!top_left.IsValid() || !bottom_right.IsValid()
+        || bottom_right.row < top_left.row || bottom_right.col < top_left.col) {
+        throw InvalidPositionException("Invalid range");
+    }
+    const int width = bottom_right.col - top_left.col + 1;
+    const int height = bottom_right.row - top_left.row + 1;
+    if (buffer_size < static_cast<size_t>(width) * height) {
+        throw std::length_error("Range buffer is too small");
+    }
+    std::fill(buffer, buffer + static_cast<size_t>(width) * height, RangeValue{});
+
+    // Rows and cells past the end of the storage stay Empty
+    const int last_row = std::min(bottom_right.row, static_cast<int>(data_sheet->rows.size()) - 1);
+    for (int i = top_left.row; i <= last_row; ++i) {
+        const auto& cells = data_sheet->rows[i]->cells;
+        const int last_col = std::min(bottom_right.col, static_cast<int>(cells.size()) - 1);
+        RangeValue* out = buffer + static_cast<size_t>(i - top_left.row) * width;
+        for (int j = top_left.col; j <= last_col; ++j) {
+            const auto& cell = cells[j];
+            if (!cell) {
+                continue;
+            }
+            RangeValue& value = out[j - top_left.col];
+            std::visit([&value](auto view) {
+                using T = decltype(view);
+                if constexpr (std::is_same_v<T, double>) {
+                    value.type = RangeValue::Type::Number;
+                    value.number = view;
+                } else if constexpr (std::is_same_v<T, FormulaError>) {
+                    value.type = RangeValue::Type::Error;
+                    value.error = view.GetCategory();
+                } else if (!view.empty()) {
+                    value.type = RangeValue::Type::Text;
+                    value.text = view;
+                }
+            }, GetValueView(*cell));
+        }
+    }
+}
+
+void Sheet::Recalculate() {
+    RecalculateStep(RecalcBudget{});
+}
+
+bool Sheet::RecalculateStep(const RecalcBudget& budget) {
+    TraceScope trace("Sheet::RecalculateStep");
+    const auto deadline = budget.max_time == std::chrono::microseconds::max()
+                              ? std::chrono::steady_clock::time_point::max()
+                              : std::chrono::steady_clock::now() + budget.max_time;
+    // At least one cell per step, so that a tiny budget still makes progress
+    auto exhausted = [&](size_t evaluated) {
+        return evaluated > 0
+               && (evaluated >= budget.max_cells
+                   || (deadline != std::chrono::steady_clock::time_point::max()
+                       && std::chrono::steady_clock::now() >= deadline));
+    };
+
+    size_t evaluated = 0;
+    // No value can be trusted before the edits have invalidated everything depending on them
+    while (!pending_invalidations_->empty() && !exhausted(evaluated)) {
+        evaluated += PropagateInvalidation();
+    }
+    if (!pending_invalidations_->empty()) {
+        return false;
+    }
+    const bool viewport_dirty = !dirty_viewport_cells_->empty();
+    for (; !dirty_viewport_cells_->empty() && !exhausted(evaluated); ++evaluated) {
+        auto& viewport_cells = CopyOnWrite(dirty_viewport_cells_);
+        Position pos = *viewport_cells.begin();
+        viewport_cells.erase(viewport_cells.begin());
+        // Still dirty while evaluated, so that its evicted value is not recalled
+        StageValue(pos);
+        CopyOnWrite(dirty_cells_).erase(pos);
+    }
+    // Readers get the viewport as soon as it is up to date, not after the whole sheet
+    if (viewport_dirty && dirty_viewport_cells_->empty() && !staged_values_->empty()) {
+        PublishStagedValues();
+    }
+    // The viewport is drained before the rest is touched, so the cells below are never in it
+    for (; dirty_viewport_cells_->empty() && !dirty_cells_->empty() && !exhausted(evaluated); ++evaluated) {
+        Position pos = *dirty_cells_->begin();
+        StageValue(pos);
+        CopyOnWrite(dirty_cells_).erase(pos);
+    }
+    if (!dirty_cells_->empty()) {
+        return false;
+    }
+    if (!staged_values_->empty()) {
+        PublishStagedValues();
+    }
+    return true;
+}
+
+void Sheet::StageValue(Position pos) {
+    // Dependencies evaluated on the way stay dirty but are served from their caches later
+    const Cell* cell = PeekCell(pos);
+    if (cell && !cell->GetFormula()) {
+        // The published value of a text cell is the one its text shares in the dictionary
+        if (const auto& value = texts_->GetValue(cell->GetTextId())) {
+            CopyOnWrite(staged_values_)[pos] = value;
+            return;
+        }
+    }
+    CopyOnWrite(staged_values_)[pos] = cell ? Cell::MakeValue(GetValueView(*cell)) : CellInterface::Value(std::string());
+}
+
+void Sheet::SetViewport(Position top_left, Position bottom_right) {
+    if (!top_left.IsValid() || !bottom_right.IsValid()
+        || bottom_right.row < top_left.row || bottom_right.col < top_left.col) {
+        throw InvalidPositionException("Invalid viewport");
+    }
+    viewport_.emplace(top_left, bottom_right);
+    auto viewport_cells = std::make_shared<PositionSet>();
+
+    // Walk whichever of the viewport and the dirty set is smaller
+    const size_t area = static_cast<size_t>(bottom_right.row - top_left.row + 1)
+                        * static_cast<size_t>(bottom_right.col - top_left.col + 1);
+    if (area < dirty_cells_->size()) {
+        for (int row = top_left.row; row <= bottom_right.row; ++row) {
+            for (int col = top_left.col; col <= bottom_right.col; ++col) {
+                if (dirty_cells_->count({row, col})) {
+                    viewport_cells->insert({row, col});
+                }
+            }
+        }
+    } else {
+        for (Position pos : *dirty_cells_) {
+            if (InViewport(pos)) {
+                viewport_cells->insert(pos);
+            }
+        }
+    }
+    dirty_viewport_cells_ = std::move(viewport_cells);
+}
+
+void Sheet::ResetViewport() {
+    viewport_.reset();
+    dirty_viewport_cells_ = std::make_shared<PositionSet>();
+}
+
+bool Sheet::InViewport(Position pos) const {
+    return viewport_ && viewport_->first.row <= pos.row && pos.row <= viewport_->second.row
+           && viewport_->first.col <= pos.col && pos.col <= viewport_->second.col;
+}
+
+bool Sheet::HasDirtyCells() const {
+    return !dirty_cells_->empty() || !pending_invalidations_->empty();
+}
+
+bool Sheet::IsDirty(Position pos) const {
+    return dirty_cells_->count(pos) > 0 || !pending_invalidations_->empty();
+}
+
+void Sheet::PublishStagedValues() {
+    TraceScope trace("publish");
+    const ValueSnapshot& previous = *values_.Current();
+    auto rows = std::make_shared<ValueSnapshot::Rows>(*previous.rows_);
+
+    // Rows are shared with the previous version until one of their cells changes
+    std::vector<Position> changed;
+    std::unordered_map<int, std::shared_ptr<ValueSnapshot::Row>> copied_rows;
+    auto& staged_values = CopyOnWrite(staged_values_);
+    for (auto it = staged_values.begin(); it != staged_values.end();) {
+        // A cell changed again since it was staged waits for its next value
+        if (dirty_cells_->count(it->first)) {
+            ++it;
+            continue;
+        }
+        const Position pos = it->first;
+        ValueSnapshot::Slot slot = std::move(it->second);
+        it = staged_values.erase(it);
+        const CellInterface::Value& value = ValueSnapshot::Get(slot);
+        const CellInterface::Value* old_value = previous.Find(pos);
+        if (old_value ? *old_value == value : value == CellInterface::Value(std::string())) {
+            continue;  // recomputed to the same value
+        }
+        changed.push_back(pos);
+
+        auto& row = copied_rows[pos.row];
+        if (!row) {
+            if (pos.row >= static_cast<int>(rows->size())) {
+                rows->resize(pos.row + 1);
+            }
+            const auto& shared = (*rows)[pos.row];
+            row = shared ? std::make_shared<ValueSnapshot::Row>(*shared) : std::make_shared<ValueSnapshot::Row>();
+        }
+        if (pos.col >= static_cast<int>(row->size())) {
+            row->resize(pos.col + 1, CellInterface::Value(std::string()));
+        }
+        (*row)[pos.col] = std::move(slot);
+    }
+    if (changed.empty()) {
+        return;
+    }
+    memory_.published_values.Add(-1, 0, previous.rows_->capacity() * sizeof(ValueSnapshot::Rows::value_type));
+    memory_.published_values.Add(1, 0, rows->capacity() * sizeof(ValueSnapshot::Rows::value_type));
+    for (auto& [row_index, row] : copied_rows) {
+        if (const auto& replaced = (*rows)[row_index]) {
+            AccountValueRow(*replaced, -1);
+        }
+        AccountValueRow(*row, 1);
+        (*rows)[row_index] = std::move(row);
+    }
+
+    auto snapshot = std::make_unique<ValueSnapshot>();
+    snapshot->version_ = ++version_;
+    snapshot->rows_ = std::move(rows);
+    values_.Publish(std::move(snapshot));
+    if (search_index_) {
+        for (Position pos : changed) {
+            if (const Cell* cell = PeekCell(pos); cell && cell->GetFormula()) {
+                UpdateSearchEntry(pos);
+            }
+        }
+    }
+    RecordChanges(std::move(changed));
+}
+
+void Sheet::RecordChanges(std::vector<Position> changed) {
+    std::sort(changed.begin(), changed.end());
+    // A copy, so that callbacks may subscribe and unsubscribe
+    const auto subscribers = subscribers_;
+    for (const auto& [id, callback] : subscribers) {
+        callback(version_, changed);
+    }
+
+    change_history_size_ += changed.size();
+    change_history_.push_back({version_, std::move(changed)});
+    while (change_history_size_ > MAX_CHANGE_HISTORY && change_history_.size() > 1) {
+        change_history_size_ -= change_history_.front().changed.size();
+        history_base_version_ = change_history_.front().version;
+        change_history_.pop_front();
+    }
+}
+
+uint64_t Sheet::GetVersion() const {
+    return version_;
+}
+
+std::optional<std::vector<Position>> Sheet::GetChangesSince(uint64_t version) const {
+    if (version < history_base_version_) {
+        return std::nullopt;
+    }
+    std::vector<Position> changed;
+    // Batches are sorted by version, the ones after `version` form a suffix
+    auto first = std::partition_point(change_history_.begin(), change_history_.end(),
+                                      [version](const ChangeBatch& batch) {
+                                          return batch.version <= version;
+                                      });
+    for (auto it = first; it != change_history_.end(); ++it) {
+        changed.insert(changed.end(), it->changed.begin(), it->changed.end());
+    }
+    if (std::distance(first, change_history_.end()) > 1) {
+        std::sort(changed.begin(), changed.end());
+        changed.erase(std::unique(changed.begin(), changed.end()), changed.end());
+    }
+    return changed;
+}
+
+uint64_t Sheet::Subscribe(ChangeCallback callback) {
+    subscribers_.emplace_back(next_subscription_, std::move(callback));
+    return next_subscription_++;
+}
+
+void Sheet::Unsubscribe(uint64_t subscription) {
+    subscribers_.erase(std::remove_if(subscribers_.begin(), subscribers_.end(),
+                                      [subscription](const auto& subscriber) {
+                                          return subscriber.first == subscription;
+                                      }),
+                       subscribers_.end());
+}
+
+Sheet::ValuesGuard Sheet::ReadValues() const {
+    return values_.Read();
+}
+
+void Sheet::MarkDirty(Position pos) {
+    CopyOnWrite(dirty_cells_).insert(pos);
+    if (InViewport(pos)) {
+        CopyOnWrite(dirty_viewport_cells_).insert(pos);
+    }
+    lookup_indexes_.Invalidate(pos);
+    if (subexpression_values_.HasValues()) {
+        subexpression_values_.InvalidateReaders(pos, *subexpressions_);
+    }
+}
+
+void Sheet::AddRangeDependent(Position dependent, const std::vector<CellRange>& ranges) {
+    if (ranges.empty()) {
+        return;
+    }
+    if (!IsExclusive(range_dependents_)) {
+        range_dependents_ = std::make_shared<RangeDependents>(*range_dependents_);
+    }
+    range_dependents_->Add(dependent, ranges);
+}
+
+void Sheet::RemoveRangeDependent(Position dependent, const std::vector<CellRange>& ranges) {
+    if (ranges.empty()) {
+        return;
+    }
+    if (!IsExclusive(range_dependents_)) {
+        range_dependents_ = std::make_shared<RangeDependents>(*range_dependents_);
+    }
+    range_dependents_->Remove(dependent, ranges);
+}
+
+void Sheet::CollectRangeDependents(Position pos, std::vector<Position>& out) const {
+    range_dependents_->Collect(pos, out);
+}
+
+const TextDictionary& Sheet::GetTexts() const {
+    return *texts_;
+}
+
+TextId Sheet::InternText(std::string_view text) {
+    if (text.empty()) {
+        return TextDictionary::EMPTY;
+    }
+    if (!IsExclusive(texts_)) {
+        texts_ = std::make_shared<TextDictionary>(std::move(texts_));
+    }
+    return texts_->Intern(text);
+}
+
+void Sheet::ReleaseText(TextId id) {
+    if (id == TextDictionary::EMPTY) {
+        return;
+    }
+    if (!IsExclusive(texts_)) {
+        texts_ = std::make_shared<TextDictionary>(std::move(texts_));
+    }
+    texts_->Release(id);
+}
+
+std::string_view Sheet::GetCellText(const Cell& cell) const {
+    return texts_->View(cell.GetTextId());
+}
+
+std::optional<LookupIndexes::Key> Sheet::GetIndexKey(const Cell& cell) const {
+    if (cell.GetFormula()) {
+        // A formula has a number or an error
+        const Cell::ValueView value = GetValueView(cell);
+        if (const double* number = std::get_if<double>(&value)) {
+            return *number;
+        }
+        return std::nullopt;
+    }
+    const auto& key = texts_->GetLookupKey(cell.GetTextId());
+    if (!key) {
+        return std::nullopt;
+    }
+    if (const double* number = std::get_if<double>(&*key)) {
+        return *number;
+    }
+    // Aliases the text of the key, which the entry keeps for as long as the index needs it
+    return std::shared_ptr<const std::string>(key, &std::get<std::string>(*key));
+}
+
+double Sheet::GetCellNumber(Position pos) const {
     if (!pos.IsValid()) {
         throw InvalidPositionException("Invalid position");
     }
-    if (int(data_sheet.rows.size()) <= pos.row) {
-        return nullptr;
+    const Cell* cell = PeekCell(pos);
+    if (cell == nullptr) {
+        return 0.0;
+    }
+    if (cell->GetFormula()) {
+        // A formula has a number or an error
+        const Cell::ValueView value = GetValueView(*cell);
+        if (const double* number = std::get_if<double>(&value)) {
+            return *number;
+        }
+        throw std::get<FormulaError>(value);
+    }
+    // The key of a text is its number when the whole text is one, as in arithmetic
+    const auto& key = texts_->GetLookupKey(cell->GetTextId());
+    if (!key) {
+        return 0.0;
+    }
+    if (const double* number = std::get_if<double>(&*key)) {
+        return *number;
+    }
+    throw FormulaError(FormulaError::Category::Value);
+}
+
+std::optional<int> Sheet::Lookup(const LookupKey& key, CellRange range, LookupMatch match) const {
+    // The keys of an index are only refreshed for the cells marked dirty
+    SettleInvalidation();
+    if (lookup_indexes_.CanIndex(range)) {
+        return lookup_indexes_.Lookup(key, range, match, [this](Position pos) -> std::optional<LookupIndexes::Key> {
+            const Cell* cell = PeekCell(pos);
+            return cell ? GetIndexKey(*cell) : std::nullopt;
+        });
+    }
+    const auto* text = std::get_if<std::string>(&key);
+    if (!text || match != LookupMatch::Exact || !range.IsValid() || (range.GetRows() > 1 && range.GetCols() > 1)) {
+        return SheetInterface::Lookup(key, range, match);
+    }
+    // Only text cells have text values, and equal texts share an id: each distinct text is
+    // compared with the key once, the rest of the range compares ids
+    std::unordered_map<TextId, bool> matches;
+    const int length = std::max(range.GetRows(), range.GetCols());
+    for (int i = 0; i < length; ++i) {
+        Position pos = range.GetRows() > 1 ? Position{range.first.row + i, range.first.col}
+                                           : Position{range.first.row, range.first.col + i};
+        const Cell* cell = PeekCell(pos);
+        if (!cell || cell->GetFormula() || cell->GetTextId() == TextDictionary::EMPTY) {
+            continue;
+        }
+        auto [verdict, added] = matches.emplace(cell->GetTextId(), false);
+        if (added) {
+            const auto& cell_key = texts_->GetLookupKey(cell->GetTextId());
+            verdict->second = cell_key && *cell_key == key;
+        }
+        if (verdict->second) {
+            return i;
+        }
+    }
+    return std::nullopt;
+}
+
+std::vector<Position> Sheet::FindText(std::string_view text) const {
+    return GetSearchIndex().FindExact(text);
+}
+
+std::vector<Position> Sheet::FindTextPrefix(std::string_view prefix) const {
+    return GetSearchIndex().FindPrefix(prefix);
+}
+
+std::vector<Position> Sheet::FindTextContaining(std::string_view needle) const {
+    return GetSearchIndex().FindSubstring(needle);
+}
+
+std::vector<Position> Sheet::FindNumbers(double low, double high) const {
+    return GetSearchIndex().FindNumbers(low, high);
+}
+
+void Sheet::IndexCell(Position pos) {
+    if (search_index_) {
+        UpdateSearchEntry(pos);
+    }
+}
+
+SearchIndex& Sheet::GetSearchIndex() const {
+    if (!search_index_) {
+        search_index_ = std::make_unique<SearchIndex>();
+        const auto& rows = data_sheet->rows;
+        for (int row = 0; row < static_cast<int>(rows.size()); ++row) {
+            for (int col = 0; col < static_cast<int>(rows[row]->cells.size()); ++col) {
+                if (rows[row]->cells[col]) {
+                    UpdateSearchEntry({row, col});
+                }
+            }
+        }
+    }
+    return *search_index_;
+}
+
+void Sheet::UpdateSearchEntry(Position pos) const {
+    const Cell* cell = PeekCell(pos);
+    if (!cell || cell->IsEmpty()) {
+        search_index_->Remove(pos);
+        return;
     }
-    if (int(data_sheet.rows.at(pos.row)->cells.size()) <= pos.col) {
+    const double* number = nullptr;
+    if (!cell->GetFormula()) {
+        const auto& key = texts_->GetLookupKey(cell->GetTextId());
+        number = key ? std::get_if<double>(&*key) : nullptr;
+    } else if (const auto* value = values_.Current()->Find(pos)) {
+        number = std::get_if<double>(value);
+    }
+    // NaN has no place in the order of numbers
+    search_index_->Set(pos, GetCellText(*cell),
+                       number && !std::isnan(*number) ? std::optional<double>(*number) : std::nullopt);
+}
+
+void Sheet::EnableProfiling([[maybe_unused]] bool enabled) {
+#ifdef SPREADSHEET_PROFILING
+    profiler_.SetEnabled(enabled);
+#endif
+}
+
+void Sheet::ResetProfile() {
+#ifdef SPREADSHEET_PROFILING
+    profiler_.Reset();
+#endif
+}
+
+#ifdef SPREADSHEET_PROFILING
+Profiler& Sheet::GetProfiler() {
+    return profiler_;
+}
+#endif
+
+ProfileReport Sheet::GetProfile([[maybe_unused]] size_t top_n) const {
+    ProfileReport report;
+#ifdef SPREADSHEET_PROFILING
+    // The caches an edit resets are counted as the invalidation reaches them
+    SettleInvalidation();
+    const auto& profiles = profiler_.GetCells();
+    std::vector<const CellProfile*> cells;
+    cells.reserve(profiles.size());
+    for (const auto& [pos, profile] : profiles) {
+        cells.push_back(&profile);
+        report.evaluations += profile.evaluations;
+        report.cache_hits += profile.cache_hits;
+    }
+    auto take_top = [&cells, top_n](auto by) {
+        const size_t count = std::min(top_n, cells.size());
+        std::partial_sort(cells.begin(), cells.begin() + count, cells.end(),
+                          [by](const CellProfile* lhs, const CellProfile* rhs) {
+                              return lhs->*by > rhs->*by;
+                          });
+        return count;
+    };
+
+    for (size_t i = 0, count = take_top(&CellProfile::self_time); i < count; ++i) {
+        report.top_cells.push_back(*cells[i]);
+    }
+    // A chain goes down through the most expensive formula each cell reads
+    for (size_t i = 0, count = take_top(&CellProfile::eval_time); i < count; ++i) {
+        ProfileChain chain{{cells[i]->pos}, cells[i]->eval_time};
+        std::unordered_set<Position, PositionHasher> seen{cells[i]->pos};
+        for (const Cell* cell = PeekCell(cells[i]->pos); cell;) {
+            const CellProfile* next = nullptr;
+            for (Position ref : cell->GetReferencedCellsView()) {
+                auto it = profiles.find(ref);
+                if (it != profiles.end() && it->second.eval_time.count() > 0 && !seen.count(ref)
+                    && (!next || it->second.eval_time > next->eval_time)) {
+                    next = &it->second;
+                }
+            }
+            if (!next) {
+                break;
+            }
+            chain.cells.push_back(next->pos);
+            seen.insert(next->pos);
+            cell = PeekCell(next->pos);
+        }
+        report.top_chains.push_back(std::move(chain));
+    }
+#endif
+    return report;
+}
+
+size_t Sheet::GetLookupIndexMemoryUsage() const {
+    return lookup_indexes_.GetMemoryUsage();
+}
+
+void Sheet::SetLookupIndexMemoryLimit(size_t bytes) {
+    lookup_indexes_.SetMemoryLimit(bytes);
+}
+
+bool Sheet::Undo() {
+    UndoJournal::Batch batch;
+    if (!undo_.TakeUndo(batch)) {
+        return false;
+    }
+    undo_.PushRedo(ApplyReverse(batch));
+    return true;
+}
+
+bool Sheet::Redo() {
+    UndoJournal::Batch batch;
+    if (!undo_.TakeRedo(batch)) {
+        return false;
+    }
+    undo_.PushUndo(ApplyReverse(batch));
+    return true;
+}
+
+void Sheet::BeginUndoGroup() {
+    undo_.BeginBatch();
+}
+
+void Sheet::EndUndoGroup() {
+    undo_.EndBatch();
+}
+
+const UndoJournal& Sheet::GetUndoJournal() const {
+    return undo_;
+}
+
+void Sheet::SetUndoMemoryLimit(size_t bytes) {
+    undo_.SetMemoryLimit(bytes);
+}
+
+SheetMemoryStats Sheet::MemoryStats() const {
+    SheetMemoryStats stats = memory_;
+    stats.texts = {texts_->GetSize(), texts_->GetMemoryUsage()};
+    stats.value_caches = {value_cache_.GetSize(), value_cache_.GetMemoryUsage()};
+    stats.subexpressions = {subexpressions_->GetNodeCount(),
+                            subexpressions_->GetMemoryUsage() + subexpression_values_.GetMemoryUsage()};
+    stats.lookup_indexes = {lookup_indexes_.GetIndexCount(), lookup_indexes_.GetMemoryUsage()};
+    // A proxy and its hash table node: the entry, the link to the next node and the cached hash
+    constexpr size_t PROXY_COST = sizeof(SharedCell) + sizeof(std::pair<const Position, std::unique_ptr<SharedCell>>)
+                                  + 2 * sizeof(void*);
+    stats.cell_proxies = {shared_cells_.size(), shared_cells_.size() * PROXY_COST};
+    return stats;
+}
+
+void Sheet::AccountCell(const Cell& cell, int sign) {
+    cell.AccountMemory(memory_, sign);
+}
+
+ValueCache& Sheet::GetValueCache() const {
+    return value_cache_;
+}
+
+std::optional<FormulaInterface::Value> Sheet::RecallValue(Position pos) const {
+    SettleInvalidation();
+    // A cell that is not dirty has not changed since its value was staged or published
+    if (dirty_cells_->count(pos)) {
+        return std::nullopt;
+    }
+    const CellInterface::Value* value = nullptr;
+    if (auto staged = staged_values_->find(pos); staged != staged_values_->end()) {
+        value = &ValueSnapshot::Get(staged->second);
+    } else {
+        value = values_.Current()->Find(pos);
+    }
+    if (const auto* number = value ? std::get_if<double>(value) : nullptr) {
+        return *number;
+    }
+    if (const auto* error = value ? std::get_if<FormulaError>(value) : nullptr) {
+        return *error;
+    }
+    return std::nullopt;
+}
+
+std::optional<FormulaInterface::Value> Sheet::GetCachedValue(Position pos) const {
+    SettleInvalidation();
+    // Invalidation erases the value, so whatever the cache holds is up to date
+    if (const auto* value = value_cache_.Peek(pos)) {
+        return *value;
+    }
+    return std::nullopt;
+}
+
+Cell::ValueView Sheet::GetValueView(const Cell& cell) const {
+    const FormulaInterface* formula = cell.GetFormula();
+    if (formula == nullptr) {
+        std::string_view text = GetCellText(cell);
+        if (!text.empty() && text.front() == ESCAPE_SIGN) {
+            text.remove_prefix(1);
+        }
+        return text;
+    }
+
+    auto view = [](const FormulaInterface::Value& value) {
+        return std::visit([](auto alternative) -> Cell::ValueView {
+            return alternative;
+        }, value);
+    };
+    SettleInvalidation();
+    const Position pos = cell.GetPosition();
+    if (!invalid_values_->count(pos)) {
+        if (const auto* value = value_cache_.Find(pos)) {
+            SPREADSHEET_PROFILE(profiler_.CountCacheHit(pos);)
+            return view(*value);
+        }
+        if (auto value = RecallValue(pos)) {
+            SPREADSHEET_PROFILE(profiler_.CountCacheHit(pos);)
+            value_cache_.CountRecall();
+            // Recalling it again is as cheap
+            value_cache_.Insert(pos, *value, 1);
+            return view(*value);
+        }
+    }
+
+    // The formulas evaluated on the way count as misses too: their number is the cost
+    const uint64_t misses = value_cache_.GetMisses();
+    value_cache_.CountMiss();
+    FormulaInterface::Value value = 0.0;
+    {
+        SPREADSHEET_PROFILE(auto evaluation = profiler_.Measure(Profiler::Kind::Evaluation, pos);)
+        TraceScope trace("evaluate", pos);
+        try {
+            value = EvaluateFormula(*formula);
+        } catch (const FormulaException &e) {
+            value = FormulaError(e.what());
+        }
+    }
+    value_cache_.Insert(pos, value, value_cache_.GetMisses() - misses);
+    if (invalid_values_->count(pos)) {
+        CopyOnWrite(invalid_values_).erase(pos);
+    }
+    return view(value);
+}
+
+size_t Sheet::InvalidateDependents(Position pos) {
+    return InvalidateDependents(pos, pos);
+}
+
+size_t Sheet::InvalidateDependents(Position pos, Position source) {
+    std::vector<Position> dependents;
+    if (const Cell* cell = std::as_const(*this).GetCommonCell(pos)) {
+        const auto& referring = cell->GetCellReferringView();
+        dependents.assign(referring.begin(), referring.end());
+    }
+    CollectRangeDependents(pos, dependents);
+    size_t invalidated = 0;
+    for (Position dependent : dependents) {
+        // Dependents without a cache are skipped together with everything that depends on them:
+        // a formula is only cached after the formulas it reads are. The dependents are only read,
+        // their rows are not copied.
+        const Cell* cell = std::as_const(*this).GetCommonCell(dependent);
+        if (!cell || !InvalidateValue(*cell)) {
+            continue;
+        }
+        MarkDirty(dependent);
+        CopyOnWrite(pending_invalidations_).push_back({dependent, source});
+        ++invalidated;
+    }
+    return invalidated;
+}
+
+size_t Sheet::PropagateInvalidation() {
+    auto& pending = CopyOnWrite(pending_invalidations_);
+    const PendingInvalidation next = pending.back();
+    pending.pop_back();
+    const size_t invalidated = InvalidateDependents(next.cell, next.source);
+    SPREADSHEET_PROFILE(profiler_.CountInvalidatedCaches(next.source, invalidated);)
+    return invalidated;
+}
+
+void Sheet::SettleInvalidation() const {
+    if (pending_invalidations_->empty()) {
+        return;
+    }
+    TraceScope trace("Sheet::SettleInvalidation");
+    // Part of the edits rather than of the state being read
+    auto& sheet = const_cast<Sheet&>(*this);
+    while (!pending_invalidations_->empty()) {
+        sheet.PropagateInvalidation();
+    }
+}
+
+bool Sheet::InvalidateValue(const Cell& cell) {
+    const Position pos = cell.GetPosition();
+    if (!cell.GetFormula()) {
+        // A text has no value to keep up to date
+        if (invalid_values_->count(pos)) {
+            CopyOnWrite(invalid_values_).erase(pos);
+        }
+        return false;
+    }
+    if (invalid_values_->count(pos)) {
+        return false;
+    }
+    CopyOnWrite(invalid_values_).insert(pos);
+    value_cache_.Erase(pos);
+    return true;
+}
+
+void Sheet::SetValueCacheMemoryLimit(size_t bytes) {
+    value_cache_.SetMemoryLimit(bytes);
+}
+
+ValueCacheStats Sheet::GetValueCacheStats() const {
+    return value_cache_.GetStats();
+}
+
+void Sheet::SetSubexpressionSharing(bool enabled) {
+    subexpression_sharing_ = enabled;
+    // Values are not kept up to date while sharing is off
+    subexpression_values_.Clear();
+}
+
+SubexpressionStats Sheet::GetSubexpressionStats() const {
+    SubexpressionStats stats;
+    stats.nodes = subexpressions_->GetNodeCount();
+    stats.shared_nodes = subexpressions_->GetSharedCount();
+    subexpression_values_.FillStats(stats);
+    stats.memory_usage = subexpressions_->GetMemoryUsage() + subexpression_values_.GetMemoryUsage();
+    return stats;
+}
+
+FormulaInterface::Value Sheet::EvaluateFormula(const FormulaInterface& formula) const {
+    const auto* nodes = subexpression_sharing_ ? subexpressions_->FindNodes(formula) : nullptr;
+    if (!nodes) {
+        return formula.Evaluate(*this);
+    }
+    SubexpressionBinding shared(*subexpressions_, subexpression_values_, *nodes);
+    return formula.Evaluate(*this, shared);
+}
+
+void Sheet::AddSubexpressions(const FormulaInterface& formula) {
+    const auto subexpressions = formula.GetSubexpressions();
+    if (subexpressions.empty()) {
+        return;
+    }
+    if (!IsExclusive(subexpressions_)) {
+        subexpressions_ = std::make_shared<SubexpressionGraph>(*subexpressions_);
+    }
+    subexpressions_->Add(formula, subexpressions);
+}
+
+void Sheet::RemoveSubexpressions(const FormulaInterface& formula) {
+    if (!subexpressions_->FindNodes(formula)) {
+        return;
+    }
+    if (!IsExclusive(subexpressions_)) {
+        subexpressions_ = std::make_shared<SubexpressionGraph>(*subexpressions_);
+    }
+    std::vector<SubexpressionGraph::NodeId> freed;
+    subexpressions_->Remove(formula, freed);
+    subexpression_values_.Forget(freed);
+}
+
+void Sheet::AccountRowIndex(int sign) {
+    memory_.rows.Add(sign, 0, data_sheet->rows.capacity() * sizeof(std::shared_ptr<Row>));
+}
+
+void Sheet::AccountRow(const Row& row, int sign) {
+    memory_.rows.Add(sign, 1, sizeof(Row) + row.cells.capacity() * sizeof(std::unique_ptr<Cell>));
+}
+
+void Sheet::AccountValueRow(const ValueSnapshot::Row& row, int sign) {
+    // Shared texts are counted once, by the dictionary
+    size_t bytes = row.capacity() * sizeof(ValueSnapshot::Slot);
+    for (const auto& slot : row) {
+        const auto* value = std::get_if<CellInterface::Value>(&slot);
+        if (const auto* text = value ? std::get_if<std::string>(value) : nullptr) {
+            bytes += SheetMemoryStats::GetHeapBytes(*text);
+        }
+    }
+    memory_.published_values.Add(sign, row.size(), bytes);
+}
+
+const Cell* Sheet::PeekCell(Position pos) const {
+    if (!pos.IsValid() || pos.row >= static_cast<int>(data_sheet->rows.size())) {
         return nullptr;
     }
-    if (data_sheet.rows[pos.row]->cells[pos.col] != nullptr) {
-        return data_sheet.rows[pos.row]->cells[pos.col].get();
+    const auto& cells = data_sheet->rows[pos.row]->cells;
+    return pos.col < static_cast<int>(cells.size()) ? cells[pos.col].get() : nullptr;
+}
+
+UndoJournal::CellState Sheet::CaptureState(Position pos) const {
+    const Cell* cell = PeekCell(pos);
+    if (!cell) {
+        return {pos, {}, nullptr};
     }
-    return nullptr;
+    return {pos, std::string(GetCellText(*cell)), cell->GetSharedFormula()};
+}
+
+void Sheet::RecordUndo(UndoJournal::CellState before) {
+    if (replaying_) {
+        return;
+    }
+    // Placeholders created for references and no-op edits are not worth an entry
+    const Cell* cell = PeekCell(before.pos);
+    std::string_view text = cell ? GetCellText(*cell) : std::string_view();
+    if (text == before.text && (cell ? cell->GetFormula() : nullptr) == before.formula.get()) {
+        return;
+    }
+    undo_.Record(std::move(before));
+}
+
+void Sheet::RestoreState(const UndoJournal::CellState& state) {
+    if (state.text.empty() && !state.formula) {
+        ClearCell(state.pos);
+    } else {
+        EnsureCell(state.pos)->Revert(state.text, state.formula);
+    }
+}
+
+UndoJournal::Batch Sheet::ApplyReverse(const UndoJournal::Batch& batch) {
+    ReplayScope replay(replaying_);
+    // The states before each edit, restored newest first; the inverse batch collects the states
+    // they replace in the same order, so applying it backwards redoes the edits in order
+    UndoJournal::Batch inverse;
+    inverse.reserve(batch.size());
+    for (auto it = batch.rbegin(); it != batch.rend(); ++it) {
+        if (const auto* shift = std::get_if<ReferenceShift>(&*it)) {
+            // Undoing a shift is the inverse shift, with its own erased states, journaled the
+            // same way as by ChangeStructure()
+            ReferenceShift inverse_shift = shift->Inverse();
+            for (auto& state : ShiftCells(inverse_shift)) {
+                inverse.push_back(std::move(state));
+            }
+            inverse.push_back(inverse_shift);
+            continue;
+        }
+        const auto& state = std::get<UndoJournal::CellState>(*it);
+        if (!state.restore_only) {
+            inverse.push_back(CaptureState(state.pos));
+        }
+        RestoreState(state);
+    }
+    return inverse;
+}
+
+const Cell *Sheet::GetCommonCell(Position pos) const {
+    if (!pos.IsValid()) {
+        throw InvalidPositionException("Invalid position");
+    }
+    return PeekCell(pos);
 }
 
 Cell *Sheet::GetCommonCell(Position pos) {
     if (!pos.IsValid()) {
         throw InvalidPositionException("Invalid position");
     }
-    if (int(data_sheet.rows.size()) <= pos.row) {
+    if (int(data_sheet->rows.size()) <= pos.row) {
         return nullptr;
     }
-    if (int(data_sheet.rows.at(pos.row)->cells.size()) <= pos.col) {
+    if (int(data_sheet->rows.at(pos.row)->cells.size()) <= pos.col) {
         return nullptr;
     }
-    if (data_sheet.rows[pos.row]->cells[pos.col] != nullptr) {
-        return data_sheet.rows[pos.row]->cells[pos.col].get();
+    if (data_sheet->rows[pos.row]->cells[pos.col] != nullptr) {
+        return OwnRow(pos.row).cells[pos.col].get();
     }
     return nullptr;
 }
@@ -2,39 +2,417 @@
 
 #include "cell.h"
 #include "common.h"
+#include "epoch.h"
+#include "exporter.h"
+#include "lookup_index.h"
+#include "memory_stats.h"
+#include "profiler.h"
+#include "search_index.h"
+#include "subexpressions.h"
+#include "text_dictionary.h"
+#include "undo.h"
+#include "value_cache.h"
+#include "value_snapshot.h"
 
+#include <chrono>
+#include <cstdint>
+#include <deque>
 #include <functional>
+#include <limits>
+#include <optional>
+#include <stdexcept>
+#include <string>
 #include <unordered_map>
+#include <unordered_set>
+#include <utility>
 
 class Cell;
 
+// Исключение, выбрасываемое при ошибке записи или чтения двоичного снимка таблицы
+class SnapshotException : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// Значение ячейки в буфере Sheet::ReadRange. Текст ссылается на данные ячейки и действителен до
+// следующего изменения таблицы.
+struct RangeValue {
+    enum class Type {
+        Empty,   // ячейки нет или её текст пуст
+        Number,  // значение формулы
+        Text,    // текст без экранирующего символа
+        Error,   // ошибка вычисления формулы
+    };
+
+    Type type = Type::Empty;
+    double number = 0.0;
+    std::string_view text;
+    FormulaError::Category error = FormulaError::Category::Ref;
+};
+
+// Ограничение одной порции пересчёта: сколько формул вычислить и сколько времени потратить.
+// Время проверяется между ячейками, поэтому одну ячейку с длинной цепочкой зависимостей порция
+// вычисляет целиком; хотя бы одна ячейка вычисляется всегда.
+struct RecalcBudget {
+    size_t max_cells = std::numeric_limits<size_t>::max();
+    std::chrono::microseconds max_time = std::chrono::microseconds::max();
+};
+
+// Потоки: все методы, кроме ReadValues(), вызываются из одного потока-писателя. Читатели из любых
+// потоков обращаются только к снимкам значений, которые писатель публикует методом Recalculate().
+// Таблица и её форки могут использоваться из разных потоков одновременно.
 class Sheet : public SheetInterface {
 public:
+    using ValuesGuard = EpochPublisher<ValueSnapshot>::ReadGuard;
+
+    Sheet();
     ~Sheet();
 
+    // Копия таблицы за O(1) для анализа сценариев. Форк разделяет с исходной таблицей строки
+    // (копирование при записи) и разобранные формулы; строка копируется, когда одна из таблиц
+    // впервые изменяет её ячейки, а чтение и вычисление строк не копируют. Значения формул форк берёт из разделяемого снимка значений,
+    // поэтому после изменения пересчитываются только зависимые формулы. Незавершённый пересчёт (грязные ячейки и вычисленные,
+    // но не опубликованные значения) тоже разделяется до первого изменения, поэтому время Fork() не зависит и от него.
+    // Форк не зависит от времени жизни исходной таблицы.
+    // Указатели на ячейки, полученные до вызова Fork(), использовать нельзя.
+    std::unique_ptr<Sheet> Fork() const;
+
     void SetCell(Position pos, std::string text) override;
+    // То же с уже разобранной формулой текста text (nullptr для текстовой ячейки)
+    void SetCell(Position pos, std::string text, std::unique_ptr<FormulaInterface> formula);
 
+    // Массовая загрузка ячеек. Формулы парсятся параллельно на пуле потоков, после чего ячейки
+    // связываются в одном потоке в порядке следования в cells. Результат и исключения
+    // (FormulaException, CircularDependencyException, InvalidPositionException) такие же, как при
+    // последовательном вызове SetCell для каждого элемента: ячейки до ошибочной остаются заданными.
+    void SetCells(std::vector<std::pair<Position, std::string>> cells);
+
+    // Только из потока-писателя, как и GetValue() полученной ячейки: вычисление значения формулы
+    // заполняет кэши таблицы. Из других потоков значения читаются через ReadValues().
+    // Для ячейки строки, разделяемой с форком, возвращается её представитель: он читает ячейку
+    // через эту таблицу, а Set вызывает SetCell. Представитель привязан к позиции и действителен,
+    // пока строка разделяется: когда таблица копирует строку (изменяя её ячейки), вставляет или
+    // удаляет строки и столбцы, представители её ячеек удаляются, и GetCell нужно вызвать снова.
     const CellInterface* GetCell(Position pos) const override;
     CellInterface* GetCell(Position pos) override;
 
+    // Ячейка для чтения формулы и связей без копирования строки, разделяемой с форком. Текст и
+    // значение такой ячейки читаются через таблицу (GetCell), а не через саму ячейку.
     const Cell* GetCommonCell(Position pos) const;
+    // Ячейка для изменения: строка, разделяемая с форком, сначала копируется
     Cell* GetCommonCell(Position pos);
 
     void ClearCell(Position pos) override;
 
+    // Вставка count пустых строк (столбцов) перед before и удаление count строк (столбцов), начиная
+    // с first. Ячейки сдвигаются блоками, ссылки в формулах переписываются на месте, а ссылки на
+    // удалённые ячейки становятся ошибкой #REF!. Время пропорционально числу сдвинутых ячеек и
+    // ссылающихся на них формул. Бросает InvalidPositionException для некорректных аргументов и
+    // если непустые ячейки вышли бы за пределы таблицы.
+    void InsertRows(int before, int count = 1);
+    void DeleteRows(int first, int count = 1);
+    void InsertCols(int before, int count = 1);
+    void DeleteCols(int first, int count = 1);
+
     Size GetPrintableSize() const override;
 
     void PrintValues(std::ostream& output) const override;
     void PrintTexts(std::ostream& output) const override;
 
+    // Быстрый вывод через буферизованный писатель, например в файловый дескриптор.
+    // Результат побайтно совпадает с выводом в поток с настройками по умолчанию.
+    void PrintValues(ExportWriter& output) const;
+    void PrintTexts(ExportWriter& output) const;
+
+    // Заполняет buffer значениями прямоугольника [top_left, bottom_right] построчно: значение
+    // ячейки (row, col) попадает в buffer[(row - top_left.row) * width + (col - top_left.col)].
+    // Пересчитываются только формулы внутри прямоугольника, чей кэш устарел (и то, от чего они
+    // зависят). Бросает InvalidPositionException для некорректного прямоугольника и
+    // std::length_error, если buffer_size меньше его площади.
+    void ReadRange(Position top_left, Position bottom_right, RangeValue* buffer, size_t buffer_size) const;
+
+    // Записывает таблицу в версионированный двоичный снимок: тексты без повторов, формулы в
+    // скомпилированном виде, список ссылок каждой формулы и, если with_values, вычисленные
+    // значения. Файл пишется последовательно во временный файл, сбрасывается на диск (fsync) и
+    // атомарно переименовывается; запись о переименовании в каталоге сбрасывает вызывающий.
+    void SaveSnapshot(const std::string& path, bool with_values = true) const;
+    // Отображает снимок в память и восстанавливает по нему таблицу без разбора формул и без
+    // пересчёта сохранённых значений. Бросает SnapshotException для повреждённого файла.
+    static std::unique_ptr<Sheet> LoadSnapshot(const std::string& path);
+
+    // Вычисляет все формулы, чьё значение могло измениться, и атомарно публикует новую версию
+    // снимка значений, если какие-то значения действительно изменились. Копируются только строки
+    // с изменившимися ячейками.
+    void Recalculate();
+    // Пересчёт по частям в пределах budget. Правка сбрасывает значения только формул, непосредственно
+    // читающих изменённую ячейку; сначала шаг доводит сброс до формул, зависящих от них, и лишь
+    // затем вычисляет значения, начиная с ячеек видимой области. Чтение значения до этого
+    // доводит сброс сразу. Сброшенная формула считается в budget как вычисленная. Вычисленные
+    // значения копятся и публикуются версией, как только пересчитана видимая область, и ещё раз,
+    // когда изменившихся ячеек не остаётся. В промежутке снимок содержит новые значения видимой
+    // области и прежние - остальных ячеек. Возвращает true, если таблица полностью пересчитана.
+    bool RecalculateStep(const RecalcBudget& budget);
+    // Видимая область [top_left, bottom_right], которую RecalculateStep пересчитывает в первую очередь
+    void SetViewport(Position top_left, Position bottom_right);
+    void ResetViewport();
+    // Есть ли ячейки, чьё значение ещё не вычислено после изменений. Пока сброс значений не доведён
+    // до всех зависимых формул, грязной считается любая ячейка.
+    bool HasDirtyCells() const;
+    bool IsDirty(Position pos) const;
+    // Последний опубликованный снимок значений. Безопасно вызывать из любого потока одновременно
+    // с писателем; не блокирует. Снимок не освобождается, пока жив возвращённый объект.
+    ValuesGuard ReadValues() const;
+
+    // Подписчик ленты изменений: номер новой версии и ячейки, чьё значение в ней изменилось
+    using ChangeCallback = std::function<void(uint64_t version, const std::vector<Position>& changed)>;
+
+    // Номер последней опубликованной версии значений
+    uint64_t GetVersion() const;
+    // Ячейки, чьё вычисленное значение изменилось после версии version, по возрастанию позиции.
+    // Пересчёт, давший прежнее значение, изменением не считается. Если история изменений так
+    // далеко не хранится (см. MAX_CHANGE_HISTORY), возвращает nullopt: нужно перечитать всё.
+    std::optional<std::vector<Position>> GetChangesSince(uint64_t version) const;
+    // Вызывает callback в потоке писателя после публикации каждой версии. Возвращает id подписки.
+    uint64_t Subscribe(ChangeCallback callback);
+    void Unsubscribe(uint64_t subscription);
+
+    // Сколько изменённых ячеек (суммарно по версиям) хранится для GetChangesSince
+    static constexpr size_t MAX_CHANGE_HISTORY = 1 << 20;
+
+    // Отмена и повтор правок. Пакет - это один вызов SetCell, ClearCell, SetCells, вставки или
+    // удаления строк (столбцов) либо все правки между BeginUndoGroup() и EndUndoGroup(). Отмена
+    // возвращает прежние тексты и формулы без повторного разбора за время, пропорциональное
+    // размеру пакета (для сдвига - как у самого сдвига); зависимые формулы
+    // пересчитываются как после обычной правки. Возвращают false, если отменять (повторять) нечего.
+    // Форк начинает с пустого журнала.
+    bool Undo();
+    bool Redo();
+    void BeginUndoGroup();
+    void EndUndoGroup();
+    const UndoJournal& GetUndoJournal() const;
+    void SetUndoMemoryLimit(size_t bytes);
+
+    // Поиск для MATCH, VLOOKUP и XLOOKUP по индексам столбцов (см. LookupIndexes): после первого
+    // поиска по диапазону следующие занимают логарифмическое время
+    std::optional<int> Lookup(const LookupKey& key, CellRange range, LookupMatch match) const override;
+    // Число текстовой ячейки берётся из словаря текстов, где оно разобрано один раз
+    double GetCellNumber(Position pos) const override;
+    // Память, занятая индексами столбцов, и её предел. Индекс, который не помещается в предел,
+    // не строится: поиск по такому диапазону перебирает ячейки.
+    size_t GetLookupIndexMemoryUsage() const;
+    void SetLookupIndexMemoryLimit(size_t bytes);
+
+    // Поиск по всей таблице без учёта регистра: ячейки, чей текст (как его возвращает GetText)
+    // совпадает с text, начинается с prefix или содержит needle, и ячейки, чьё числовое значение
+    // лежит в [low, high]. Числом считается и текст, целиком записывающий число; значения формул
+    // берутся из последнего опубликованного снимка (см. Recalculate). Индекс строится при первом
+    // поиске и дальше обновляется при каждой правке; форк строит собственный.
+    std::vector<Position> FindText(std::string_view text) const;
+    std::vector<Position> FindTextPrefix(std::string_view prefix) const;
+    std::vector<Position> FindTextContaining(std::string_view needle) const;
+    std::vector<Position> FindNumbers(double low, double high) const;
+
+    // Вычисленные значения формул хранятся в кэше таблицы, а не в ячейках. Кэш ограничен по
+    // памяти (по умолчанию не ограничен) и при нехватке вытесняет значения, к которым давно не
+    // обращались, начиная с дешёвых для повторного вычисления. Вытесненное значение неизменившейся
+    // ячейки берётся из опубликованного снимка, если он есть, иначе формула вычисляется заново.
+    // Форк начинает с пустым кэшем того же размера.
+    void SetValueCacheMemoryLimit(size_t bytes);
+    ValueCacheStats GetValueCacheStats() const;
+    // Значение формулы в ячейке pos (число или ошибка), если оно есть в кэше значений этой таблицы.
+    // Не вызывает вычисление.
+    std::optional<FormulaInterface::Value> GetCachedValue(Position pos) const;
+
+    // Одинаковые подвыражения разных формул (например, общая сумма B1+C1 в формулах =(B1+C1)*2
+    // и =(B1+C1)/4) хранятся в графе таблицы одним узлом и при включённом разделении вычисляются
+    // один раз: остальные формулы берут готовое значение. Значение узла сбрасывается, когда
+    // меняется одна из ячеек, которые он читает. Граф ведётся всегда; разделение включено по
+    // умолчанию. Форк разделяет с таблицей граф, но не значения.
+    void SetSubexpressionSharing(bool enabled);
+    SubexpressionStats GetSubexpressionStats() const;
+
+    // Профилировщик пересчёта: вычисления и попадания в кэш значений, время вычисления и разбора
+    // формул, сброшенные правкой кэши и проверки циклов по ячейкам. Выключен, пока не вызван
+    // EnableProfiling(true); в сборке без SPREADSHEET_PROFILING эти методы ничего не делают,
+    // а отчёт пуст. Отчёт содержит top_n самых дорогих ячеек и цепочек зависимостей.
+    void EnableProfiling(bool enabled);
+    void ResetProfile();
+    ProfileReport GetProfile(size_t top_n) const;
+#ifdef SPREADSHEET_PROFILING
+    Profiler& GetProfiler();
+#endif
+
+    // Память таблицы по видам объектов. Счётчики обновляются при каждом изменении ячеек, строк
+    // и снимка значений, поэтому вызов не обходит таблицу и занимает O(1).
+    SheetMemoryStats MemoryStats() const;
+
+    // Вызывается ячейкой до (sign = -1) и после (sign = 1) изменения того, что она хранит
+    void AccountCell(const Cell& cell, int sign);
+    // Кэш значений формул, в который ячейки кладут вычисленные значения
+    ValueCache& GetValueCache() const;
+    // Вызывается ячейкой, чьё значение вытеснено из кэша: значение из снимка значений (или
+    // вычисленное для следующего снимка), если ячейка с тех пор не менялась
+    std::optional<FormulaInterface::Value> RecallValue(Position pos) const;
+    // Видимое значение ячейки в этой таблице; формула вычисляется, если её значение устарело.
+    // Ячейка может принадлежать строке, которую таблица разделяет с форком.
+    Cell::ValueView GetValueView(const Cell& cell) const;
+    // Вызывается ячейкой, чьё значение могло измениться: значение формулы сбрасывается. Возвращает
+    // false, если оно уже было сброшено (или ячейка не формула).
+    bool InvalidateValue(const Cell& cell);
+    // Значение формулы ячейки с общими подвыражениями (см. SetSubexpressionSharing)
+    FormulaInterface::Value EvaluateFormula(const FormulaInterface& formula) const;
+    // Вызываются ячейкой, которая получает формулу и расстаётся с ней
+    void AddSubexpressions(const FormulaInterface& formula);
+    void RemoveSubexpressions(const FormulaInterface& formula);
+    // Словарь текстов ячеек. Тексты добавляет и отпускает ячейка, чей текст меняется.
+    const TextDictionary& GetTexts() const;
+    TextId InternText(std::string_view text);
+    void ReleaseText(TextId id);
+    // Вызывается ячейкой, чьё значение могло измениться
+    void MarkDirty(Position pos);
+    // Вызывается изменившейся ячейкой: сбрасывает значения формул, непосредственно читающих pos.
+    // Формулы, читающие их, сбрасываются позже (см. RecalculateStep). Возвращает число сброшенных.
+    size_t InvalidateDependents(Position pos);
+    // Вызывается ячейкой, чей текст изменился
+    void IndexCell(Position pos);
+    // Вызываются ячейкой, чья формула начинает или перестаёт читать диапазоны, и при обходе
+    // зависимых от ячейки формул
+    void AddRangeDependent(Position dependent, const std::vector<CellRange>& ranges);
+    void RemoveRangeDependent(Position dependent, const std::vector<CellRange>& ranges);
+    void CollectRangeDependents(Position pos, std::vector<Position>& out) const;
+
 private:
+    // A tile of the copy-on-write storage. Its cells point at the owner sheet; any other sheet
+    // holding the row reads the cells through its own texts and values and copies the row
+    // before changing them.
     struct Row {
+        uint64_t owner = 0;
         std::vector<std::unique_ptr<Cell>> cells{};
     };
 
     struct SheetData {
-        std::vector<std::unique_ptr<Row>> rows{};
+        std::vector<std::shared_ptr<Row>> rows{};
+    };
+
+    // Stands in for a cell of a row shared with another sheet: it reads the cell through this
+    // sheet, whose values may differ from those of the sheet the cell points at
+    class SharedCell;
+
+    // Unique id of the sheet: unlike its address it is never reused by another sheet
+    const uint64_t id_;
+    // Shared with forks until one side needs to change a row
+    std::shared_ptr<SheetData> data_sheet;
+    // Handed out by GetCell for the cells of shared rows, one per position; dropped once the
+    // row is copied
+    mutable std::unordered_map<Position, std::unique_ptr<SharedCell>, PositionHasher> shared_cells_;
+
+    using PositionSet = std::unordered_set<Position, PositionHasher>;
+    using StagedValues = std::unordered_map<Position, ValueSnapshot::Slot, PositionHasher>;
+
+    // The pending work below is shared with forks until one side changes it, so that forking
+    // takes the same time however much of it there is
+
+    // Cells whose published value may be out of date
+    std::shared_ptr<PositionSet> dirty_cells_ = std::make_shared<PositionSet>();
+    // Dirty cells inside the viewport, a subset of dirty_cells_
+    std::shared_ptr<PositionSet> dirty_viewport_cells_ = std::make_shared<PositionSet>();
+    std::optional<std::pair<Position, Position>> viewport_;
+    // Formulas whose value is neither in value_cache_ nor evicted from it, a subset of
+    // dirty_cells_. Kept here rather than in the cells, which forks share: a formula is only
+    // valid after the formulas it reads are, which lets invalidation stop early.
+    mutable std::shared_ptr<PositionSet> invalid_values_ = std::make_shared<PositionSet>();
+    // Values computed by RecalculateStep, published once the viewport or the whole sheet is done.
+    // They are values of the cells as a fork sees them too.
+    std::shared_ptr<StagedValues> staged_values_ = std::make_shared<StagedValues>();
+    // A formula invalidated by an edit whose own dependents are not invalidated yet, and the
+    // edited cell, for the profiler
+    struct PendingInvalidation {
+        Position cell;
+        Position source;
+    };
+    // Until it is empty the caches and published values of the cells further down may be stale
+    std::shared_ptr<std::vector<PendingInvalidation>> pending_invalidations_ =
+        std::make_shared<std::vector<PendingInvalidation>>();
+    uint64_t version_ = 0;
+    EpochPublisher<ValueSnapshot> values_;
+
+    struct ChangeBatch {
+        uint64_t version;
+        std::vector<Position> changed;
     };
+    // Changes of the versions after history_base_version_, oldest first
+    std::deque<ChangeBatch> change_history_;
+    size_t change_history_size_ = 0;
+    uint64_t history_base_version_ = 0;
+    std::vector<std::pair<uint64_t, ChangeCallback>> subscribers_;
+    uint64_t next_subscription_ = 1;
+
+    // Shared with forks until one side changes it
+    std::shared_ptr<RangeDependents> range_dependents_;
+    // Shared with forks until one side changes it, which then builds a dictionary of its own
+    // over the shared one: only the changes are stored, under the ids the cells hold
+    std::shared_ptr<TextDictionary> texts_;
+    // Built by lookups on this sheet only, forks index their own ranges
+    mutable LookupIndexes lookup_indexes_;
+    // Built by the first search, null until then
+    mutable std::unique_ptr<SearchIndex> search_index_;
+    // Filled by evaluation in const methods, hence mutable
+    mutable ValueCache value_cache_;
+    // Shared with forks until one side changes it; the copy keeps the node ids
+    std::shared_ptr<SubexpressionGraph> subexpressions_;
+    // Values of the nodes of subexpressions_, filled by evaluation
+    mutable SubexpressionCache subexpression_values_;
+    bool subexpression_sharing_ = true;
+
+#ifdef SPREADSHEET_PROFILING
+    // Filled by evaluation in const methods, hence mutable
+    mutable Profiler profiler_;
+#endif
+
+    // Kept up to date by every change of the cells, rows and published values
+    SheetMemoryStats memory_;
+
+    UndoJournal undo_;
+    // Set while Undo/Redo restore cells, so that restoring is not journaled as a new edit
+    bool replaying_ = false;
 
-    SheetData data_sheet;
+    Cell* EnsureCell(Position pos);
+    // Cell for reading its text and formula, without taking ownership of a shared row
+    const Cell* PeekCell(Position pos) const;
+    UndoJournal::CellState CaptureState(Position pos) const;
+    void RecordUndo(UndoJournal::CellState before);
+    void RestoreState(const UndoJournal::CellState& state);
+    void ChangeStructure(const ReferenceShift& shift);
+    // Moves the cells and rewrites the references; returns the states of the cells the shift
+    // erased or broke, which undoing it has to restore
+    std::vector<UndoJournal::CellState> ShiftCells(const ReferenceShift& shift);
+    UndoJournal::Batch ApplyReverse(const UndoJournal::Batch& batch);
+    SearchIndex& GetSearchIndex() const;
+    // Text of a cell, possibly one of a row shared with a fork: its id is valid in the dictionary
+    // of every sheet holding the row, while the sheet the cell points at may be gone
+    std::string_view GetCellText(const Cell& cell) const;
+    // Key of the value of a cell in a lookup index; a text cell shares the one its dictionary
+    // entry keeps
+    std::optional<LookupIndexes::Key> GetIndexKey(const Cell& cell) const;
+    void UpdateSearchEntry(Position pos) const;
+    bool InViewport(Position pos) const;
+    void StageValue(Position pos);
+    void PublishStagedValues();
+    size_t InvalidateDependents(Position pos, Position source);
+    // Invalidates the dependents of one pending formula; returns how many it invalidated
+    size_t PropagateInvalidation();
+    // Finishes the invalidation left by the edits, before a value is read
+    void SettleInvalidation() const;
+    void RecordChanges(std::vector<Position> changed);
+    // Row index private to this sheet
+    SheetData& OwnData();
+    // Whether the row is private to this sheet, i.e. its cells may be changed in place
+    bool OwnsRow(int row) const;
+    // Row private to this sheet, copied first if it is shared
+    Row& OwnRow(int row);
+    // Add (sign = 1) or remove (sign = -1) the row index, a row with its cell slots, or one
+    // row of published values to the memory statistics
+    void AccountRowIndex(int sign);
+    void AccountRow(const Row& row, int sign);
+    void AccountValueRow(const ValueSnapshot::Row& row, int sign);
 };
\ No newline at end of file
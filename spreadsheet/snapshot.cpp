@@ -0,0 +1,429 @@
+#include "sheet.h"
+
+#include "cell.h"
+#include "formula.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#include <iterator>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std::literals;
+
+// Snapshot layout, all integers in host byte order:
+//
+//   Header
+//   StringRef[string_count]   offset and length of every distinct text in the string blob
+//   CellRecord[cell_count]    one record per non-empty cell, in row-major order
+//   RefRecord[ref_count]      referenced cells of every formula (the dependency index)
+//   code blob                 formulas encoded by FormulaInterface::Serialize
+//   string blob
+//
+// Every section starts at a multiple of 8 bytes. The reader validates all offsets against the
+// file size, so a truncated or corrupted file is reported instead of read out of bounds.
+namespace {
+    constexpr char SNAPSHOT_MAGIC[8] = {'S', 'H', 'E', 'E', 'T', 'S', 'N', 'P'};
+    // 2: formula code may hold ranges, strings and function calls, and values the #N/A error
+    constexpr uint32_t SNAPSHOT_VERSION = 2;
+    constexpr uint32_t BYTE_ORDER_MARK = 0x01020304;
+    constexpr uint32_t FLAG_WITH_VALUES = 1;
+
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t byte_order;
+        uint32_t flags;
+        uint32_t reserved;
+        uint64_t string_count;
+        uint64_t cell_count;
+        uint64_t ref_count;
+        uint64_t code_size;
+        uint64_t string_blob_size;
+    };
+
+    struct StringRef {
+        uint64_t offset;
+        uint64_t length;
+    };
+
+    enum CellKind : uint8_t {
+        CK_TEXT = 0,
+        CK_FORMULA = 1,
+    };
+
+    enum ValueKind : uint8_t {
+        VK_NONE = 0,
+        VK_NUMBER = 1,
+        VK_ERROR = 2,
+    };
+
+    struct CellRecord {
+        int32_t row;
+        int32_t col;
+        uint32_t text_id;
+        uint8_t kind;
+        uint8_t value_kind;
+        uint16_t error;  // FormulaError::Category for VK_ERROR
+        uint64_t code_offset;
+        uint32_t code_size;
+        uint32_t ref_count;
+        uint64_t ref_offset;
+        double value;
+    };
+
+    struct RefRecord {
+        int32_t row;
+        int32_t col;
+    };
+
+    static_assert(sizeof(Header) == 64);
+    static_assert(sizeof(CellRecord) == 48);
+    static_assert(sizeof(RefRecord) == 8);
+
+    size_t Align8(size_t size) {
+        return (size + 7) & ~size_t{7};
+    }
+
+    // Buffered writes through a descriptor, so that the file can be fsynced before it replaces
+    // the previous snapshot
+    class FileWriter {
+    public:
+        explicit FileWriter(const std::string& path)
+                : path_(path) {
+#ifdef _WIN32
+            fd_ = _open(path.c_str(), _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, 0644);
+#else
+            fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#endif
+            if (fd_ < 0) {
+                throw SnapshotException("Cannot create snapshot: "s + path);
+            }
+            buffer_.reserve(BUFFER_SIZE);
+        }
+
+        FileWriter(const FileWriter&) = delete;
+        FileWriter& operator=(const FileWriter&) = delete;
+
+        ~FileWriter() {
+#ifdef _WIN32
+            _close(fd_);
+#else
+            ::close(fd_);
+#endif
+        }
+
+        void Write(const char* data, size_t size) {
+            if (buffer_.size() + size > BUFFER_SIZE) {
+                Flush();
+            }
+            if (size >= BUFFER_SIZE) {
+                WriteAll(data, size);
+            } else {
+                buffer_.append(data, size);
+            }
+        }
+
+        // Returns once the data written so far is on disk
+        void Sync() {
+            Flush();
+#ifdef _WIN32
+            const int result = _commit(fd_);
+#else
+            const int result = ::fsync(fd_);
+#endif
+            if (result != 0) {
+                throw SnapshotException("Cannot sync snapshot: "s + path_ + ": " + std::strerror(errno));
+            }
+        }
+
+    private:
+        static constexpr size_t BUFFER_SIZE = 1 << 20;
+
+        void Flush() {
+            WriteAll(buffer_.data(), buffer_.size());
+            buffer_.clear();
+        }
+
+        void WriteAll(const char* data, size_t size) {
+            while (size > 0) {
+#ifdef _WIN32
+                auto written = _write(fd_, data, static_cast<unsigned>(std::min<size_t>(size, 1u << 30)));
+#else
+                auto written = ::write(fd_, data, size);
+#endif
+                if (written < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    throw SnapshotException("Cannot write snapshot: "s + path_ + ": " + std::strerror(errno));
+                }
+                data += written;
+                size -= static_cast<size_t>(written);
+            }
+        }
+
+        std::string path_;
+        int fd_ = -1;
+        std::string buffer_;
+    };
+
+    template <typename T>
+    void WriteSection(FileWriter& out, const std::vector<T>& items) {
+        out.Write(reinterpret_cast<const char*>(items.data()), items.size() * sizeof(T));
+    }
+
+    void WritePadding(FileWriter& out, size_t written) {
+        static constexpr char zeros[8] = {};
+        out.Write(zeros, Align8(written) - written);
+    }
+
+    // Read-only view of a whole file, mapped into memory where the platform allows it. Pages are
+    // only read in when cells that live on them are restored.
+    class MappedFile {
+    public:
+        explicit MappedFile(const std::string& path) {
+#ifdef _WIN32
+            std::ifstream in(path, std::ios::binary);
+            if (!in) {
+                throw SnapshotException("Cannot open snapshot: "s + path);
+            }
+            buffer_.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+            data_ = buffer_.data();
+            size_ = buffer_.size();
+#else
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0) {
+                throw SnapshotException("Cannot open snapshot: "s + path);
+            }
+            struct stat st {};
+            if (::fstat(fd, &st) != 0) {
+                ::close(fd);
+                throw SnapshotException("Cannot stat snapshot: "s + path);
+            }
+            size_ = static_cast<size_t>(st.st_size);
+            if (size_ > 0) {
+                void* mapped = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (mapped == MAP_FAILED) {
+                    ::close(fd);
+                    throw SnapshotException("Cannot map snapshot: "s + path);
+                }
+                ::madvise(mapped, size_, MADV_SEQUENTIAL);
+                data_ = static_cast<const char*>(mapped);
+            }
+            ::close(fd);
+#endif
+        }
+
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        ~MappedFile() {
+#ifndef _WIN32
+            if (data_) {
+                ::munmap(const_cast<char*>(data_), size_);
+            }
+#endif
+        }
+
+        std::string_view Bytes(uint64_t offset, uint64_t length) const {
+            if (offset > size_ || length > size_ - offset) {
+                throw SnapshotException("Snapshot is truncated or corrupted");
+            }
+            return {data_ + offset, static_cast<size_t>(length)};
+        }
+
+        template <typename T>
+        T Read(uint64_t offset) const {
+            T value;
+            std::memcpy(&value, Bytes(offset, sizeof(T)).data(), sizeof(T));
+            return value;
+        }
+
+    private:
+        const char* data_ = nullptr;
+        size_t size_ = 0;
+#ifdef _WIN32
+        std::vector<char> buffer_;
+#endif
+    };
+}  // namespace
+
+void Sheet::SaveSnapshot(const std::string& path, bool with_values) const {
+    std::vector<std::string_view> strings;
+    std::unordered_map<std::string_view, uint32_t> string_ids;
+    std::vector<CellRecord> cells;
+    std::vector<RefRecord> refs;
+    std::string code;
+
+    auto intern = [&](std::string_view text) {
+        auto [it, inserted] = string_ids.emplace(text, static_cast<uint32_t>(strings.size()));
+        if (inserted) {
+            strings.push_back(text);
+        }
+        return it->second;
+    };
+
+    for (const auto& row : data_sheet->rows) {
+        for (const auto& cell : row->cells) {
+            if (!cell || cell->IsEmpty()) {
+                continue;  // placeholders are recreated from the references of formulas
+            }
+            Position pos = cell->GetPosition();
+            CellRecord record{};
+            record.row = pos.row;
+            record.col = pos.col;
+            record.text_id = intern(GetCellText(*cell));
+            if (const FormulaInterface* formula = cell->GetFormula()) {
+                record.kind = CK_FORMULA;
+                record.code_offset = code.size();
+                formula->Serialize(code);
+                record.code_size = static_cast<uint32_t>(code.size() - record.code_offset);
+
+                record.ref_offset = refs.size();
+                for (const Position& ref : cell->GetReferencedCells()) {
+                    refs.push_back({ref.row, ref.col});
+                }
+                record.ref_count = static_cast<uint32_t>(refs.size() - record.ref_offset);
+
+                // Taken by position from this sheet: a cell of a row shared with a fork points at
+                // the sheet that created it, whose values may differ or which may be gone
+                std::optional<FormulaInterface::Value> value = GetCachedValue(pos);
+                if (!value) {
+                    value = RecallValue(pos);
+                }
+                if (with_values && value) {
+                    if (std::holds_alternative<double>(*value)) {
+                        record.value_kind = VK_NUMBER;
+                        record.value = std::get<double>(*value);
+                    } else {
+                        record.value_kind = VK_ERROR;
+                        record.error = static_cast<uint16_t>(std::get<FormulaError>(*value).GetCategory());
+                    }
+                }
+            } else {
+                record.kind = CK_TEXT;
+            }
+            cells.push_back(record);
+        }
+    }
+
+    std::vector<StringRef> string_refs;
+    string_refs.reserve(strings.size());
+    uint64_t blob_size = 0;
+    for (std::string_view text : strings) {
+        string_refs.push_back({blob_size, text.size()});
+        blob_size += text.size();
+    }
+
+    Header header{};
+    std::memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.byte_order = BYTE_ORDER_MARK;
+    header.flags = with_values ? FLAG_WITH_VALUES : 0;
+    header.string_count = string_refs.size();
+    header.cell_count = cells.size();
+    header.ref_count = refs.size();
+    header.code_size = code.size();
+    header.string_blob_size = blob_size;
+
+    const std::string tmp_path = path + ".tmp";
+    try {
+        FileWriter out(tmp_path);
+        out.Write(reinterpret_cast<const char*>(&header), sizeof(header));
+        WriteSection(out, string_refs);
+        WriteSection(out, cells);
+        WriteSection(out, refs);
+        out.Write(code.data(), code.size());
+        WritePadding(out, code.size());
+        for (std::string_view text : strings) {
+            out.Write(text.data(), text.size());
+        }
+        // The contents must be durable before the rename makes them the snapshot
+        out.Sync();
+    } catch (...) {
+        std::remove(tmp_path.c_str());
+        throw;
+    }
+    if (std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+        std::remove(tmp_path.c_str());
+        throw SnapshotException("Cannot replace snapshot: "s + path);
+    }
+}
+
+std::unique_ptr<Sheet> Sheet::LoadSnapshot(const std::string& path) {
+    MappedFile file(path);
+
+    const auto header = file.Read<Header>(0);
+    if (std::memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0) {
+        throw SnapshotException("Not a sheet snapshot: "s + path);
+    }
+    if (header.version != SNAPSHOT_VERSION || header.byte_order != BYTE_ORDER_MARK) {
+        throw SnapshotException("Unsupported snapshot version or byte order: "s + path);
+    }
+
+    const uint64_t strings_offset = sizeof(Header);
+    const uint64_t cells_offset = strings_offset + header.string_count * sizeof(StringRef);
+    const uint64_t refs_offset = cells_offset + header.cell_count * sizeof(CellRecord);
+    const uint64_t code_offset = refs_offset + header.ref_count * sizeof(RefRecord);
+    const uint64_t blob_offset = code_offset + Align8(header.code_size);
+    file.Bytes(blob_offset, header.string_blob_size);  // validates the total size
+
+    const bool with_values = header.flags & FLAG_WITH_VALUES;
+    auto sheet = std::make_unique<Sheet>();
+    for (uint64_t i = 0; i < header.cell_count; ++i) {
+        const auto record = file.Read<CellRecord>(cells_offset + i * sizeof(CellRecord));
+        Position pos{record.row, record.col};
+        if (!pos.IsValid() || record.text_id >= header.string_count) {
+            throw SnapshotException("Snapshot is truncated or corrupted");
+        }
+        const auto text_ref = file.Read<StringRef>(strings_offset + record.text_id * sizeof(StringRef));
+        std::string text(file.Bytes(blob_offset + text_ref.offset, text_ref.length));
+
+        std::unique_ptr<FormulaInterface> formula = nullptr;
+        std::vector<Position> referenced_cells;
+        std::optional<FormulaInterface::Value> cached_value;
+        if (record.kind == CK_FORMULA) {
+            if (record.code_offset + record.code_size > header.code_size
+                || record.ref_offset + record.ref_count > header.ref_count) {
+                throw SnapshotException("Snapshot is truncated or corrupted");
+            }
+            try {
+                formula = LoadFormula(file.Bytes(code_offset + record.code_offset, record.code_size));
+            } catch (const FormulaException&) {
+                throw SnapshotException("Snapshot contains a corrupted formula");
+            }
+            referenced_cells.reserve(record.ref_count);
+            for (uint32_t k = 0; k < record.ref_count; ++k) {
+                auto ref = file.Read<RefRecord>(refs_offset + (record.ref_offset + k) * sizeof(RefRecord));
+                referenced_cells.emplace_back(ref.row, ref.col);
+                if (!referenced_cells.back().IsValid()) {
+                    throw SnapshotException("Snapshot is truncated or corrupted");
+                }
+            }
+            if (with_values && record.value_kind == VK_NUMBER) {
+                cached_value = record.value;
+            } else if (with_values && record.value_kind == VK_ERROR) {
+                cached_value = FormulaError(static_cast<FormulaError::Category>(record.error));
+            }
+        }
+        sheet->EnsureCell(pos)->Restore(std::move(text), std::move(formula), std::move(referenced_cells),
+                                        cached_value);
+    }
+    return sheet;
+}
@@ -2,6 +2,7 @@
 
 #include <cctype>
 #include <sstream>
+#include <stdexcept>
 #include <algorithm>
 
 using namespace std::string_view_literals;
@@ -75,6 +76,35 @@ Position Position::FromString(std::string_view str) {
     return {row - 1, col - 1};
 }
 
+const CellRange CellRange::NONE = {Position::NONE, Position::NONE};
+
+bool CellRange::operator==(const CellRange& rhs) const {
+    return first == rhs.first && last == rhs.last;
+}
+
+bool CellRange::IsValid() const {
+    return first.IsValid() && last.IsValid() && first.row <= last.row && first.col <= last.col;
+}
+
+bool CellRange::Contains(Position pos) const {
+    return first.row <= pos.row && pos.row <= last.row && first.col <= pos.col && pos.col <= last.col;
+}
+
+int CellRange::GetRows() const {
+    return last.row - first.row + 1;
+}
+
+int CellRange::GetCols() const {
+    return last.col - first.col + 1;
+}
+
+std::string CellRange::ToString() const {
+    if (!IsValid()) {
+        return "";
+    }
+    return first.ToString() + ':' + last.ToString();
+}
+
 bool Size::operator==(Size rhs) const {
     return cols == rhs.cols && rows == rhs.rows;
 }
@@ -102,6 +132,9 @@ std::string_view FormulaError::ToString() const {
         case Category::Div0: {
             return "#ARITHM!"sv;
         }
+        case Category::NA: {
+            return "#N/A"sv;
+        }
         default:
             return "#CAN'T IDENTIFY ERROR!"sv;
     }
@@ -114,10 +147,98 @@ FormulaError::FormulaError(std::string_view string_category) {
         category_ = Category::Value;
     } else if (string_category == "#ARITHM!"sv){
         category_ = Category::Div0;
+    } else if (string_category == "#N/A"sv) {
+        category_ = Category::NA;
     }
 }
 
 std::ostream& operator<<(std::ostream& output, FormulaError fe) {
     output << fe.ToString();
     return output;
-}
\ No newline at end of file
+}
+
+std::optional<LookupKey> MakeLookupKey(const CellInterface::Value& value) {
+    if (const double* number = std::get_if<double>(&value)) {
+        return *number;
+    }
+    const std::string* text = std::get_if<std::string>(&value);
+    if (!text || text->empty()) {
+        return std::nullopt;
+    }
+    // Text cells hold numbers too, the same text counts as a number in arithmetic
+    size_t parsed = 0;
+    try {
+        double number = std::stod(*text, &parsed);
+        if (parsed == text->size()) {
+            return number;
+        }
+    } catch (const std::logic_error&) {
+        // not a number
+    }
+    std::string key = *text;
+    std::transform(key.begin(), key.end(), key.begin(), [](unsigned char c) {
+        return static_cast<char>(std::tolower(c));
+    });
+    return key;
+}
+
+double SheetInterface::GetCellNumber(Position pos) const {
+    // Reading must not change the sheet: a missing cell is simply empty
+    const CellInterface* cell = GetCell(pos);
+    if (cell == nullptr) {
+        return 0.0;
+    }
+
+    CellInterface::Value value = cell->GetValue();
+
+    if (std::holds_alternative<double>(value)) {
+        return std::get<double>(value);
+    } else if (std::holds_alternative<std::string>(value)){
+        const std::string& text = std::get<std::string>(value);
+        if (text.empty()) {
+            return 0.0;
+        }
+        size_t parsed = 0;
+        try {
+            double num = std::stod(text, &parsed);
+            if (parsed == text.size()) {
+                return num;
+            }
+        } catch (const std::logic_error&) {
+            // neither a number nor in range of double
+        }
+        throw FormulaError{ FormulaError::Category::Value };
+    }
+
+    throw *std::get_if<FormulaError>(&value);
+}
+
+std::optional<int> SheetInterface::Lookup(const LookupKey& key, CellRange range, LookupMatch match) const {
+    if (!range.IsValid() || (range.GetRows() > 1 && range.GetCols() > 1)) {
+        return std::nullopt;
+    }
+    const int length = std::max(range.GetRows(), range.GetCols());
+    std::optional<int> found;
+    std::optional<LookupKey> best;
+    for (int i = 0; i < length; ++i) {
+        Position pos = range.GetRows() > 1 ? Position{range.first.row + i, range.first.col}
+                                           : Position{range.first.row, range.first.col + i};
+        const CellInterface* cell = GetCell(pos);
+        auto value = cell ? MakeLookupKey(cell->GetValue()) : std::nullopt;
+        if (!value || value->index() != key.index()) {
+            continue;
+        }
+        if (*value == key) {
+            return i;
+        }
+        // The closest value on the allowed side wins; ties keep the first one
+        bool better = match == LookupMatch::ExactOrLess ? *value < key && (!best || *best < *value)
+                    : match == LookupMatch::ExactOrGreater ? key < *value && (!best || *value < *best)
+                                                           : false;
+        if (better) {
+            best = std::move(value);
+            found = i;
+        }
+    }
+    return found;
+}
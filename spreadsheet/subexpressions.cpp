@@ -0,0 +1,292 @@
+#include "subexpressions.h"
+
+#include "memory_stats.h"
+
+#include <algorithm>
+#include <cstring>
+#include <utility>
+
+namespace {
+    // A hash table node: the entry, the link to the next node and the cached hash
+    template <typename Entry>
+    constexpr size_t INDEX_NODE_COST = sizeof(Entry) + 2 * sizeof(void*);
+
+    template <typename T>
+    void EraseAll(std::vector<T>& values, T value) {
+        values.erase(std::remove(values.begin(), values.end(), value), values.end());
+    }
+
+    // Each distinct element once, so that a node is listed once per cell or operand
+    template <typename T>
+    std::vector<T> Distinct(std::vector<T> values) {
+        std::sort(values.begin(), values.end());
+        values.erase(std::unique(values.begin(), values.end()), values.end());
+        return values;
+    }
+}  // namespace
+
+SubexpressionGraph::SubexpressionGraph(const SubexpressionGraph& other)
+        : nodes_(other.nodes_)
+        , free_ids_(other.free_ids_)
+        , index_(other.index_)
+        , formulas_(other.formulas_)
+        , readers_(other.readers_)
+        , shared_count_(other.shared_count_)
+        , memory_(other.memory_) {
+    for (const auto& [key, id] : index_) {
+        nodes_[id].key = &key;
+    }
+}
+
+void SubexpressionGraph::Add(const FormulaInterface& formula,
+                             const std::vector<FormulaInterface::Subexpression>& subexpressions) {
+    if (auto found = formulas_.find(&formula); found != formulas_.end()) {
+        ++found->second.references;
+        for (NodeId id : found->second.nodes) {
+            if (++nodes_[id].uses == 2) {
+                ++shared_count_;
+            }
+        }
+        return;
+    }
+
+    if (subexpressions.empty()) {
+        return;
+    }
+    Registration registration{1, {}};
+    registration.nodes.reserve(subexpressions.size());
+    // Operands come before the operations reading them, so their nodes are known by then
+    for (const auto& subexpression : subexpressions) {
+        registration.nodes.push_back(Intern(subexpression, registration.nodes));
+    }
+    memory_ += INDEX_NODE_COST<std::pair<const FormulaInterface* const, Registration>>
+               + registration.nodes.size() * sizeof(NodeId);
+    formulas_.emplace(&formula, std::move(registration));
+}
+
+void SubexpressionGraph::Remove(const FormulaInterface& formula, std::vector<NodeId>& freed) {
+    auto found = formulas_.find(&formula);
+    if (found == formulas_.end()) {
+        return;
+    }
+    Registration& registration = found->second;
+    // Operations go before their operands, so that a freed node is no longer anyone's parent
+    for (auto it = registration.nodes.rbegin(); it != registration.nodes.rend(); ++it) {
+        Release(*it, freed);
+    }
+    if (--registration.references > 0) {
+        return;
+    }
+    memory_ -= INDEX_NODE_COST<std::pair<const FormulaInterface* const, Registration>>
+               + registration.nodes.size() * sizeof(NodeId);
+    formulas_.erase(found);
+    if (free_ids_.size() == nodes_.size()) {
+        nodes_.clear();
+        free_ids_.clear();
+    }
+}
+
+const std::vector<SubexpressionGraph::NodeId>* SubexpressionGraph::FindNodes(const FormulaInterface& formula) const {
+    auto found = formulas_.find(&formula);
+    return found == formulas_.end() ? nullptr : &found->second.nodes;
+}
+
+bool SubexpressionGraph::IsShared(NodeId id) const {
+    return nodes_[id].uses > 1;
+}
+
+const std::vector<SubexpressionGraph::NodeId>* SubexpressionGraph::FindReaders(Position pos) const {
+    auto found = readers_.find(pos);
+    return found == readers_.end() ? nullptr : &found->second;
+}
+
+const std::vector<SubexpressionGraph::NodeId>& SubexpressionGraph::GetParents(NodeId id) const {
+    return nodes_[id].parents;
+}
+
+size_t SubexpressionGraph::GetNodeCount() const {
+    return index_.size();
+}
+
+size_t SubexpressionGraph::GetSharedCount() const {
+    return shared_count_;
+}
+
+size_t SubexpressionGraph::GetMemoryUsage() const {
+    if (nodes_.empty() && formulas_.empty()) {
+        return 0;
+    }
+    // Free nodes stay allocated until every node is free
+    return memory_ + free_ids_.size() * sizeof(Node)
+           + (index_.bucket_count() + formulas_.bucket_count() + readers_.bucket_count()) * sizeof(void*);
+}
+
+SubexpressionGraph::NodeId SubexpressionGraph::Intern(const FormulaInterface::Subexpression& subexpression,
+                                                      const std::vector<NodeId>& numbered) {
+    std::vector<NodeId> operands;
+    operands.reserve(subexpression.operands.size());
+    std::string key = subexpression.key;
+    for (uint32_t operand : subexpression.operands) {
+        operands.push_back(numbered[operand]);
+        char bytes[sizeof(NodeId)];
+        std::memcpy(bytes, &operands.back(), sizeof(NodeId));
+        key.append(bytes, sizeof(NodeId));
+    }
+
+    if (auto found = index_.find(key); found != index_.end()) {
+        if (++nodes_[found->second].uses == 2) {
+            ++shared_count_;
+        }
+        return found->second;
+    }
+
+    NodeId id;
+    if (!free_ids_.empty()) {
+        id = free_ids_.back();
+        free_ids_.pop_back();
+    } else {
+        id = static_cast<NodeId>(nodes_.size());
+        nodes_.emplace_back();
+    }
+    Node& node = nodes_[id];
+    node.key = &index_.emplace(std::move(key), id).first->first;
+    node.cells = Distinct(subexpression.cells);
+    node.operands = std::move(operands);
+    node.uses = 1;
+    for (Position pos : node.cells) {
+        readers_[pos].push_back(id);
+    }
+    for (NodeId operand : Distinct(node.operands)) {
+        nodes_[operand].parents.push_back(id);
+        memory_ += sizeof(NodeId);
+    }
+    Account(node, 1);
+    return id;
+}
+
+void SubexpressionGraph::Release(NodeId id, std::vector<NodeId>& freed) {
+    Node& node = nodes_[id];
+    if (--node.uses == 1) {
+        --shared_count_;
+    }
+    if (node.uses > 0) {
+        return;
+    }
+
+    Account(node, -1);
+    for (Position pos : node.cells) {
+        auto found = readers_.find(pos);
+        EraseAll(found->second, id);
+        if (found->second.empty()) {
+            readers_.erase(found);
+        }
+    }
+    for (NodeId operand : Distinct(node.operands)) {
+        EraseAll(nodes_[operand].parents, id);
+        memory_ -= sizeof(NodeId);
+    }
+    index_.erase(index_.find(*node.key));
+    node = Node{};
+    free_ids_.push_back(id);
+    freed.push_back(id);
+}
+
+void SubexpressionGraph::Account(const Node& node, int sign) {
+    // Each cell also costs an entry in the list of its readers
+    const size_t bytes = sizeof(Node) + INDEX_NODE_COST<std::pair<const std::string, NodeId>>
+                         + SheetMemoryStats::GetHeapBytes(*node.key)
+                         + node.cells.size() * (sizeof(Position) + sizeof(NodeId))
+                         + node.operands.size() * sizeof(NodeId);
+    memory_ += static_cast<size_t>(sign) * bytes;
+}
+
+const SubexpressionCache::Value* SubexpressionCache::Find(SubexpressionGraph::NodeId id) {
+    if (id < values_.size() && values_[id]) {
+        ++hits_;
+        return &*values_[id];
+    }
+    ++misses_;
+    return nullptr;
+}
+
+void SubexpressionCache::Store(SubexpressionGraph::NodeId id, const Value& value) {
+    if (id >= values_.size()) {
+        values_.resize(id + 1);
+    }
+    if (!values_[id]) {
+        ++valid_;
+    }
+    values_[id] = value;
+}
+
+void SubexpressionCache::InvalidateReaders(Position pos, const SubexpressionGraph& graph) {
+    if (const auto* readers = graph.FindReaders(pos)) {
+        for (SubexpressionGraph::NodeId id : *readers) {
+            Invalidate(id, graph);
+        }
+    }
+}
+
+void SubexpressionCache::Forget(const std::vector<SubexpressionGraph::NodeId>& freed) {
+    for (SubexpressionGraph::NodeId id : freed) {
+        if (id < values_.size() && values_[id]) {
+            values_[id].reset();
+            --valid_;
+        }
+    }
+}
+
+void SubexpressionCache::Clear() {
+    values_.clear();
+    valid_ = 0;
+}
+
+bool SubexpressionCache::HasValues() const {
+    return valid_ > 0;
+}
+
+void SubexpressionCache::FillStats(SubexpressionStats& stats) const {
+    stats.cached_values = valid_;
+    stats.hits = hits_;
+    stats.misses = misses_;
+}
+
+size_t SubexpressionCache::GetMemoryUsage() const {
+    return values_.capacity() * sizeof(std::optional<Value>);
+}
+
+void SubexpressionCache::Invalidate(SubexpressionGraph::NodeId id, const SubexpressionGraph& graph) {
+    // An operation is only stored after its operands are, so a node without a value has no
+    // parents with one
+    std::vector<SubexpressionGraph::NodeId> pending{id};
+    while (!pending.empty()) {
+        id = pending.back();
+        pending.pop_back();
+        if (id >= values_.size() || !values_[id]) {
+            continue;
+        }
+        values_[id].reset();
+        --valid_;
+        const auto& parents = graph.GetParents(id);
+        pending.insert(pending.end(), parents.begin(), parents.end());
+    }
+}
+
+SubexpressionBinding::SubexpressionBinding(const SubexpressionGraph& graph, SubexpressionCache& cache,
+                                           const std::vector<SubexpressionGraph::NodeId>& nodes)
+        : graph_(graph)
+        , cache_(cache)
+        , nodes_(nodes) {
+}
+
+const FormulaInterface::Value* SubexpressionBinding::Find(size_t index) {
+    const SubexpressionGraph::NodeId id = nodes_[index];
+    return graph_.IsShared(id) ? cache_.Find(id) : nullptr;
+}
+
+void SubexpressionBinding::Store(size_t index, const FormulaInterface::Value& value) {
+    const SubexpressionGraph::NodeId id = nodes_[index];
+    if (graph_.IsShared(id)) {
+        cache_.Store(id, value);
+    }
+}
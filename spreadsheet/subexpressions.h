@@ -0,0 +1,135 @@
+#pragma once
+
+#include "common.h"
+#include "formula.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Счётчики общих подвыражений таблицы (см. Sheet::SetSubexpressionSharing)
+struct SubexpressionStats {
+    // Различные подвыражения формул таблицы
+    size_t nodes = 0;
+    // Из них входящие в формулы больше одного раза
+    size_t shared_nodes = 0;
+    // Вычисленные значения общих подвыражений
+    size_t cached_values = 0;
+    // Значение общего подвыражения взято готовым
+    uint64_t hits = 0;
+    // Общее подвыражение пришлось вычислить
+    uint64_t misses = 0;
+    size_t memory_usage = 0;
+};
+
+// Граф подвыражений формул таблицы (см. FormulaInterface::GetSubexpressions). Одинаковые
+// подвыражения разных формул - один узел; узел ссылается на узлы своих операндов, так что граф
+// ациклический. Для каждого узла известны ячейки, которые он читает сам, и узлы, в которые он
+// входит операндом: по ним значения узлов сбрасываются так же, как значения зависимых ячеек.
+class SubexpressionGraph {
+public:
+    using NodeId = uint32_t;
+
+    SubexpressionGraph() = default;
+    // Копия с теми же номерами узлов
+    SubexpressionGraph(const SubexpressionGraph& other);
+    SubexpressionGraph& operator=(const SubexpressionGraph&) = delete;
+
+    // Учитывает подвыражения формулы, полученные от её GetSubexpressions(). Формула, добавленная
+    // несколько раз, столько же раз и убирается.
+    void Add(const FormulaInterface& formula, const std::vector<FormulaInterface::Subexpression>& subexpressions);
+    // Дописывает в freed узлы, которые больше не входят ни в одну формулу: их номера могут
+    // достаться новым подвыражениям
+    void Remove(const FormulaInterface& formula, std::vector<NodeId>& freed);
+
+    // Узлы подвыражений формулы по их номерам или nullptr, если подвыражений у неё нет
+    const std::vector<NodeId>* FindNodes(const FormulaInterface& formula) const;
+    // Узел входит в формулы больше одного раза, и его значение стоит хранить
+    bool IsShared(NodeId id) const;
+    // Узлы, которые читают ячейку pos не через операнды, или nullptr
+    const std::vector<NodeId>* FindReaders(Position pos) const;
+    // Узлы, в которые узел входит операндом
+    const std::vector<NodeId>& GetParents(NodeId id) const;
+
+    size_t GetNodeCount() const;
+    size_t GetSharedCount() const;
+    size_t GetMemoryUsage() const;
+
+private:
+    struct Node {
+        // Points at the key in index_; null for a free node
+        const std::string* key = nullptr;
+        std::vector<Position> cells;
+        std::vector<NodeId> operands;
+        std::vector<NodeId> parents;
+        uint32_t uses = 0;
+    };
+
+    struct Registration {
+        uint32_t references = 0;
+        std::vector<NodeId> nodes;
+    };
+
+    NodeId Intern(const FormulaInterface::Subexpression& subexpression, const std::vector<NodeId>& numbered);
+    void Release(NodeId id, std::vector<NodeId>& freed);
+    void Account(const Node& node, int sign);
+
+    std::vector<Node> nodes_;
+    std::vector<NodeId> free_ids_;
+    // Keys with the operands replaced by their node ids
+    std::unordered_map<std::string, NodeId> index_;
+    std::unordered_map<const FormulaInterface*, Registration> formulas_;
+    std::unordered_map<Position, std::vector<NodeId>, PositionHasher> readers_;
+    size_t shared_count_ = 0;
+    // Bytes of the nodes and registrations, without the hash table buckets
+    size_t memory_ = 0;
+};
+
+// Вычисленные значения узлов графа подвыражений одной таблицы. Хранятся только значения общих
+// узлов; значение узла действительно, пока действительны значения ячеек, которые он читает.
+class SubexpressionCache {
+public:
+    using Value = FormulaInterface::Value;
+
+    // Значение узла или nullptr; результат засчитывается как попадание или промах
+    const Value* Find(SubexpressionGraph::NodeId id);
+    void Store(SubexpressionGraph::NodeId id, const Value& value);
+    // Сбрасывает значения узлов, читающих ячейку pos, и узлов, в которые они входят
+    void InvalidateReaders(Position pos, const SubexpressionGraph& graph);
+    // Сбрасывает значения узлов, номера которых освободились
+    void Forget(const std::vector<SubexpressionGraph::NodeId>& freed);
+    void Clear();
+
+    // Есть ли хотя бы одно значение
+    bool HasValues() const;
+    // Заполняет в stats счётчики кэша
+    void FillStats(SubexpressionStats& stats) const;
+    size_t GetMemoryUsage() const;
+
+private:
+    void Invalidate(SubexpressionGraph::NodeId id, const SubexpressionGraph& graph);
+
+    std::vector<std::optional<Value>> values_;
+    size_t valid_ = 0;
+    uint64_t hits_ = 0;
+    uint64_t misses_ = 0;
+};
+
+// Общие подвыражения одной формулы при её вычислении: номера подвыражений формулы переводятся
+// в узлы графа, а значения берутся из кэша таблицы
+class SubexpressionBinding final : public SharedSubexpressions {
+public:
+    SubexpressionBinding(const SubexpressionGraph& graph, SubexpressionCache& cache,
+                         const std::vector<SubexpressionGraph::NodeId>& nodes);
+
+    const FormulaInterface::Value* Find(size_t index) override;
+    void Store(size_t index, const FormulaInterface::Value& value) override;
+
+private:
+    const SubexpressionGraph& graph_;
+    SubexpressionCache& cache_;
+    const std::vector<SubexpressionGraph::NodeId>& nodes_;
+};
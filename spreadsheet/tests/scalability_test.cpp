@@ -0,0 +1,350 @@
+// Scalability regression test: runs each core operation at sizes N, 2N, 4N and 8N and fails when
+// its cost grows faster than the complexity class it is expected to have. Functional tests do not
+// notice an operation going quadratic; this does, at sizes still small enough for CI.
+//
+// Cost is counted rather than timed where possible, so that the result does not depend on the
+// load of a shared machine: every case counts heap allocations (exact on any platform) and
+// retired user-space instructions (Linux perf counters). Where perf counters are not available,
+// thread CPU time takes their place, as the minimum over more runs and with a wider margin.
+// Usage: spreadsheet_scalability_test [--verbose]
+
+#include "sheet.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#endif
+
+namespace {
+    std::atomic<uint64_t> allocations{0};
+}  // namespace
+
+void* operator new(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* memory = std::malloc(size ? size : 1)) {
+        return memory;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* memory) noexcept {
+    std::free(memory);
+}
+
+void operator delete(void* memory, size_t /* size */) noexcept {
+    std::free(memory);
+}
+
+namespace {
+    // Retired user-space instructions of the calling thread, or thread CPU time in nanoseconds
+    // where perf counters cannot be opened
+    class WorkCounter {
+    public:
+        WorkCounter() {
+#ifdef __linux__
+            perf_event_attr attr;
+            std::memset(&attr, 0, sizeof(attr));
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.size = sizeof(attr);
+            attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            fd_ = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+#endif
+        }
+
+        ~WorkCounter() {
+#ifdef __linux__
+            if (fd_ >= 0) {
+                close(fd_);
+            }
+#endif
+        }
+
+        WorkCounter(const WorkCounter&) = delete;
+        WorkCounter& operator=(const WorkCounter&) = delete;
+
+        bool CountsInstructions() const {
+            return fd_ >= 0;
+        }
+
+        uint64_t Read() const {
+#ifdef __linux__
+            uint64_t count = 0;
+            if (fd_ >= 0 && read(fd_, &count, sizeof(count)) == sizeof(count)) {
+                return count;
+            }
+#endif
+#ifdef _WIN32
+            FILETIME creation, exited, kernel, user;
+            GetThreadTimes(GetCurrentThread(), &creation, &exited, &kernel, &user);
+            // Both in units of 100 ns
+            auto ticks = [](const FILETIME& time) {
+                return (static_cast<uint64_t>(time.dwHighDateTime) << 32) | time.dwLowDateTime;
+            };
+            return (ticks(kernel) + ticks(user)) * 100u;
+#else
+            timespec now{};
+            clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+            return static_cast<uint64_t>(now.tv_sec) * 1000000000u + static_cast<uint64_t>(now.tv_nsec);
+#endif
+        }
+
+    private:
+        int fd_ = -1;
+    };
+
+    struct Cost {
+        uint64_t allocations = 0;
+        uint64_t work = 0;
+    };
+
+    // A case builds its input of size n untimed, then runs the measured part
+    struct Case {
+        const char* name;
+        int base;
+        // Expected growth: the cost at 2n is at most 2^exponent times the cost at n
+        double exponent;
+        std::function<std::function<void()>(Sheet& sheet, int n)> prepare;
+    };
+
+    std::string Name(int row, int col) {
+        return Position{row, col}.ToString();
+    }
+
+    // Runs of each size; the cheapest one counts. Instruction and allocation counts of a run are
+    // almost exact, CPU time is not.
+    constexpr int RUNS = 3;
+    constexpr int TIMED_RUNS = 7;
+    constexpr int STEPS = 4;
+    // Allowed excess of the growth exponent over the expected one. A quadratic operation expected
+    // to be linear exceeds the largest margin by a factor of two.
+    constexpr double ALLOCATION_MARGIN = 0.15;
+    constexpr double INSTRUCTION_MARGIN = 0.3;
+    constexpr double TIME_MARGIN = 0.5;
+
+    Cost Measure(const WorkCounter& counter, const Case& test, int n) {
+        Cost best{UINT64_MAX, UINT64_MAX};
+        for (int run = 0; run < (counter.CountsInstructions() ? RUNS : TIMED_RUNS); ++run) {
+            Sheet sheet;
+            auto operation = test.prepare(sheet, n);
+            const uint64_t allocations_before = allocations.load(std::memory_order_relaxed);
+            const uint64_t work_before = counter.Read();
+            operation();
+            const uint64_t work = counter.Read() - work_before;
+            best.allocations = std::min(best.allocations, allocations.load(std::memory_order_relaxed) - allocations_before);
+            best.work = std::min(best.work, work);
+        }
+        return best;
+    }
+
+    // Growth exponent: the median over the doublings of the size, so that a single jump (the
+    // working set outgrowing a cache level) does not count as faster growth, while an operation
+    // growing faster at every step does. Costs are shifted by one so that an operation without
+    // allocations is constant.
+    double Exponent(const std::vector<Cost>& costs, uint64_t Cost::*metric) {
+        std::vector<double> steps;
+        for (size_t i = 1; i < costs.size(); ++i) {
+            steps.push_back(std::log2((static_cast<double>(costs[i].*metric) + 1)
+                                      / (static_cast<double>(costs[i - 1].*metric) + 1)));
+        }
+        std::nth_element(steps.begin(), steps.begin() + steps.size() / 2, steps.end());
+        return steps[steps.size() / 2];
+    }
+
+    const std::vector<Case>& GetCases() {
+        static const std::vector<Case> cases = {
+            // n formulas sharing one argument: linking appends to its list of dependents
+            {"set", 2000, 1.0, [](Sheet& sheet, int n) {
+                 sheet.SetCell({0, 0}, "1");
+                 return [&sheet, n] {
+                     for (int i = 0; i < n; ++i) {
+                         sheet.SetCell({i + 1, 0}, "=A1+" + std::to_string(i));
+                     }
+                 };
+             }},
+            // ... and clearing them unlinks each from that list
+            {"clear", 2000, 1.0, [](Sheet& sheet, int n) {
+                 sheet.SetCell({0, 0}, "1");
+                 for (int i = 0; i < n; ++i) {
+                     sheet.SetCell({i + 1, 0}, "=A1+" + std::to_string(i));
+                 }
+                 return [&sheet, n] {
+                     for (int i = 0; i < n; ++i) {
+                         sheet.ClearCell({i + 1, 0});
+                     }
+                 };
+             }},
+            // A fixed number of edits does not depend on the size of the rest of the sheet
+            {"set_in_large_sheet", 2000, 0.0, [](Sheet& sheet, int n) {
+                 for (int i = 0; i < n; ++i) {
+                     sheet.SetCell({i, 0}, std::to_string(i));
+                     sheet.SetCell({i, 1}, "=A" + std::to_string(i + 1) + "*2");
+                 }
+                 return [&sheet] {
+                     for (int i = 0; i < 200; ++i) {
+                         sheet.SetCell({5, 3}, "=A1+" + std::to_string(i));
+                         sheet.ClearCell({5, 3});
+                     }
+                 };
+             }},
+            // One edit resets the caches of n cached dependents
+            {"fan_out_invalidation", 8000, 1.0, [](Sheet& sheet, int n) {
+                 sheet.SetCell({0, 0}, "1");
+                 for (int i = 0; i < n; ++i) {
+                     const Position pos{1 + i / 10, i % 10};
+                     sheet.SetCell(pos, "=A1+" + std::to_string(i));
+                     sheet.GetCell(pos)->GetValue();
+                 }
+                 return [&sheet] {
+                     sheet.SetCell({0, 0}, "2");
+                 };
+             }},
+            // An edit at the head of a cached chain of n formulas resets only the formula reading
+            // it; the rest of the chain is left to the recalculation
+            {"set_chain_head", 200, 0.0, [](Sheet& sheet, int n) {
+                 constexpr int CHAINS = 20;
+                 // Other formulas fill the sheet up to the same size at every n, so that only the
+                 // chains grow and not the tables an edit touches
+                 constexpr int CELLS = CHAINS * 1600;
+                 for (int i = 0; i < CELLS - CHAINS * n; ++i) {
+                     sheet.SetCell({i / CHAINS, CHAINS + i % CHAINS}, "=1");
+                 }
+                 for (int col = 0; col < CHAINS; ++col) {
+                     sheet.SetCell({0, col}, "1");
+                     for (int i = 1; i < n; ++i) {
+                         sheet.SetCell({i, col}, "=" + Name(i - 1, col) + "+1");
+                     }
+                     sheet.GetCell({n - 1, col})->GetValue();
+                 }
+                 sheet.Recalculate();
+                 return [&sheet] {
+                     for (int col = 0; col < CHAINS; ++col) {
+                         sheet.SetCell({0, col}, "2");
+                     }
+                 };
+             }},
+            // n formulas reading short ranges of one column: an edit reaches the few containing it
+            {"range_dependents", 1000, 0.0, [](Sheet& sheet, int n) {
+                 for (int i = 0; i < n; ++i) {
+                     sheet.SetCell({i, 0}, std::to_string(i));
+                     sheet.SetCell({i, 1}, "=MATCH(1," + Name(i, 0) + ":" + Name(i + 1, 0) + ",0)");
+                 }
+                 return [&sheet] {
+                     for (int i = 0; i < 200; ++i) {
+                         sheet.SetCell({0, 0}, std::to_string(i));
+                     }
+                 };
+             }},
+            // Evaluating the end of a chain of n formulas evaluates each of them once
+            {"chain_evaluation", 400, 1.0, [](Sheet& sheet, int n) {
+                 sheet.SetCell({0, 0}, "1");
+                 for (int i = 1; i < n; ++i) {
+                     sheet.SetCell({i, 0}, "=" + Name(i - 1, 0) + "+1");
+                 }
+                 return [&sheet, n] {
+                     sheet.GetCell({n - 1, 0})->GetValue();
+                 };
+             }},
+            // Forking shares the pending recalculation of n formulas instead of copying it
+            {"fork_pending", 2000, 0.0, [](Sheet& sheet, int n) {
+                 sheet.SetCell({0, 0}, "1");
+                 for (int i = 0; i < n; ++i) {
+                     const Position pos{i + 1, 0};
+                     sheet.SetCell(pos, "=A1+" + std::to_string(i));
+                     sheet.GetCell(pos)->GetValue();
+                 }
+                 sheet.Recalculate();
+                 // Invalidated values, half of them staged again and the rest dirty
+                 sheet.SetCell({0, 0}, "2");
+                 sheet.RecalculateStep(RecalcBudget{static_cast<size_t>(n / 2)});
+                 return [&sheet] {
+                     for (int i = 0; i < 200; ++i) {
+                         sheet.Fork();
+                     }
+                 };
+             }},
+            // The printable area of a sheet with n rows of cells
+            {"printable_size", 2000, 1.0, [](Sheet& sheet, int n) {
+                 for (int i = 0; i < n; ++i) {
+                     sheet.SetCell({i, i % 10}, "x");
+                 }
+                 return [&sheet] {
+                     for (int i = 0; i < 20; ++i) {
+                         sheet.GetPrintableSize();
+                     }
+                 };
+             }},
+            // Values and texts of n rows of numbers, formulas and text
+            {"export", 1000, 1.0, [](Sheet& sheet, int n) {
+                 for (int i = 0; i < n; ++i) {
+                     sheet.SetCell({i, 0}, std::to_string(i));
+                     sheet.SetCell({i, 1}, "=" + Name(i, 0) + "*2");
+                     sheet.SetCell({i, 2}, "text " + std::to_string(i));
+                 }
+                 sheet.Recalculate();
+                 return [&sheet] {
+                     std::ostringstream values;
+                     std::ostringstream texts;
+                     sheet.PrintValues(values);
+                     sheet.PrintTexts(texts);
+                 };
+             }},
+        };
+        return cases;
+    }
+}  // namespace
+
+int main(int argc, char** argv) {
+    const bool verbose = argc > 1 && std::string(argv[1]) == "--verbose";
+    const WorkCounter counter;
+    const char* work_name = counter.CountsInstructions() ? "instructions" : "cpu_ns";
+    const double work_margin = counter.CountsInstructions() ? INSTRUCTION_MARGIN : TIME_MARGIN;
+
+    int failures = 0;
+    std::cout << std::fixed << std::setprecision(2);
+    for (const Case& test : GetCases()) {
+        std::vector<Cost> costs;
+        for (int step = 0, n = test.base; step < STEPS; ++step, n *= 2) {
+            costs.push_back(Measure(counter, test, n));
+        }
+        const double allocation_growth = Exponent(costs, &Cost::allocations);
+        const double work_growth = Exponent(costs, &Cost::work);
+        const bool passed = allocation_growth <= test.exponent + ALLOCATION_MARGIN
+                            && work_growth <= test.exponent + work_margin;
+        failures += passed ? 0 : 1;
+
+        std::cout << (passed ? "ok   " : "FAIL ") << test.name << ": expected n^" << test.exponent
+                  << ", allocations n^" << allocation_growth << ", " << work_name << " n^" << work_growth << '\n';
+        if (verbose || !passed) {
+            for (int step = 0, n = test.base; step < STEPS; ++step, n *= 2) {
+                std::cout << "     n=" << n << " allocations=" << costs[step].allocations << ' ' << work_name
+                          << '=' << costs[step].work << '\n';
+            }
+        }
+    }
+    std::cout << (failures ? "FAILED: " : "passed: ") << GetCases().size() - failures << " of "
+              << GetCases().size() << " cases within bounds" << std::endl;
+    return failures ? 1 : 0;
+}
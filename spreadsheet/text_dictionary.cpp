@@ -0,0 +1,174 @@
+#include "text_dictionary.h"
+
+#include "cell.h"
+#include "memory_stats.h"
+
+namespace {
+    // A hash table node: the entry, the link to the next node and the cached hash
+    constexpr size_t INDEX_NODE_COST = sizeof(std::pair<const std::string_view, TextId>) + 2 * sizeof(void*);
+}  // namespace
+
+TextDictionary::TextDictionary()
+        : entries_(1) {
+}
+
+TextDictionary::TextDictionary(std::shared_ptr<const TextDictionary> base)
+        : first_id_(base->first_id_ + static_cast<TextId>(base->entries_.size()))
+        , size_(base->size_) {
+    if (base->depth_ < MAX_DEPTH) {
+        depth_ = base->depth_ + 1;
+        base_ = std::move(base);
+        return;
+    }
+    // A flat copy: the texts with references keep their ids, the rest become free ids
+    entries_.resize(first_id_);
+    first_id_ = 0;
+    size_ = 0;
+    for (TextId id = static_cast<TextId>(entries_.size()) - 1; id > EMPTY; --id) {
+        const uint32_t references = base->GetReferences(id);
+        if (references == 0) {
+            free_ids_.push_back(id);
+            continue;
+        }
+        Entry& entry = entries_[id];
+        entry = base->GetEntry(id);
+        entry.references = references;
+        index_.emplace(entry.text, id);
+        memory_ += GetEntryBytes(entry);
+        ++size_;
+    }
+}
+
+TextId TextDictionary::Intern(std::string_view text) {
+    if (text.empty()) {
+        return EMPTY;
+    }
+    if (auto found = index_.find(text); found != index_.end()) {
+        ++entries_[found->second - first_id_].references;
+        return found->second;
+    }
+    if (const TextId id = base_ ? base_->FindAny(text) : EMPTY; id != EMPTY) {
+        auto [references, added] = base_references_.emplace(id, base_->GetReferences(id));
+        if (references->second++ == 0) {
+            ++size_;
+        }
+        return id;
+    }
+
+    TextId id;
+    if (!free_ids_.empty()) {
+        id = free_ids_.back();
+        free_ids_.pop_back();
+    } else {
+        id = first_id_ + static_cast<TextId>(entries_.size());
+        entries_.emplace_back();
+    }
+    Entry& entry = entries_[id - first_id_];
+    entry.text = std::string(text);
+    if (!Cell::IsFormulaText(entry.text)) {
+        const std::string_view value = text[0] == ESCAPE_SIGN ? text.substr(1) : text;
+        entry.value = std::make_shared<const CellInterface::Value>(std::string(value));
+        if (auto key = MakeLookupKey(*entry.value)) {
+            entry.key = std::make_shared<const LookupKey>(std::move(*key));
+        }
+    }
+    entry.references = 1;
+    index_.emplace(entry.text, id);
+    memory_ += GetEntryBytes(entry);
+    ++size_;
+    return id;
+}
+
+void TextDictionary::Release(TextId id) {
+    if (id == EMPTY) {
+        return;
+    }
+    if (id < first_id_) {
+        // The entry stays in the base, where it may be found and referred to again
+        auto [references, added] = base_references_.emplace(id, base_->GetReferences(id));
+        if (--references->second == 0) {
+            --size_;
+        }
+        return;
+    }
+    Entry& entry = entries_[id - first_id_];
+    if (--entry.references > 0) {
+        return;
+    }
+    memory_ -= GetEntryBytes(entry);
+    index_.erase(entry.text);
+    entry = Entry{};
+    free_ids_.push_back(id);
+    --size_;
+}
+
+TextId TextDictionary::Find(std::string_view text) const {
+    const TextId id = FindAny(text);
+    return id != EMPTY && GetReferences(id) > 0 ? id : EMPTY;
+}
+
+std::string_view TextDictionary::View(TextId id) const {
+    return GetEntry(id).text;
+}
+
+const std::shared_ptr<const LookupKey>& TextDictionary::GetLookupKey(TextId id) const {
+    return GetEntry(id).key;
+}
+
+const std::shared_ptr<const CellInterface::Value>& TextDictionary::GetValue(TextId id) const {
+    return GetEntry(id).value;
+}
+
+size_t TextDictionary::GetSize() const {
+    return size_;
+}
+
+size_t TextDictionary::GetMemoryUsage() const {
+    // The bases are counted in each of the dictionaries built over them
+    size_t bytes = base_ ? base_->GetMemoryUsage() : 0;
+    if (!base_references_.empty()) {
+        bytes += base_references_.bucket_count() * sizeof(void*)
+                 + base_references_.size() * (sizeof(std::pair<const TextId, uint32_t>) + 2 * sizeof(void*));
+    }
+    // Only the first dictionary of a stack holds the entry of EMPTY
+    if (entries_.size() <= (first_id_ == EMPTY ? 1u : 0u)) {
+        return bytes;
+    }
+    // Free entries stay allocated until the dictionary is destroyed
+    return bytes + memory_ + free_ids_.size() * sizeof(Entry) + index_.bucket_count() * sizeof(void*);
+}
+
+const TextDictionary::Entry& TextDictionary::GetEntry(TextId id) const {
+    return id >= first_id_ ? entries_[id - first_id_] : base_->GetEntry(id);
+}
+
+uint32_t TextDictionary::GetReferences(TextId id) const {
+    if (id >= first_id_) {
+        return entries_[id - first_id_].references;
+    }
+    auto found = base_references_.find(id);
+    return found != base_references_.end() ? found->second : base_->GetReferences(id);
+}
+
+TextId TextDictionary::FindAny(std::string_view text) const {
+    if (auto found = index_.find(text); found != index_.end()) {
+        return found->second;
+    }
+    return base_ ? base_->FindAny(text) : EMPTY;
+}
+
+size_t TextDictionary::GetEntryBytes(const Entry& entry) {
+    size_t bytes = sizeof(Entry) + INDEX_NODE_COST + SheetMemoryStats::GetHeapBytes(entry.text);
+    // The key and the value are allocated along with their reference counts
+    if (entry.key) {
+        bytes += sizeof(LookupKey) + 2 * sizeof(uint32_t);
+        if (const auto* key = std::get_if<std::string>(&*entry.key)) {
+            bytes += SheetMemoryStats::GetHeapBytes(*key);
+        }
+    }
+    if (entry.value) {
+        bytes += sizeof(CellInterface::Value) + 2 * sizeof(uint32_t)
+                 + SheetMemoryStats::GetHeapBytes(std::get<std::string>(*entry.value));
+    }
+    return bytes;
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Номер текста в словаре таблицы
+using TextId = uint32_t;
+
+// Словарь текстов ячеек таблицы: каждый различный текст хранится один раз, а ячейки хранят его
+// номер. Равные тексты имеют равные номера, поэтому сравнение текстов сводится к сравнению номеров.
+// Словарь считает ссылки на тексты: текст, на который больше не ссылается ни одна ячейка,
+// удаляется, и его номер может достаться другому тексту. Пустой текст не хранится и имеет номер
+// EMPTY.
+class TextDictionary {
+public:
+    static constexpr TextId EMPTY = 0;
+
+    TextDictionary();
+    // Словарь с теми же номерами текстов, что и у base, построенный поверх него: он хранит только
+    // добавленные тексты и изменённые счётчики ссылок, поэтому строится за O(1). base больше не
+    // изменяется, и его могут разделять несколько словарей (например, таблицы и её форков).
+    explicit TextDictionary(std::shared_ptr<const TextDictionary> base);
+    TextDictionary(const TextDictionary&) = delete;
+    TextDictionary& operator=(const TextDictionary&) = delete;
+
+    // Номер текста с ещё одной ссылкой на него; текст добавляется, если его не было
+    TextId Intern(std::string_view text);
+    // Убирает ссылку, полученную от Intern
+    void Release(TextId id);
+
+    // Номер текста или EMPTY, если такого текста нет
+    TextId Find(std::string_view text) const;
+    // Текст действителен, пока на него есть ссылки
+    std::string_view View(TextId id) const;
+    // Ключ поиска (см. MakeLookupKey) для значения текстовой ячейки с этим текстом, вычисленный
+    // при добавлении текста. Индексы поиска разделяют его, а не копируют. Для пустого текста и
+    // текстов формул - nullptr.
+    const std::shared_ptr<const LookupKey>& GetLookupKey(TextId id) const;
+    // Значение текстовой ячейки с этим текстом, общее для всех таких ячеек и живущее, пока на него
+    // есть ссылки (в том числе из снимков значений). Для пустого текста и текстов формул - nullptr.
+    const std::shared_ptr<const CellInterface::Value>& GetValue(TextId id) const;
+
+    // Число различных текстов
+    size_t GetSize() const;
+    size_t GetMemoryUsage() const;
+
+private:
+    struct Entry {
+        std::string text;
+        std::shared_ptr<const LookupKey> key;
+        std::shared_ptr<const CellInterface::Value> value;
+        uint32_t references = 0;
+    };
+
+    // A dictionary over this many others is built as a flat copy of them instead, which keeps
+    // the reads, walking down the bases, short
+    static constexpr size_t MAX_DEPTH = 8;
+
+    static size_t GetEntryBytes(const Entry& entry);
+    const Entry& GetEntry(TextId id) const;
+    uint32_t GetReferences(TextId id) const;
+    // Id of the text in this dictionary or its bases, even one without references
+    TextId FindAny(std::string_view text) const;
+
+    // Texts with ids below first_id_; never changed, possibly shared with other dictionaries
+    std::shared_ptr<const TextDictionary> base_;
+    size_t depth_ = 1;
+    TextId first_id_ = 0;
+    // References to the texts of base_ counted by this dictionary, for those it has changed
+    std::unordered_map<TextId, uint32_t> base_references_;
+    // Texts added here, with ids from first_id_. A deque keeps the texts in place as it grows,
+    // so the index may refer to them.
+    std::deque<Entry> entries_;
+    std::vector<TextId> free_ids_;
+    std::unordered_map<std::string_view, TextId> index_;
+    // Distinct texts with references, those of base_ included
+    size_t size_ = 0;
+    // Bytes of the entries in use, without the index buckets
+    size_t memory_ = 0;
+};
@@ -0,0 +1,163 @@
+#include "trace_events.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+std::atomic<bool> EventTracer::enabled_{false};
+
+namespace {
+    // A slot is a seqlock: odd while its writer fills it in, 2 * (index + 1) once event `index` is
+    // complete. The fields are atomics so that a reader racing with the writer is well defined.
+    struct Slot {
+        std::atomic<uint64_t> sequence{0};
+        std::atomic<const char*> name{nullptr};
+        std::atomic<uint64_t> cell{0};
+        std::atomic<int64_t> start{0};
+        std::atomic<int64_t> duration{0};
+    };
+
+    struct ThreadBuffer {
+        explicit ThreadBuffer(int id)
+                : id(id)
+                , slots(EventTracer::EVENTS_PER_THREAD) {
+        }
+
+        const int id;
+        std::vector<Slot> slots;
+        // Only the owner thread writes it
+        std::atomic<uint64_t> next{0};
+        // Events before this one were dropped by Clear()
+        std::atomic<uint64_t> cleared{0};
+        std::atomic<bool> finished{false};
+    };
+
+    struct Registry {
+        std::mutex mutex;
+        std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+        int next_id = 1;
+        const std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+    };
+
+    Registry& GetRegistry() {
+        static Registry registry;
+        return registry;
+    }
+
+    // Marks the buffer finished when its thread exits; the registry keeps it for the next dump
+    struct BufferOwner {
+        std::shared_ptr<ThreadBuffer> buffer;
+
+        ~BufferOwner() {
+            if (buffer) {
+                buffer->finished.store(true, std::memory_order_release);
+            }
+        }
+    };
+
+    ThreadBuffer& GetThreadBuffer() {
+        thread_local BufferOwner owner;
+        if (!owner.buffer) {
+            Registry& registry = GetRegistry();
+            std::lock_guard lock(registry.mutex);
+            owner.buffer = std::make_shared<ThreadBuffer>(registry.next_id++);
+            registry.buffers.push_back(owner.buffer);
+        }
+        return *owner.buffer;
+    }
+
+    uint64_t PackCell(Position pos) {
+        return pos.IsValid() ? (static_cast<uint64_t>(pos.row) << 32 | static_cast<uint32_t>(pos.col)) + 1 : 0;
+    }
+
+    Position UnpackCell(uint64_t cell) {
+        if (cell == 0) {
+            return Position::NONE;
+        }
+        --cell;
+        return {static_cast<int>(cell >> 32), static_cast<int>(cell & 0xFFFFFFFFu)};
+    }
+}  // namespace
+
+void EventTracer::SetEnabled(bool enabled) {
+    enabled_.store(enabled, std::memory_order_relaxed);
+}
+
+void EventTracer::Record(const char* name, Position pos, std::chrono::steady_clock::time_point start,
+                         std::chrono::steady_clock::time_point end) {
+    ThreadBuffer& buffer = GetThreadBuffer();
+    const uint64_t index = buffer.next.load(std::memory_order_relaxed);
+    Slot& slot = buffer.slots[index % EVENTS_PER_THREAD];
+
+    slot.sequence.store(2 * index + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.name.store(name, std::memory_order_relaxed);
+    slot.cell.store(PackCell(pos), std::memory_order_relaxed);
+    slot.start.store(std::chrono::duration_cast<std::chrono::nanoseconds>(start - GetRegistry().epoch).count(),
+                     std::memory_order_relaxed);
+    slot.duration.store(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count(),
+                        std::memory_order_relaxed);
+    slot.sequence.store(2 * index + 2, std::memory_order_release);
+    buffer.next.store(index + 1, std::memory_order_release);
+}
+
+void EventTracer::WriteChromeTrace(std::ostream& output) {
+    std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+    {
+        Registry& registry = GetRegistry();
+        std::lock_guard lock(registry.mutex);
+        buffers = registry.buffers;
+    }
+
+    const auto flags = output.flags();
+    output << std::fixed << std::setprecision(3);
+    output << "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [";
+    bool first = true;
+    for (const auto& buffer : buffers) {
+        output << (first ? "\n" : ",\n") << "{\"ph\": \"M\", \"name\": \"thread_name\", \"pid\": 1, \"tid\": "
+               << buffer->id << ", \"args\": {\"name\": \"thread " << buffer->id << "\"}}";
+        first = false;
+
+        const uint64_t end = buffer->next.load(std::memory_order_acquire);
+        const uint64_t begin = std::max(end > EVENTS_PER_THREAD ? end - EVENTS_PER_THREAD : 0,
+                                        buffer->cleared.load(std::memory_order_relaxed));
+        for (uint64_t index = begin; index < end; ++index) {
+            const Slot& slot = buffer->slots[index % EVENTS_PER_THREAD];
+            const uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+            const char* name = slot.name.load(std::memory_order_relaxed);
+            const Position cell = UnpackCell(slot.cell.load(std::memory_order_relaxed));
+            const int64_t start = slot.start.load(std::memory_order_relaxed);
+            const int64_t duration = slot.duration.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (sequence != 2 * index + 2 || slot.sequence.load(std::memory_order_relaxed) != sequence) {
+                continue;  // overwritten meanwhile
+            }
+            // Chrome trace timestamps are in microseconds
+            output << ",\n{\"ph\": \"X\", \"name\": \"" << name << "\", \"pid\": 1, \"tid\": " << buffer->id
+                   << ", \"ts\": " << start / 1000.0 << ", \"dur\": " << duration / 1000.0;
+            if (cell.IsValid()) {
+                output << ", \"args\": {\"cell\": \"" << cell.ToString() << "\"}";
+            }
+            output << "}";
+        }
+    }
+    output << "\n]}\n";
+    output.flags(flags);
+}
+
+void EventTracer::Clear() {
+    Registry& registry = GetRegistry();
+    std::lock_guard lock(registry.mutex);
+    std::vector<std::shared_ptr<ThreadBuffer>> alive;
+    for (auto& buffer : registry.buffers) {
+        if (!buffer->finished.load(std::memory_order_acquire)) {
+            // Live buffers are only ever written by their owner; skipping past their events
+            // empties them without racing with it
+            buffer->cleared.store(buffer->next.load(std::memory_order_acquire), std::memory_order_relaxed);
+            alive.push_back(std::move(buffer));
+        }
+    }
+    registry.buffers = std::move(alive);
+}
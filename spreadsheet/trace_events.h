@@ -0,0 +1,63 @@
+#pragma once
+
+#include "common.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+
+// События для временной шкалы правок и пересчёта. Каждый поток пишет в собственный кольцевой
+// буфер без блокировок (при переполнении старые события затираются); запись можно включать и
+// выключать во время работы, а выключенная стоит одной атомарной загрузки на область.
+// Накопленное выводится в формате Chrome Trace Event, который открывают Perfetto и chrome://tracing.
+class EventTracer {
+public:
+    // Сколько последних событий хранит буфер одного потока
+    static constexpr size_t EVENTS_PER_THREAD = 1 << 14;
+
+    static void SetEnabled(bool enabled);
+    static bool IsEnabled() {
+        return enabled_.load(std::memory_order_relaxed);
+    }
+
+    // Завершённое событие: name - строковый литерал, pos - ячейка, к которой оно относится
+    static void Record(const char* name, Position pos, std::chrono::steady_clock::time_point start,
+                       std::chrono::steady_clock::time_point end);
+
+    // Выводит события всех потоков. Безопасно вызывать одновременно с записью: событие,
+    // которое в этот момент перезаписывается, пропускается.
+    static void WriteChromeTrace(std::ostream& output);
+    // Удаляет накопленные события и буферы завершившихся потоков
+    static void Clear();
+
+private:
+    static std::atomic<bool> enabled_;
+};
+
+// Событие длиной в область видимости объекта
+class TraceScope {
+public:
+    explicit TraceScope(const char* name, Position pos = Position::NONE)
+            : name_(EventTracer::IsEnabled() ? name : nullptr)
+            , pos_(pos) {
+        if (name_) {
+            start_ = std::chrono::steady_clock::now();
+        }
+    }
+
+    ~TraceScope() {
+        if (name_) {
+            EventTracer::Record(name_, pos_, start_, std::chrono::steady_clock::now());
+        }
+    }
+
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+
+private:
+    const char* name_;
+    Position pos_;
+    std::chrono::steady_clock::time_point start_;
+};
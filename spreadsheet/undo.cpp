@@ -0,0 +1,98 @@
+#include "undo.h"
+
+#include <utility>
+
+void UndoJournal::BeginBatch() {
+    ++open_depth_;
+}
+
+void UndoJournal::EndBatch() {
+    if (--open_depth_ > 0 || open_batch_.empty()) {
+        return;
+    }
+    // A new edit makes the undone batches unreachable
+    for (const Batch& batch : redo_) {
+        memory_usage_ -= Cost(batch);
+    }
+    redo_.clear();
+    Push(undo_, std::exchange(open_batch_, {}));
+}
+
+void UndoJournal::Record(Entry entry) {
+    open_batch_.push_back(std::move(entry));
+}
+
+bool UndoJournal::TakeUndo(Batch& batch) {
+    if (undo_.empty()) {
+        return false;
+    }
+    batch = std::move(undo_.back());
+    undo_.pop_back();
+    memory_usage_ -= Cost(batch);
+    return true;
+}
+
+bool UndoJournal::TakeRedo(Batch& batch) {
+    if (redo_.empty()) {
+        return false;
+    }
+    batch = std::move(redo_.back());
+    redo_.pop_back();
+    memory_usage_ -= Cost(batch);
+    return true;
+}
+
+void UndoJournal::PushRedo(Batch batch) {
+    Push(redo_, std::move(batch));
+}
+
+void UndoJournal::PushUndo(Batch batch) {
+    Push(undo_, std::move(batch));
+}
+
+bool UndoJournal::CanUndo() const {
+    return !undo_.empty();
+}
+
+bool UndoJournal::CanRedo() const {
+    return !redo_.empty();
+}
+
+size_t UndoJournal::GetMemoryUsage() const {
+    return memory_usage_;
+}
+
+void UndoJournal::SetMemoryLimit(size_t bytes) {
+    memory_limit_ = bytes;
+    Evict();
+}
+
+size_t UndoJournal::Cost(const Batch& batch) {
+    size_t cost = sizeof(Batch) + batch.capacity() * sizeof(Entry);
+    for (const Entry& entry : batch) {
+        if (const auto* state = std::get_if<CellState>(&entry)) {
+            // A parsed formula is taken to be about as large as its text
+            cost += state->text.size() * (state->formula ? 2 : 1);
+        }
+    }
+    return cost;
+}
+
+void UndoJournal::Push(std::deque<Batch>& stack, Batch batch) {
+    batch.shrink_to_fit();
+    memory_usage_ += Cost(batch);
+    stack.push_back(std::move(batch));
+    Evict();
+}
+
+void UndoJournal::Evict() {
+    // The oldest edits go first, then the redo batches farthest from the current state
+    while (memory_usage_ > memory_limit_ && !undo_.empty()) {
+        memory_usage_ -= Cost(undo_.front());
+        undo_.pop_front();
+    }
+    while (memory_usage_ > memory_limit_ && !redo_.empty()) {
+        memory_usage_ -= Cost(redo_.front());
+        redo_.pop_front();
+    }
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include "common.h"
+#include "formula.h"
+
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <string>
+#include <variant>
+#include <vector>
+
+// Журнал отмены и повтора правок. Хранит не копии таблицы, а прежнее состояние каждой затронутой
+// ячейки: текст и разделяемую разобранную формулу, по которой восстанавливаются и связи с другими
+// ячейками, а для вставки и удаления строк (столбцов) - сам сдвиг. Правки группируются в пакеты;
+// старые пакеты вытесняются, когда журнал превышает лимит памяти.
+class UndoJournal {
+public:
+    // Состояние ячейки до правки. Пустой текст без формулы означает отсутствующую ячейку.
+    struct CellState {
+        Position pos;
+        std::string text;
+        std::shared_ptr<const FormulaInterface> formula;
+        // Состояние, которое стёр сдвиг, записанный в пакете после него: отмена восстанавливает
+        // его, а повтор сдвига стирает заново, поэтому обратное состояние не запоминается
+        bool restore_only = false;
+    };
+    using Entry = std::variant<CellState, ReferenceShift>;
+    using Batch = std::vector<Entry>;
+
+    static constexpr size_t DEFAULT_MEMORY_LIMIT = 64 << 20;
+
+    // Пакеты вкладываются друг в друга; в журнал попадает внешний, когда он закрыт
+    void BeginBatch();
+    void EndBatch();
+    // Запоминает состояние ячейки перед правкой или выполненный сдвиг; только внутри пакета
+    void Record(Entry entry);
+
+    // Забирает последний пакет для отмены или повтора. false, если забирать нечего.
+    bool TakeUndo(Batch& batch);
+    bool TakeRedo(Batch& batch);
+    // Кладёт пакет, обратный отменённому (повторённому)
+    void PushRedo(Batch batch);
+    void PushUndo(Batch batch);
+
+    bool CanUndo() const;
+    bool CanRedo() const;
+
+    // Оценка памяти, занятой пакетами, и её предел. Пакет больше предела не сохраняется.
+    size_t GetMemoryUsage() const;
+    void SetMemoryLimit(size_t bytes);
+
+private:
+    static size_t Cost(const Batch& batch);
+    void Push(std::deque<Batch>& stack, Batch batch);
+    void Evict();
+
+    std::deque<Batch> undo_;
+    std::deque<Batch> redo_;
+    Batch open_batch_;
+    int open_depth_ = 0;
+    size_t memory_usage_ = 0;
+    size_t memory_limit_ = DEFAULT_MEMORY_LIMIT;
+};
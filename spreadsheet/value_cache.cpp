@@ -0,0 +1,133 @@
+#include "value_cache.h"
+
+#include <algorithm>
+#include <tuple>
+#include <utility>
+
+const ValueCache::Value* ValueCache::Find(Position pos) {
+    auto found = index_.find(pos);
+    if (found == index_.end()) {
+        return nullptr;
+    }
+    Slot& slot = slots_[found->second];
+    slot.credit = slot.cost;
+    ++stats_.hits;
+    return &slot.value;
+}
+
+const ValueCache::Value* ValueCache::Peek(Position pos) const {
+    auto found = index_.find(pos);
+    return found == index_.end() ? nullptr : &slots_[found->second].value;
+}
+
+void ValueCache::Insert(Position pos, Value value, uint64_t cost) {
+    const uint32_t credit = static_cast<uint32_t>(std::clamp<uint64_t>(cost, 1, MAX_CREDIT));
+    if (auto found = index_.find(pos); found != index_.end()) {
+        slots_[found->second] = {pos, std::move(value), credit, credit};
+        return;
+    }
+    size_t slot;
+    if (!free_slots_.empty()) {
+        slot = free_slots_.back();
+        free_slots_.pop_back();
+    } else {
+        slot = slots_.size();
+        slots_.emplace_back();
+    }
+    slots_[slot] = {pos, std::move(value), credit, credit};
+    index_.emplace(pos, slot);
+    Evict();
+}
+
+void ValueCache::Erase(Position pos) {
+    auto found = index_.find(pos);
+    if (found == index_.end()) {
+        return;
+    }
+    const size_t slot = found->second;
+    index_.erase(found);
+    Release(slot);
+}
+
+void ValueCache::Shift(const std::vector<Position>& moved, const ReferenceShift& shift) {
+    // All the entries leave their places before any arrives, so that none is overwritten
+    std::vector<std::tuple<Position, Value, uint32_t>> arriving;
+    for (Position pos : moved) {
+        auto found = index_.find(pos);
+        if (found == index_.end()) {
+            continue;
+        }
+        const size_t slot = found->second;
+        index_.erase(found);
+        if (Position shifted = shift.Apply(pos); shifted.IsValid()) {
+            arriving.emplace_back(shifted, std::move(slots_[slot].value), slots_[slot].cost);
+        }
+        Release(slot);
+    }
+    for (auto& [pos, value, cost] : arriving) {
+        Insert(pos, std::move(value), cost);
+    }
+}
+
+void ValueCache::CountRecall() {
+    ++stats_.recalls;
+}
+
+void ValueCache::CountMiss() {
+    ++stats_.misses;
+}
+
+uint64_t ValueCache::GetMisses() const {
+    return stats_.misses;
+}
+
+void ValueCache::SetMemoryLimit(size_t bytes) {
+    memory_limit_ = bytes;
+    Evict();
+}
+
+ValueCacheStats ValueCache::GetStats() const {
+    ValueCacheStats stats = stats_;
+    stats.entries = GetSize();
+    stats.memory_usage = GetMemoryUsage();
+    stats.memory_limit = memory_limit_;
+    return stats;
+}
+
+size_t ValueCache::GetSize() const {
+    return index_.size();
+}
+
+size_t ValueCache::GetMemoryUsage() const {
+    return index_.size() * ENTRY_COST;
+}
+
+void ValueCache::Release(size_t slot) {
+    slots_[slot].pos = Position::NONE;
+    free_slots_.push_back(slot);
+    if (free_slots_.size() == slots_.size()) {
+        slots_.clear();
+        free_slots_.clear();
+        hand_ = 0;
+    }
+}
+
+void ValueCache::Evict() {
+    // Each turn of the hand takes a unit of credit from every entry, so this ends
+    while (GetMemoryUsage() > memory_limit_ && !index_.empty()) {
+        if (hand_ >= slots_.size()) {
+            hand_ = 0;
+        }
+        Slot& slot = slots_[hand_];
+        if (slot.pos.IsValid()) {
+            if (slot.credit > 0) {
+                --slot.credit;
+            } else {
+                index_.erase(slot.pos);
+                Release(hand_);
+                ++stats_.evictions;
+            }
+        }
+        ++hand_;
+    }
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include "common.h"
+#include "formula.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <unordered_map>
+#include <vector>
+
+// Счётчики кэша значений формул
+struct ValueCacheStats {
+    // Значение нашлось в кэше
+    uint64_t hits = 0;
+    // Вытесненное значение взято из снимка значений таблицы, без вычисления
+    uint64_t recalls = 0;
+    // Формулу пришлось вычислить
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    size_t entries = 0;
+    size_t memory_usage = 0;
+    size_t memory_limit = 0;
+
+    // Доля обращений, обошедшихся без вычисления формулы
+    double GetHitRate() const {
+        const uint64_t total = hits + recalls + misses;
+        return total ? static_cast<double>(hits + recalls) / static_cast<double>(total) : 0.0;
+    }
+};
+
+// Кэш вычисленных значений формул одной таблицы по позициям ячеек, с ограничением памяти.
+// Вытеснение - обобщённый CLOCK: стрелка обходит записи по кругу и у каждой отнимает единицу
+// запаса, а вытесняет запись без запаса. Запас записи - стоимость её вычисления (сколько формул
+// пришлось вычислить ради неё); обращение к записи восполняет его. Так первыми уходят значения,
+// к которым давно не обращались и которые дёшево вычислить заново.
+class ValueCache {
+public:
+    using Value = FormulaInterface::Value;
+
+    // Оценка памяти одной записи: её слот и узел хеш-таблицы позиций
+    static constexpr size_t ENTRY_COST = 96;
+    // Запас записи не больше этого, чтобы дорогое значение всё же вытеснялось за конечное число
+    // оборотов стрелки
+    static constexpr uint32_t MAX_CREDIT = 64;
+
+    // Значение ячейки или nullptr; найденное засчитывается как попадание. Указатель действителен
+    // до следующего изменения кэша.
+    const Value* Find(Position pos);
+    // То же без учёта в счётчиках и в очереди вытеснения
+    const Value* Peek(Position pos) const;
+    // cost - число формул, вычисленных ради значения, включая саму формулу
+    void Insert(Position pos, Value value, uint64_t cost);
+    void Erase(Position pos);
+    // Переносит записи ячеек moved на их места после сдвига строк (столбцов); записи удалённых
+    // ячеек пропадают
+    void Shift(const std::vector<Position>& moved, const ReferenceShift& shift);
+
+    void CountRecall();
+    void CountMiss();
+    uint64_t GetMisses() const;
+
+    void SetMemoryLimit(size_t bytes);
+    ValueCacheStats GetStats() const;
+    size_t GetSize() const;
+    size_t GetMemoryUsage() const;
+
+private:
+    struct Slot {
+        Position pos = Position::NONE;
+        Value value = 0.0;
+        uint32_t cost = 0;
+        uint32_t credit = 0;
+    };
+
+    void Release(size_t slot);
+    void Evict();
+
+    std::vector<Slot> slots_;
+    std::vector<size_t> free_slots_;
+    std::unordered_map<Position, size_t, PositionHasher> index_;
+    size_t hand_ = 0;
+    size_t memory_limit_ = std::numeric_limits<size_t>::max();
+    ValueCacheStats stats_;
+};
@@ -0,0 +1,54 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstdint>
+#include <memory>
+#include <variant>
+#include <vector>
+
+// Неизменяемый снимок вычисленных значений таблицы. Строки хранятся отдельными блоками и
+// разделяются между соседними версиями: новая версия копирует только изменившиеся строки.
+class ValueSnapshot {
+public:
+    // Значение в строке снимка. Значение формулы хранится в самой строке, а значение текстовой
+    // ячейки разделяется со словарём текстов таблицы: один экземпляр на каждый различный текст.
+    using Slot = std::variant<CellInterface::Value, std::shared_ptr<const CellInterface::Value>>;
+    using Row = std::vector<Slot>;
+
+    // Значение, хранящееся в slot
+    static const CellInterface::Value& Get(const Slot& slot) {
+        if (const auto* shared = std::get_if<std::shared_ptr<const CellInterface::Value>>(&slot)) {
+            return **shared;
+        }
+        return std::get<CellInterface::Value>(slot);
+    }
+
+    // Номер версии; растёт с каждой публикацией
+    uint64_t GetVersion() const {
+        return version_;
+    }
+
+    // Значение ячейки или nullptr, если ячейка за пределами сохранённых строк. Пустая ячейка
+    // внутри них представлена пустой строкой.
+    const CellInterface::Value* Find(Position pos) const {
+        const Rows& rows = *rows_;
+        if (pos.row < 0 || pos.row >= static_cast<int>(rows.size()) || !rows[pos.row]) {
+            return nullptr;
+        }
+        const Row& row = *rows[pos.row];
+        if (pos.col < 0 || pos.col >= static_cast<int>(row.size())) {
+            return nullptr;
+        }
+        return &Get(row[pos.col]);
+    }
+
+private:
+    friend class Sheet;
+
+    using Rows = std::vector<std::shared_ptr<const Row>>;
+
+    uint64_t version_ = 0;
+    // The index is shared too, so that copying a snapshot (e.g. into a fork) is O(1)
+    std::shared_ptr<const Rows> rows_ = std::make_shared<Rows>();
+};
@@ -0,0 +1,389 @@
+#include "workload_trace.h"
+
+#include <algorithm>
+#include <exception>
+#include <iterator>
+#include <ostream>
+#include <stdexcept>
+#include <streambuf>
+#include <utility>
+#include <vector>
+
+using namespace std::literals;
+
+namespace {
+    constexpr std::string_view TRACE_MAGIC = "SPTRACE\x01"sv;
+    constexpr size_t FLUSH_BYTES = 1 << 16;
+
+    void AppendVarint(std::string& out, uint64_t value) {
+        while (value >= 0x80) {
+            out.push_back(static_cast<char>(value | 0x80));
+            value >>= 7;
+        }
+        out.push_back(static_cast<char>(value));
+    }
+
+    // Positions may be invalid (negative), as the calls that throw are recorded too
+    uint64_t ZigZag(int value) {
+        const auto wide = static_cast<int64_t>(value);
+        return (static_cast<uint64_t>(wide) << 1) ^ static_cast<uint64_t>(wide >> 63);
+    }
+
+    int UnZigZag(uint64_t value) {
+        return static_cast<int>(static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1));
+    }
+
+    bool HasPosition(TraceOp op) {
+        return op == TraceOp::SetCell || op == TraceOp::ClearCell || op == TraceOp::GetCell
+               || op == TraceOp::GetValue || op == TraceOp::GetText;
+    }
+
+    class TraceReader {
+    public:
+        explicit TraceReader(std::string data)
+                : data_(std::move(data)) {
+        }
+
+        bool ReadByte(uint8_t& value) {
+            if (offset_ >= data_.size()) {
+                return false;
+            }
+            value = static_cast<uint8_t>(data_[offset_++]);
+            return true;
+        }
+
+        bool ReadVarint(uint64_t& value) {
+            value = 0;
+            for (int shift = 0; shift < 64; shift += 7) {
+                if (offset_ >= data_.size()) {
+                    return false;
+                }
+                auto byte = static_cast<uint8_t>(data_[offset_++]);
+                value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+                if (!(byte & 0x80)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        bool ReadBytes(size_t size, std::string& out) {
+            if (data_.size() - offset_ < size) {
+                return false;
+            }
+            out.assign(data_, offset_, size);
+            offset_ += size;
+            return true;
+        }
+
+        bool AtEnd() const {
+            return offset_ >= data_.size();
+        }
+
+    private:
+        std::string data_;
+        size_t offset_ = TRACE_MAGIC.size();
+    };
+
+    // Print* output is formatted as usual, then dropped
+    class NullBuffer : public std::streambuf {
+    protected:
+        int_type overflow(int_type c) override {
+            return traits_type::not_eof(c);
+        }
+        std::streamsize xsputn(const char* /* data */, std::streamsize size) override {
+            return size;
+        }
+    };
+}  // namespace
+
+std::string_view ToString(TraceOp op) {
+    switch (op) {
+        case TraceOp::SetCell:
+            return "SetCell"sv;
+        case TraceOp::ClearCell:
+            return "ClearCell"sv;
+        case TraceOp::GetCell:
+            return "GetCell"sv;
+        case TraceOp::GetValue:
+            return "GetValue"sv;
+        case TraceOp::GetText:
+            return "GetText"sv;
+        case TraceOp::GetPrintableSize:
+            return "GetPrintableSize"sv;
+        case TraceOp::PrintValues:
+            return "PrintValues"sv;
+        case TraceOp::PrintTexts:
+            return "PrintTexts"sv;
+    }
+    return "Unknown"sv;
+}
+
+TraceWriter::TraceWriter(const std::string& path)
+        : output_(path, std::ios::binary | std::ios::trunc)
+        , last_(std::chrono::steady_clock::now()) {
+    if (!output_) {
+        throw std::runtime_error("Cannot open trace "s + path);
+    }
+    buffer_.append(TRACE_MAGIC);
+}
+
+void TraceWriter::Append(TraceOp op, Position pos, std::string_view text) {
+    auto now = std::chrono::steady_clock::now();
+    buffer_.push_back(static_cast<char>(op));
+    AppendVarint(buffer_, std::chrono::duration_cast<std::chrono::nanoseconds>(now - last_).count());
+    last_ = now;
+    if (HasPosition(op)) {
+        AppendVarint(buffer_, ZigZag(pos.row));
+        AppendVarint(buffer_, ZigZag(pos.col));
+    }
+    if (op == TraceOp::SetCell) {
+        AppendVarint(buffer_, text.size());
+        buffer_.append(text);
+    }
+    if (buffer_.size() >= FLUSH_BYTES) {
+        Flush();
+    }
+}
+
+void TraceWriter::Flush() {
+    output_.write(buffer_.data(), static_cast<std::streamsize>(buffer_.size()));
+    output_.flush();
+    buffer_.clear();
+    if (!output_) {
+        throw std::runtime_error("Trace write failed");
+    }
+}
+
+class RecordingSheet::RecordingCell : public CellInterface {
+public:
+    RecordingCell(RecordingSheet& owner, Position pos)
+            : owner_(owner)
+            , pos_(pos) {
+    }
+
+    void Set(std::string text) override {
+        owner_.SetCell(pos_, std::move(text));
+    }
+
+    std::string GetText() const override {
+        owner_.trace_.Append(TraceOp::GetText, pos_);
+        const CellInterface* cell = owner_.sheet_.GetCell(pos_);
+        return cell ? cell->GetText() : std::string();
+    }
+
+    Value GetValue() const override {
+        owner_.trace_.Append(TraceOp::GetValue, pos_);
+        const CellInterface* cell = owner_.sheet_.GetCell(pos_);
+        return cell ? cell->GetValue() : Value(std::string());
+    }
+
+    std::vector<Position> GetReferencedCells() const override {
+        const CellInterface* cell = owner_.sheet_.GetCell(pos_);
+        return cell ? cell->GetReferencedCells() : std::vector<Position>();
+    }
+
+private:
+    RecordingSheet& owner_;
+    Position pos_;
+};
+
+RecordingSheet::RecordingSheet(SheetInterface& sheet, const std::string& trace_path)
+        : sheet_(sheet)
+        , trace_(trace_path) {
+}
+
+RecordingSheet::~RecordingSheet() {
+    try {
+        trace_.Flush();
+    } catch (...) {
+        // Destructors must not throw; call Flush() explicitly to observe write errors
+    }
+}
+
+void RecordingSheet::SetCell(Position pos, std::string text) {
+    trace_.Append(TraceOp::SetCell, pos, text);
+    sheet_.SetCell(pos, std::move(text));
+}
+
+const CellInterface* RecordingSheet::GetCell(Position pos) const {
+    trace_.Append(TraceOp::GetCell, pos);
+    return sheet_.GetCell(pos) ? Wrap(pos) : nullptr;
+}
+
+CellInterface* RecordingSheet::GetCell(Position pos) {
+    trace_.Append(TraceOp::GetCell, pos);
+    return sheet_.GetCell(pos) ? Wrap(pos) : nullptr;
+}
+
+void RecordingSheet::ClearCell(Position pos) {
+    trace_.Append(TraceOp::ClearCell, pos);
+    sheet_.ClearCell(pos);
+}
+
+Size RecordingSheet::GetPrintableSize() const {
+    trace_.Append(TraceOp::GetPrintableSize);
+    return sheet_.GetPrintableSize();
+}
+
+void RecordingSheet::PrintValues(std::ostream& output) const {
+    trace_.Append(TraceOp::PrintValues);
+    sheet_.PrintValues(output);
+}
+
+void RecordingSheet::PrintTexts(std::ostream& output) const {
+    trace_.Append(TraceOp::PrintTexts);
+    sheet_.PrintTexts(output);
+}
+
+std::optional<int> RecordingSheet::Lookup(const LookupKey& key, CellRange range, LookupMatch match) const {
+    return sheet_.Lookup(key, range, match);
+}
+
+void RecordingSheet::Flush() {
+    trace_.Flush();
+}
+
+CellInterface* RecordingSheet::Wrap(Position pos) const {
+    auto& cell = cells_[pos];
+    if (!cell) {
+        cell = std::make_unique<RecordingCell>(const_cast<RecordingSheet&>(*this), pos);
+    }
+    return cell.get();
+}
+
+void LatencyHistogram::Add(std::chrono::nanoseconds latency) {
+    const auto ns = static_cast<uint64_t>(std::max<int64_t>(latency.count(), 0));
+    size_t bucket = 0;
+    for (uint64_t rest = ns; rest > 0 && bucket + 1 < BUCKETS; rest >>= 1) {
+        ++bucket;
+    }
+    ++buckets_[bucket];
+    ++count_;
+    total_ += latency;
+    max_ = std::max(max_, latency);
+}
+
+void LatencyHistogram::Merge(const LatencyHistogram& other) {
+    for (size_t bucket = 0; bucket < BUCKETS; ++bucket) {
+        buckets_[bucket] += other.buckets_[bucket];
+    }
+    count_ += other.count_;
+    total_ += other.total_;
+    max_ = std::max(max_, other.max_);
+}
+
+uint64_t LatencyHistogram::GetCount() const {
+    return count_;
+}
+
+std::chrono::nanoseconds LatencyHistogram::GetTotal() const {
+    return total_;
+}
+
+std::chrono::nanoseconds LatencyHistogram::GetMax() const {
+    return max_;
+}
+
+std::chrono::nanoseconds LatencyHistogram::GetPercentile(double p) const {
+    const auto rank = static_cast<uint64_t>(p * static_cast<double>(count_));
+    uint64_t seen = 0;
+    for (size_t bucket = 0; bucket < BUCKETS; ++bucket) {
+        seen += buckets_[bucket];
+        if (seen > rank || seen == count_) {
+            return std::min(max_, std::chrono::nanoseconds(bucket == 0 ? 0 : int64_t{1} << bucket));
+        }
+    }
+    return max_;
+}
+
+uint64_t LatencyHistogram::GetBucket(size_t bucket) const {
+    return buckets_.at(bucket);
+}
+
+ReplayReport ReplayTrace(const std::string& path, SheetInterface& sheet) {
+    std::ifstream input(path, std::ios::binary);
+    if (!input) {
+        throw std::runtime_error("Cannot open trace "s + path);
+    }
+    std::string data{std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>()};
+    if (data.compare(0, TRACE_MAGIC.size(), TRACE_MAGIC) != 0) {
+        throw std::runtime_error(path + " is not a workload trace"s);
+    }
+
+    NullBuffer null_buffer;
+    std::ostream null_output(&null_buffer);
+    ReplayReport report;
+    TraceReader reader(std::move(data));
+    std::string text;
+    while (!reader.AtEnd()) {
+        uint8_t op_code = 0;
+        uint64_t delay = 0;
+        uint64_t row = 0;
+        uint64_t col = 0;
+        uint64_t size = 0;
+        // The recorded delays are skipped: the trace is replayed at full speed
+        if (!reader.ReadByte(op_code) || !reader.ReadVarint(delay)) {
+            break;
+        }
+        if (op_code < static_cast<uint8_t>(TraceOp::SetCell) || op_code > static_cast<uint8_t>(TraceOp::PrintTexts)) {
+            throw std::runtime_error("Unknown operation in trace "s + path);
+        }
+        const auto op = static_cast<TraceOp>(op_code);
+        if (HasPosition(op) && (!reader.ReadVarint(row) || !reader.ReadVarint(col))) {
+            break;
+        }
+        if (op == TraceOp::SetCell && (!reader.ReadVarint(size) || !reader.ReadBytes(size, text))) {
+            break;
+        }
+        const Position pos{UnZigZag(row), UnZigZag(col)};
+
+        // Cells are looked up outside the measured call
+        const CellInterface* cell = nullptr;
+        if (op == TraceOp::GetValue || op == TraceOp::GetText) {
+            try {
+                cell = sheet.GetCell(pos);
+            } catch (const std::exception&) {
+                // measured and counted below
+            }
+        }
+        const auto start = std::chrono::steady_clock::now();
+        try {
+            switch (op) {
+                case TraceOp::SetCell:
+                    sheet.SetCell(pos, std::move(text));
+                    break;
+                case TraceOp::ClearCell:
+                    sheet.ClearCell(pos);
+                    break;
+                case TraceOp::GetCell:
+                    sheet.GetCell(pos);
+                    break;
+                case TraceOp::GetValue:
+                    if (cell) {
+                        cell->GetValue();
+                    }
+                    break;
+                case TraceOp::GetText:
+                    if (cell) {
+                        cell->GetText();
+                    }
+                    break;
+                case TraceOp::GetPrintableSize:
+                    sheet.GetPrintableSize();
+                    break;
+                case TraceOp::PrintValues:
+                    sheet.PrintValues(null_output);
+                    break;
+                case TraceOp::PrintTexts:
+                    sheet.PrintTexts(null_output);
+                    break;
+            }
+        } catch (const std::exception&) {
+            ++report.exceptions;
+        }
+        report.latencies[op].Add(std::chrono::steady_clock::now() - start);
+        text.clear();
+    }
+    return report;
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include "common.h"
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+// Операции, которые записывает RecordingSheet
+enum class TraceOp : uint8_t {
+    SetCell = 1,
+    ClearCell = 2,
+    GetCell = 3,
+    GetValue = 4,
+    GetText = 5,
+    GetPrintableSize = 6,
+    PrintValues = 7,
+    PrintTexts = 8,
+};
+
+std::string_view ToString(TraceOp op);
+
+// Двоичная трасса нагрузки: заголовок и записи [операция][время от предыдущей записи, нс][строка]
+// [столбец][длина текста][текст], где все числа - varint, а позиция и текст есть только у
+// операций, которым они нужны.
+class TraceWriter {
+public:
+    explicit TraceWriter(const std::string& path);
+
+    void Append(TraceOp op, Position pos = Position::NONE, std::string_view text = {});
+    void Flush();
+
+private:
+    std::ofstream output_;
+    std::string buffer_;
+    std::chrono::steady_clock::time_point last_;
+};
+
+// Обёртка над таблицей, записывающая каждый вызов в трассу, в том числе GetValue и GetText
+// возвращённых ячеек. Сама таблица при этом не меняется: формулы вычисляются внутри неё.
+// Указатель на ячейку, полученный через обёртку, действителен, пока жива обёртка.
+class RecordingSheet : public SheetInterface {
+public:
+    RecordingSheet(SheetInterface& sheet, const std::string& trace_path);
+    ~RecordingSheet() override;
+
+    void SetCell(Position pos, std::string text) override;
+    const CellInterface* GetCell(Position pos) const override;
+    CellInterface* GetCell(Position pos) override;
+    void ClearCell(Position pos) override;
+    Size GetPrintableSize() const override;
+    void PrintValues(std::ostream& output) const override;
+    void PrintTexts(std::ostream& output) const override;
+    std::optional<int> Lookup(const LookupKey& key, CellRange range, LookupMatch match) const override;
+
+    // Дописывает буфер трассы в файл
+    void Flush();
+
+private:
+    class RecordingCell;
+
+    CellInterface* Wrap(Position pos) const;
+
+    SheetInterface& sheet_;
+    mutable TraceWriter trace_;
+    // One forwarding cell per position ever returned; it looks the real cell up on every call
+    mutable std::unordered_map<Position, std::unique_ptr<RecordingCell>, PositionHasher> cells_;
+};
+
+// Гистограмма задержек с корзинами по степеням двойки наносекунд
+class LatencyHistogram {
+public:
+    static constexpr size_t BUCKETS = 48;
+
+    void Add(std::chrono::nanoseconds latency);
+    void Merge(const LatencyHistogram& other);
+
+    uint64_t GetCount() const;
+    std::chrono::nanoseconds GetTotal() const;
+    std::chrono::nanoseconds GetMax() const;
+    // Верхняя граница корзины, в которую попадает доля p (от 0 до 1) измерений
+    std::chrono::nanoseconds GetPercentile(double p) const;
+    // Число измерений в корзине [2^(bucket-1), 2^bucket) нс; в нулевой - меньше 1 нс
+    uint64_t GetBucket(size_t bucket) const;
+
+private:
+    std::array<uint64_t, BUCKETS> buckets_{};
+    uint64_t count_ = 0;
+    std::chrono::nanoseconds total_{0};
+    std::chrono::nanoseconds max_{0};
+};
+
+struct ReplayReport {
+    std::map<TraceOp, LatencyHistogram> latencies;
+    // Операции, бросившие исключение (как и при записи, это не ошибка воспроизведения)
+    uint64_t exceptions = 0;
+};
+
+// Выполняет трассу на таблице sheet с максимальной скоростью, без пауз между операциями, и
+// измеряет каждую операцию. Бросает std::runtime_error для файла, который не является трассой;
+// недописанная последняя запись игнорируется.
+ReplayReport ReplayTrace(const std::string& path, SheetInterface& sheet);